@@ -44,6 +44,7 @@
 #include "qapi/visitor.h"
 #include "qapi/qapi-types-common.h"
 #include "qapi/qapi-visit-common.h"
+#include "qapi/qapi-types-migration.h"
 #include "sysemu/reset.h"
 
 #include "hw/boards.h"
@@ -73,6 +74,7 @@
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    uint32_t kvm_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -128,6 +130,12 @@ struct KVMState
         KVMMemoryListener *ml;
         AddressSpace *as;
     } *as;
+
+    /* Number of entries of each vCPU dirty ring, 0 if disabled */
+    uint32_t kvm_dirty_ring_size;
+    /* Size of each vCPU dirty ring in bytes */
+    uint32_t kvm_dirty_ring_bytes;
+    struct KVMDirtyRingReaper reaper;
 };
 
 KVMState *kvm_state;
@@ -160,8 +168,17 @@ static const KVMCapabilityInfo kvm_required_capabilites[] = {
 static NotifierList kvm_irqchip_change_notifiers =
     NOTIFIER_LIST_INITIALIZER(kvm_irqchip_change_notifiers);
 
-#define kvm_slots_lock(kml)      qemu_mutex_lock(&(kml)->slots_lock)
-#define kvm_slots_unlock(kml)    qemu_mutex_unlock(&(kml)->slots_lock)
+/*
+ * Protects the slots of all the KVMMemoryListeners.  A single lock is
+ * used because the dirty ring reaper has to look up slots of any
+ * address space while harvesting.
+ */
+static QemuMutex kml_slots_lock;
+
+#define kvm_slots_lock()      qemu_mutex_lock(&kml_slots_lock)
+#define kvm_slots_unlock()    qemu_mutex_unlock(&kml_slots_lock)
+
+static uint64_t kvm_dirty_ring_reap(KVMState *s);
 
 int kvm_get_max_memslots(void)
 {
@@ -190,7 +207,7 @@ int kvm_memcrypt_encrypt_data(uint8_t *ptr, uint64_t len)
     return 1;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kml_slots_lock held */
 static KVMSlot *kvm_get_free_slot(KVMMemoryListener *kml)
 {
     KVMState *s = kvm_state;
@@ -211,14 +228,14 @@ bool kvm_has_free_slot(MachineState *ms)
     bool result;
     KVMMemoryListener *kml = &s->memory_listener;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     result = !!kvm_get_free_slot(kml);
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return result;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kml_slots_lock held */
 static KVMSlot *kvm_alloc_slot(KVMMemoryListener *kml)
 {
     KVMSlot *slot = kvm_get_free_slot(kml);
@@ -279,7 +296,7 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
     KVMMemoryListener *kml = &s->memory_listener;
     int i, ret = 0;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     for (i = 0; i < s->nr_slots; i++) {
         KVMSlot *mem = &kml->slots[i];
 
@@ -289,7 +306,7 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
             break;
         }
     }
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return ret;
 }
@@ -355,15 +372,27 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        /* Harvest what is left in the ring before dropping it */
+        kvm_dirty_ring_reap(s);
+        ret = munmap(cpu->kvm_dirty_gfns, s->kvm_dirty_ring_bytes);
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id,
+                        uint32_t *fetch_index)
 {
     struct KVMParkedVcpu *cpu;
 
@@ -373,11 +402,14 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            /* The kernel side of the dirty ring survives parking */
+            *fetch_index = cpu->kvm_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
     }
 
+    *fetch_index = 0;
     return kvm_vm_ioctl(s, KVM_CREATE_VCPU, (void *)vcpu_id);
 }
 
@@ -389,7 +421,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu), &cpu->kvm_fetch_index);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -419,6 +451,20 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        /* Use MAP_SHARED to share pages with the kernel */
+        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_bytes,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty gfns failed: %d\n", ret);
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -442,7 +488,7 @@ static int kvm_mem_flags(MemoryRegion *mr)
     return flags;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kml_slots_lock held */
 static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
                                  MemoryRegion *mr)
 {
@@ -468,7 +514,7 @@ static int kvm_section_update_flags(KVMMemoryListener *kml,
         return 0;
     }
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     while (size && !ret) {
         slot_size = MIN(kvm_max_slot_size, size);
@@ -484,7 +530,7 @@ static int kvm_section_update_flags(KVMMemoryListener *kml,
     }
 
 out:
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
     return ret;
 }
 
@@ -555,6 +601,206 @@ static void kvm_memslot_init_dirty_bitmap(KVMSlot *mem)
     hwaddr bitmap_size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                                         /*HOST_LONG_BITS*/ 64) / 8;
     mem->dirty_bmap = g_malloc0(bitmap_size);
+    mem->dirty_bmap_size = bitmap_size;
+}
+
+/* Push the dirty bitmap cache of a slot into the ram_addr_t dirty bitmap */
+static void kvm_slot_sync_dirty_pages(KVMSlot *slot)
+{
+    ram_addr_t pages = slot->memory_size / qemu_real_host_page_size;
+
+    if (!slot->dirty_bmap) {
+        return;
+    }
+    cpu_physical_memory_set_dirty_lebitmap(slot->dirty_bmap,
+                                           slot->ram_start_offset, pages);
+}
+
+static void kvm_slot_reset_dirty_pages(KVMSlot *slot)
+{
+    if (slot->dirty_bmap) {
+        memset(slot->dirty_bmap, 0, slot->dirty_bmap_size);
+    }
+}
+
+/* Called with kml_slots_lock held */
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset)
+{
+    KVMMemoryListener *kml = NULL;
+    KVMSlot *mem;
+    int i;
+
+    for (i = 0; i < s->nr_as; i++) {
+        if (s->as[i].ml && s->as[i].ml->as_id == as_id) {
+            kml = s->as[i].ml;
+            break;
+        }
+    }
+
+    if (!kml || slot_id >= s->nr_slots) {
+        return;
+    }
+
+    mem = &kml->slots[slot_id];
+
+    if (!mem->memory_size ||
+        offset >= (mem->memory_size / qemu_real_host_page_size)) {
+        return;
+    }
+
+    if (!mem->dirty_bmap) {
+        kvm_memslot_init_dirty_bitmap(mem);
+    }
+
+    set_bit(offset, mem->dirty_bmap);
+}
+
+static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
+{
+    return atomic_load_acquire(&gfn->flags) == KVM_DIRTY_GFN_F_DIRTY;
+}
+
+static void dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
+{
+    atomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+}
+
+/* Called with kml_slots_lock held */
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns, *cur;
+    uint32_t ring_size = s->kvm_dirty_ring_size;
+    uint32_t count = 0, fetch = cpu->kvm_fetch_index;
+
+    if (!dirty_gfns) {
+        /* The vCPU is still being created or is already gone */
+        return 0;
+    }
+
+    trace_kvm_dirty_ring_reap_vcpu(cpu->cpu_index);
+
+    while (true) {
+        cur = &dirty_gfns[fetch % ring_size];
+        if (!dirty_gfn_is_dirtied(cur)) {
+            break;
+        }
+        kvm_dirty_ring_mark_page(s, cur->slot >> 16, cur->slot & 0xffff,
+                                 cur->offset);
+        dirty_gfn_set_collected(cur);
+        trace_kvm_dirty_ring_page(cpu->cpu_index, fetch, cur->offset);
+        fetch++;
+        count++;
+    }
+    cpu->kvm_fetch_index = fetch;
+
+    return count;
+}
+
+/* Called with kml_slots_lock held */
+static uint64_t kvm_dirty_ring_reap_locked(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int64_t stamp;
+    int ret;
+
+    stamp = get_clock();
+
+    CPU_FOREACH(cpu) {
+        total += kvm_dirty_ring_reap_one(s, cpu);
+    }
+
+    if (total) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        assert(ret == total);
+    }
+
+    stamp = get_clock() - stamp;
+
+    s->reaper.reap_count++;
+    s->reaper.reaped_pages += total;
+
+    if (total) {
+        trace_kvm_dirty_ring_reap(total, stamp / 1000);
+    }
+
+    return total;
+}
+
+/*
+ * Currently for simplicity, we must hold BQL before calling this.  We can
+ * consider to drop the BQL if we're clear with all the race conditions.
+ */
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    uint64_t total;
+
+    /*
+     * We need to lock all kvm slots for all address spaces here,
+     * because:
+     *
+     * (1) We need to mark dirty for dirty bitmaps in multiple slots
+     *     and for tons of pages, so it's better to take the lock here
+     *     once rather than once per page.  And more importantly,
+     *
+     * (2) We must _NOT_ publish dirty bits to the other threads
+     *     (e.g., the migration thread) via the kvm memory slot dirty
+     *     bitmaps before correctly re-protect those dirtied pages.
+     *     Otherwise we can have potential risk of data corruption if
+     *     the page data is read in the other thread before we do
+     *     reset below.
+     */
+    kvm_slots_lock();
+    total = kvm_dirty_ring_reap_locked(s);
+    kvm_slots_unlock();
+
+    return total;
+}
+
+static void do_kvm_cpu_synchronize_kick(CPUState *cpu, run_on_cpu_data arg)
+{
+    /* No need to do anything */
+}
+
+/*
+ * Kick all vcpus out in a synchronized way.  When returned, we
+ * guarantee that every vcpu has been kicked and at least returned to
+ * userspace once.
+ */
+static void kvm_cpu_synchronize_kick_all(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        run_on_cpu(cpu, do_kvm_cpu_synchronize_kick, RUN_ON_CPU_NULL);
+    }
+}
+
+/*
+ * Flush all the existing dirty pages to the KVM slot buffers.  When
+ * this call returns, we guarantee that all the touched dirty pages
+ * before calling this function have been put into the per-kvmslot
+ * dirty bitmap.
+ *
+ * This function must be called with BQL held.
+ */
+static void kvm_dirty_ring_flush(void)
+{
+    trace_kvm_dirty_ring_flush(0);
+    /*
+     * The function needs to be serialized.  Since this function
+     * should always be with BQL held, serialization is guaranteed.
+     * However, let's be sure of it.
+     */
+    assert(qemu_mutex_iothread_locked());
+    /*
+     * First make sure to flush the hardware buffers by kicking all
+     * vcpus out in a synchronous way.
+     */
+    kvm_cpu_synchronize_kick_all();
+    kvm_dirty_ring_reap(kvm_state);
+    trace_kvm_dirty_ring_flush(1);
 }
 
 /**
@@ -563,7 +809,7 @@ static void kvm_memslot_init_dirty_bitmap(KVMSlot *mem)
  * This function will first try to fetch dirty bitmap from the kernel,
  * and then updates qemu's dirty bitmap.
  *
- * NOTE: caller must be with kml->slots_lock held.
+ * NOTE: caller must be with kml_slots_lock held.
  *
  * @kml: the KVM memory listener object
  * @section: the memory section to sync the dirty bitmap with
@@ -755,7 +1001,7 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
         return ret;
     }
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     for (i = 0; i < s->nr_slots; i++) {
         mem = &kml->slots[i];
@@ -781,7 +1027,7 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
         }
     }
 
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return ret;
 }
@@ -1065,6 +1311,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     MemoryRegion *mr = section->mr;
     bool writeable = !mr->readonly && !mr->rom_device;
     hwaddr start_addr, size, slot_size;
+    ram_addr_t ram_start_offset;
     void *ram;
 
     if (!memory_region_is_ram(mr)) {
@@ -1082,11 +1329,14 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
         return;
     }
 
-    /* use aligned delta to align the ram address */
+    /* use aligned delta to align the ram address and offset */
     ram = memory_region_get_ram_ptr(mr) + section->offset_within_region +
           (start_addr - section->offset_within_address_space);
+    ram_start_offset = memory_region_get_ram_addr(mr) +
+                       section->offset_within_region +
+                       (start_addr - section->offset_within_address_space);
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     if (!add) {
         do {
@@ -1096,12 +1346,22 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
                 goto out;
             }
             if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-                kvm_physical_sync_dirty_bitmap(kml, section);
+                if (kvm_state->kvm_dirty_ring_size) {
+                    /*
+                     * Collect whatever the rings still hold for the
+                     * slot before it goes away.
+                     */
+                    kvm_dirty_ring_reap_locked(kvm_state);
+                    kvm_slot_sync_dirty_pages(mem);
+                } else {
+                    kvm_physical_sync_dirty_bitmap(kml, section);
+                }
             }
 
             /* unregister the slot */
             g_free(mem->dirty_bmap);
             mem->dirty_bmap = NULL;
+            mem->dirty_bmap_size = 0;
             mem->memory_size = 0;
             mem->flags = 0;
             err = kvm_set_user_memory_region(kml, mem, false);
@@ -1123,6 +1383,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
         mem->memory_size = slot_size;
         mem->start_addr = start_addr;
         mem->ram = ram;
+        mem->ram_start_offset = ram_start_offset;
         mem->flags = kvm_mem_flags(mr);
 
         if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
@@ -1139,12 +1400,13 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             abort();
         }
         start_addr += slot_size;
+        ram_start_offset += slot_size;
         ram += slot_size;
         size -= slot_size;
     } while (size);
 
 out:
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 }
 
 static void kvm_region_add(MemoryListener *listener,
@@ -1171,14 +1433,53 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     r = kvm_physical_sync_dirty_bitmap(kml, section);
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
     if (r < 0) {
         abort();
     }
 }
 
+/*
+ * With the dirty ring, the dirty pages are not tracked per memory slot
+ * by the kernel, so the only thing we can do is to harvest all the
+ * rings and then push every slot bitmap into the ram_addr_t bitmaps.
+ */
+static void kvm_log_sync_global(MemoryListener *listener)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    KVMState *s = kvm_state;
+    KVMSlot *mem;
+    int i;
+
+    /*
+     * Flush all kernel dirty addresses into the KVMSlot dirty bitmaps of
+     * every address space.  The rings are not per address space, so this
+     * is only done once per sync: memory_region_sync_dirty_bitmap() calls
+     * the listeners in registration order, and the one for
+     * address_space_memory is registered by kvm_init() before any other.
+     */
+    if (kml == &s->memory_listener) {
+        kvm_dirty_ring_flush();
+    }
+
+    kvm_slots_lock();
+    for (i = 0; i < s->nr_slots; i++) {
+        mem = &kml->slots[i];
+        if (mem->memory_size && mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
+            kvm_slot_sync_dirty_pages(mem);
+            /*
+             * This is not needed by KVM_GET_DIRTY_LOG because the
+             * ioctl will unconditionally overwrite the whole region.
+             * However kvm dirty ring has no such side effect.
+             */
+            kvm_slot_reset_dirty_pages(mem);
+        }
+    }
+    kvm_slots_unlock();
+}
+
 static void kvm_log_clear(MemoryListener *listener,
                           MemoryRegionSection *section)
 {
@@ -1273,7 +1574,6 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 {
     int i;
 
-    qemu_mutex_init(&kml->slots_lock);
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
 
@@ -1285,8 +1585,12 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.region_del = kvm_region_del;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
-    kml->listener.log_sync = kvm_log_sync;
-    kml->listener.log_clear = kvm_log_clear;
+    if (s->kvm_dirty_ring_size) {
+        kml->listener.log_sync_global = kvm_log_sync_global;
+    } else {
+        kml->listener.log_sync = kvm_log_sync;
+        kml->listener.log_clear = kvm_log_clear;
+    }
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1896,6 +2200,115 @@ bool kvm_vcpu_id_is_valid(int vcpu_id)
     return vcpu_id >= 0 && vcpu_id < kvm_max_vcpu_id(s);
 }
 
+/*
+ * Bounds of the reaper sleep interval.  Harvesting early keeps the vCPUs
+ * from exiting with KVM_EXIT_DIRTY_RING_FULL, which costs a BQL round
+ * trip per vCPU, but every harvest also takes the BQL and kicks nobody
+ * out, so an idle guest should not be woken more than once a second.
+ */
+#define KVM_DIRTY_RING_REAPER_MIN_MS    10
+#define KVM_DIRTY_RING_REAPER_MAX_MS    1000
+
+/*
+ * Pick the next sleep interval from what the last harvest found: halve it
+ * when a ring filled up in between or the harvest collected more than half
+ * a ring worth of pages, double it when nothing was dirtied.
+ */
+static unsigned int kvm_dirty_ring_reaper_next_interval(KVMState *s,
+                                                        uint64_t pages,
+                                                        uint64_t full_exits)
+{
+    unsigned int ms = s->reaper.reaper_interval_ms;
+
+    if (full_exits || pages > s->kvm_dirty_ring_size / 2) {
+        ms = MAX(ms / 2, KVM_DIRTY_RING_REAPER_MIN_MS);
+    } else if (!pages) {
+        ms = MIN(ms * 2, KVM_DIRTY_RING_REAPER_MAX_MS);
+    }
+
+    return ms;
+}
+
+static void *kvm_dirty_ring_reaper_thread(void *data)
+{
+    KVMState *s = data;
+    struct KVMDirtyRingReaper *r = &s->reaper;
+    uint64_t last_full_exits = 0;
+
+    rcu_register_thread();
+
+    trace_kvm_dirty_ring_reaper("init");
+
+    while (!atomic_read(&r->reaper_quit)) {
+        uint64_t pages, full_exits;
+
+        r->reaper_state = KVM_DIRTY_RING_REAPER_WAIT;
+        trace_kvm_dirty_ring_reaper("wait");
+        qemu_sem_timedwait(&r->reaper_sem, r->reaper_interval_ms);
+        if (atomic_read(&r->reaper_quit)) {
+            break;
+        }
+
+        trace_kvm_dirty_ring_reaper("wakeup");
+        r->reaper_state = KVM_DIRTY_RING_REAPER_REAPING;
+
+        qemu_mutex_lock_iothread();
+        pages = kvm_dirty_ring_reap(s);
+        full_exits = r->full_exits - last_full_exits;
+        last_full_exits = r->full_exits;
+        qemu_mutex_unlock_iothread();
+
+        r->reaper_interval_ms =
+            kvm_dirty_ring_reaper_next_interval(s, pages, full_exits);
+        trace_kvm_dirty_ring_reaper_interval(pages, r->reaper_interval_ms);
+
+        r->reaper_iteration++;
+    }
+
+    r->reaper_state = KVM_DIRTY_RING_REAPER_NONE;
+    trace_kvm_dirty_ring_reaper("exit");
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void kvm_dirty_ring_reaper_init(KVMState *s)
+{
+    struct KVMDirtyRingReaper *r = &s->reaper;
+
+    qemu_sem_init(&r->reaper_sem, 0);
+    r->reaper_interval_ms = KVM_DIRTY_RING_REAPER_MAX_MS;
+    qemu_thread_create(&r->reaper_thr, "kvm-reaper",
+                       kvm_dirty_ring_reaper_thread,
+                       s, QEMU_THREAD_JOINABLE);
+}
+
+void kvm_dirty_ring_reaper_stop(void)
+{
+    KVMState *s = kvm_state;
+    struct KVMDirtyRingReaper *r;
+
+    if (!s || !s->kvm_dirty_ring_size) {
+        return;
+    }
+
+    r = &s->reaper;
+    if (atomic_read(&r->reaper_quit)) {
+        return;
+    }
+
+    atomic_set(&r->reaper_quit, true);
+    qemu_sem_post(&r->reaper_sem);
+
+    /* The reaper may be waiting for the BQL to do one last harvest */
+    qemu_mutex_unlock_iothread();
+    qemu_thread_join(&r->reaper_thr);
+    qemu_mutex_lock_iothread();
+
+    qemu_sem_destroy(&r->reaper_sem);
+}
+
 static int kvm_init(MachineState *ms)
 {
     MachineClass *mc = MACHINE_GET_CLASS(ms);
@@ -1929,6 +2342,8 @@ static int kvm_init(MachineState *ms)
 
     s->sigmask_len = 8;
 
+    qemu_mutex_init(&kml_slots_lock);
+
 #ifdef KVM_CAP_SET_GUEST_DEBUG
     QTAILQ_INIT(&s->kvm_sw_breakpoints);
 #endif
@@ -2041,7 +2456,48 @@ static int kvm_init(MachineState *ms)
     s->coalesced_pio = s->coalesced_mmio &&
                        kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
-    s->manual_dirty_log_protect =
+    /*
+     * Enable KVM dirty ring if supported, otherwise fall back to
+     * dirty logging mode
+     */
+    if (s->kvm_dirty_ring_size > 0) {
+        uint64_t ring_bytes;
+
+        ring_bytes = s->kvm_dirty_ring_size * sizeof(struct kvm_dirty_gfn);
+
+        /* Read the max supported pages */
+        ret = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+        if (ret > 0) {
+            if (ring_bytes > ret) {
+                error_report("KVM dirty ring size %" PRIu32 " too big "
+                             "(maximum is %ld).  Please use a smaller value.",
+                             s->kvm_dirty_ring_size,
+                             (long)ret / sizeof(struct kvm_dirty_gfn));
+                ret = -EINVAL;
+                goto err;
+            }
+
+            ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+            if (ret) {
+                error_report("Enabling of KVM dirty ring failed: %s. "
+                             "Suggested minimum value is 1024.",
+                             strerror(-ret));
+                goto err;
+            }
+
+            s->kvm_dirty_ring_bytes = ring_bytes;
+        } else {
+            warn_report("KVM dirty ring not available, using bitmap method");
+            s->kvm_dirty_ring_size = 0;
+        }
+    }
+
+    /*
+     * KVM_CAP_DIRTY_LOG_RING and KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2 are
+     * not needed together; the dirty ring already re-protects the
+     * pages when the rings are reset.
+     */
+    s->manual_dirty_log_protect = !s->kvm_dirty_ring_size &&
         kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
     if (s->manual_dirty_log_protect) {
         ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0, 1);
@@ -2146,6 +2602,10 @@ static int kvm_init(MachineState *ms)
         qemu_balloon_inhibit(true);
     }
 
+    if (s->kvm_dirty_ring_size) {
+        kvm_dirty_ring_reaper_init(s);
+    }
+
     return 0;
 
 err:
@@ -2440,6 +2900,18 @@ int kvm_cpu_exec(CPUState *cpu)
             DPRINTF("irq_window_open\n");
             ret = EXCP_INTERRUPT;
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /*
+             * We shouldn't continue if the dirty ring of this vcpu is
+             * still full.  Got kicked by KVM_RESET_DIRTY_RINGS.
+             */
+            trace_kvm_dirty_ring_full(cpu->cpu_index);
+            qemu_mutex_lock_iothread();
+            kvm_state->reaper.full_exits++;
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SHUTDOWN:
             DPRINTF("shutdown\n");
             qemu_system_reset_request(SHUTDOWN_CAUSE_GUEST_RESET);
@@ -3077,6 +3549,57 @@ static void kvm_set_kernel_irqchip(Object *obj, Visitor *v,
     }
 }
 
+static void kvm_get_dirty_ring_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value = s->kvm_dirty_ring_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void kvm_set_dirty_ring_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    Error *error = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &error);
+    if (error) {
+        error_propagate(errp, error);
+        return;
+    }
+    if (value & (value - 1)) {
+        error_setg(errp, "dirty-ring-size must be a power of two.");
+        return;
+    }
+
+    s->kvm_dirty_ring_size = value;
+}
+
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state && kvm_state->kvm_dirty_ring_size;
+}
+
+DirtyRingStats *kvm_dirty_ring_query_stats(void)
+{
+    KVMState *s = kvm_state;
+    DirtyRingStats *stats = g_new0(DirtyRingStats, 1);
+
+    kvm_slots_lock();
+    stats->ring_size = s->kvm_dirty_ring_size;
+    stats->reap_count = s->reaper.reap_count;
+    stats->reaped_pages = s->reaper.reaped_pages;
+    kvm_slots_unlock();
+    stats->full_exits = s->reaper.full_exits;
+
+    return stats;
+}
+
 bool kvm_kernel_irqchip_allowed(void)
 {
     return kvm_state->kernel_irqchip_allowed;
@@ -3120,6 +3643,12 @@ static void kvm_accel_class_init(ObjectClass *oc, void *data)
         NULL, NULL);
     object_class_property_set_description(oc, "kvm-shadow-mem",
         "KVM shadow MMU size");
+
+    object_class_property_add(oc, "dirty-ring-size", "uint32",
+        kvm_get_dirty_ring_size, kvm_set_dirty_ring_size,
+        NULL, NULL);
+    object_class_property_set_description(oc, "dirty-ring-size",
+        "Size of KVM dirty page ring buffer (default: 0, i.e. use bitmap)");
 }
 
 static const TypeInfo kvm_accel_type = {
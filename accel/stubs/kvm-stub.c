@@ -68,6 +68,20 @@ bool kvm_has_sync_mmu(void)
     return false;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
+struct DirtyRingStats *kvm_dirty_ring_query_stats(void)
+{
+    abort();
+}
+
+void kvm_dirty_ring_reaper_stop(void)
+{
+}
+
 int kvm_has_many_ioeventfds(void)
 {
     return 0;
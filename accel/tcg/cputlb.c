@@ -270,21 +270,24 @@ void tlb_init(CPUState *cpu)
     }
 }
 
-/* flush_all_helper: run fn across all cpus
+static void tlb_queue_flush(CPUState *cpu, uint16_t full,
+                            const CPUTLBFlushRange *r);
+
+/* flush_all_helper: queue a flush on all cpus except src
  *
- * If the wait flag is set then the src cpu's helper will be queued as
- * "safe" work and the loop exited creating a synchronisation point
- * where all queued work will be finished before execution starts
- * again.
+ * The flush is merged into each cpu's pending batch, see
+ * tlb_queue_flush.  If the caller needs a synchronisation point it
+ * queues the src cpu's part of the flush as "safe" work, so that all
+ * queued work will be finished before execution starts again.
  */
-static void flush_all_helper(CPUState *src, run_on_cpu_func fn,
-                             run_on_cpu_data d)
+static void flush_all_helper(CPUState *src, uint16_t full,
+                             const CPUTLBFlushRange *r)
 {
     CPUState *cpu;
 
     CPU_FOREACH(cpu) {
         if (cpu != src) {
-            async_run_on_cpu(cpu, fn, d);
+            tlb_queue_flush(cpu, full, r);
         }
     }
 }
@@ -352,8 +355,7 @@ void tlb_flush_by_mmuidx(CPUState *cpu, uint16_t idxmap)
     tlb_debug("mmu_idx: 0x%" PRIx16 "\n", idxmap);
 
     if (cpu->created && !qemu_cpu_is_self(cpu)) {
-        async_run_on_cpu(cpu, tlb_flush_by_mmuidx_async_work,
-                         RUN_ON_CPU_HOST_INT(idxmap));
+        tlb_queue_flush(cpu, idxmap, NULL);
     } else {
         tlb_flush_by_mmuidx_async_work(cpu, RUN_ON_CPU_HOST_INT(idxmap));
     }
@@ -370,7 +372,7 @@ void tlb_flush_by_mmuidx_all_cpus(CPUState *src_cpu, uint16_t idxmap)
 
     tlb_debug("mmu_idx: 0x%"PRIx16"\n", idxmap);
 
-    flush_all_helper(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
+    flush_all_helper(src_cpu, idxmap, NULL);
     fn(src_cpu, RUN_ON_CPU_HOST_INT(idxmap));
 }
 
@@ -385,7 +387,7 @@ void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *src_cpu, uint16_t idxmap)
 
     tlb_debug("mmu_idx: 0x%"PRIx16"\n", idxmap);
 
-    flush_all_helper(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
+    flush_all_helper(src_cpu, idxmap, NULL);
     async_safe_run_on_cpu(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
 }
 
@@ -541,22 +543,15 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, uint16_t idxmap)
 
     if (qemu_cpu_is_self(cpu)) {
         tlb_flush_page_by_mmuidx_async_0(cpu, addr, idxmap);
-    } else if (idxmap < TARGET_PAGE_SIZE) {
-        /*
-         * Most targets have only a few mmu_idx.  In the case where
-         * we can stuff idxmap into the low TARGET_PAGE_BITS, avoid
-         * allocating memory for this operation.
-         */
-        async_run_on_cpu(cpu, tlb_flush_page_by_mmuidx_async_1,
-                         RUN_ON_CPU_TARGET_PTR(addr | idxmap));
     } else {
-        TLBFlushPageByMMUIdxData *d = g_new(TLBFlushPageByMMUIdxData, 1);
+        CPUTLBFlushRange r = {
+            .addr = addr,
+            .len = TARGET_PAGE_SIZE,
+            .idxmap = idxmap,
+            .bits = TARGET_LONG_BITS,
+        };
 
-        /* Otherwise allocate a structure, freed by the worker.  */
-        d->addr = addr;
-        d->idxmap = idxmap;
-        async_run_on_cpu(cpu, tlb_flush_page_by_mmuidx_async_2,
-                         RUN_ON_CPU_HOST_PTR(d));
+        tlb_queue_flush(cpu, 0, &r);
     }
 }
 
@@ -568,34 +563,18 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
 void tlb_flush_page_by_mmuidx_all_cpus(CPUState *src_cpu, target_ulong addr,
                                        uint16_t idxmap)
 {
+    CPUTLBFlushRange r;
+
     tlb_debug("addr: "TARGET_FMT_lx" mmu_idx:%"PRIx16"\n", addr, idxmap);
 
     /* This should already be page aligned */
     addr &= TARGET_PAGE_MASK;
 
-    /*
-     * Allocate memory to hold addr+idxmap only when needed.
-     * See tlb_flush_page_by_mmuidx for details.
-     */
-    if (idxmap < TARGET_PAGE_SIZE) {
-        flush_all_helper(src_cpu, tlb_flush_page_by_mmuidx_async_1,
-                         RUN_ON_CPU_TARGET_PTR(addr | idxmap));
-    } else {
-        CPUState *dst_cpu;
-
-        /* Allocate a separate data block for each destination cpu.  */
-        CPU_FOREACH(dst_cpu) {
-            if (dst_cpu != src_cpu) {
-                TLBFlushPageByMMUIdxData *d
-                    = g_new(TLBFlushPageByMMUIdxData, 1);
-
-                d->addr = addr;
-                d->idxmap = idxmap;
-                async_run_on_cpu(dst_cpu, tlb_flush_page_by_mmuidx_async_2,
-                                 RUN_ON_CPU_HOST_PTR(d));
-            }
-        }
-    }
+    r.addr = addr;
+    r.len = TARGET_PAGE_SIZE;
+    r.idxmap = idxmap;
+    r.bits = TARGET_LONG_BITS;
+    flush_all_helper(src_cpu, 0, &r);
 
     tlb_flush_page_by_mmuidx_async_0(src_cpu, addr, idxmap);
 }
@@ -609,36 +588,30 @@ void tlb_flush_page_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
                                               target_ulong addr,
                                               uint16_t idxmap)
 {
+    CPUTLBFlushRange r;
+
     tlb_debug("addr: "TARGET_FMT_lx" mmu_idx:%"PRIx16"\n", addr, idxmap);
 
     /* This should already be page aligned */
     addr &= TARGET_PAGE_MASK;
 
+    r.addr = addr;
+    r.len = TARGET_PAGE_SIZE;
+    r.idxmap = idxmap;
+    r.bits = TARGET_LONG_BITS;
+    flush_all_helper(src_cpu, 0, &r);
+
     /*
-     * Allocate memory to hold addr+idxmap only when needed.
-     * See tlb_flush_page_by_mmuidx for details.
+     * Allocate memory to hold addr+idxmap only when needed: in the
+     * common case where idxmap fits in the low TARGET_PAGE_BITS, stuff
+     * it into the page offset of the address.
      */
     if (idxmap < TARGET_PAGE_SIZE) {
-        flush_all_helper(src_cpu, tlb_flush_page_by_mmuidx_async_1,
-                         RUN_ON_CPU_TARGET_PTR(addr | idxmap));
         async_safe_run_on_cpu(src_cpu, tlb_flush_page_by_mmuidx_async_1,
                               RUN_ON_CPU_TARGET_PTR(addr | idxmap));
     } else {
-        CPUState *dst_cpu;
-        TLBFlushPageByMMUIdxData *d;
-
-        /* Allocate a separate data block for each destination cpu.  */
-        CPU_FOREACH(dst_cpu) {
-            if (dst_cpu != src_cpu) {
-                d = g_new(TLBFlushPageByMMUIdxData, 1);
-                d->addr = addr;
-                d->idxmap = idxmap;
-                async_run_on_cpu(dst_cpu, tlb_flush_page_by_mmuidx_async_2,
-                                 RUN_ON_CPU_HOST_PTR(d));
-            }
-        }
+        TLBFlushPageByMMUIdxData *d = g_new(TLBFlushPageByMMUIdxData, 1);
 
-        d = g_new(TLBFlushPageByMMUIdxData, 1);
         d->addr = addr;
         d->idxmap = idxmap;
         async_safe_run_on_cpu(src_cpu, tlb_flush_page_by_mmuidx_async_2,
@@ -651,6 +624,372 @@ void tlb_flush_page_all_cpus_synced(CPUState *src, target_ulong addr)
     tlb_flush_page_by_mmuidx_all_cpus_synced(src, addr, ALL_MMUIDX_BITS);
 }
 
+static inline bool tlb_hit_page_mask_anyprot(CPUTLBEntry *tlb_entry,
+                                             target_ulong page,
+                                             target_ulong mask)
+{
+    page &= mask;
+    mask &= TARGET_PAGE_MASK | TLB_INVALID_MASK;
+
+    return (page == (tlb_entry->addr_read & mask) ||
+            page == (tlb_addr_write(tlb_entry) & mask) ||
+            page == (tlb_entry->addr_code & mask));
+}
+
+/* Called with tlb_c.lock held */
+static inline bool tlb_flush_entry_mask_locked(CPUTLBEntry *tlb_entry,
+                                               target_ulong page,
+                                               target_ulong mask)
+{
+    if (tlb_hit_page_mask_anyprot(tlb_entry, page, mask)) {
+        memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
+    }
+    return false;
+}
+
+/* Called with tlb_c.lock held */
+static void tlb_flush_vtlb_page_mask_locked(CPUArchState *env, int mmu_idx,
+                                            target_ulong page,
+                                            target_ulong mask)
+{
+    CPUTLBDesc *d = &env_tlb(env)->d[mmu_idx];
+    int k;
+
+    assert_cpu_is_self(env_cpu(env));
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        if (tlb_flush_entry_mask_locked(&d->vtable[k], page, mask)) {
+            tlb_n_used_entries_dec(env, mmu_idx);
+        }
+    }
+}
+
+static void tlb_flush_range_locked(CPUArchState *env, int midx,
+                                   target_ulong addr, target_ulong len,
+                                   unsigned bits)
+{
+    CPUTLBDesc *d = &env_tlb(env)->d[midx];
+    CPUTLBDescFast *f = &env_tlb(env)->f[midx];
+    target_ulong mask = MAKE_64BIT_MASK(0, bits);
+    target_ulong i;
+
+    /*
+     * If @bits does not even cover the bits used to index the TLB, an
+     * address may match several entries; just flush everything.  The
+     * same is true if @len covers more pages than there are entries in
+     * the TLB: walking the range would take longer than a full flush.
+     */
+    if (bits < TARGET_PAGE_BITS + ctz64(tlb_n_entries(f)) ||
+        (len >> TARGET_PAGE_BITS) >= tlb_n_entries(f)) {
+        tlb_debug("forcing full flush midx %d ("
+                  TARGET_FMT_lx "/%u+" TARGET_FMT_lx ")\n",
+                  midx, addr, bits, len);
+        tlb_flush_one_mmuidx_locked(env, midx, get_clock_realtime());
+        return;
+    }
+
+    /*
+     * Check if we need to flush due to large pages.  Because
+     * large_page_mask contains all 1's from the msb, a range that does
+     * not cross the large page region either starts or ends in it.
+     */
+    if ((addr & d->large_page_mask) == d->large_page_addr ||
+        ((addr + len - 1) & d->large_page_mask) == d->large_page_addr) {
+        tlb_debug("forcing full flush midx %d ("
+                  TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
+                  midx, d->large_page_addr, d->large_page_mask);
+        tlb_flush_one_mmuidx_locked(env, midx, get_clock_realtime());
+        return;
+    }
+
+    for (i = 0; i < len; i += TARGET_PAGE_SIZE) {
+        target_ulong page = addr + i;
+
+        if (tlb_flush_entry_mask_locked(tlb_entry(env, midx, page),
+                                        page, mask)) {
+            tlb_n_used_entries_dec(env, midx);
+        }
+        tlb_flush_vtlb_page_mask_locked(env, midx, page, mask);
+    }
+}
+
+/**
+ * tlb_flush_range_by_mmuidx_async_0:
+ * @cpu: cpu on which to flush
+ * @r: range, bit length and set of mmu_idx to flush
+ *
+ * Helper for tlb_flush_range_by_mmuidx and friends, flush the pages
+ * in @r from the tlbs indicated by @r->idxmap from @cpu.
+ */
+static void tlb_flush_range_by_mmuidx_async_0(CPUState *cpu,
+                                              const CPUTLBFlushRange *r)
+{
+    CPUArchState *env = cpu->env_ptr;
+    target_ulong i;
+    int mmu_idx;
+
+    assert_cpu_is_self(cpu);
+
+    tlb_debug("range:" TARGET_FMT_lx "/%u+" TARGET_FMT_lx " mmu_map:0x%x\n",
+              r->addr, r->bits, r->len, r->idxmap);
+
+    qemu_spin_lock(&env_tlb(env)->c.lock);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if ((r->idxmap >> mmu_idx) & 1) {
+            tlb_flush_range_locked(env, mmu_idx, r->addr, r->len, r->bits);
+        }
+    }
+    qemu_spin_unlock(&env_tlb(env)->c.lock);
+
+    /*
+     * If the range is larger than what the jump cache can hold, clearing
+     * it entirely is cheaper than clearing the pages one by one.
+     */
+    if ((r->len >> TARGET_PAGE_BITS) >= TB_JMP_CACHE_SIZE ||
+        r->bits < TARGET_LONG_BITS) {
+        cpu_tb_jmp_cache_clear(cpu);
+        return;
+    }
+
+    for (i = 0; i < r->len; i += TARGET_PAGE_SIZE) {
+        tb_flush_jmp_cache(cpu, r->addr + i);
+    }
+}
+
+/**
+ * tlb_flush_range_by_mmuidx_async_1:
+ * @cpu: cpu on which to flush
+ * @data: allocated CPUTLBFlushRange
+ *
+ * Helper for tlb_flush_range_by_mmuidx_all_cpus_synced, called through
+ * async_safe_run_on_cpu.  Free the structure when done.
+ */
+static void tlb_flush_range_by_mmuidx_async_1(CPUState *cpu,
+                                              run_on_cpu_data data)
+{
+    CPUTLBFlushRange *r = data.host_ptr;
+
+    tlb_flush_range_by_mmuidx_async_0(cpu, r);
+    g_free(r);
+}
+
+/*
+ * Add @r to the pending batch @p, merging it with a pending range for
+ * the same mmu_idx set and bit length if they overlap or are adjacent.
+ * If the batch is full, or the merged range would become larger than
+ * any TLB, fall back to flushing the whole of @r->idxmap.
+ */
+static void tlb_pending_add_range_locked(CPUTLBPendingFlush *p,
+                                         const CPUTLBFlushRange *r)
+{
+    target_ulong r_last = r->addr + r->len - 1;
+    unsigned i;
+
+    if (!(r->idxmap & ~p->full)) {
+        /* Already covered by a pending full flush */
+        return;
+    }
+
+    for (i = 0; i < p->n_ranges; i++) {
+        CPUTLBFlushRange *q = &p->range[i];
+        target_ulong q_last = q->addr + q->len - 1;
+        target_ulong first, last;
+
+        if (q->idxmap != r->idxmap || q->bits != r->bits) {
+            continue;
+        }
+        if (!((r->addr <= q_last || r->addr == q_last + 1) &&
+              (q->addr <= r_last || q->addr == r_last + 1))) {
+            continue;
+        }
+
+        first = MIN(q->addr, r->addr);
+        last = MAX(q_last, r_last);
+        if (((last - first) >> TARGET_PAGE_BITS) >=
+            (1 << CPU_TLB_DYN_MAX_BITS)) {
+            p->full |= r->idxmap;
+            return;
+        }
+        q->addr = first;
+        q->len = last - first + 1;
+        return;
+    }
+
+    if (p->n_ranges < CPU_TLB_PENDING_RANGES) {
+        p->range[p->n_ranges++] = *r;
+    } else {
+        p->full |= r->idxmap;
+    }
+}
+
+static void tlb_flush_pending_async_work(CPUState *cpu, run_on_cpu_data data)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBPendingFlush *p = &env_tlb(env)->c.pending;
+    CPUTLBFlushRange range[CPU_TLB_PENDING_RANGES];
+    unsigned i, n_ranges;
+    uint16_t full;
+
+    assert_cpu_is_self(cpu);
+
+    /*
+     * Take the whole batch; flushes queued from now on will need a new
+     * work item.
+     */
+    qemu_spin_lock(&env_tlb(env)->c.lock);
+    full = p->full;
+    n_ranges = p->n_ranges;
+    memcpy(range, p->range, n_ranges * sizeof(range[0]));
+    p->full = 0;
+    p->n_ranges = 0;
+    p->queued = false;
+    qemu_spin_unlock(&env_tlb(env)->c.lock);
+
+    if (full) {
+        tlb_flush_by_mmuidx_async_work(cpu, RUN_ON_CPU_HOST_INT(full));
+    }
+    for (i = 0; i < n_ranges; i++) {
+        range[i].idxmap &= ~full;
+        if (range[i].idxmap) {
+            tlb_flush_range_by_mmuidx_async_0(cpu, &range[i]);
+        }
+    }
+}
+
+/**
+ * tlb_queue_flush:
+ * @cpu: cpu on which to flush
+ * @full: set of mmu_idx to flush completely
+ * @r: range to flush, or NULL
+ *
+ * Queue a flush on a vCPU other than the current one.  The request is
+ * merged into the vCPU's pending batch, and only the first request of
+ * a batch queues a work item.  A guest shooting down many pages
+ * therefore costs one work item per vCPU rather than one per page.
+ */
+static void tlb_queue_flush(CPUState *cpu, uint16_t full,
+                            const CPUTLBFlushRange *r)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBPendingFlush *p = &env_tlb(env)->c.pending;
+    bool queue;
+
+    qemu_spin_lock(&env_tlb(env)->c.lock);
+    p->full |= full;
+    if (r) {
+        tlb_pending_add_range_locked(p, r);
+    }
+    queue = !p->queued;
+    p->queued = true;
+    qemu_spin_unlock(&env_tlb(env)->c.lock);
+
+    if (queue) {
+        async_run_on_cpu(cpu, tlb_flush_pending_async_work, RUN_ON_CPU_NULL);
+    }
+}
+
+void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                               target_ulong len, uint16_t idxmap,
+                               unsigned bits)
+{
+    CPUTLBFlushRange r;
+
+    /*
+     * If all bits are significant, and len is small,
+     * this devolves to tlb_flush_page.
+     */
+    if (bits >= TARGET_LONG_BITS && len <= TARGET_PAGE_SIZE) {
+        tlb_flush_page_by_mmuidx(cpu, addr, idxmap);
+        return;
+    }
+    /* If no page bits are significant, this devolves to tlb_flush. */
+    if (bits < TARGET_PAGE_BITS) {
+        tlb_flush_by_mmuidx(cpu, idxmap);
+        return;
+    }
+
+    /* This should already be page aligned */
+    r.addr = addr & TARGET_PAGE_MASK;
+    r.len = len;
+    r.idxmap = idxmap;
+    r.bits = MIN(bits, TARGET_LONG_BITS);
+
+    if (qemu_cpu_is_self(cpu)) {
+        tlb_flush_range_by_mmuidx_async_0(cpu, &r);
+    } else {
+        tlb_queue_flush(cpu, 0, &r);
+    }
+}
+
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len)
+{
+    tlb_flush_range_by_mmuidx(cpu, addr, len, ALL_MMUIDX_BITS,
+                              TARGET_LONG_BITS);
+}
+
+void tlb_flush_range_by_mmuidx_all_cpus(CPUState *src_cpu,
+                                        target_ulong addr, target_ulong len,
+                                        uint16_t idxmap, unsigned bits)
+{
+    CPUTLBFlushRange r;
+
+    /*
+     * If all bits are significant, and len is small,
+     * this devolves to tlb_flush_page.
+     */
+    if (bits >= TARGET_LONG_BITS && len <= TARGET_PAGE_SIZE) {
+        tlb_flush_page_by_mmuidx_all_cpus(src_cpu, addr, idxmap);
+        return;
+    }
+    /* If no page bits are significant, this devolves to tlb_flush. */
+    if (bits < TARGET_PAGE_BITS) {
+        tlb_flush_by_mmuidx_all_cpus(src_cpu, idxmap);
+        return;
+    }
+
+    /* This should already be page aligned */
+    r.addr = addr & TARGET_PAGE_MASK;
+    r.len = len;
+    r.idxmap = idxmap;
+    r.bits = MIN(bits, TARGET_LONG_BITS);
+
+    flush_all_helper(src_cpu, 0, &r);
+    tlb_flush_range_by_mmuidx_async_0(src_cpu, &r);
+}
+
+void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
+                                               target_ulong addr,
+                                               target_ulong len,
+                                               uint16_t idxmap,
+                                               unsigned bits)
+{
+    CPUTLBFlushRange r;
+
+    /*
+     * If all bits are significant, and len is small,
+     * this devolves to tlb_flush_page.
+     */
+    if (bits >= TARGET_LONG_BITS && len <= TARGET_PAGE_SIZE) {
+        tlb_flush_page_by_mmuidx_all_cpus_synced(src_cpu, addr, idxmap);
+        return;
+    }
+    /* If no page bits are significant, this devolves to tlb_flush. */
+    if (bits < TARGET_PAGE_BITS) {
+        tlb_flush_by_mmuidx_all_cpus_synced(src_cpu, idxmap);
+        return;
+    }
+
+    /* This should already be page aligned */
+    r.addr = addr & TARGET_PAGE_MASK;
+    r.len = len;
+    r.idxmap = idxmap;
+    r.bits = MIN(bits, TARGET_LONG_BITS);
+
+    flush_all_helper(src_cpu, 0, &r);
+    async_safe_run_on_cpu(src_cpu, tlb_flush_range_by_mmuidx_async_1,
+                          RUN_ON_CPU_HOST_PTR(g_memdup(&r, sizeof(r))));
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
@@ -1414,6 +1414,7 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     PageDesc *p;
     uint32_t h;
     tb_page_addr_t phys_pc;
+    int i;
 
     assert_memory_lock();
 
@@ -1444,10 +1445,12 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     }
 
     /* remove the TB from the hash list */
-    h = tb_jmp_cache_hash_func(tb->pc);
+    h = tb_jmp_cache_hash_func(tb->pc) * TB_JMP_CACHE_WAYS;
     CPU_FOREACH(cpu) {
-        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
-            atomic_set(&cpu->tb_jmp_cache[h], NULL);
+        for (i = 0; i < TB_JMP_CACHE_WAYS; i++) {
+            if (atomic_read(&cpu->tb_jmp_cache[h + i]) == tb) {
+                atomic_set(&cpu->tb_jmp_cache[h + i], NULL);
+            }
         }
     }
 
@@ -2248,9 +2251,9 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
 
 static void tb_jmp_cache_clear_page(CPUState *cpu, target_ulong page_addr)
 {
-    unsigned int i, i0 = tb_jmp_cache_hash_page(page_addr);
+    unsigned int i, i0 = tb_jmp_cache_hash_page(page_addr) * TB_JMP_CACHE_WAYS;
 
-    for (i = 0; i < TB_JMP_PAGE_SIZE; i++) {
+    for (i = 0; i < TB_JMP_PAGE_SIZE * TB_JMP_CACHE_WAYS; i++) {
         atomic_set(&cpu->tb_jmp_cache[i0 + i], NULL);
     }
 }
@@ -2333,6 +2336,33 @@ static gboolean tb_tree_stats_iter(gpointer key, gpointer value, gpointer data)
     return false;
 }
 
+static void print_tb_jmp_cache_statistics(void)
+{
+#ifdef CONFIG_PROFILER
+    TBJmpCacheStats total = {};
+    CPUState *cpu;
+    size_t lookups;
+#endif
+
+    qemu_printf("TB lookup cache     %d sets x %d ways per vCPU\n",
+                TB_JMP_CACHE_SIZE, TB_JMP_CACHE_WAYS);
+#ifdef CONFIG_PROFILER
+    CPU_FOREACH(cpu) {
+        total.hits += atomic_read(&cpu->tb_jmp_cache_stats.hits);
+        total.promotions += atomic_read(&cpu->tb_jmp_cache_stats.promotions);
+        total.misses += atomic_read(&cpu->tb_jmp_cache_stats.misses);
+        total.evictions += atomic_read(&cpu->tb_jmp_cache_stats.evictions);
+    }
+    lookups = total.hits + total.misses;
+
+    qemu_printf("TB lookup hits      %zu (%0.2f%%), %zu promotions\n",
+                total.hits, lookups ? (double)total.hits / lookups * 100 : 0,
+                total.promotions);
+    qemu_printf("TB lookup misses    %zu, %zu evictions\n",
+                total.misses, total.evictions);
+#endif
+}
+
 void dump_exec_info(void)
 {
     struct tb_tree_stats tst = {};
@@ -2368,6 +2398,7 @@ void dump_exec_info(void)
     qht_statistics_init(&tb_ctx.htable, &hst);
     print_qht_statistics(hst);
     qht_statistics_destroy(&hst);
+    print_tb_jmp_cache_statistics();
 
     qemu_printf("\nStatistics:\n");
     qemu_printf("TB flush count      %u\n",
@@ -380,7 +380,8 @@ BlockDriverState *bdrv_new(void)
     }
     notifier_with_return_list_init(&bs->before_write_notifiers);
     qemu_co_mutex_init(&bs->reqs_lock);
-    qemu_mutex_init(&bs->dirty_bitmap_mutex);
+    qemu_rec_mutex_init(&bs->dirty_bitmap_mutex);
+    qemu_spin_init(&bs->dirty_pending_lock);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
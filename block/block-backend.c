@@ -1389,27 +1389,36 @@ typedef struct BlkAioEmAIOCB {
     BlockAIOCB common;
     BlkRwCo rwco;
     int bytes;
-    bool has_returned;
+    /* Set by whichever of blk_aio_prwv() and the request coroutine finishes
+     * first; the other one completes the request.  They run in different
+     * threads when the request is submitted from an AioContext other than
+     * the BlockBackend's, so this is accessed atomically. */
+    bool half_done;
 } BlkAioEmAIOCB;
 
 static const AIOCBInfo blk_aio_em_aiocb_info = {
     .aiocb_size         = sizeof(BlkAioEmAIOCB),
 };
 
+static void blk_aio_do_complete(BlkAioEmAIOCB *acb)
+{
+    acb->common.cb(acb->common.opaque, acb->rwco.ret);
+    blk_dec_in_flight(acb->rwco.blk);
+    qemu_aio_unref(acb);
+}
+
 static void blk_aio_complete(BlkAioEmAIOCB *acb)
 {
-    if (acb->has_returned) {
-        acb->common.cb(acb->common.opaque, acb->rwco.ret);
-        blk_dec_in_flight(acb->rwco.blk);
-        qemu_aio_unref(acb);
+    if (atomic_xchg(&acb->half_done, true)) {
+        blk_aio_do_complete(acb);
     }
 }
 
 static void blk_aio_complete_bh(void *opaque)
 {
     BlkAioEmAIOCB *acb = opaque;
-    assert(acb->has_returned);
-    blk_aio_complete(acb);
+    assert(atomic_read(&acb->half_done));
+    blk_aio_do_complete(acb);
 }
 
 static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
@@ -1430,13 +1439,14 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
         .ret    = NOT_DONE,
     };
     acb->bytes = bytes;
-    acb->has_returned = false;
+    acb->half_done = false;
 
     co = qemu_coroutine_create(co_entry, acb);
     bdrv_coroutine_enter(blk_bs(blk), co);
 
-    acb->has_returned = true;
-    if (acb->rwco.ret != NOT_DONE) {
+    if (atomic_xchg(&acb->half_done, true)) {
+        /* Already completed, but the callback must not run before we
+         * return */
         replay_bh_schedule_oneshot_event(blk_get_aio_context(blk),
                                          blk_aio_complete_bh, acb);
     }
@@ -2402,6 +2412,25 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+/*
+ * Like blk_co_copy_range(), for a source that is not attached to a
+ * BlockBackend, such as the node below a block job's filter.
+ */
+int coroutine_fn blk_co_copy_range_from_child(BdrvChild *src, int64_t off_in,
+                                              BlockBackend *blk_out,
+                                              int64_t off_out, int bytes,
+                                              BdrvRequestFlags read_flags,
+                                              BdrvRequestFlags write_flags)
+{
+    int r;
+    r = blk_check_byte_request(blk_out, off_out, bytes);
+    if (r) {
+        return r;
+    }
+    return bdrv_co_copy_range(src, off_in, blk_out->root, off_out,
+                              bytes, read_flags, write_flags);
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     return blk->root;
@@ -59,14 +59,61 @@ struct BdrvDirtyBitmapIter {
     BdrvDirtyBitmap *bitmap;
 };
 
+static void bdrv_dirty_bitmaps_set_locked(BlockDriverState *bs,
+                                          int64_t offset, int64_t bytes)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!bdrv_dirty_bitmap_enabled(bitmap)) {
+            continue;
+        }
+        assert(!bdrv_dirty_bitmap_readonly(bitmap));
+        hbitmap_set(bitmap->bitmap, offset, bytes);
+    }
+}
+
+/* Apply the ranges batched by bdrv_set_dirty() to the enabled bitmaps.
+ * Called with dirty_bitmap_mutex held.  */
+static void bdrv_dirty_bitmaps_flush_locked(BlockDriverState *bs)
+{
+    typeof(bs->dirty_pending[0]) pending[BDRV_DIRTY_PENDING_MAX];
+    int i, n;
+
+    if (!atomic_read(&bs->dirty_pending_count)) {
+        return;
+    }
+
+    qemu_spin_lock(&bs->dirty_pending_lock);
+    n = bs->dirty_pending_count;
+    memcpy(pending, bs->dirty_pending, n * sizeof(pending[0]));
+    atomic_set(&bs->dirty_pending_count, 0);
+    qemu_spin_unlock(&bs->dirty_pending_lock);
+
+    for (i = 0; i < n; i++) {
+        bdrv_dirty_bitmaps_set_locked(bs, pending[i].offset, pending[i].bytes);
+    }
+}
+
 static inline void bdrv_dirty_bitmaps_lock(BlockDriverState *bs)
 {
-    qemu_mutex_lock(&bs->dirty_bitmap_mutex);
+    qemu_rec_mutex_lock(&bs->dirty_bitmap_mutex);
+    bdrv_dirty_bitmaps_flush_locked(bs);
 }
 
 static inline void bdrv_dirty_bitmaps_unlock(BlockDriverState *bs)
 {
-    qemu_mutex_unlock(&bs->dirty_bitmap_mutex);
+    qemu_rec_mutex_unlock(&bs->dirty_bitmap_mutex);
+}
+
+/* Make pending writes visible to the functions that read a bitmap without
+ * taking the lock.  */
+static void bdrv_dirty_bitmaps_flush(BlockDriverState *bs)
+{
+    if (atomic_read(&bs->dirty_pending_count)) {
+        bdrv_dirty_bitmaps_lock(bs);
+        bdrv_dirty_bitmaps_unlock(bs);
+    }
 }
 
 void bdrv_dirty_bitmap_lock(BdrvDirtyBitmap *bitmap)
@@ -641,6 +688,8 @@ uint32_t bdrv_dirty_bitmap_granularity(const BdrvDirtyBitmap *bitmap)
 BdrvDirtyBitmapIter *bdrv_dirty_iter_new(BdrvDirtyBitmap *bitmap)
 {
     BdrvDirtyBitmapIter *iter = g_new(BdrvDirtyBitmapIter, 1);
+
+    bdrv_dirty_bitmaps_flush(bitmap->bs);
     hbitmap_iter_init(&iter->hbi, bitmap->bitmap, 0);
     iter->bitmap = bitmap;
     bitmap->active_iterators++;
@@ -659,6 +708,7 @@ void bdrv_dirty_iter_free(BdrvDirtyBitmapIter *iter)
 
 int64_t bdrv_dirty_iter_next(BdrvDirtyBitmapIter *iter)
 {
+    bdrv_dirty_bitmaps_flush(iter->bitmap->bs);
     return hbitmap_iter_next(&iter->hbi);
 }
 
@@ -732,6 +782,7 @@ void bdrv_dirty_bitmap_serialize_part(const BdrvDirtyBitmap *bitmap,
                                       uint8_t *buf, uint64_t offset,
                                       uint64_t bytes)
 {
+    bdrv_dirty_bitmaps_flush(bitmap->bs);
     hbitmap_serialize_part(bitmap->bitmap, buf, offset, bytes);
 }
 
@@ -761,22 +812,43 @@ void bdrv_dirty_bitmap_deserialize_finish(BdrvDirtyBitmap *bitmap)
     hbitmap_deserialize_finish(bitmap->bitmap);
 }
 
+/* Writes are only recorded here, merging them with the previous one if
+ * they touch, and reach the bitmaps the next time they are locked.  */
 void bdrv_set_dirty(BlockDriverState *bs, int64_t offset, int64_t bytes)
 {
-    BdrvDirtyBitmap *bitmap;
+    int n;
 
     if (QLIST_EMPTY(&bs->dirty_bitmaps)) {
         return;
     }
 
-    bdrv_dirty_bitmaps_lock(bs);
-    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
-        if (!bdrv_dirty_bitmap_enabled(bitmap)) {
-            continue;
+    qemu_spin_lock(&bs->dirty_pending_lock);
+    n = bs->dirty_pending_count;
+    if (n) {
+        int64_t last_offset = bs->dirty_pending[n - 1].offset;
+        int64_t last_end = last_offset + bs->dirty_pending[n - 1].bytes;
+
+        if (offset <= last_end && last_offset <= offset + bytes) {
+            last_offset = MIN(last_offset, offset);
+            last_end = MAX(last_end, offset + bytes);
+            bs->dirty_pending[n - 1].offset = last_offset;
+            bs->dirty_pending[n - 1].bytes = last_end - last_offset;
+            qemu_spin_unlock(&bs->dirty_pending_lock);
+            return;
         }
-        assert(!bdrv_dirty_bitmap_readonly(bitmap));
-        hbitmap_set(bitmap->bitmap, offset, bytes);
     }
+    if (n < BDRV_DIRTY_PENDING_MAX) {
+        bs->dirty_pending[n].offset = offset;
+        bs->dirty_pending[n].bytes = bytes;
+        atomic_set(&bs->dirty_pending_count, n + 1);
+        qemu_spin_unlock(&bs->dirty_pending_lock);
+        return;
+    }
+    qemu_spin_unlock(&bs->dirty_pending_lock);
+
+    /* The batch is full; flush it together with this write */
+    bdrv_dirty_bitmaps_lock(bs);
+    bdrv_dirty_bitmaps_set_locked(bs, offset, bytes);
     bdrv_dirty_bitmaps_unlock(bs);
 }
 
@@ -790,6 +862,7 @@ void bdrv_set_dirty_iter(BdrvDirtyBitmapIter *iter, int64_t offset)
 
 int64_t bdrv_get_dirty_count(BdrvDirtyBitmap *bitmap)
 {
+    bdrv_dirty_bitmaps_flush(bitmap->bs);
     return hbitmap_count(bitmap->bitmap);
 }
 
@@ -879,18 +952,21 @@ BdrvDirtyBitmap *bdrv_dirty_bitmap_next(BdrvDirtyBitmap *bitmap)
 
 char *bdrv_dirty_bitmap_sha256(const BdrvDirtyBitmap *bitmap, Error **errp)
 {
+    bdrv_dirty_bitmaps_flush(bitmap->bs);
     return hbitmap_sha256(bitmap->bitmap, errp);
 }
 
 int64_t bdrv_dirty_bitmap_next_dirty(BdrvDirtyBitmap *bitmap, int64_t offset,
                                      int64_t bytes)
 {
+    bdrv_dirty_bitmaps_flush(bitmap->bs);
     return hbitmap_next_dirty(bitmap->bitmap, offset, bytes);
 }
 
 int64_t bdrv_dirty_bitmap_next_zero(BdrvDirtyBitmap *bitmap, int64_t offset,
                                     int64_t bytes)
 {
+    bdrv_dirty_bitmaps_flush(bitmap->bs);
     return hbitmap_next_zero(bitmap->bitmap, offset, bytes);
 }
 
@@ -898,6 +974,7 @@ bool bdrv_dirty_bitmap_next_dirty_area(BdrvDirtyBitmap *bitmap,
         int64_t start, int64_t end, int64_t max_dirty_count,
         int64_t *dirty_start, int64_t *dirty_count)
 {
+    bdrv_dirty_bitmaps_flush(bitmap->bs);
     return hbitmap_next_dirty_area(bitmap->bitmap, start, end, max_dirty_count,
                                    dirty_start, dirty_count);
 }
@@ -965,6 +1042,9 @@ bool bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
         if (src->bs != dest->bs) {
             bdrv_dirty_bitmaps_lock(src->bs);
         }
+    } else {
+        bdrv_dirty_bitmaps_flush(dest->bs);
+        bdrv_dirty_bitmaps_flush(src->bs);
     }
 
     if (backup) {
@@ -159,9 +159,17 @@ typedef struct BDRVRawState {
     bool use_linux_io_uring:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
+    /* Cleared from the thread pool when cloning fails, use atomics */
+    bool has_clone_range;
     bool needs_alignment;
     bool drop_cache;
     bool check_cache_dropped;
+#ifdef CONFIG_LINUX_IO_URING
+    /* Index of fd in the AioContext's registered file table, or -1 */
+    int luring_fixed_fd;
+    /* io_uring requests in flight, which may refer to luring_fixed_fd */
+    unsigned int luring_in_flight;
+#endif
     struct {
         uint64_t discard_nb_ok;
         uint64_t discard_nb_failed;
@@ -475,6 +483,36 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+/*
+ * With aio=io_uring, keep s->fd in the registered file table of the
+ * AioContext's io_uring while it is in use.
+ */
+static void raw_luring_register_fd(BlockDriverState *bs, AioContext *ctx)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring && s->fd >= 0) {
+        s->luring_fixed_fd = luring_register_file(aio_get_linux_io_uring(ctx),
+                                                  s->fd);
+    }
+#endif
+}
+
+static void raw_luring_unregister_fd(BlockDriverState *bs, AioContext *ctx)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring && s->luring_fixed_fd >= 0) {
+        /* Queued sqes only pick up the file from the table when submitted */
+        AIO_WAIT_WHILE(ctx, s->luring_in_flight > 0);
+        luring_unregister_file(aio_get_linux_io_uring(ctx), s->fd);
+        s->luring_fixed_fd = -1;
+    }
+#endif
+}
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -574,6 +612,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     raw_parse_flags(bdrv_flags, &s->open_flags, false);
 
     s->fd = -1;
+#ifdef CONFIG_LINUX_IO_URING
+    s->luring_fixed_fd = -1;
+#endif
     fd = qemu_open(filename, s->open_flags, 0644);
     ret = fd < 0 ? -errno : 0;
 
@@ -655,6 +696,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         } else {
             s->discard_zeroes = true;
             s->has_fallocate = true;
+            atomic_set(&s->has_clone_range, true);
         }
     } else {
         if (!(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode))) {
@@ -706,6 +748,8 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+    raw_luring_register_fd(bs, bdrv_get_aio_context(bs));
     ret = 0;
 fail:
     if (filename && (bdrv_flags & BDRV_O_TEMPORARY)) {
@@ -1056,8 +1100,10 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->check_cache_dropped = rs->check_cache_dropped;
     s->open_flags = rs->open_flags;
 
+    raw_luring_unregister_fd(state->bs, bdrv_get_aio_context(state->bs));
     qemu_close(s->fd);
     s->fd = rs->fd;
+    raw_luring_register_fd(state->bs, bdrv_get_aio_context(state->bs));
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1654,6 +1700,34 @@ static int handle_aiocb_copy_range(void *opaque)
     off_t in_off = aiocb->aio_offset;
     off_t out_off = aiocb->copy_range.aio_offset2;
 
+#ifdef FICLONERANGE
+    BDRVRawState *s = aiocb->bs->opaque;
+
+    /* On filesystems with reflink support, share the extents instead of
+     * copying the data */
+    if (atomic_read(&s->has_clone_range)) {
+        struct file_clone_range range = {
+            .src_fd         = aiocb->aio_fildes,
+            .src_offset     = in_off,
+            .src_length     = bytes,
+            .dest_offset    = out_off,
+        };
+        int ret = ioctl(aiocb->copy_range.aio_fd2, FICLONERANGE, &range);
+
+        trace_file_clone_range(aiocb->bs, aiocb->aio_fildes, in_off,
+                               aiocb->copy_range.aio_fd2, out_off, bytes,
+                               ret < 0 ? -errno : 0);
+        if (ret == 0) {
+            return 0;
+        }
+        /* EINVAL means that the range is not aligned to the filesystem
+         * block size, anything else that cloning cannot work at all */
+        if (errno != EINVAL) {
+            atomic_set(&s->has_clone_range, false);
+        }
+    }
+#endif
+
     while (bytes) {
         ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
                                       aiocb->copy_range.aio_fd2, &out_off,
@@ -1896,6 +1970,25 @@ static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
     return thread_pool_submit_co(pool, func, arg);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static int coroutine_fn raw_luring_co_submit(BlockDriverState *bs,
+                                             uint64_t offset,
+                                             QEMUIOVector *qiov, int type)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    int ret;
+
+    s->luring_in_flight++;
+    ret = luring_co_submit(bs, aio, s->fd, s->luring_fixed_fd, offset, qiov,
+                           type);
+    s->luring_in_flight--;
+    aio_wait_kick();
+
+    return ret;
+}
+#endif
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
@@ -1915,9 +2008,8 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
     } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
         assert(qiov->size == bytes);
-        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        return raw_luring_co_submit(bs, offset, qiov, type);
 #endif
 #ifdef CONFIG_LINUX_AIO
     } else if (s->use_linux_aio) {
@@ -2011,8 +2103,7 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        return raw_luring_co_submit(bs, 0, NULL, QEMU_AIO_FLUSH);
     }
 #endif
     return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
@@ -2042,6 +2133,12 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
         }
     }
 #endif
+    raw_luring_register_fd(bs, new_context);
+}
+
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    raw_luring_unregister_fd(bs, bdrv_get_aio_context(bs));
 }
 
 static void raw_close(BlockDriverState *bs)
@@ -2049,6 +2146,7 @@ static void raw_close(BlockDriverState *bs)
     BDRVRawState *s = bs->opaque;
 
     if (s->fd >= 0) {
+        raw_luring_unregister_fd(bs, bdrv_get_aio_context(bs));
         qemu_close(s->fd);
         s->fd = -1;
     }
@@ -3013,9 +3111,11 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_luring_unregister_fd(bs, bdrv_get_aio_context(bs));
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
+        raw_luring_register_fd(bs, bdrv_get_aio_context(bs));
     }
     s->perm_change_fd = 0;
 
@@ -3115,6 +3215,7 @@ BlockDriver bdrv_file = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3533,6 +3634,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3657,6 +3759,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3789,6 +3892,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
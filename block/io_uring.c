@@ -30,6 +30,16 @@ typedef struct LuringAIOCB {
     bool is_read;
     QSIMPLEQ_ENTRY(LuringAIOCB) next;
 
+    /*
+     * Requests submitted from the AioContext home thread go through the
+     * AioContext's own io_uring when it has one, see ioq_submit().
+     * @fixed_fd is the index of the file in that ring's registered file
+     * table, or -1.
+     */
+    struct LuringState *s;
+    CqeHandler cqe_handler;
+    int fixed_fd;
+
     /*
      * Buffered reads may require resubmission, see
      * luring_resubmit_short_read().
@@ -71,17 +81,18 @@ static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
 }
 
 /**
- * luring_resubmit_short_read:
+ * luring_prepare_short_read:
  *
  * Before Linux commit 9d93a3f5a0c ("io_uring: punt short reads to async
  * context") a buffered I/O request with the start of the file range in the
  * page cache could result in a short read.  Applications need to resubmit the
- * remaining read request.
+ * remaining read request.  This function updates the sqe accordingly, the
+ * caller resubmits it.
  *
  * This is a slow path but recent kernels never take it.
  */
-static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
-                                       int nread)
+static void luring_prepare_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                      int nread)
 {
     QEMUIOVector *resubmit_qiov;
     size_t remaining;
@@ -106,8 +117,64 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luringcb->sqeq.off = nread;
     luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
     luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+}
 
-    luring_resubmit(s, luringcb);
+/**
+ * luring_complete:
+ * @s: AIO state
+ * @luringcb: AIO control block
+ * @ret: result from the cqe
+ *
+ * Handles the result of a request and wakes up its coroutine.
+ *
+ * Returns: true if the request must be resubmitted instead.
+ */
+static bool luring_complete(LuringState *s, LuringAIOCB *luringcb, int ret)
+{
+    /* total_read is non-zero only for resubmitted read requests */
+    int total_bytes = ret + luringcb->total_read;
+
+    trace_luring_process_completion(s, luringcb, ret);
+
+    if (ret < 0) {
+        if (ret == -EINTR) {
+            return true;
+        }
+    } else if (!luringcb->qiov) {
+        goto end;
+    } else if (total_bytes == luringcb->qiov->size) {
+        ret = 0;
+    /* Only read/write */
+    } else {
+        /* Short Read/Write */
+        if (luringcb->is_read) {
+            if (ret > 0) {
+                luring_prepare_short_read(s, luringcb, ret);
+                return true;
+            } else {
+                /* Pad with zeroes */
+                qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                                  luringcb->qiov->size - total_bytes);
+                ret = 0;
+            }
+        } else {
+            ret = -ENOSPC;
+        }
+    }
+end:
+    luringcb->ret = ret;
+    qemu_iovec_destroy(&luringcb->resubmit_qiov);
+
+    /*
+     * If the coroutine is already entered it must be in ioq_submit()
+     * and will notice luringcb->ret has been filled in when it
+     * eventually runs later. Coroutines cannot be entered recursively
+     * so avoid doing that!
+     */
+    if (!qemu_coroutine_entered(luringcb->co)) {
+        aio_co_wake(luringcb->co);
+    }
+    return false;
 }
 
 /**
@@ -126,7 +193,6 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
 static void luring_process_completions(LuringState *s)
 {
     struct io_uring_cqe *cqes;
-    int total_bytes;
     /*
      * Request completion callbacks can run the nested event loop.
      * Schedule ourselves so the nested event loop will "see" remaining
@@ -159,59 +225,79 @@ static void luring_process_completions(LuringState *s)
 
         /* Change counters one-by-one because we can be nested. */
         s->io_q.in_flight--;
-        trace_luring_process_completion(s, luringcb, ret);
-
-        /* total_read is non-zero only for resubmitted read requests */
-        total_bytes = ret + luringcb->total_read;
-
-        if (ret < 0) {
-            if (ret == -EINTR) {
-                luring_resubmit(s, luringcb);
-                continue;
-            }
-        } else if (!luringcb->qiov) {
-            goto end;
-        } else if (total_bytes == luringcb->qiov->size) {
-            ret = 0;
-        /* Only read/write */
-        } else {
-            /* Short Read/Write */
-            if (luringcb->is_read) {
-                if (ret > 0) {
-                    luring_resubmit_short_read(s, luringcb, ret);
-                    continue;
-                } else {
-                    /* Pad with zeroes */
-                    qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
-                                      luringcb->qiov->size - total_bytes);
-                    ret = 0;
-                }
-            } else {
-                ret = -ENOSPC;
-            }
-        }
-end:
-        luringcb->ret = ret;
-        qemu_iovec_destroy(&luringcb->resubmit_qiov);
 
-        /*
-         * If the coroutine is already entered it must be in ioq_submit()
-         * and will notice luringcb->ret has been filled in when it
-         * eventually runs later. Coroutines cannot be entered recursively
-         * so avoid doing that!
-         */
-        if (!qemu_coroutine_entered(luringcb->co)) {
-            aio_co_wake(luringcb->co);
+        if (luring_complete(s, luringcb, ret)) {
+            luring_resubmit(s, luringcb);
         }
     }
     qemu_bh_cancel(s->completion_bh);
 }
 
+static void luring_prep_shared_sqe(struct io_uring_sqe *sqe, void *opaque)
+{
+    LuringAIOCB *luringcb = opaque;
+
+    *sqe = luringcb->sqeq;
+    if (luringcb->fixed_fd >= 0) {
+        sqe->fd = luringcb->fixed_fd;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+static void luring_shared_cqe_handler(CqeHandler *cqe_handler);
+
+/*
+ * The AioContext's own io_uring submits requests together with its next
+ * wait for events, which saves a system call and the wakeups for a second
+ * ring.  Its sq ring may only be filled by the home thread though.
+ */
+static bool luring_use_shared_ring(LuringState *s)
+{
+    return aio_has_io_uring(s->aio_context) &&
+           in_aio_context_home_thread(s->aio_context);
+}
+
+static void luring_submit_shared(LuringState *s, LuringAIOCB *luringcb)
+{
+    luringcb->s = s;
+    luringcb->cqe_handler.cb = luring_shared_cqe_handler;
+    s->io_q.in_flight++;
+    aio_add_sqe(s->aio_context, luring_prep_shared_sqe, luringcb,
+                &luringcb->cqe_handler);
+}
+
+/* Completion callback for requests on the AioContext's io_uring */
+static void luring_shared_cqe_handler(CqeHandler *cqe_handler)
+{
+    LuringAIOCB *luringcb = container_of(cqe_handler, LuringAIOCB,
+                                         cqe_handler);
+    LuringState *s = luringcb->s;
+    AioContext *ctx = s->aio_context;
+
+    aio_context_acquire(ctx);
+    s->io_q.in_flight--;
+    if (luring_complete(s, luringcb, cqe_handler->cqe.res)) {
+        luring_submit_shared(s, luringcb);
+    }
+    aio_context_release(ctx);
+}
+
 static int ioq_submit(LuringState *s)
 {
     int ret = 0;
     LuringAIOCB *luringcb, *luringcb_next;
 
+    if (luring_use_shared_ring(s)) {
+        while ((luringcb = QSIMPLEQ_FIRST(&s->io_q.submit_queue))) {
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+            s->io_q.in_queue--;
+            luring_submit_shared(s, luringcb);
+            ret++;
+        }
+        s->io_q.blocked = false;
+        return ret;
+    }
+
     while (s->io_q.in_queue > 0) {
         /*
          * Try to fetch sqes from the ring for requests waiting in
@@ -318,6 +404,7 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
+ * @fixed_fd: index of @fd in the AioContext's registered file table, or -1
  * @luringcb: AIO control block
  * @s: AIO state
  * @offset: offset for request
@@ -326,8 +413,8 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
  * Fetches sqes from ring, adds to pending queue and preps them
  *
  */
-static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
-                            uint64_t offset, int type)
+static int luring_do_submit(int fd, int fixed_fd, LuringAIOCB *luringcb,
+                            LuringState *s, uint64_t offset, int type)
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
@@ -350,6 +437,7 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
         abort();
     }
     io_uring_sqe_set_data(sqes, luringcb);
+    luringcb->fixed_fd = fixed_fd;
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
@@ -366,7 +454,8 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 }
 
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
-                                  uint64_t offset, QEMUIOVector *qiov, int type)
+                                  int fixed_fd, uint64_t offset,
+                                  QEMUIOVector *qiov, int type)
 {
     int ret;
     LuringAIOCB luringcb = {
@@ -377,7 +466,7 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
     };
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
-    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    ret = luring_do_submit(fd, fixed_fd, &luringcb, s, offset, type);
 
     if (ret < 0) {
         return ret;
@@ -389,6 +478,30 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
     return luringcb.ret;
 }
 
+/*
+ * Add @fd to the registered file table of the AioContext's io_uring so that
+ * the kernel does not need to look it up for every request.  This is only an
+ * optimization, so failure is not an error.
+ *
+ * Returns: the index to pass to luring_co_submit(), or -1.
+ */
+int luring_register_file(LuringState *s, int fd)
+{
+    int ret = aio_register_fixed_file(s->aio_context, fd);
+
+    trace_luring_register_file(s, fd, ret);
+    return ret < 0 ? -1 : ret;
+}
+
+/*
+ * Must be called while no requests that were submitted with the index
+ * returned by luring_register_file() are in flight.
+ */
+void luring_unregister_file(LuringState *s, int fd)
+{
+    aio_unregister_fixed_file(s->aio_context, fd);
+}
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
     aio_set_fd_handler(old_context, s->ring.ring_fd, false, NULL, NULL, NULL,
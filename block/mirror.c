@@ -24,9 +24,18 @@
 #include "qemu/ratelimit.h"
 #include "qemu/bitmap.h"
 
-#define MAX_IN_FLIGHT 16
+#define DEFAULT_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
-#define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
+#define DEFAULT_MIRROR_BUF_SIZE (DEFAULT_IN_FLIGHT * MAX_IO_BYTES)
+
+/* Limits for the adaptive request sizing done by mirror_tune() */
+#define MIN_IO_BYTES (64 * 1024)
+#define MAX_IN_FLIGHT_LIMIT 64
+#define TUNE_MIN_OPS 8
+#define TUNE_TARGET_LATENCY_NS (10 * SCALE_MS)
+
+/* Largest unallocated or zero area handled in a single iteration */
+#define MAX_BULK_BYTES (1 << 30)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -79,10 +88,28 @@ typedef struct MirrorBlockJob {
     bool unmap;
     int target_cluster_size;
     int max_iov;
+    /* Copy with bdrv_co_copy_range() instead of reading and writing */
+    bool use_copy_range;
     bool initial_zeroing_ongoing;
     int in_active_write_counter;
     bool prepared;
     bool in_drain;
+
+    /* Size of copy requests and number of requests kept in flight,
+     * adjusted by mirror_tune() from what the target achieves */
+    int64_t io_bytes;
+    int64_t min_io_bytes;
+    int64_t max_io_bytes;
+    int max_in_flight;
+    int in_flight_step;
+    /* Copy requests completed in the current tuning period */
+    int64_t tune_start_ns;
+    uint64_t tune_ops;
+    uint64_t tune_bytes;
+    uint64_t tune_latency_ns;
+    /* Results of the last tuning period */
+    uint64_t write_latency_ns;
+    uint64_t throughput;
 } MirrorBlockJob;
 
 typedef struct MirrorBDSOpaque {
@@ -100,6 +127,9 @@ struct MirrorOp {
      * mirror_co_discard() before yielding for the first time */
     int64_t *bytes_handled;
 
+    /* When the copy started writing to the target, 0 for other ops */
+    int64_t write_start_ns;
+
     bool is_pseudo_op;
     bool is_active_write;
     bool is_in_flight;
@@ -194,6 +224,12 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
         if (!s->initial_zeroing_ongoing) {
             job_progress_update(&s->common.job, op->bytes);
         }
+        if (op->write_start_ns) {
+            s->tune_ops++;
+            s->tune_bytes += op->bytes;
+            s->tune_latency_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                  op->write_start_ns;
+        }
     }
     qemu_iovec_destroy(&op->qiov);
 
@@ -235,6 +271,7 @@ static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
         return;
     }
 
+    op->write_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = blk_co_pwritev(s->target, op->offset, op->qiov.size, &op->qiov, 0);
     mirror_write_complete(op, ret);
 }
@@ -311,6 +348,39 @@ mirror_wait_for_free_in_flight_slot(MirrorBlockJob *s)
     mirror_wait_for_any_operation(s, false);
 }
 
+/* Copy the range of @op without going through the buffer, which for
+ * local files may not move any data at all.  Returns false if the copy
+ * has to be done with a read and a write instead; copy offloading is then
+ * disabled for the rest of the job.
+ */
+static bool coroutine_fn mirror_co_copy_range(MirrorOp *op)
+{
+    MirrorBlockJob *s = op->s;
+    int ret;
+
+    s->in_flight++;
+    s->bytes_in_flight += op->bytes;
+    op->is_in_flight = true;
+    trace_mirror_one_iteration(s, op->offset, op->bytes);
+
+    op->write_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    ret = blk_co_copy_range_from_child(s->mirror_top_bs->backing, op->offset,
+                                       s->target, op->offset, op->bytes,
+                                       0, 0);
+    if (ret < 0) {
+        trace_mirror_copy_range_fail(s, op->offset, ret);
+        s->use_copy_range = false;
+        s->in_flight--;
+        s->bytes_in_flight -= op->bytes;
+        op->is_in_flight = false;
+        op->write_start_ns = 0;
+        return false;
+    }
+
+    mirror_write_complete(op, ret);
+    return true;
+}
+
 /* Perform a mirror copy operation.
  *
  * *op->bytes_handled is set to the number of bytes copied after and
@@ -349,6 +419,10 @@ static void coroutine_fn mirror_co_read(void *opaque)
     assert(QEMU_IS_ALIGNED(op->bytes, BDRV_SECTOR_SIZE));
     nb_chunks = DIV_ROUND_UP(op->bytes, s->granularity);
 
+    if (s->use_copy_range && mirror_co_copy_range(op)) {
+        return;
+    }
+
     while (s->buf_free_count < nb_chunks) {
         trace_mirror_yield_in_flight(s, op->offset, s->in_flight);
         mirror_wait_for_free_in_flight_slot(s);
@@ -457,12 +531,13 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->mirror_top_bs->backing->bs;
     MirrorOp *pseudo_op;
-    int64_t offset;
+    int64_t offset, end, next_zero, max_bytes, status_bytes;
     uint64_t delay_ns = 0, ret = 0;
-    /* At least the first dirty chunk is mirrored in one iteration. */
-    int nb_chunks = 1;
+    unsigned long next_busy_chunk;
+    int nb_chunks;
+    int status;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = s->io_bytes;
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -478,30 +553,40 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 
     job_pause_point(&s->common.job);
 
-    /* Find the number of consective dirty chunks following the first dirty
-     * one, and wait for in flight requests in them. */
+    /* Copies are limited by the buffer, but areas that are unallocated or
+     * read as zeroes in the source don't use it, so take them in much
+     * larger pieces.  The dirty bits are only cleared below, and the block
+     * status is queried again for each request, so data written in the
+     * meantime cannot be missed. */
+    max_bytes = s->buf_size;
+    status = bdrv_block_status_above(source, NULL, offset,
+                                     MIN(s->bdev_length - offset,
+                                         MAX_BULK_BYTES),
+                                     &status_bytes, NULL, NULL);
+    if (status >= 0 && !(status & BDRV_BLOCK_DATA)) {
+        max_bytes = MAX(max_bytes,
+                        QEMU_ALIGN_DOWN(status_bytes, s->granularity));
+    }
+
+    /* Find the consecutive dirty chunks following the first dirty one,
+     * stopping at the first one with a request in flight. */
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
-    while (nb_chunks * s->granularity < s->buf_size) {
-        int64_t next_dirty;
-        int64_t next_offset = offset + nb_chunks * s->granularity;
-        int64_t next_chunk = next_offset / s->granularity;
-        if (next_offset >= s->bdev_length ||
-            !bdrv_dirty_bitmap_get_locked(s->dirty_bitmap, next_offset)) {
-            break;
-        }
-        if (test_bit(next_chunk, s->in_flight_bitmap)) {
-            break;
-        }
+    end = MIN(offset + max_bytes, s->bdev_length);
+    next_zero = bdrv_dirty_bitmap_next_zero(s->dirty_bitmap, offset,
+                                            end - offset);
+    if (next_zero >= 0 && next_zero < end) {
+        end = next_zero;
+    }
+    next_busy_chunk = find_next_bit(s->in_flight_bitmap,
+                                    DIV_ROUND_UP(end, s->granularity),
+                                    offset / s->granularity + 1);
+    end = MIN(end, (int64_t)next_busy_chunk * s->granularity);
+    /* At least the first dirty chunk is mirrored in one iteration. */
+    nb_chunks = MAX(DIV_ROUND_UP(end - offset, s->granularity), 1);
 
-        next_dirty = bdrv_dirty_iter_next(s->dbi);
-        if (next_dirty > next_offset || next_dirty < 0) {
-            /* The bitmap iterator's cache is stale, refresh it */
-            bdrv_set_dirty_iter(s->dbi, next_offset);
-            next_dirty = bdrv_dirty_iter_next(s->dbi);
-        }
-        assert(next_dirty == next_offset);
-        nb_chunks++;
-    }
+    /* Continue after the area on the next iteration */
+    end = offset + nb_chunks * s->granularity;
+    bdrv_set_dirty_iter(s->dbi, end < s->bdev_length ? end : 0);
 
     /* Clear dirty bits before querying the block status, because
      * calling bdrv_block_status_above could yield - if some blocks are
@@ -559,7 +644,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -783,6 +868,61 @@ static void coroutine_fn mirror_throttle(MirrorBlockJob *s)
     }
 }
 
+/* Adjust the request size so that a copy takes about
+ * TUNE_TARGET_LATENCY_NS on the target, and look for the number of
+ * requests in flight that gives the best throughput, backing off quickly
+ * when the target gets overloaded.
+ */
+static void mirror_tune(MirrorBlockJob *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->tune_start_ns;
+    uint64_t latency, throughput;
+    int64_t io_bytes;
+
+    if (elapsed < BLOCK_JOB_SLICE_TIME) {
+        return;
+    }
+    if (s->tune_ops < TUNE_MIN_OPS) {
+        /* Not enough copying to learn anything, e.g. because the job is
+         * idle in the ready state; don't let it dilute the next period */
+        if (elapsed > 10 * BLOCK_JOB_SLICE_TIME) {
+            goto reset;
+        }
+        return;
+    }
+
+    latency = MAX(s->tune_latency_ns / s->tune_ops, 1);
+    throughput = s->tune_bytes * 1000 / (elapsed / SCALE_MS);
+
+    io_bytes = s->tune_bytes / s->tune_ops * TUNE_TARGET_LATENCY_NS / latency;
+    io_bytes = MIN(MAX(io_bytes, s->io_bytes / 2), s->io_bytes * 2);
+    io_bytes = MIN(MAX(io_bytes, s->min_io_bytes), s->max_io_bytes);
+    s->io_bytes = MAX(QEMU_ALIGN_DOWN(io_bytes, s->granularity),
+                      s->granularity);
+
+    if (latency > 4 * TUNE_TARGET_LATENCY_NS) {
+        s->max_in_flight = MAX(s->max_in_flight * 3 / 4, 1);
+        s->in_flight_step = -1;
+    } else {
+        if (s->throughput && throughput < s->throughput * 95 / 100) {
+            s->in_flight_step = -s->in_flight_step;
+        }
+        s->max_in_flight = MIN(MAX(s->max_in_flight + s->in_flight_step, 1),
+                               MAX_IN_FLIGHT_LIMIT);
+    }
+
+    s->write_latency_ns = latency;
+    s->throughput = throughput;
+    trace_mirror_tune(s, s->io_bytes, s->max_in_flight, latency, throughput);
+
+reset:
+    s->tune_start_ns = now;
+    s->tune_ops = 0;
+    s->tune_bytes = 0;
+    s->tune_latency_ns = 0;
+}
+
 static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
 {
     int64_t offset;
@@ -810,7 +950,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -873,6 +1013,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     bool need_drain = true;
     int64_t length;
     int64_t target_length;
+    uint32_t max_transfer;
     BlockDriverInfo bdi;
     char backing_filename[2]; /* we only need 2 characters because we are only
                                  checking for a NULL string */
@@ -943,6 +1084,12 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     }
     s->max_iov = MIN(bs->bl.max_iov, target_bs->bl.max_iov);
 
+    /* copy_range does not respect max_transfer, so only use it if whole
+     * requests can be passed down.  The first failure turns it off. */
+    max_transfer = MIN_NON_ZERO(bs->bl.max_transfer,
+                                target_bs->bl.max_transfer);
+    s->use_copy_range = !max_transfer || max_transfer >= s->buf_size;
+
     s->buf = qemu_try_blockalign(bs, s->buf_size);
     if (s->buf == NULL) {
         ret = -ENOMEM;
@@ -961,6 +1108,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     assert(!s->dbi);
     s->dbi = bdrv_dirty_iter_new(s->dirty_bitmap);
+    s->tune_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     for (;;) {
         uint64_t delay_ns = 0;
         int64_t cnt, delta;
@@ -978,6 +1126,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         }
 
         job_pause_point(&s->common.job);
+        mirror_tune(s);
 
         cnt = bdrv_get_dirty_count(s->dirty_bitmap);
         /* cnt is the number of dirty bytes remaining and s->bytes_in_flight is
@@ -992,7 +1141,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1175,6 +1324,20 @@ static bool mirror_drained_poll(BlockJob *job)
     return !!s->in_flight;
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->has_mirror = true;
+    info->mirror = g_new(BlockJobInfoMirror, 1);
+    *info->mirror = (BlockJobInfoMirror) {
+        .chunk_size     = s->io_bytes,
+        .max_in_flight  = s->max_in_flight,
+        .write_latency  = s->write_latency_ns,
+        .throughput     = s->throughput,
+    };
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(MirrorBlockJob),
@@ -1188,6 +1351,7 @@ static const BlockJobDriver mirror_job_driver = {
         .complete               = mirror_complete,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1203,6 +1367,7 @@ static const BlockJobDriver commit_active_job_driver = {
         .complete               = mirror_complete,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static void coroutine_fn
@@ -1675,6 +1840,11 @@ static BlockJob *mirror_start_job(
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->io_bytes = MAX(s->buf_size / DEFAULT_IN_FLIGHT, MAX_IO_BYTES);
+    s->min_io_bytes = MIN(s->io_bytes, MAX(granularity, MIN_IO_BYTES));
+    s->max_io_bytes = MAX(s->io_bytes, s->buf_size / 4);
+    s->max_in_flight = DEFAULT_IN_FLIGHT;
+    s->in_flight_step = 1;
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -31,6 +31,7 @@
 #include "qemu/osdep.h"
 
 #include "trace.h"
+#include "qemu/units.h"
 #include "qemu/uri.h"
 #include "qemu/option.h"
 #include "qemu/cutils.h"
@@ -46,6 +47,9 @@
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
 
+/* Granularity of the client-side read cache */
+#define NBD_CACHE_BLOCK_SIZE    (64 * KiB)
+
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
 
@@ -55,6 +59,13 @@ typedef struct {
     bool receiving;         /* waiting for connection_co? */
 } NBDClientRequest;
 
+typedef struct NBDCacheBlock {
+    uint64_t index;         /* offset / cache_block_size */
+    uint32_t len;           /* shorter than a cache block only at EOF */
+    uint8_t *buf;
+    QTAILQ_ENTRY(NBDCacheBlock) lru;
+} NBDCacheBlock;
+
 typedef enum NBDClientState {
     NBD_CLIENT_CONNECTING_WAIT,
     NBD_CLIENT_CONNECTING_NOWAIT,
@@ -91,10 +102,121 @@ typedef struct BDRVNBDState {
     QCryptoTLSCreds *tlscreds;
     const char *hostname;
     char *x_dirty_bitmap;
+
+    /*
+     * Client-side read cache, disabled if cache_max_blocks is 0.  Writes
+     * invalidate the blocks they touch and bump cache_gen, so that reads
+     * that raced with them do not fill the cache with stale data.
+     */
+    uint64_t cache_size;
+    uint64_t readahead_size;
+    uint32_t cache_block_size;
+    unsigned cache_nr_blocks, cache_max_blocks;
+    GHashTable *cache;
+    QTAILQ_HEAD(, NBDCacheBlock) cache_lru;
+    uint64_t cache_gen;
+
+    /* Sequential read detection for readahead */
+    uint64_t ra_next;       /* where the next sequential read starts */
+    uint64_t ra_window;     /* current readahead size, 0 if not sequential */
+    uint64_t ra_end;        /* end of the data already read ahead */
 } BDRVNBDState;
 
 static int nbd_client_connect(BlockDriverState *bs, Error **errp);
 
+static NBDCacheBlock *nbd_cache_lookup(BDRVNBDState *s, uint64_t index)
+{
+    NBDCacheBlock *blk = g_hash_table_lookup(s->cache, &index);
+
+    if (blk) {
+        QTAILQ_REMOVE(&s->cache_lru, blk, lru);
+        QTAILQ_INSERT_HEAD(&s->cache_lru, blk, lru);
+    }
+    return blk;
+}
+
+static void nbd_cache_remove(BDRVNBDState *s, NBDCacheBlock *blk)
+{
+    QTAILQ_REMOVE(&s->cache_lru, blk, lru);
+    g_hash_table_remove(s->cache, &blk->index);
+    s->cache_nr_blocks--;
+    g_free(blk->buf);
+    g_free(blk);
+}
+
+static void nbd_cache_insert(BDRVNBDState *s, uint64_t index,
+                             const uint8_t *data, uint32_t len)
+{
+    NBDCacheBlock *blk = nbd_cache_lookup(s, index);
+
+    if (!blk) {
+        if (s->cache_nr_blocks == s->cache_max_blocks) {
+            nbd_cache_remove(s, QTAILQ_LAST(&s->cache_lru));
+        }
+        blk = g_new(NBDCacheBlock, 1);
+        blk->index = index;
+        blk->buf = g_malloc(s->cache_block_size);
+        g_hash_table_insert(s->cache, &blk->index, blk);
+        QTAILQ_INSERT_HEAD(&s->cache_lru, blk, lru);
+        s->cache_nr_blocks++;
+    }
+    blk->len = len;
+    memcpy(blk->buf, data, len);
+}
+
+/* Fill the cache from a block-aligned buffer read from the server */
+static void nbd_cache_fill(BDRVNBDState *s, uint64_t offset,
+                           const uint8_t *buf, uint64_t bytes)
+{
+    uint64_t pos;
+
+    assert(QEMU_IS_ALIGNED(offset, s->cache_block_size));
+    for (pos = 0; pos < bytes; pos += s->cache_block_size) {
+        nbd_cache_insert(s, (offset + pos) / s->cache_block_size, buf + pos,
+                         MIN(bytes - pos, s->cache_block_size));
+    }
+}
+
+static void nbd_cache_invalidate(BDRVNBDState *s, uint64_t offset,
+                                 uint64_t bytes)
+{
+    uint64_t first, last, index;
+    NBDCacheBlock *blk, *next;
+
+    if (!s->cache_max_blocks || !bytes) {
+        return;
+    }
+
+    s->cache_gen++;
+    s->ra_end = 0;
+
+    first = offset / s->cache_block_size;
+    last = (offset + bytes - 1) / s->cache_block_size;
+    if (last - first >= s->cache_nr_blocks) {
+        QTAILQ_FOREACH_SAFE(blk, &s->cache_lru, lru, next) {
+            if (blk->index >= first && blk->index <= last) {
+                nbd_cache_remove(s, blk);
+            }
+        }
+        return;
+    }
+    for (index = first; index <= last; index++) {
+        blk = g_hash_table_lookup(s->cache, &index);
+        if (blk) {
+            nbd_cache_remove(s, blk);
+        }
+    }
+}
+
+static void nbd_cache_clear(BDRVNBDState *s)
+{
+    while (!QTAILQ_EMPTY(&s->cache_lru)) {
+        nbd_cache_remove(s, QTAILQ_FIRST(&s->cache_lru));
+    }
+    s->cache_gen++;
+    s->ra_end = 0;
+}
+
 static void nbd_clear_bdrvstate(BDRVNBDState *s)
 {
     object_unref(OBJECT(s->tlscreds));
@@ -106,6 +228,11 @@ static void nbd_clear_bdrvstate(BDRVNBDState *s)
     s->tlscredsid = NULL;
     g_free(s->x_dirty_bitmap);
     s->x_dirty_bitmap = NULL;
+    if (s->cache) {
+        nbd_cache_clear(s);
+        g_hash_table_destroy(s->cache);
+        s->cache = NULL;
+    }
 }
 
 static void nbd_channel_error(BDRVNBDState *s, int ret)
@@ -290,6 +417,11 @@ static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
         return;
     }
 
+    /* The image may have changed while we were disconnected */
+    if (s->cache) {
+        nbd_cache_clear(s);
+    }
+
     /* successfully connected */
     s->state = NBD_CLIENT_CONNECTED;
     qemu_co_queue_restart_all(&s->free_sema);
@@ -1160,8 +1292,9 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     return ret ? ret : request_ret;
 }
 
-static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
-                                uint64_t bytes, QEMUIOVector *qiov, int flags)
+static int nbd_client_co_read_server(BlockDriverState *bs, uint64_t offset,
+                                     uint64_t bytes, QEMUIOVector *qiov,
+                                     int flags)
 {
     int ret, request_ret;
     Error *local_err = NULL;
@@ -1218,6 +1351,172 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     return ret ? ret : request_ret;
 }
 
+/*
+ * Read a block-aligned range from the server into a new buffer and add it
+ * to the cache, unless a write has touched the image in the meantime.
+ * Returns the buffer, which the caller must free, or NULL on error.
+ */
+static uint8_t *coroutine_fn nbd_cache_co_read(BlockDriverState *bs,
+                                               uint64_t offset,
+                                               uint64_t bytes, int *pret)
+{
+    BDRVNBDState *s = bs->opaque;
+    uint64_t gen = s->cache_gen;
+    QEMUIOVector qiov;
+    uint8_t *buf;
+
+    buf = g_try_malloc(bytes);
+    if (!buf) {
+        *pret = -ENOMEM;
+        return NULL;
+    }
+
+    qemu_iovec_init_buf(&qiov, buf, bytes);
+    *pret = nbd_client_co_read_server(bs, offset, bytes, &qiov, 0);
+    if (*pret < 0) {
+        g_free(buf);
+        return NULL;
+    }
+
+    if (gen == s->cache_gen) {
+        nbd_cache_fill(s, offset, buf, bytes);
+    }
+    return buf;
+}
+
+typedef struct NBDReadahead {
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+} NBDReadahead;
+
+static void coroutine_fn nbd_readahead_entry(void *opaque)
+{
+    NBDReadahead *ra = opaque;
+    int ret;
+
+    trace_nbd_readahead(ra->offset, ra->bytes);
+    g_free(nbd_cache_co_read(ra->bs, ra->offset, ra->bytes, &ret));
+    bdrv_dec_in_flight(ra->bs);
+    g_free(ra);
+}
+
+/* Read the current window after @offset in the background */
+static void nbd_readahead(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVNBDState *s = bs->opaque;
+    uint32_t max_bytes = MIN_NON_ZERO(NBD_MAX_BUFFER_SIZE, s->info.max_block);
+    uint64_t start, end;
+    NBDReadahead *ra;
+
+    start = MAX(ROUND_UP(offset, s->cache_block_size), s->ra_end);
+    end = MIN(ROUND_UP(offset + s->ra_window, s->cache_block_size),
+              s->info.size);
+    while (start < end &&
+           g_hash_table_contains(s->cache,
+                                 &(uint64_t){start / s->cache_block_size})) {
+        start += s->cache_block_size;
+    }
+    if (start >= end) {
+        return;
+    }
+    end = MIN(end, start + QEMU_ALIGN_DOWN(max_bytes, s->cache_block_size));
+    s->ra_end = end;
+
+    ra = g_new(NBDReadahead, 1);
+    *ra = (NBDReadahead) {
+        .bs     = bs,
+        .offset = start,
+        .bytes  = end - start,
+    };
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(bdrv_get_aio_context(bs),
+                 qemu_coroutine_create(nbd_readahead_entry, ra));
+}
+
+static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
+                                uint64_t bytes, QEMUIOVector *qiov, int flags)
+{
+    BDRVNBDState *s = bs->opaque;
+    uint32_t max_bytes = MIN_NON_ZERO(NBD_MAX_BUFFER_SIZE, s->info.max_block);
+    uint64_t first, last, index, start, end, pos;
+    uint8_t *buf;
+    int ret = 0;
+
+    if (!s->cache_max_blocks || !bytes || offset + bytes > s->info.size) {
+        return nbd_client_co_read_server(bs, offset, bytes, qiov, flags);
+    }
+
+    if (s->readahead_size) {
+        if (offset == s->ra_next) {
+            s->ra_window = MIN(MAX(s->ra_window * 2, s->cache_block_size),
+                               s->readahead_size);
+        } else {
+            s->ra_window = 0;
+            s->ra_end = 0;
+        }
+        s->ra_next = offset + bytes;
+    }
+
+    first = offset / s->cache_block_size;
+    last = (offset + bytes - 1) / s->cache_block_size;
+    for (index = first; index <= last; index++) {
+        if (!nbd_cache_lookup(s, index)) {
+            break;
+        }
+    }
+
+    if (index > last) {
+        /* Everything is cached */
+        trace_nbd_cache_hit(offset, bytes);
+        for (pos = 0; pos < bytes; ) {
+            NBDCacheBlock *blk = nbd_cache_lookup(s, (offset + pos) /
+                                                  s->cache_block_size);
+            uint64_t skip = (offset + pos) % s->cache_block_size;
+            uint64_t n = MIN(bytes - pos, blk->len - skip);
+
+            qemu_iovec_from_buf(qiov, pos, blk->buf + skip, n);
+            pos += n;
+        }
+    } else {
+        start = first * s->cache_block_size;
+        end = MIN((last + 1) * s->cache_block_size, s->info.size);
+        if (end - start > max_bytes) {
+            ret = nbd_client_co_read_server(bs, offset, bytes, qiov, flags);
+        } else {
+            trace_nbd_cache_miss(offset, bytes, start, end - start);
+            buf = nbd_cache_co_read(bs, start, end - start, &ret);
+            if (buf) {
+                qemu_iovec_from_buf(qiov, 0, buf + offset - start, bytes);
+                g_free(buf);
+            }
+        }
+    }
+
+    if (ret == 0 && s->ra_window) {
+        nbd_readahead(bs, offset + bytes);
+    }
+    return ret;
+}
+
+/*
+ * Send a request that modifies the image.  Cached blocks are dropped both
+ * before and after it, so that a read that overlapped the write cannot
+ * leave stale data in the cache.
+ */
+static int nbd_co_write_request(BlockDriverState *bs, NBDRequest *request,
+                                QEMUIOVector *write_qiov)
+{
+    BDRVNBDState *s = bs->opaque;
+    int ret;
+
+    nbd_cache_invalidate(s, request->from, request->len);
+    ret = nbd_co_request(bs, request, write_qiov);
+    nbd_cache_invalidate(s, request->from, request->len);
+
+    return ret;
+}
+
 static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                  uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
@@ -1239,7 +1538,7 @@ static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, qiov);
+    return nbd_co_write_request(bs, &request, qiov);
 }
 
 static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
@@ -1272,7 +1571,7 @@ static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_write_request(bs, &request, NULL);
 }
 
 static int nbd_client_co_flush(BlockDriverState *bs)
@@ -1305,7 +1604,7 @@ static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
         return 0;
     }
 
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_write_request(bs, &request, NULL);
 }
 
 static int coroutine_fn nbd_client_co_block_status(
@@ -1827,6 +2126,18 @@ static QemuOptsList nbd_runtime_opts = {
                     "future requests before a successful reconnect will "
                     "immediately fail. Default 0",
         },
+        {
+            .name = "cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the client-side read cache in bytes, "
+                    "0 to disable it. Default 0",
+        },
+        {
+            .name = "readahead-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of data to read ahead of sequential "
+                    "reads, at most half of cache-size. Default 0",
+        },
         { /* end of list */ }
     },
 };
@@ -1886,6 +2197,13 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
 
+    s->cache_size = qemu_opt_get_size(opts, "cache-size", 0);
+    s->readahead_size = qemu_opt_get_size(opts, "readahead-size", 0);
+    if (s->readahead_size > s->cache_size / 2) {
+        error_setg(errp, "readahead-size must not exceed half of cache-size");
+        goto error;
+    }
+
     ret = 0;
 
  error:
@@ -1910,12 +2228,20 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     s->bs = bs;
     qemu_co_mutex_init(&s->send_mutex);
     qemu_co_queue_init(&s->free_sema);
+    QTAILQ_INIT(&s->cache_lru);
 
     ret = nbd_client_connect(bs, errp);
     if (ret < 0) {
         nbd_clear_bdrvstate(s);
         return ret;
     }
+
+    if (s->cache_size) {
+        s->cache_block_size = MAX(NBD_CACHE_BLOCK_SIZE, s->info.min_block);
+        s->cache_max_blocks = MAX(s->cache_size / s->cache_block_size, 1);
+        s->cache = g_hash_table_new(g_int64_hash, g_int64_equal);
+    }
+
     /* successfully connected */
     s->state = NBD_CLIENT_CONNECTED;
 
@@ -33,6 +33,10 @@
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
 
+/* Upper bound on queue pairs, including the admin queue.  I/O queue pairs
+ * are created lazily, one per AioContext submitting requests. */
+#define NVME_MAX_QUEUES 64
+
 typedef struct {
     int32_t  head, tail;
     uint8_t  *queue;
@@ -47,17 +51,29 @@ typedef struct {
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
+    /* If set, receives dword 0 of the completion queue entry */
+    uint32_t *result;
     bool busy;
 } NVMeRequest;
 
+typedef struct BDRVNVMeState BDRVNVMeState;
+
 typedef struct {
     CoQueue     free_req_queue;
     QemuMutex   lock;
+    BDRVNVMeState *s;
 
     /* Fields protected by BQL */
     int         index;
     uint8_t     *prp_list_pages;
 
+    /* The AioContext submitting to and polling this queue pair, or NULL if
+     * the queue pair is unbound.  Set under BDRVNVMeState.queue_lock. */
+    AioContext  *aio_context;
+    /* Kicked by the interrupt handler when @aio_context is not the BDS's
+     * AioContext, so that completions are processed in the owner. */
+    EventNotifier notifier;
+
     /* Fields protected by @lock */
     NVMeQueue   sq, cq;
     int         cq_phase;
@@ -89,16 +105,24 @@ typedef volatile struct {
 
 QEMU_BUILD_BUG_ON(offsetof(NVMeRegs, doorbells) != 0x1000);
 
-typedef struct {
+struct BDRVNVMeState {
     AioContext *aio_context;
     QEMUVFIOState *vfio;
     NVMeRegs *regs;
     /* The submission/completion queue pairs.
      * [0]: admin queue.
      * [1..]: io queues.
+     * The array has room for NVME_MAX_QUEUES entries and is never reallocated;
+     * nr_queues is published with atomic_store_release() so that it can be
+     * read locklessly from any AioContext.
      */
     NVMeQueuePair **queues;
     int nr_queues;
+    int max_queues;
+    /* Set when no more I/O queue pairs can be bound or created */
+    bool queues_exhausted;
+    /* Serializes binding and creation of I/O queue pairs */
+    CoMutex queue_lock;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -123,7 +147,7 @@ typedef struct {
 
     /* PCI address (required for nvme_refresh_filename()) */
     char *device;
-} BDRVNVMeState;
+};
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
@@ -173,6 +197,7 @@ static void nvme_free_queue_pair(BlockDriverState *bs, NVMeQueuePair *q)
     qemu_vfree(q->sq.queue);
     qemu_vfree(q->cq.queue);
     qemu_mutex_destroy(&q->lock);
+    event_notifier_cleanup(&q->notifier);
     g_free(q);
 }
 
@@ -197,7 +222,13 @@ static NVMeQueuePair *nvme_create_queue_pair(BlockDriverState *bs,
     NVMeQueuePair *q = g_new0(NVMeQueuePair, 1);
     uint64_t prp_list_iova;
 
+    if (event_notifier_init(&q->notifier, 0)) {
+        error_setg(errp, "Failed to init queue event notifier");
+        g_free(q);
+        return NULL;
+    }
     qemu_mutex_init(&q->lock);
+    q->s = s;
     q->index = idx;
     qemu_co_queue_init(&q->free_req_queue);
     q->prp_list_pages = qemu_blockalign0(bs, s->page_size * NVME_QUEUE_SIZE);
@@ -344,6 +375,10 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
         assert(req.cb);
         preq->busy = false;
         preq->cb = preq->opaque = NULL;
+        preq->result = NULL;
+        if (req.result) {
+            *req.result = le32_to_cpu(c->result);
+        }
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, nvme_translate_error(c));
         qemu_mutex_lock(&q->lock);
@@ -355,8 +390,8 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
         smp_mb_release();
         *q->cq.doorbell = cpu_to_le32(q->cq.head);
         if (!qemu_co_queue_empty(&q->free_req_queue)) {
-            replay_bh_schedule_oneshot_event(s->aio_context,
-                                             nvme_free_req_queue_cb, q);
+            AioContext *ctx = atomic_read(&q->aio_context) ?: s->aio_context;
+            replay_bh_schedule_oneshot_event(ctx, nvme_free_req_queue_cb, q);
         }
     }
     q->busy = false;
@@ -396,6 +431,46 @@ static void nvme_submit_command(BDRVNVMeState *s, NVMeQueuePair *q,
     qemu_mutex_unlock(&q->lock);
 }
 
+typedef struct {
+    Coroutine *co;
+    int ret;
+    AioContext *ctx;
+} NVMeCoData;
+
+static void nvme_rw_cb_bh(void *opaque)
+{
+    NVMeCoData *data = opaque;
+    qemu_coroutine_enter(data->co);
+}
+
+/* The completion may be processed in a different thread than the one that
+ * submitted the request, so the submitting coroutine sets data->co before
+ * submission and always yields exactly once; the BH below is its only way
+ * back in. */
+static void nvme_rw_cb(void *opaque, int ret)
+{
+    NVMeCoData *data = opaque;
+    data->ret = ret;
+    replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
+}
+
+/* Submit @cmd on @q and wait for its completion */
+static coroutine_fn int nvme_co_submit_command(BDRVNVMeState *s,
+                                               NVMeQueuePair *q,
+                                               NVMeRequest *req, NvmeCmd *cmd)
+{
+    NVMeCoData data = {
+        .co = qemu_coroutine_self(),
+        .ctx = qemu_get_current_aio_context(),
+        .ret = -EINPROGRESS,
+    };
+
+    nvme_submit_command(s, q, req, cmd, nvme_rw_cb, &data);
+    qemu_coroutine_yield();
+    assert(data.ret != -EINPROGRESS);
+    return data.ret;
+}
+
 static void nvme_cmd_sync_cb(void *opaque, int ret)
 {
     int *pret = opaque;
@@ -403,8 +478,10 @@ static void nvme_cmd_sync_cb(void *opaque, int ret)
     aio_wait_kick();
 }
 
-static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
-                         NvmeCmd *cmd)
+/* Like nvme_cmd_sync(), but also return dword 0 of the completion in
+ * @result. */
+static int nvme_cmd_sync_result(BlockDriverState *bs, NVMeQueuePair *q,
+                                NvmeCmd *cmd, uint32_t *result)
 {
     NVMeRequest *req;
     BDRVNVMeState *s = bs->opaque;
@@ -413,12 +490,23 @@ static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
     if (!req) {
         return -EBUSY;
     }
+    req->result = result;
+    if (qemu_in_coroutine()) {
+        /* Lazily creating an I/O queue pair from a request coroutine */
+        return nvme_co_submit_command(s, q, req, cmd);
+    }
     nvme_submit_command(s, q, req, cmd, nvme_cmd_sync_cb, &ret);
 
     BDRV_POLL_WHILE(bs, ret == -EINPROGRESS);
     return ret;
 }
 
+static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
+                         NvmeCmd *cmd)
+{
+    return nvme_cmd_sync_result(bs, q, cmd, NULL);
+}
+
 static void nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
@@ -505,19 +593,43 @@ out:
     qemu_vfree(resp);
 }
 
-static bool nvme_poll_queues(BDRVNVMeState *s)
+static bool nvme_poll_queue(BDRVNVMeState *s, NVMeQueuePair *q)
 {
     bool progress = false;
-    int i;
 
-    for (i = 0; i < s->nr_queues; i++) {
+    qemu_mutex_lock(&q->lock);
+    while (nvme_process_completion(s, q)) {
+        /* Keep polling */
+        progress = true;
+    }
+    qemu_mutex_unlock(&q->lock);
+    return progress;
+}
+
+/* Whether completions on @q are processed by the BDS's own AioContext, as
+ * opposed to the AioContext that @q is bound to. */
+static bool nvme_queue_is_local(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    AioContext *ctx = atomic_read(&q->aio_context);
+
+    return !ctx || ctx == s->aio_context;
+}
+
+/* Poll the queues serviced by the BDS's AioContext.  If @kick_remote, notify
+ * the owners of all other queues as well, since they share the interrupt. */
+static bool nvme_poll_queues(BDRVNVMeState *s, bool kick_remote)
+{
+    bool progress = false;
+    int i, n = atomic_load_acquire(&s->nr_queues);
+
+    for (i = 0; i < n; i++) {
         NVMeQueuePair *q = s->queues[i];
-        qemu_mutex_lock(&q->lock);
-        while (nvme_process_completion(s, q)) {
-            /* Keep polling */
-            progress = true;
+
+        if (nvme_queue_is_local(s, q)) {
+            progress |= nvme_poll_queue(s, q);
+        } else if (kick_remote) {
+            event_notifier_set(&q->notifier);
         }
-        qemu_mutex_unlock(&q->lock);
     }
     return progress;
 }
@@ -528,10 +640,51 @@ static void nvme_handle_event(EventNotifier *n)
 
     trace_nvme_handle_event(s);
     event_notifier_test_and_clear(n);
-    nvme_poll_queues(s);
+    nvme_poll_queues(s, true);
+}
+
+static void nvme_handle_queue_event(EventNotifier *n)
+{
+    NVMeQueuePair *q = container_of(n, NVMeQueuePair, notifier);
+
+    trace_nvme_handle_queue_event(q->s, q->index);
+    event_notifier_test_and_clear(n);
+    nvme_poll_queue(q->s, q);
+}
+
+static bool nvme_queue_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NVMeQueuePair *q = container_of(e, NVMeQueuePair, notifier);
+
+    return nvme_poll_queue(q->s, q);
+}
+
+/* Make @ctx the owner of @q.  Completions on queues owned by the BDS's own
+ * AioContext are handled directly by the interrupt handler; any other owner
+ * polls its queue through q->notifier. */
+static void nvme_bind_queue_pair(BDRVNVMeState *s, NVMeQueuePair *q,
+                                 AioContext *ctx)
+{
+    trace_nvme_bind_queue_pair(s, q->index, ctx);
+    atomic_set(&q->aio_context, ctx);
+    if (ctx != s->aio_context) {
+        aio_set_event_notifier(ctx, &q->notifier, false,
+                               nvme_handle_queue_event, nvme_queue_poll_cb);
+    }
+}
+
+static void nvme_unbind_queue_pair(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    if (!nvme_queue_is_local(s, q)) {
+        aio_set_event_notifier(q->aio_context, &q->notifier, false,
+                               NULL, NULL);
+    }
+    atomic_set(&q->aio_context, NULL);
 }
 
-static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+static bool nvme_add_io_queue(BlockDriverState *bs, AioContext *ctx,
+                              Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     int n = s->nr_queues;
@@ -539,6 +692,7 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     NvmeCmd cmd;
     int queue_size = NVME_QUEUE_SIZE;
 
+    assert(n < s->max_queues);
     q = nvme_create_queue_pair(bs, n, queue_size, errp);
     if (!q) {
         return false;
@@ -562,22 +716,115 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     };
     if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
         error_setg(errp, "Failed to create io queue [%d]", n);
+        cmd = (NvmeCmd) {
+            .opcode = NVME_ADM_CMD_DELETE_CQ,
+            .cdw10 = cpu_to_le32(n & 0xFFFF),
+        };
+        nvme_cmd_sync(bs, s->queues[0], &cmd);
         nvme_free_queue_pair(bs, q);
         return false;
     }
-    s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
+    nvme_bind_queue_pair(s, q, ctx);
     s->queues[n] = q;
-    s->nr_queues++;
+    atomic_store_release(&s->nr_queues, n + 1);
     return true;
 }
 
+/* Slow path of nvme_get_queue_pair(), called with s->queue_lock held */
+static coroutine_fn NVMeQueuePair *nvme_find_queue_pair_locked(
+        BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVNVMeState *s = bs->opaque;
+    Error *local_err = NULL;
+    int i;
+
+    /* Another coroutine in @ctx may have got here first; otherwise reuse a
+     * queue pair that was released by nvme_detach_aio_context(). */
+    for (i = 1; i < s->nr_queues; i++) {
+        if (s->queues[i]->aio_context == ctx) {
+            return s->queues[i];
+        }
+    }
+    for (i = 1; i < s->nr_queues; i++) {
+        if (!s->queues[i]->aio_context) {
+            nvme_bind_queue_pair(s, s->queues[i], ctx);
+            return s->queues[i];
+        }
+    }
+    if (s->nr_queues < s->max_queues) {
+        if (nvme_add_io_queue(bs, ctx, &local_err)) {
+            return s->queues[s->nr_queues - 1];
+        }
+        trace_nvme_add_io_queue_failed(s, error_get_pretty(local_err));
+        error_free(local_err);
+    }
+
+    /* Out of queue pairs: share the first one, whose owner will hand the
+     * completions over to us through nvme_rw_cb(). */
+    atomic_set(&s->queues_exhausted, true);
+    return s->queues[1];
+}
+
+/* Return the I/O queue pair for the current AioContext, creating it on first
+ * use. */
+static coroutine_fn NVMeQueuePair *nvme_get_queue_pair(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    NVMeQueuePair *q;
+    int i, n = atomic_load_acquire(&s->nr_queues);
+
+    assert(n > 1);
+    for (i = 1; i < n; i++) {
+        if (atomic_read(&s->queues[i]->aio_context) == ctx) {
+            return s->queues[i];
+        }
+    }
+    if (atomic_read(&s->queues_exhausted)) {
+        return s->queues[1];
+    }
+
+    qemu_co_mutex_lock(&s->queue_lock);
+    q = nvme_find_queue_pair_locked(bs, ctx);
+    qemu_co_mutex_unlock(&s->queue_lock);
+    return q;
+}
+
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
     BDRVNVMeState *s = container_of(e, BDRVNVMeState, irq_notifier);
 
     trace_nvme_poll_cb(s);
-    return nvme_poll_queues(s);
+    return nvme_poll_queues(s, false);
+}
+
+/* Ask the controller for as many I/O queues as we may use.  Must be done
+ * before any I/O queue is created; on failure we stick to a single one.
+ * The controller may allocate fewer queues than requested, so the limit is
+ * taken from dword 0 of the completion. */
+static void nvme_set_queue_count(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int nr_io_queues = NVME_MAX_QUEUES - 1;
+    int nsq, ncq;
+    uint32_t result;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((nr_io_queues - 1) << 16) | (nr_io_queues - 1)),
+    };
+
+    if (nvme_cmd_sync_result(bs, s->queues[0], &cmd, &result)) {
+        s->max_queues = 2;
+        return;
+    }
+
+    /* Both counts are zero-based and exclude the admin queue */
+    nsq = (result & 0xFFFF) + 1;
+    ncq = (result >> 16) + 1;
+    s->max_queues = MIN(MIN(nsq, ncq) + 1, NVME_MAX_QUEUES);
+    trace_nvme_set_queue_count(s, nsq, ncq, s->max_queues);
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
@@ -592,6 +839,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
+    qemu_co_mutex_init(&s->queue_lock);
     s->device = g_strdup(device);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
@@ -643,13 +891,14 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up admin queue. */
-    s->queues = g_new(NVMeQueuePair *, 1);
+    s->queues = g_new0(NVMeQueuePair *, NVME_MAX_QUEUES);
     s->queues[0] = nvme_create_queue_pair(bs, 0, NVME_QUEUE_SIZE, errp);
     if (!s->queues[0]) {
         ret = -EINVAL;
         goto out;
     }
     s->nr_queues = 1;
+    s->max_queues = 2;
     QEMU_BUILD_BUG_ON(NVME_QUEUE_SIZE & 0xF000);
     s->regs->aqa = cpu_to_le32((NVME_QUEUE_SIZE << 16) | NVME_QUEUE_SIZE);
     s->regs->asq = cpu_to_le64(s->queues[0]->sq.iova);
@@ -687,8 +936,10 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
-    /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    /* Set up the command queue for the BDS's AioContext; the queues for
+     * other AioContexts are created on demand by nvme_get_queue_pair(). */
+    nvme_set_queue_count(bs);
+    if (!nvme_add_io_queue(bs, s->aio_context, errp)) {
         ret = -EIO;
     }
 out:
@@ -757,6 +1008,7 @@ static void nvme_close(BlockDriverState *bs)
     BDRVNVMeState *s = bs->opaque;
 
     for (i = 0; i < s->nr_queues; ++i) {
+        nvme_unbind_queue_pair(s, s->queues[i]);
         nvme_free_queue_pair(bs, s->queues[i]);
     }
     g_free(s->queues);
@@ -930,29 +1182,6 @@ fail:
     return r;
 }
 
-typedef struct {
-    Coroutine *co;
-    int ret;
-    AioContext *ctx;
-} NVMeCoData;
-
-static void nvme_rw_cb_bh(void *opaque)
-{
-    NVMeCoData *data = opaque;
-    qemu_coroutine_enter(data->co);
-}
-
-static void nvme_rw_cb(void *opaque, int ret)
-{
-    NVMeCoData *data = opaque;
-    data->ret = ret;
-    if (!data->co) {
-        /* The rw coroutine hasn't yielded, don't try to enter. */
-        return;
-    }
-    replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
-}
-
 static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
                                             uint64_t offset, uint64_t bytes,
                                             QEMUIOVector *qiov,
@@ -961,7 +1190,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_queue_pair(bs);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -973,13 +1202,9 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw11 = cpu_to_le32(((offset >> s->blkshift) >> 32) & 0xFFFFFFFF),
         .cdw12 = cpu_to_le32(cdw12),
     };
-    NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
-        .ret = -EINPROGRESS,
-    };
+    int ret;
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
-    assert(s->nr_queues > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -990,12 +1215,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         req->busy = false;
         return r;
     }
-    nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
-
-    data.co = qemu_coroutine_self();
-    while (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    ret = nvme_co_submit_command(s, ioq, req, &cmd);
 
     qemu_co_mutex_lock(&s->dma_map_lock);
     r = nvme_cmd_unmap_qiov(bs, qiov);
@@ -1004,8 +1224,8 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         return r;
     }
 
-    trace_nvme_rw_done(s, is_write, offset, bytes, data.ret);
-    return data.ret;
+    trace_nvme_rw_done(s, is_write, offset, bytes, ret);
+    return ret;
 }
 
 static inline bool nvme_qiov_aligned(BlockDriverState *bs,
@@ -1076,28 +1296,16 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_queue_pair(bs);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
-    NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
-        .ret = -EINPROGRESS,
-    };
 
-    assert(s->nr_queues > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
-    nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
-
-    data.co = qemu_coroutine_self();
-    if (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
-
-    return data.ret;
+    return nvme_co_submit_command(s, ioq, req, &cmd);
 }
 
 
@@ -1107,8 +1315,9 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
+    int ret;
 
     uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
 
@@ -1123,11 +1332,6 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
         .cdw11 = cpu_to_le32(((offset >> s->blkshift) >> 32) & 0xFFFFFFFF),
     };
 
-    NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
-        .ret = -EINPROGRESS,
-    };
-
     if (flags & BDRV_REQ_MAY_UNMAP) {
         cdw12 |= (1 << 25);
     }
@@ -1139,19 +1343,14 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     cmd.cdw12 = cpu_to_le32(cdw12);
 
     trace_nvme_write_zeroes(s, offset, bytes, flags);
-    assert(s->nr_queues > 1);
+    ioq = nvme_get_queue_pair(bs);
     req = nvme_get_free_req(ioq);
     assert(req);
 
-    nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
+    ret = nvme_co_submit_command(s, ioq, req, &cmd);
 
-    data.co = qemu_coroutine_self();
-    while (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
-
-    trace_nvme_rw_done(s, true, offset, bytes, data.ret);
-    return data.ret;
+    trace_nvme_rw_done(s, true, offset, bytes, ret);
+    return ret;
 }
 
 
@@ -1160,11 +1359,11 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
-    int ret;
+    int ret, r;
 
     NvmeCmd cmd = {
         .opcode = NVME_CMD_DSM,
@@ -1173,17 +1372,10 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
         .cdw11 = cpu_to_le32(1 << 2), /*deallocate bit*/
     };
 
-    NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
-        .ret = -EINPROGRESS,
-    };
-
     if (!s->supports_discard) {
         return -ENOTSUP;
     }
 
-    assert(s->nr_queues > 1);
-
     buf = qemu_try_blockalign0(bs, s->page_size);
     if (!buf) {
         return -ENOMEM;
@@ -1196,6 +1388,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     qemu_iovec_init(&local_qiov, 1);
     qemu_iovec_add(&local_qiov, buf, 4096);
 
+    ioq = nvme_get_queue_pair(bs);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1210,12 +1403,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
 
     trace_nvme_dsm(s, offset, bytes);
 
-    nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
-
-    data.co = qemu_coroutine_self();
-    while (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    r = nvme_co_submit_command(s, ioq, req, &cmd);
 
     qemu_co_mutex_lock(&s->dma_map_lock);
     ret = nvme_cmd_unmap_qiov(bs, &local_qiov);
@@ -1225,7 +1413,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
         goto out;
     }
 
-    ret = data.ret;
+    ret = r;
     trace_nvme_dsm_done(s, offset, bytes, ret);
 out:
     qemu_iovec_destroy(&local_qiov);
@@ -1261,6 +1449,14 @@ static void nvme_refresh_limits(BlockDriverState *bs, Error **errp)
 static void nvme_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
+    int i;
+
+    /* The BDS is drained, so the I/O queues are idle and can be rebound to
+     * whichever AioContexts submit requests after the switch. */
+    for (i = 1; i < s->nr_queues; i++) {
+        nvme_unbind_queue_pair(s, s->queues[i]);
+    }
+    atomic_set(&s->queues_exhausted, false);
 
     aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
                            false, NULL, NULL);
@@ -1287,13 +1483,17 @@ static void nvme_aio_unplug(BlockDriverState *bs)
 {
     int i;
     BDRVNVMeState *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     assert(s->plugged);
     s->plugged = false;
-    for (i = 1; i < s->nr_queues; i++) {
+    for (i = 1; i < atomic_load_acquire(&s->nr_queues); i++) {
         NVMeQueuePair *q = s->queues[i];
         qemu_mutex_lock(&q->lock);
         nvme_kick(s, q);
-        nvme_process_completion(s, q);
+        /* Completions on other queues are left to their owners */
+        if (atomic_read(&q->aio_context) == ctx) {
+            nvme_process_completion(s, q);
+        }
         qemu_mutex_unlock(&q->lock);
     }
 }
@@ -27,6 +27,7 @@
 #include "block/qapi.h"
 #include "block/block_int.h"
 #include "block/throttle-groups.h"
+#include "block/thread-pool.h"
 #include "block/write-threshold.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block-core.h"
@@ -655,6 +656,50 @@ BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
     return head;
 }
 
+ThreadPoolNodeInfoList *qmp_query_thread_pool(Error **errp)
+{
+    ThreadPoolNodeInfoList *head = NULL, **p_next = &head;
+    ThreadPoolNodeStats *stats;
+    int i, n;
+
+    n = thread_pool_get_stats(&stats);
+    for (i = 0; i < n; i++) {
+        ThreadPoolNodeInfoList *info = g_malloc0(sizeof(*info));
+
+        info->value = g_new0(ThreadPoolNodeInfo, 1);
+        info->value->node = stats[i].node;
+        info->value->workers = stats[i].workers;
+        info->value->max_workers = stats[i].max_workers;
+        info->value->queue_depth = stats[i].queue_depth;
+        info->value->requests = stats[i].requests;
+        info->value->steals = stats[i].steals;
+        info->value->wait_time = stats[i].wait_ns;
+
+        *p_next = info;
+        p_next = &info->next;
+    }
+    g_free(stats);
+
+    return head;
+}
+
+void qmp_set_thread_pool_parameters(bool has_max_workers, int64_t max_workers,
+                                    bool has_pin_workers, bool pin_workers,
+                                    Error **errp)
+{
+    if (has_max_workers) {
+        if (max_workers < 1 || max_workers > THREAD_POOL_MAX_WORKERS) {
+            error_setg(errp, "max-workers must be between 1 and %d",
+                       THREAD_POOL_MAX_WORKERS);
+            return;
+        }
+        thread_pool_set_max_workers(max_workers);
+    }
+    if (has_pin_workers) {
+        thread_pool_set_pin_workers(pin_workers);
+    }
+}
+
 void bdrv_snapshot_dump(QEMUSnapshotInfo *sn)
 {
     char date_buf[128], clock_buf[128];
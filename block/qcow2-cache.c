@@ -23,14 +23,23 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/queue.h"
+#include "qemu/xxhash.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/* Maximum number of L2 slices read ahead on a sequential miss */
+#define QCOW2_CACHE_PREFETCH_SLICES 4
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* Next entry in the same hash bucket, or -1 */
+    int      hash_next;
+    /* Link in Qcow2Cache.lru, valid while ref == 0 */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_entry;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -42,6 +51,20 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Hash index of the cached tables by offset; each bucket holds the
+     * index of the first entry of its chain, or -1 */
+    int                    *buckets;
+    uint32_t                bucket_mask;
+
+    /* Unreferenced entries, least recently used first.  Empty entries are
+     * put at the head so that they are reused before any cached table. */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
+
+    /* Offset at which a miss is considered sequential */
+    uint64_t                prefetch_next;
+
+    Qcow2CacheStats         stats;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -57,6 +80,62 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+static inline uint32_t qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    return qemu_xxhash2(offset) & c->bucket_mask;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_bucket(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Change the offset of entry @i, keeping the hash index up to date */
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, int64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    int *link;
+
+    if (t->offset == offset) {
+        return;
+    }
+    if (t->offset) {
+        link = &c->buckets[qcow2_cache_bucket(c, t->offset)];
+        while (*link != i) {
+            assert(*link >= 0);
+            link = &c->entries[*link].hash_next;
+        }
+        *link = t->hash_next;
+        t->hash_next = -1;
+    }
+    t->offset = offset;
+    if (offset) {
+        link = &c->buckets[qcow2_cache_bucket(c, offset)];
+        t->hash_next = *link;
+        *link = i;
+    }
+}
+
+/* Empty entry @i and make it the first candidate for reuse */
+static void qcow2_cache_entry_reset(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0);
+    qcow2_cache_set_offset(c, i, 0);
+    t->lru_counter = 0;
+    QTAILQ_REMOVE(&c->lru, t, lru_entry);
+    QTAILQ_INSERT_HEAD(&c->lru, t, lru_entry);
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -104,8 +183,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_reset(c, i);
             i++;
             to_clean++;
         }
@@ -123,6 +201,8 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    uint32_t nb_buckets;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -135,12 +215,23 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
+    nb_buckets = pow2ceil(num_tables);
+    c->bucket_mask = nb_buckets - 1;
+    c->buckets = g_try_new(int, nb_buckets);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->table_array || !c->buckets) {
         qemu_vfree(c->table_array);
         g_free(c->entries);
+        g_free(c->buckets);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    memset(c->buckets, -1, nb_buckets * sizeof(int));
+    QTAILQ_INIT(&c->lru);
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_entry);
     }
 
     return c;
@@ -156,6 +247,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
 
     qemu_vfree(c->table_array);
     g_free(c->entries);
+    g_free(c->buckets);
     g_free(c);
 
     return 0;
@@ -304,27 +396,85 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_reset(c, i);
     }
 
     qcow2_cache_table_release(c, 0, c->size);
 
     c->lru_counter = 0;
+    c->prefetch_next = 0;
 
     return 0;
 }
 
+/*
+ * Take the least recently used unreferenced entry off the LRU list, writing
+ * it back first if it is dirty.  Returns its index or a negative errno; on
+ * error the entry stays on the list.
+ */
+static int qcow2_cache_get_victim(BlockDriverState *bs, Qcow2Cache *c)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t = QTAILQ_FIRST(&c->lru);
+    int i, ret;
+
+    if (!t) {
+        /* This can't happen in current synchronous code, but leave the check
+         * here as a reminder for whoever starts using AIO with the cache */
+        abort();
+    }
+
+    i = t - c->entries;
+    trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
+                                        c == s->l2_table_cache, i);
+
+    ret = qcow2_cache_entry_flush(bs, c, i);
+    if (ret < 0) {
+        return ret;
+    }
+
+    QTAILQ_REMOVE(&c->lru, t, lru_entry);
+    if (t->offset) {
+        c->stats.evictions++;
+        qcow2_cache_set_offset(c, i, 0);
+    }
+    return i;
+}
+
+/*
+ * After a miss on @offset, decide how many of the following L2 slices to
+ * read along with it.  Only sequential misses prefetch, and only slices of
+ * the same L2 table that are not cached yet, so that the whole range can be
+ * read with a single request.
+ */
+static int qcow2_cache_prefetch_count(BlockDriverState *bs, Qcow2Cache *c,
+                                      uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t end = start_of_cluster(s, offset) + s->cluster_size;
+    int n;
+
+    if (c != s->l2_table_cache || offset != c->prefetch_next) {
+        return 0;
+    }
+
+    for (n = 0; n < MIN(QCOW2_CACHE_PREFETCH_SLICES, c->size / 4); n++) {
+        uint64_t next = offset + (uint64_t) (n + 1) * c->table_size;
+        if (next >= end || qcow2_cache_lookup(c, next) >= 0) {
+            break;
+        }
+    }
+    return n;
+}
+
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
-    int i;
+    int i, j;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
+    int idx[1 + QCOW2_CACHE_PREFETCH_SLICES];
+    int nb_prefetch = 0;
 
     assert(offset != 0);
 
@@ -339,58 +489,77 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
-
-    if (min_lru_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        c->stats.hits++;
+        goto found;
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
-    trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
-                                        c == s->l2_table_cache, i);
-
-    ret = qcow2_cache_entry_flush(bs, c, i);
-    if (ret < 0) {
-        return ret;
+    c->stats.misses++;
+    i = qcow2_cache_get_victim(bs, c);
+    if (i < 0) {
+        return i;
     }
+    idx[0] = i;
 
-    trace_qcow2_cache_get_read(qemu_coroutine_self(),
-                               c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
     if (read_from_disk) {
+        QEMUIOVector qiov;
+        int wanted = qcow2_cache_prefetch_count(bs, c, offset);
+
+        /* Never write back a table just to make room for prefetching */
+        while (nb_prefetch < wanted) {
+            Qcow2CachedTable *t = QTAILQ_FIRST(&c->lru);
+
+            if (!t || t->dirty) {
+                break;
+            }
+            idx[++nb_prefetch] = qcow2_cache_get_victim(bs, c);
+        }
+
+        trace_qcow2_cache_get_read(qemu_coroutine_self(),
+                                   c == s->l2_table_cache, i);
+        if (nb_prefetch) {
+            trace_qcow2_cache_prefetch(qemu_coroutine_self(), offset,
+                                       nb_prefetch);
+        }
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset,
-                         qcow2_cache_get_table_addr(c, i),
-                         c->table_size);
+        qemu_iovec_init(&qiov, nb_prefetch + 1);
+        for (j = 0; j <= nb_prefetch; j++) {
+            qemu_iovec_add(&qiov, qcow2_cache_get_table_addr(c, idx[j]),
+                           c->table_size);
+        }
+        ret = bdrv_preadv(bs->file, offset, &qiov);
+        qemu_iovec_destroy(&qiov);
         if (ret < 0) {
+            for (j = 0; j <= nb_prefetch; j++) {
+                QTAILQ_INSERT_HEAD(&c->lru, &c->entries[idx[j]], lru_entry);
+            }
             return ret;
         }
+
+        c->prefetch_next = offset + (uint64_t) (nb_prefetch + 1) *
+                                    c->table_size;
     }
 
-    c->entries[i].offset = offset;
+    for (j = 0; j <= nb_prefetch; j++) {
+        Qcow2CachedTable *t = &c->entries[idx[j]];
+
+        qcow2_cache_set_offset(c, idx[j],
+                               offset + (uint64_t) j * c->table_size);
+        t->lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru, t, lru_entry);
+    }
+    c->stats.prefetches += nb_prefetch;
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru, &c->entries[i], lru_entry);
+    }
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -420,6 +589,7 @@ void qcow2_cache_put(Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_entry);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -434,25 +604,22 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    int i = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
-    }
-    return NULL;
+    return i >= 0 ? qcow2_cache_get_table_addr(c, i) : NULL;
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
 
-    assert(c->entries[i].ref == 0);
-
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_entry_reset(c, i);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats)
+{
+    *stats = c->stats;
+}
@@ -208,7 +208,7 @@ static int l2_load(BlockDriverState *bs, uint64_t offset,
                    uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcow2State *s = bs->opaque;
-    int start_of_slice = sizeof(uint64_t) *
+    int start_of_slice = l2_entry_size(s) *
         (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
 
     return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
@@ -281,7 +281,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * l2_entry_size(s));
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -305,7 +305,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* allocate a new entry in the l2 cache */
 
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     trace_qcow2_l2_allocate_get_empty(bs, l1_index);
@@ -369,7 +369,7 @@ fail:
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -383,12 +383,14 @@ fail:
  * cluster which may require a different handling)
  */
 static int count_contiguous_clusters(BlockDriverState *bs, int nb_clusters,
-        int cluster_size, uint64_t *l2_slice, uint64_t stop_flags)
+        int cluster_size, uint64_t *l2_slice, int l2_index,
+        uint64_t stop_flags)
 {
+    BDRVQcow2State *s = bs->opaque;
     int i;
     QCow2ClusterType first_cluster_type;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_slice[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_slice, l2_index);
     uint64_t offset = first_entry & mask;
 
     first_cluster_type = qcow2_get_cluster_type(bs, first_entry);
@@ -401,7 +403,7 @@ static int count_contiguous_clusters(BlockDriverState *bs, int nb_clusters,
            first_cluster_type == QCOW2_CLUSTER_ZERO_ALLOC);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_slice[i]) & mask;
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i) & mask;
         if (offset + (uint64_t) i * cluster_size != l2_entry) {
             break;
         }
@@ -417,14 +419,16 @@ static int count_contiguous_clusters(BlockDriverState *bs, int nb_clusters,
 static int count_contiguous_clusters_unallocated(BlockDriverState *bs,
                                                  int nb_clusters,
                                                  uint64_t *l2_slice,
+                                                 int l2_index,
                                                  QCow2ClusterType wanted_type)
 {
+    BDRVQcow2State *s = bs->opaque;
     int i;
 
     assert(wanted_type == QCOW2_CLUSTER_ZERO_PLAIN ||
            wanted_type == QCOW2_CLUSTER_UNALLOCATED);
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t entry = be64_to_cpu(l2_slice[i]);
+        uint64_t entry = get_l2_entry(s, l2_slice, l2_index + i);
         QCow2ClusterType type = qcow2_get_cluster_type(bs, entry);
 
         if (type != wanted_type) {
@@ -435,6 +439,60 @@ static int count_contiguous_clusters_unallocated(BlockDriverState *bs,
     return i;
 }
 
+/*
+ * In images with extended L2 entries, returns the number of consecutive
+ * subclusters (starting at subcluster @sc_index of the L2 entry @l2_index
+ * and spanning at most @nb_clusters clusters) that have the same type as the
+ * first one and, if they have a host offset, are contiguous in the image file.
+ * The type of the subclusters is stored in *type.
+ *
+ * Compressed clusters are always returned one by one.
+ *
+ * Returns -EIO if the first L2 entry is invalid.
+ */
+static int count_contiguous_subclusters(BlockDriverState *bs, int nb_clusters,
+                                        unsigned sc_index, uint64_t *l2_slice,
+                                        int l2_index, int *type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    uint64_t expected_offset = l2_entry & L2E_OFFSET_MASK;
+    bool check_offset;
+    int i, j, count = 0;
+
+    *type = qcow2_get_subcluster_type(bs, l2_entry, l2_bitmap, sc_index);
+    if (*type < 0) {
+        return -EIO;
+    } else if (*type == QCOW2_CLUSTER_COMPRESSED) {
+        return s->subclusters_per_cluster - sc_index;
+    }
+
+    check_offset = *type == QCOW2_CLUSTER_NORMAL ||
+                   *type == QCOW2_CLUSTER_ZERO_ALLOC;
+
+    for (i = 0; i < nb_clusters; i++) {
+        l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+
+        if (check_offset && (l2_entry & L2E_OFFSET_MASK) != expected_offset) {
+            break;
+        }
+
+        for (j = (i == 0) ? sc_index : 0; j < s->subclusters_per_cluster; j++) {
+            int sc_type = qcow2_get_subcluster_type(bs, l2_entry, l2_bitmap, j);
+            if (sc_type != *type) {
+                return count;
+            }
+            count++;
+        }
+
+        expected_offset += s->cluster_size;
+    }
+
+    return count;
+}
+
 static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
                                             uint64_t src_cluster_offset,
                                             unsigned offset_in_cluster,
@@ -508,6 +566,10 @@ static int coroutine_fn do_perform_cow_write(BlockDriverState *bs,
  * cluster type and (if applicable) are stored contiguously in the image file.
  * Compressed clusters are always returned one by one.
  *
+ * In images with extended L2 entries the type is that of the subcluster
+ * containing offset (see qcow2_get_subcluster_type()), and *bytes only covers
+ * subclusters of that same type.
+ *
  * Returns the cluster type (QCOW2_CLUSTER_*) on success, -errno in error
  * cases.
  */
@@ -515,12 +577,12 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
                              unsigned int *bytes, uint64_t *cluster_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    unsigned int l2_index;
+    unsigned int l2_index, sc_index = 0;
     uint64_t l1_index, l2_offset, *l2_slice;
-    int c;
+    int c = 0;
     unsigned int offset_in_cluster;
     uint64_t bytes_available, bytes_needed, nb_clusters;
-    QCow2ClusterType type;
+    int type;
     int ret;
 
     offset_in_cluster = offset_into_cluster(s, offset);
@@ -570,7 +632,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = offset_to_l2_slice_index(s, offset);
-    *cluster_offset = be64_to_cpu(l2_slice[l2_index]);
+    *cluster_offset = get_l2_entry(s, l2_slice, l2_index);
 
     nb_clusters = size_to_clusters(s, bytes_needed);
     /* bytes_needed <= *bytes + offset_in_cluster, both of which are unsigned
@@ -578,7 +640,22 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
      * true */
     assert(nb_clusters <= INT_MAX);
 
-    type = qcow2_get_cluster_type(bs, *cluster_offset);
+    if (has_subclusters(s)) {
+        /* c counts subclusters here, starting at the one containing offset */
+        sc_index = offset_to_sc_index(s, offset);
+        c = count_contiguous_subclusters(bs, nb_clusters, sc_index,
+                                         l2_slice, l2_index, &type);
+        if (c < 0) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Invalid cluster "
+                                    "entry found (L2 offset: %#" PRIx64
+                                    ", L2 index: %#x)", l2_offset, l2_index);
+            ret = -EIO;
+            goto fail;
+        }
+    } else {
+        type = qcow2_get_cluster_type(bs, *cluster_offset);
+    }
+
     if (s->qcow_version < 3 && (type == QCOW2_CLUSTER_ZERO_PLAIN ||
                                 type == QCOW2_CLUSTER_ZERO_ALLOC)) {
         qcow2_signal_corruption(bs, true, -1, -1, "Zero cluster entry found"
@@ -598,21 +675,29 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
             goto fail;
         }
         /* Compressed clusters can only be processed one by one */
-        c = 1;
+        if (!has_subclusters(s)) {
+            c = 1;
+        }
         *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
         break;
     case QCOW2_CLUSTER_ZERO_PLAIN:
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_clusters_unallocated(bs, nb_clusters,
-                                                  &l2_slice[l2_index], type);
+        if (!has_subclusters(s)) {
+            c = count_contiguous_clusters_unallocated(bs, nb_clusters,
+                                                      l2_slice, l2_index,
+                                                      type);
+        }
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_ZERO_ALLOC:
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(bs, nb_clusters, s->cluster_size,
-                                      &l2_slice[l2_index], QCOW_OFLAG_ZERO);
+        if (!has_subclusters(s)) {
+            c = count_contiguous_clusters(bs, nb_clusters, s->cluster_size,
+                                          l2_slice, l2_index,
+                                          QCOW_OFLAG_ZERO);
+        }
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1,
@@ -641,7 +726,11 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
-    bytes_available = (int64_t)c * s->cluster_size;
+    if (has_subclusters(s)) {
+        bytes_available = (uint64_t)(sc_index + c) << s->subcluster_bits;
+    } else {
+        bytes_available = (int64_t)c * s->cluster_size;
+    }
 
 out:
     if (bytes_available > bytes_needed) {
@@ -709,7 +798,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                                 QCOW2_DISCARD_OTHER);
         }
 
@@ -765,7 +854,7 @@ int qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_slice[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
         return -EIO;
@@ -794,7 +883,11 @@ int qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
-    l2_slice[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_slice, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        /* The bitmap of compressed clusters is reserved */
+        set_l2_bitmap(s, l2_slice, l2_index, 0);
+    }
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
     *host_offset = cluster_offset & s->cluster_offset_mask;
@@ -981,20 +1074,40 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     assert(l2_index + m->nb_clusters <= s->l2_slice_size);
     for (i = 0; i < m->nb_clusters; i++) {
         uint64_t offset = cluster_offset + (i << s->cluster_bits);
+        uint64_t old_entry = get_l2_entry(s, l2_slice, l2_index + i);
+
         /* if two concurrent writes happen to the same unallocated cluster
          * each write allocates separate cluster and writes data concurrently.
          * The first one to complete updates l2 table with pointer to its
          * cluster the second one has to do RMW (which is done above by
          * perform_cow()), update l2 table with its cluster pointer and free
          * old cluster. This is what this loop does */
-        if (l2_slice[l2_index + i] != 0) {
-            old_cluster[j++] = l2_slice[l2_index + i];
+        if (old_entry != 0) {
+            old_cluster[j++] = old_entry;
         }
 
         /* The offset must fit in the offset field of the L2 table entry */
         assert((offset & L2E_OFFSET_MASK) == offset);
 
-        l2_slice[l2_index + i] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+        set_l2_entry(s, l2_slice, l2_index + i, offset | QCOW_OFLAG_COPIED);
+
+        if (has_subclusters(s)) {
+            /*
+             * The subclusters covered by the guest data and the COW regions
+             * are allocated now; the rest of the cluster keeps its state.
+             */
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+            uint64_t cluster_start = (uint64_t)i << s->cluster_bits;
+            uint64_t from = MAX(m->cow_start.offset, cluster_start);
+            uint64_t to = MIN(m->cow_end.offset + m->cow_end.nb_bytes,
+                              cluster_start + s->cluster_size);
+            unsigned sc_from = (from - cluster_start) >> s->subcluster_bits;
+            unsigned sc_to = size_to_subclusters(s, to - cluster_start);
+
+            l2_bitmap |= QCOW_OFLAG_SUB_ALLOC_RANGE(sc_from, sc_to);
+            l2_bitmap &= ~QCOW_OFLAG_SUB_ZERO_RANGE(sc_from, sc_to);
+            set_l2_bitmap(s, l2_slice, l2_index + i, l2_bitmap);
+        }
      }
 
 
@@ -1008,7 +1121,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (!m->keep_old_clusters && j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -1041,10 +1154,11 @@ void qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m)
 static int count_cow_clusters(BlockDriverState *bs, int nb_clusters,
     uint64_t *l2_slice, int l2_index)
 {
+    BDRVQcow2State *s = bs->opaque;
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_slice[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
         QCow2ClusterType cluster_type = qcow2_get_cluster_type(bs, l2_entry);
 
         switch(cluster_type) {
@@ -1096,6 +1210,16 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        if (has_subclusters(s)) {
+            /*
+             * The COW regions of a subcluster allocation don't cover the
+             * whole cluster, but two requests must still not update the
+             * same L2 entry at the same time.
+             */
+            old_start = start_of_cluster(s, old_start);
+            old_end = ROUND_UP(old_end, s->cluster_size);
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -1131,6 +1255,140 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
     return 0;
 }
 
+/*
+ * Returns true if the subclusters of the cluster described by @l2_entry must
+ * all be copied to a newly allocated host cluster, i.e. if a partial write to
+ * it cannot be limited to the subclusters that it touches.
+ */
+static bool cow_needs_whole_cluster(BlockDriverState *bs, uint64_t l2_entry,
+                                    bool keep_old)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!has_subclusters(s)) {
+        return true;
+    }
+
+    /* Data that stays in place doesn't need to be copied */
+    if (keep_old) {
+        return false;
+    }
+
+    /*
+     * The data of allocated and compressed clusters moves to the new host
+     * cluster, so all of it must be copied. Unallocated subclusters keep
+     * reading from the backing file (or as zeroes) without any copy.
+     */
+    return qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_UNALLOCATED;
+}
+
+/*
+ * Creates a QCowL2Meta for a write request of @bytes at @guest_offset that
+ * goes to the @nb_clusters clusters starting at @host_cluster_offset, and
+ * prepends it to *m. @l2_slice and @l2_index describe the current L2 entries
+ * of the clusters.
+ *
+ * Without subclusters the COW regions cover the whole clusters. With
+ * subclusters only the partially written subclusters that are not allocated
+ * yet are copied, unless the whole cluster moves to a new host cluster.
+ *
+ * If @keep_old is true, the data is written in place to clusters that are
+ * already allocated and only their subcluster bitmaps need an update.
+ */
+static void calculate_l2_meta(BlockDriverState *bs,
+                              uint64_t host_cluster_offset,
+                              uint64_t guest_offset, unsigned bytes,
+                              uint64_t *l2_slice, int l2_index,
+                              int nb_clusters, QCowL2Meta **m, bool keep_old)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned write_start = offset_into_cluster(s, guest_offset);
+    unsigned write_end = write_start + bytes;
+    unsigned cow_start_from, cow_end_to;
+    int last = nb_clusters - 1;
+    uint64_t first_entry = get_l2_entry(s, l2_slice, l2_index);
+    uint64_t last_entry = get_l2_entry(s, l2_slice, l2_index + last);
+    uint64_t first_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    uint64_t last_bitmap = get_l2_bitmap(s, l2_slice, l2_index + last);
+    QCowL2Meta *old_m = *m;
+
+    assert(nb_clusters > 0);
+    assert(write_end <= (uint64_t)nb_clusters << s->cluster_bits);
+    assert(write_end > (uint64_t)last << s->cluster_bits);
+
+    if (cow_needs_whole_cluster(bs, first_entry, keep_old)) {
+        cow_start_from = 0;
+    } else if (keep_old && (first_bitmap &
+               QCOW_OFLAG_SUB_ALLOC(write_start >> s->subcluster_bits))) {
+        cow_start_from = write_start;
+    } else {
+        cow_start_from = QEMU_ALIGN_DOWN(write_start, s->subcluster_size);
+    }
+
+    if (cow_needs_whole_cluster(bs, last_entry, keep_old)) {
+        cow_end_to = nb_clusters << s->cluster_bits;
+    } else if (keep_old && (last_bitmap & QCOW_OFLAG_SUB_ALLOC(
+                   offset_to_sc_index(s, write_end - 1)))) {
+        cow_end_to = write_end;
+    } else {
+        cow_end_to = QEMU_ALIGN_UP(write_end, s->subcluster_size);
+    }
+
+    *m = g_malloc0(sizeof(**m));
+
+    **m = (QCowL2Meta) {
+        .next           = old_m,
+
+        .alloc_offset   = host_cluster_offset,
+        .offset         = start_of_cluster(s, guest_offset),
+        .nb_clusters    = nb_clusters,
+
+        .keep_old_clusters  = keep_old,
+
+        .cow_start = {
+            .offset     = cow_start_from,
+            .nb_bytes   = write_start - cow_start_from,
+        },
+        .cow_end = {
+            .offset     = write_end,
+            .nb_bytes   = cow_end_to - write_end,
+        },
+    };
+    qemu_co_queue_init(&(*m)->dependent_requests);
+    QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
+}
+
+/*
+ * Returns true if a write of @bytes at @guest_offset to the @nb_clusters
+ * clusters described by @l2_slice and @l2_index touches subclusters that are
+ * not allocated yet.
+ */
+static bool write_allocates_subclusters(BlockDriverState *bs,
+                                        uint64_t guest_offset, uint64_t bytes,
+                                        uint64_t *l2_slice, int l2_index,
+                                        int nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t write_start = offset_into_cluster(s, guest_offset);
+    uint64_t write_end = write_start + bytes;
+    int i;
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t cluster_start = (uint64_t)i << s->cluster_bits;
+        uint64_t from = MAX(write_start, cluster_start) - cluster_start;
+        uint64_t to = MIN(write_end, cluster_start + s->cluster_size) -
+                      cluster_start;
+        uint64_t wanted = QCOW_OFLAG_SUB_ALLOC_RANGE(
+            from >> s->subcluster_bits, size_to_subclusters(s, to));
+
+        if ((get_l2_bitmap(s, l2_slice, l2_index + i) & wanted) != wanted) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 /*
  * Checks how many already allocated clusters that don't require a copy on
  * write there are at the given guest_offset (up to *bytes). If *host_offset is
@@ -1149,7 +1407,9 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
  *
  *   1:     if allocated clusters that don't require a COW are available at
  *          the requested offset. *bytes may have decreased and describes
- *          the length of the area that can be written to.
+ *          the length of the area that can be written to. In images with
+ *          extended L2 entries, a new QCowL2Meta is added to *m if the write
+ *          touches subclusters that are not allocated yet.
  *
  *  -errno: in error cases
  */
@@ -1187,7 +1447,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_slice[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(bs, cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -1215,7 +1475,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
             count_contiguous_clusters(bs, nb_clusters, s->cluster_size,
-                                      &l2_slice[l2_index],
+                                      l2_slice, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
@@ -1223,6 +1483,15 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                  keep_clusters * s->cluster_size
                  - offset_into_cluster(s, guest_offset));
 
+        /* Writing to unallocated subclusters needs an L2 update */
+        if (has_subclusters(s) &&
+            write_allocates_subclusters(bs, guest_offset, *bytes, l2_slice,
+                                        l2_index, keep_clusters)) {
+            calculate_l2_meta(bs, cluster_offset & L2E_OFFSET_MASK,
+                              guest_offset, *bytes, l2_slice, l2_index,
+                              keep_clusters, m, true);
+        }
+
         ret = 1;
     } else {
         ret = 0;
@@ -1353,7 +1622,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_slice[l2_index]);
+    entry = get_l2_entry(s, l2_slice, l2_index);
     nb_clusters = count_cow_clusters(bs, nb_clusters, l2_slice, l2_index);
 
     /* This function is only called when there were no non-COW clusters, so if
@@ -1382,7 +1651,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
          * nb_clusters already to a range of COW clusters */
         preallocated_nb_clusters =
             count_contiguous_clusters(bs, nb_clusters, s->cluster_size,
-                                      &l2_slice[l2_index], QCOW_OFLAG_COPIED);
+                                      l2_slice, l2_index, QCOW_OFLAG_COPIED);
         assert(preallocated_nb_clusters > 0);
 
         nb_clusters = preallocated_nb_clusters;
@@ -1393,8 +1662,10 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         keep_old_clusters = true;
     }
 
-    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
-
+    /*
+     * Keep the L2 slice until the QCowL2Meta is set up: the COW regions
+     * depend on the current state of the subclusters.
+     */
     if (alloc_cluster_offset == INV_OFFSET) {
         /* Allocate, if necessary at a given offset in the image file */
         alloc_cluster_offset = *host_offset == INV_OFFSET ? INV_OFFSET :
@@ -1402,11 +1673,13 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
                                       &nb_clusters);
         if (ret < 0) {
+            qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
             goto fail;
         }
 
         /* Can't extend contiguous allocation */
         if (nb_clusters == 0) {
+            qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
             *bytes = 0;
             return 0;
         }
@@ -1431,30 +1704,11 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t requested_bytes = *bytes + offset_into_cluster(s, guest_offset);
     int avail_bytes = nb_clusters << s->cluster_bits;
     int nb_bytes = MIN(requested_bytes, avail_bytes);
-    QCowL2Meta *old_m = *m;
 
-    *m = g_malloc0(sizeof(**m));
-
-    **m = (QCowL2Meta) {
-        .next           = old_m,
-
-        .alloc_offset   = alloc_cluster_offset,
-        .offset         = start_of_cluster(s, guest_offset),
-        .nb_clusters    = nb_clusters,
-
-        .keep_old_clusters  = keep_old_clusters,
-
-        .cow_start = {
-            .offset     = 0,
-            .nb_bytes   = offset_into_cluster(s, guest_offset),
-        },
-        .cow_end = {
-            .offset     = nb_bytes,
-            .nb_bytes   = avail_bytes - nb_bytes,
-        },
-    };
-    qemu_co_queue_init(&(*m)->dependent_requests);
-    QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
+    calculate_l2_meta(bs, alloc_cluster_offset, guest_offset,
+                      nb_bytes - offset_into_cluster(s, guest_offset),
+                      l2_slice, l2_index, nb_clusters, m, keep_old_clusters);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
     *host_offset = alloc_cluster_offset + offset_into_cluster(s, guest_offset);
     *bytes = MIN(*bytes, nb_bytes - offset_into_cluster(s, guest_offset));
@@ -1623,9 +1877,11 @@ static int discard_in_l2_slice(BlockDriverState *bs, uint64_t offset,
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t old_l2_entry;
+        uint64_t old_l2_entry, old_l2_bitmap, new_l2_bitmap;
 
-        old_l2_entry = be64_to_cpu(l2_slice[l2_index + i]);
+        old_l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        old_l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+        new_l2_bitmap = full_discard ? 0 : QCOW_L2_BITMAP_ALL_ZEROES;
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1640,34 +1896,50 @@ static int discard_in_l2_slice(BlockDriverState *bs, uint64_t offset,
          * If full_discard is true, the sector should not read back as zeroes,
          * but rather fall through to the backing file.
          */
-        switch (qcow2_get_cluster_type(bs, old_l2_entry)) {
-        case QCOW2_CLUSTER_UNALLOCATED:
-            if (full_discard || !bs->backing) {
+        if (has_subclusters(s)) {
+            /*
+             * Unallocated clusters may still have subclusters that read as
+             * zeroes, so compare the whole bitmap.
+             */
+            if (qcow2_get_cluster_type(bs, old_l2_entry) ==
+                QCOW2_CLUSTER_UNALLOCATED &&
+                (old_l2_bitmap == new_l2_bitmap ||
+                 (!full_discard && !bs->backing))) {
                 continue;
             }
-            break;
+        } else {
+            switch (qcow2_get_cluster_type(bs, old_l2_entry)) {
+            case QCOW2_CLUSTER_UNALLOCATED:
+                if (full_discard || !bs->backing) {
+                    continue;
+                }
+                break;
 
-        case QCOW2_CLUSTER_ZERO_PLAIN:
-            if (!full_discard) {
-                continue;
-            }
-            break;
+            case QCOW2_CLUSTER_ZERO_PLAIN:
+                if (!full_discard) {
+                    continue;
+                }
+                break;
 
-        case QCOW2_CLUSTER_ZERO_ALLOC:
-        case QCOW2_CLUSTER_NORMAL:
-        case QCOW2_CLUSTER_COMPRESSED:
-            break;
+            case QCOW2_CLUSTER_ZERO_ALLOC:
+            case QCOW2_CLUSTER_NORMAL:
+            case QCOW2_CLUSTER_COMPRESSED:
+                break;
 
-        default:
-            abort();
+            default:
+                abort();
+            }
         }
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
-        if (!full_discard && s->qcow_version >= 3) {
-            l2_slice[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+        if (has_subclusters(s)) {
+            set_l2_entry(s, l2_slice, l2_index + i, 0);
+            set_l2_bitmap(s, l2_slice, l2_index + i, new_l2_bitmap);
+        } else if (!full_discard && s->qcow_version >= 3) {
+            set_l2_entry(s, l2_slice, l2_index + i, QCOW_OFLAG_ZERO);
         } else {
-            l2_slice[l2_index + i] = cpu_to_be64(0);
+            set_l2_entry(s, l2_slice, l2_index + i, 0);
         }
 
         /* Then decrease the refcount */
@@ -1679,6 +1951,92 @@ static int discard_in_l2_slice(BlockDriverState *bs, uint64_t offset,
     return nb_clusters;
 }
 
+
+/*
+ * Discards @nb_subclusters subclusters starting at @offset, all of which must
+ * be in the same cluster of an image with extended L2 entries. Whole clusters
+ * are left to discard_in_l2_slice().
+ *
+ * The host cluster stays allocated as long as some of its subclusters are
+ * still in use, so nothing is passed down to the protocol layer here.
+ */
+static int discard_l2_subclusters(BlockDriverState *bs, uint64_t offset,
+                                  unsigned nb_subclusters,
+                                  enum qcow2_discard_type type,
+                                  bool full_discard)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice;
+    uint64_t l2_entry, old_l2_bitmap, new_l2_bitmap;
+    uint64_t alloc_mask, zero_mask;
+    int l2_index, ret;
+    int sc = offset_to_sc_index(s, offset);
+
+    assert(has_subclusters(s));
+    assert(nb_subclusters > 0 && nb_subclusters < s->subclusters_per_cluster);
+    assert(sc + nb_subclusters <= s->subclusters_per_cluster);
+    assert(offset_into_subcluster(s, offset) == 0);
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    switch (qcow2_get_cluster_type(bs, l2_entry)) {
+    case QCOW2_CLUSTER_COMPRESSED:
+        /* Compressed clusters cannot be discarded partially */
+        ret = -ENOTSUP;
+        goto out;
+    case QCOW2_CLUSTER_NORMAL:
+    case QCOW2_CLUSTER_UNALLOCATED:
+        break;
+    default:
+        abort();
+    }
+
+    alloc_mask = QCOW_OFLAG_SUB_ALLOC_RANGE(sc, sc + nb_subclusters);
+    zero_mask = QCOW_OFLAG_SUB_ZERO_RANGE(sc, sc + nb_subclusters);
+    old_l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    new_l2_bitmap = old_l2_bitmap & ~alloc_mask;
+
+    /*
+     * As with whole clusters, a full discard makes the range fall through to
+     * the backing file, and anything else must read back as zeroes. That
+     * only needs the zero bits if there is a backing file or if the range
+     * was allocated before.
+     */
+    if (full_discard) {
+        new_l2_bitmap &= ~zero_mask;
+    } else if (bs->backing || (old_l2_bitmap & alloc_mask)) {
+        new_l2_bitmap |= zero_mask;
+    }
+
+    /*
+     * If no subcluster of the cluster is left in use, drop the whole cluster
+     * so that its refcount is released as well.
+     */
+    if (!(new_l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC) &&
+        (full_discard ? new_l2_bitmap == 0 :
+         new_l2_bitmap == QCOW_L2_BITMAP_ALL_ZEROES || !bs->backing))
+    {
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        ret = discard_in_l2_slice(bs, start_of_cluster(s, offset), 1, type,
+                                  full_discard);
+        return ret < 0 ? ret : 0;
+    }
+
+    if (new_l2_bitmap != old_l2_bitmap) {
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        set_l2_bitmap(s, l2_slice, l2_index, new_l2_bitmap);
+    }
+    ret = 0;
+
+out:
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    return ret;
+}
+
 int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, enum qcow2_discard_type type,
                           bool full_discard)
@@ -1686,18 +2044,36 @@ int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
     BDRVQcow2State *s = bs->opaque;
     uint64_t end_offset = offset + bytes;
     uint64_t nb_clusters;
+    unsigned head, tail;
     int64_t cleared;
     int ret;
 
     /* Caller must pass aligned values, except at image end */
-    assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
-    assert(QEMU_IS_ALIGNED(end_offset, s->cluster_size) ||
+    assert(QEMU_IS_ALIGNED(offset, s->subcluster_size));
+    assert(QEMU_IS_ALIGNED(end_offset, s->subcluster_size) ||
            end_offset == bs->total_sectors << BDRV_SECTOR_BITS);
 
-    nb_clusters = size_to_clusters(s, bytes);
+    /* Partial clusters at either end are only possible with subclusters */
+    head = MIN(end_offset, ROUND_UP(offset, s->cluster_size)) - offset;
+    offset += head;
+
+    tail = (end_offset >= bs->total_sectors << BDRV_SECTOR_BITS) ? 0 :
+        end_offset - MAX(offset, start_of_cluster(s, end_offset));
+    end_offset -= tail;
 
     s->cache_discards = true;
 
+    if (head) {
+        ret = discard_l2_subclusters(bs, offset - head,
+                                     size_to_subclusters(s, head), type,
+                                     full_discard);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    nb_clusters = size_to_clusters(s, end_offset - offset);
+
     /* Each L2 slice is handled by its own loop iteration */
     while (nb_clusters > 0) {
         cleared = discard_in_l2_slice(bs, offset, nb_clusters, type,
@@ -1711,6 +2087,15 @@ int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
         offset += (cleared * s->cluster_size);
     }
 
+    if (tail) {
+        ret = discard_l2_subclusters(bs, end_offset,
+                                     size_to_subclusters(s, tail), type,
+                                     full_discard);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     ret = 0;
 fail:
     s->cache_discards = false;
@@ -1744,27 +2129,43 @@ static int zero_in_l2_slice(BlockDriverState *bs, uint64_t offset,
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t old_offset;
+        uint64_t old_offset, old_l2_bitmap;
         QCow2ClusterType cluster_type;
 
-        old_offset = be64_to_cpu(l2_slice[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_slice, l2_index + i);
+        old_l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
 
         /*
          * Minimize L2 changes if the cluster already reads back as
          * zeroes with correct allocation.
          */
         cluster_type = qcow2_get_cluster_type(bs, old_offset);
-        if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN ||
-            (cluster_type == QCOW2_CLUSTER_ZERO_ALLOC && !unmap)) {
+        if (has_subclusters(s)) {
+            if (old_l2_bitmap == QCOW_L2_BITMAP_ALL_ZEROES &&
+                (cluster_type == QCOW2_CLUSTER_UNALLOCATED || !unmap)) {
+                continue;
+            }
+        } else if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN ||
+                   (cluster_type == QCOW2_CLUSTER_ZERO_ALLOC && !unmap)) {
             continue;
         }
 
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
-        if (cluster_type == QCOW2_CLUSTER_COMPRESSED || unmap) {
-            l2_slice[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+        if (has_subclusters(s)) {
+            /* All subclusters read as zeroes, allocated or not */
+            set_l2_bitmap(s, l2_slice, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
+            if (cluster_type == QCOW2_CLUSTER_COMPRESSED || unmap) {
+                set_l2_entry(s, l2_slice, l2_index + i, 0);
+                qcow2_free_any_clusters(bs, old_offset, 1,
+                                        QCOW2_DISCARD_REQUEST);
+            }
+        } else if (cluster_type == QCOW2_CLUSTER_COMPRESSED || unmap) {
+            set_l2_entry(s, l2_slice, l2_index + i, QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
         } else {
-            l2_slice[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_slice, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
@@ -1773,12 +2174,66 @@ static int zero_in_l2_slice(BlockDriverState *bs, uint64_t offset,
     return nb_clusters;
 }
 
+
+/*
+ * Zeroes @nb_subclusters subclusters starting at @offset, all of which must
+ * be in the same cluster of an image with extended L2 entries. Whole clusters
+ * are left to zero_in_l2_slice().
+ */
+static int zero_l2_subclusters(BlockDriverState *bs, uint64_t offset,
+                               unsigned nb_subclusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice;
+    uint64_t old_l2_bitmap, new_l2_bitmap;
+    int l2_index, ret;
+    int sc = offset_to_sc_index(s, offset);
+
+    assert(has_subclusters(s));
+    assert(nb_subclusters > 0 && nb_subclusters < s->subclusters_per_cluster);
+    assert(sc + nb_subclusters <= s->subclusters_per_cluster);
+    assert(offset_into_subcluster(s, offset) == 0);
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    switch (qcow2_get_cluster_type(bs, get_l2_entry(s, l2_slice, l2_index))) {
+    case QCOW2_CLUSTER_COMPRESSED:
+        /* Compressed clusters cannot be zeroed partially */
+        ret = -ENOTSUP;
+        goto out;
+    case QCOW2_CLUSTER_NORMAL:
+    case QCOW2_CLUSTER_UNALLOCATED:
+        break;
+    default:
+        abort();
+    }
+
+    old_l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    new_l2_bitmap = old_l2_bitmap;
+    new_l2_bitmap |= QCOW_OFLAG_SUB_ZERO_RANGE(sc, sc + nb_subclusters);
+    new_l2_bitmap &= ~QCOW_OFLAG_SUB_ALLOC_RANGE(sc, sc + nb_subclusters);
+
+    if (new_l2_bitmap != old_l2_bitmap) {
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        set_l2_bitmap(s, l2_slice, l2_index, new_l2_bitmap);
+    }
+    ret = 0;
+
+out:
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    return ret;
+}
+
 int qcow2_cluster_zeroize(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, int flags)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t end_offset = offset + bytes;
     uint64_t nb_clusters;
+    unsigned head, tail;
     int64_t cleared;
     int ret;
 
@@ -1793,8 +2248,8 @@ int qcow2_cluster_zeroize(BlockDriverState *bs, uint64_t offset,
     }
 
     /* Caller must pass aligned values, except at image end */
-    assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
-    assert(QEMU_IS_ALIGNED(end_offset, s->cluster_size) ||
+    assert(QEMU_IS_ALIGNED(offset, s->subcluster_size));
+    assert(QEMU_IS_ALIGNED(end_offset, s->subcluster_size) ||
            end_offset >= bs->total_sectors << BDRV_SECTOR_BITS);
 
     /* The zero flag is only supported by version 3 and newer */
@@ -1802,11 +2257,27 @@ int qcow2_cluster_zeroize(BlockDriverState *bs, uint64_t offset,
         return -ENOTSUP;
     }
 
-    /* Each L2 slice is handled by its own loop iteration */
-    nb_clusters = size_to_clusters(s, bytes);
+    /* Partial clusters at either end are only possible with subclusters */
+    head = MIN(end_offset, ROUND_UP(offset, s->cluster_size)) - offset;
+    offset += head;
+
+    tail = (end_offset >= bs->total_sectors << BDRV_SECTOR_BITS) ? 0 :
+        end_offset - MAX(offset, start_of_cluster(s, end_offset));
+    end_offset -= tail;
 
     s->cache_discards = true;
 
+    if (head) {
+        ret = zero_l2_subclusters(bs, offset - head,
+                                  size_to_subclusters(s, head));
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* Each L2 slice is handled by its own loop iteration */
+    nb_clusters = size_to_clusters(s, end_offset - offset);
+
     while (nb_clusters > 0) {
         cleared = zero_in_l2_slice(bs, offset, nb_clusters, flags);
         if (cleared < 0) {
@@ -1818,6 +2289,13 @@ int qcow2_cluster_zeroize(BlockDriverState *bs, uint64_t offset,
         offset += (cleared * s->cluster_size);
     }
 
+    if (tail) {
+        ret = zero_l2_subclusters(bs, end_offset, size_to_subclusters(s, tail));
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     ret = 0;
 fail:
     s->cache_discards = false;
@@ -1847,7 +2325,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     int ret;
     int i, j;
 
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     if (!is_active_l1) {
@@ -1902,7 +2380,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             }
 
             for (j = 0; j < s->l2_slice_size; j++) {
-                uint64_t l2_entry = be64_to_cpu(l2_slice[j]);
+                uint64_t l2_entry = get_l2_entry(s, l2_slice, j);
                 int64_t offset = l2_entry & L2E_OFFSET_MASK;
                 QCow2ClusterType cluster_type =
                     qcow2_get_cluster_type(bs, l2_entry);
@@ -1916,7 +2394,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                     if (!bs->backing) {
                         /* not backed; therefore we can simply deallocate the
                          * cluster */
-                        l2_slice[j] = 0;
+                        set_l2_entry(s, l2_slice, j, 0);
                         l2_dirty = true;
                         continue;
                     }
@@ -1982,9 +2460,9 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                 }
 
                 if (l2_refcount == 1) {
-                    l2_slice[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+                    set_l2_entry(s, l2_slice, j, offset | QCOW_OFLAG_COPIED);
                 } else {
-                    l2_slice[j] = cpu_to_be64(offset);
+                    set_l2_entry(s, l2_slice, j, offset);
                 }
                 l2_dirty = true;
             }
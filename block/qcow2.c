@@ -303,7 +303,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            qcow2_crypto_hdr_read_func,
-                                           bs, cflags, QCOW2_MAX_THREADS, errp);
+                                           bs, cflags, s->max_threads, errp);
             if (!s->crypto) {
                 return -EINVAL;
             }
@@ -870,7 +870,7 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     uint64_t max_l2_entries = DIV_ROUND_UP(virtual_disk_size, s->cluster_size);
     /* An L2 table is always one cluster in size so the max cache size
      * should be a multiple of the cluster size. */
-    uint64_t max_l2_cache = ROUND_UP(max_l2_entries * sizeof(uint64_t),
+    uint64_t max_l2_cache = ROUND_UP(max_l2_entries * l2_entry_size(s),
                                      s->cluster_size);
 
     combined_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_CACHE_SIZE);
@@ -1031,7 +1031,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
     r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
                                            l2_cache_entry_size);
     r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
@@ -1291,6 +1291,9 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     uint64_t l1_vm_state_index;
     bool update_header = false;
 
+    s->max_threads = MIN(MAX(g_get_num_processors(), QCOW2_DEFAULT_THREADS),
+                         QCOW2_MAX_THREADS);
+
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Could not read qcow2 header");
@@ -1473,7 +1476,19 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    s->subclusters_per_cluster =
+        has_subclusters(s) ? QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER : 1;
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    if (s->subcluster_size < (1 << MIN_CLUSTER_BITS)) {
+        error_setg(errp, "Unsupported subcluster size: %d", s->subcluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -1649,7 +1664,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            NULL, NULL, cflags,
-                                           QCOW2_MAX_THREADS, errp);
+                                           s->max_threads, errp);
             if (!s->crypto) {
                 ret = -EINVAL;
                 goto fail;
@@ -1812,6 +1827,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    qemu_co_queue_init(&s->compress_order_queue);
 
     return ret;
 
@@ -1898,8 +1914,8 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
         /* Encryption works on a sector granularity */
         bs->bl.request_alignment = qcrypto_block_get_sector_size(s->crypto);
     }
-    bs->bl.pwrite_zeroes_alignment = s->cluster_size;
-    bs->bl.pdiscard_alignment = s->cluster_size;
+    bs->bl.pwrite_zeroes_alignment = s->subcluster_size;
+    bs->bl.pdiscard_alignment = s->subcluster_size;
 }
 
 static int qcow2_reopen_prepare(BDRVReopenState *state,
@@ -2404,6 +2420,9 @@ static int handle_alloc_space(BlockDriverState *bs, QCowL2Meta *l2meta)
 
     for (m = l2meta; m != NULL; m = m->next) {
         int ret;
+        uint64_t start_offset = m->alloc_offset + m->cow_start.offset;
+        unsigned nb_bytes = m->cow_end.offset + m->cow_end.nb_bytes -
+                            m->cow_start.offset;
 
         if (!m->cow_start.nb_bytes && !m->cow_end.nb_bytes) {
             continue;
@@ -2415,19 +2434,18 @@ static int handle_alloc_space(BlockDriverState *bs, QCowL2Meta *l2meta)
 
         /*
          * instead of writing zero COW buffers,
-         * efficiently zero out the whole clusters
+         * efficiently zero out the whole area (i.e. whole clusters, unless
+         * only some subclusters are being allocated)
          */
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, m->alloc_offset,
-                                            m->nb_clusters * s->cluster_size,
+        ret = qcow2_pre_write_overlap_check(bs, 0, start_offset, nb_bytes,
                                             true);
         if (ret < 0) {
             return ret;
         }
 
         BLKDBG_EVENT(bs->file, BLKDBG_CLUSTER_ALLOC_SPACE);
-        ret = bdrv_co_pwrite_zeroes(s->data_file, m->alloc_offset,
-                                    m->nb_clusters * s->cluster_size,
+        ret = bdrv_co_pwrite_zeroes(s->data_file, start_offset, nb_bytes,
                                     BDRV_REQ_NO_FALLBACK);
         if (ret < 0) {
             if (ret != -ENOTSUP && ret != -EAGAIN) {
@@ -2920,6 +2938,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
                 .name = "compression type",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -3230,28 +3253,31 @@ int64_t qcow2_refcount_metadata_size(int64_t clusters, size_t cluster_size,
  * @total_size: virtual disk size in bytes
  * @cluster_size: cluster size in bytes
  * @refcount_order: refcount bits power-of-2 exponent
+ * @extended_l2: true if the image has extended L2 entries
  *
  * Returns: Total number of bytes required for the fully allocated image
  * (including metadata).
  */
 static int64_t qcow2_calc_prealloc_size(int64_t total_size,
                                         size_t cluster_size,
-                                        int refcount_order)
+                                        int refcount_order,
+                                        bool extended_l2)
 {
     int64_t meta_size = 0;
     uint64_t nl1e, nl2e;
     int64_t aligned_total_size = ROUND_UP(total_size, cluster_size);
+    size_t l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
 
     /* header: 1 cluster */
     meta_size += cluster_size;
 
     /* total size of L2 tables */
     nl2e = aligned_total_size / cluster_size;
-    nl2e = ROUND_UP(nl2e, cluster_size / sizeof(uint64_t));
-    meta_size += nl2e * sizeof(uint64_t);
+    nl2e = ROUND_UP(nl2e, cluster_size / l2e_size);
+    meta_size += nl2e * l2e_size;
 
     /* total size of L1 tables */
-    nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+    nl1e = nl2e * l2e_size / cluster_size;
     nl1e = ROUND_UP(nl1e, cluster_size / sizeof(uint64_t));
     meta_size += nl1e * sizeof(uint64_t);
 
@@ -3402,6 +3428,27 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         goto out;
     }
 
+    if (!qcow2_opts->has_extended_l2) {
+        qcow2_opts->extended_l2 = false;
+    }
+    if (qcow2_opts->extended_l2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "compatibility level 1.1 and above (use version=v3 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+        if (cluster_size < QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER <<
+                           MIN_CLUSTER_BITS) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "cluster sizes of at least %d bytes",
+                       QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER << MIN_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
     if (!qcow2_opts->has_preallocation) {
         qcow2_opts->preallocation = PREALLOC_MODE_OFF;
     }
@@ -3547,6 +3594,10 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         header->incompatible_features |=
             cpu_to_be64(QCOW2_INCOMPAT_COMPRESSION);
     }
+    if (qcow2_opts->extended_l2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
 
     ret = blk_pwrite(blk, 0, header, cluster_size, 0);
     g_free(header);
@@ -3733,6 +3784,7 @@ static int coroutine_fn qcow2_co_create_opts(BlockDriver *drv,
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
         { BLOCK_OPT_DATA_FILE_RAW,      "data-file-raw" },
         { BLOCK_OPT_COMPRESSION_TYPE,   "compression-type" },
+        { BLOCK_OPT_EXTL2,              "extended-l2" },
         { NULL, NULL },
     };
 
@@ -3837,8 +3889,9 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
     int ret;
     BDRVQcow2State *s = bs->opaque;
 
-    uint32_t head = offset % s->cluster_size;
-    uint32_t tail = (offset + bytes) % s->cluster_size;
+    /* Extended L2 entries allow zeroing single subclusters */
+    uint32_t head = offset_into_subcluster(s, offset);
+    uint32_t tail = offset_into_subcluster(s, offset + bytes);
 
     trace_qcow2_pwrite_zeroes_start_req(qemu_coroutine_self(), offset, bytes);
     if (offset + bytes == bs->total_sectors * BDRV_SECTOR_SIZE) {
@@ -3849,20 +3902,20 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
         uint64_t off;
         unsigned int nr;
 
-        assert(head + bytes <= s->cluster_size);
+        assert(head + bytes <= s->subcluster_size);
 
-        /* check whether remainder of cluster already reads as zero */
+        /* check whether remainder of subcluster already reads as zero */
         if (!(is_zero(bs, offset - head, head) &&
               is_zero(bs, offset + bytes,
-                      tail ? s->cluster_size - tail : 0))) {
+                      tail ? s->subcluster_size - tail : 0))) {
             return -ENOTSUP;
         }
 
         qemu_co_mutex_lock(&s->lock);
         /* We can have new write after previous check */
-        offset = QEMU_ALIGN_DOWN(offset, s->cluster_size);
-        bytes = s->cluster_size;
-        nr = s->cluster_size;
+        offset = QEMU_ALIGN_DOWN(offset, s->subcluster_size);
+        bytes = s->subcluster_size;
+        nr = s->subcluster_size;
         ret = qcow2_get_cluster_offset(bs, offset, &nr, &off);
         if (ret != QCOW2_CLUSTER_UNALLOCATED &&
             ret != QCOW2_CLUSTER_ZERO_PLAIN &&
@@ -3895,11 +3948,11 @@ static coroutine_fn int qcow2_co_pdiscard(BlockDriverState *bs,
         return -ENOTSUP;
     }
 
-    if (!QEMU_IS_ALIGNED(offset | bytes, s->cluster_size)) {
-        assert(bytes < s->cluster_size);
-        /* Ignore partial clusters, except for the special case of the
-         * complete partial cluster at the end of an unaligned file */
-        if (!QEMU_IS_ALIGNED(offset, s->cluster_size) ||
+    if (!QEMU_IS_ALIGNED(offset | bytes, s->subcluster_size)) {
+        assert(bytes < s->subcluster_size);
+        /* Ignore partial subclusters, except for the special case of the
+         * complete partial subcluster at the end of an unaligned file */
+        if (!QEMU_IS_ALIGNED(offset, s->subcluster_size) ||
             offset + bytes != bs->total_sectors * BDRV_SECTOR_SIZE) {
             return -ENOTSUP;
         }
@@ -4253,7 +4306,7 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
          *  preallocation. All that matters is that we will not have to allocate
          *  new refcount structures for them.) */
         nb_new_l2_tables = DIV_ROUND_UP(nb_new_data_clusters,
-                                        s->cluster_size / sizeof(uint64_t));
+                                        s->cluster_size / l2_entry_size(s));
         /* The cluster range may not be aligned to L2 boundaries, so add one L2
          * table for a potential head/tail */
         nb_new_l2_tables++;
@@ -4415,6 +4468,13 @@ fail:
     return ret;
 }
 
+/* Called with s->lock held by the request whose turn it is to allocate */
+static void coroutine_fn qcow2_compress_order_next(BDRVQcow2State *s)
+{
+    s->compress_seq_alloc++;
+    qemu_co_queue_restart_all(&s->compress_order_queue);
+}
+
 static coroutine_fn int
 qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
                                  uint64_t offset, uint64_t bytes,
@@ -4425,10 +4485,16 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
     ssize_t out_len;
     uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
+    uint64_t seq;
 
     assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
            (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
 
+    /* Take our place in the allocation order before yielding for the first
+     * time, so that requests get their host offsets in submission order
+     * even if their compression finishes out of order. */
+    seq = s->compress_seq_next++;
+
     buf = qemu_blockalign(bs, s->cluster_size);
     if (bytes < s->cluster_size) {
         /* Zero-pad last write if image size is not cluster aligned */
@@ -4440,21 +4506,30 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
                                 buf, s->cluster_size);
-    if (out_len == -ENOMEM) {
+
+    qemu_co_mutex_lock(&s->lock);
+    while (s->compress_seq_alloc != seq) {
+        qemu_co_queue_wait(&s->compress_order_queue, &s->lock);
+    }
+
+    if (out_len < 0) {
+        qcow2_compress_order_next(s);
+        qemu_co_mutex_unlock(&s->lock);
+        if (out_len != -ENOMEM) {
+            ret = -EINVAL;
+            goto fail;
+        }
         /* could not compress: write normal cluster */
         ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
         if (ret < 0) {
             goto fail;
         }
         goto success;
-    } else if (out_len < 0) {
-        ret = -EINVAL;
-        goto fail;
     }
 
-    qemu_co_mutex_lock(&s->lock);
     ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
                                                 &cluster_offset);
+    qcow2_compress_order_next(s);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
         goto fail;
@@ -4825,6 +4900,8 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     PreallocMode prealloc;
     bool has_backing_file;
     bool has_luks;
+    bool extended_l2;
+    size_t l2e_size;
 
     /* Parse image creation options */
     cluster_size = qcow2_opt_get_cluster_size_del(opts, &local_err);
@@ -4842,6 +4919,15 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
         goto err;
     }
 
+    extended_l2 = qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false);
+    if (extended_l2 &&
+        cluster_size < QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER << MIN_CLUSTER_BITS) {
+        error_setg(&local_err, "Extended L2 entries are only supported with "
+                   "cluster sizes of at least %d bytes",
+                   QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER << MIN_CLUSTER_BITS);
+        goto err;
+    }
+
     optstr = qemu_opt_get_del(opts, BLOCK_OPT_PREALLOC);
     prealloc = qapi_enum_parse(&PreallocMode_lookup, optstr,
                                PREALLOC_MODE_OFF, &local_err);
@@ -4890,8 +4976,9 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     virtual_size = ROUND_UP(virtual_size, cluster_size);
 
     /* Check that virtual disk size is valid */
+    l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
     l2_tables = DIV_ROUND_UP(virtual_size / cluster_size,
-                             cluster_size / sizeof(uint64_t));
+                             cluster_size / l2e_size);
     if (l2_tables * sizeof(uint64_t) > QCOW_MAX_L1_SIZE) {
         error_setg(&local_err, "The image size is too large "
                                "(try using a larger cluster size)");
@@ -4956,7 +5043,8 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     info = g_new0(BlockMeasureInfo, 1);
     info->fully_allocated =
         qcow2_calc_prealloc_size(virtual_size, cluster_size,
-                                 ctz32(refcount_bits)) + luks_payload_size;
+                                 ctz32(refcount_bits), extended_l2) +
+        luks_payload_size;
 
     /*
      * Remove data clusters that are not required.  This overestimates the
@@ -5037,6 +5125,8 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
             .data_file          = g_strdup(s->image_data_file),
             .has_data_file_raw  = has_data_file(bs),
             .data_file_raw      = data_file_is_raw(bs),
+            .has_extended_l2    = has_subclusters(s),
+            .extended_l2        = has_subclusters(s),
             .compression_type   = s->compression_type,
         };
     } else {
@@ -5071,6 +5161,21 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    stats->u.qcow2.l2_cache = g_new(Qcow2CacheStats, 1);
+    stats->u.qcow2.refcount_cache = g_new(Qcow2CacheStats, 1);
+    qcow2_cache_get_stats(s->l2_table_cache, stats->u.qcow2.l2_cache);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          stats->u.qcow2.refcount_cache);
+
+    return stats;
+}
+
 static int qcow2_has_zero_init(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -5459,6 +5564,14 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                                  "is not supported");
                 return -ENOTSUP;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            bool extended_l2 = qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2,
+                                                 has_subclusters(s));
+            if (extended_l2 != has_subclusters(s)) {
+                error_setg(errp, "Toggling extended L2 entries "
+                                 "is not supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -5707,6 +5820,11 @@ static QemuOptsList qcow2_create_opts = {
             .help = "qcow2 cluster size",
             .def_value_str = stringify(DEFAULT_CLUSTER_SIZE)
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 tables with subcluster allocation",
+        },
         {
             .name = BLOCK_OPT_PREALLOC,
             .type = QEMU_OPT_STRING,
@@ -5778,6 +5896,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure           = qcow2_measure,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
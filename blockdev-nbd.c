@@ -154,6 +154,7 @@ void qmp_nbd_server_add(BlockExportNbd *arg, Error **errp)
     BlockBackend *on_eject_blk;
     NBDExport *exp;
     int64_t len;
+    bool multi_conn;
     AioContext *aio_context;
 
     if (!nbd_server) {
@@ -203,8 +204,17 @@ void qmp_nbd_server_add(BlockExportNbd *arg, Error **errp)
         arg->writable = false;
     }
 
+    if (!arg->has_multi_conn) {
+        arg->multi_conn = ON_OFF_AUTO_AUTO;
+    }
+    if (arg->multi_conn == ON_OFF_AUTO_AUTO) {
+        multi_conn = !arg->writable;
+    } else {
+        multi_conn = arg->multi_conn == ON_OFF_AUTO_ON;
+    }
+
     exp = nbd_export_new(bs, 0, len, arg->name, arg->description, arg->bitmap,
-                         !arg->writable, !arg->writable,
+                         !arg->writable, multi_conn,
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
         goto out;
@@ -289,6 +289,7 @@ int64_t block_job_ratelimit_get_delay(BlockJob *job, uint64_t n)
 
 BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
 {
+    const BlockJobDriver *drv = block_job_driver(job);
     BlockJobInfo *info;
 
     if (block_job_is_internal(job)) {
@@ -310,6 +311,9 @@ BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
     info->auto_dismiss  = job->job.auto_dismiss;
     info->has_error = job->job.ret != 0;
     info->error     = job->job.ret ? g_strdup(strerror(-job->job.ret)) : NULL;
+    if (drv->query) {
+        drv->query(job, info);
+    }
     return info;
 }
 
@@ -42,12 +42,18 @@
 #ifdef CONFIG_SNAPPY
 #include <snappy-c.h>
 #endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 #ifndef ELF_MACHINE_UNAME
 #define ELF_MACHINE_UNAME "Unknown"
 #endif
 
 #define MAX_GUEST_NOTE_SIZE (1 << 20) /* 1MB should be enough */
 
+#define DUMP_DEFAULT_COMPRESS_THREADS 8
+#define DUMP_MAX_COMPRESS_THREADS 64
+
 #define ELF_NOTE_SIZE(hdr_size, name_size, desc_size)   \
     ((DIV_ROUND_UP((hdr_size), 4) +                     \
       DIV_ROUND_UP((name_size), 4) +                    \
@@ -847,6 +853,11 @@ static void create_header32(DumpState *s, Error **errp)
     if (s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) {
         status |= DUMP_DH_COMPRESSED_SNAPPY;
     }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+        status |= DUMP_DH_COMPRESSED_ZSTD;
+    }
 #endif
     dh->status = cpu_to_dump32(s, status);
 
@@ -959,6 +970,11 @@ static void create_header64(DumpState *s, Error **errp)
     if (s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) {
         status |= DUMP_DH_COMPRESSED_SNAPPY;
     }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+        status |= DUMP_DH_COMPRESSED_ZSTD;
+    }
 #endif
     dh->status = cpu_to_dump32(s, status);
 
@@ -1288,6 +1304,10 @@ static size_t get_len_buf_out(size_t page_size, uint32_t flag_compress)
 #ifdef CONFIG_SNAPPY
     case DUMP_DH_COMPRESSED_SNAPPY:
         return snappy_max_compressed_length(page_size);
+#endif
+#ifdef CONFIG_ZSTD
+    case DUMP_DH_COMPRESSED_ZSTD:
+        return ZSTD_compressBound(page_size);
 #endif
     }
     return 0;
@@ -1301,173 +1321,398 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
-static void write_dump_pages(DumpState *s, Error **errp)
+/*
+ * Pages are compressed by a pool of threads, in batches of consecutive
+ * dumpable pages.  Each thread has two batches that it works on in turn,
+ * and batches are filled and written out in a fixed round robin order, so
+ * the vmcore is the same as if pages were compressed one after the other.
+ */
+#define DUMP_COMPRESS_BATCH_PAGES 256
+
+typedef struct DumpCompressThread DumpCompressThread;
+
+typedef struct DumpPageBatch {
+    QemuSemaphore ready;        /* posted when there are pages to compress */
+    QemuSemaphore done;         /* posted when they have been compressed */
+    bool busy;                  /* handed to its thread, not written yet */
+    bool quit;
+    size_t nr_pages;
+    uint8_t *pages[DUMP_COMPRESS_BATCH_PAGES];
+    /* DUMP_DH_COMPRESSED_* flag, or 0 for zero and uncompressed pages */
+    uint32_t flags[DUMP_COMPRESS_BATCH_PAGES];
+    /* size of the compressed data, 0 for zero pages */
+    size_t sizes[DUMP_COMPRESS_BATCH_PAGES];
+    uint8_t *buf_out;           /* len_buf_out bytes for each page */
+} DumpPageBatch;
+
+struct DumpCompressThread {
+    QemuThread thread;
+    DumpState *s;
+    size_t len_buf_out;
+    DumpPageBatch *batches[2];
+#ifdef CONFIG_LZO
+    lzo_bytep wrkmem;
+#endif
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+#endif
+};
+
+typedef struct DumpPages {
+    DumpState *s;
+    DataCache page_desc;
+    DataCache page_data;
+    PageDescriptor pd_zero;
+    off_t offset_data;
+    size_t len_buf_out;
+    int nr_threads;
+    DumpCompressThread *threads;
+    /* batch i belongs to thread i % nr_threads */
+    int nr_batches;
+    DumpPageBatch *batches;
+    int next_batch;             /* the batch being filled */
+} DumpPages;
+
+/*
+ * Compress the page at @buf into @buf_out with the format in
+ * s->flag_compress.  Returns the DUMP_DH_COMPRESSED_* flag for the
+ * compressed page, or 0 if it is stored in plaintext because compression
+ * failed or did not make it smaller.  @size_out is set to the size of the
+ * page data, which is 0 for a zero page.
+ */
+static uint32_t dump_compress_page(DumpCompressThread *t, uint8_t *buf,
+                                   uint8_t *buf_out, size_t *size_out)
 {
-    int ret = 0;
-    DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
+    DumpState *s = t->s;
+    size_t page_size = s->dump_info.page_size;
+    size_t size = t->len_buf_out;
+
+    if (is_zero_page(buf, page_size)) {
+        *size_out = 0;
+        return 0;
+    }
+
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+        (compress2(buf_out, (uLongf *)&size, buf, page_size,
+                   Z_BEST_SPEED) == Z_OK) &&
+        (size < page_size)) {
+        *size_out = size;
+        return DUMP_DH_COMPRESSED_ZLIB;
+    }
+#ifdef CONFIG_LZO
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+        (lzo1x_1_compress(buf, page_size, buf_out, (lzo_uint *)&size,
+                          t->wrkmem) == LZO_E_OK) &&
+        (size < page_size)) {
+        *size_out = size;
+        return DUMP_DH_COMPRESSED_LZO;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+        (snappy_compress((char *)buf, page_size, (char *)buf_out,
+                         &size) == SNAPPY_OK) &&
+        (size < page_size)) {
+        *size_out = size;
+        return DUMP_DH_COMPRESSED_SNAPPY;
+    }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+        size = ZSTD_compressCCtx(t->zstd_cctx, buf_out, size, buf, page_size,
+                                 1);
+        if (!ZSTD_isError(size) && size < page_size) {
+            *size_out = size;
+            return DUMP_DH_COMPRESSED_ZSTD;
+        }
+    }
+#endif
+
+    /* fall back to save in plaintext */
+    *size_out = page_size;
+    return 0;
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressThread *t = opaque;
+    int turn;
+
+    for (turn = 0; ; turn ^= 1) {
+        DumpPageBatch *b = t->batches[turn];
+        size_t i;
+
+        qemu_sem_wait(&b->ready);
+        if (b->quit) {
+            break;
+        }
+        for (i = 0; i < b->nr_pages; i++) {
+            b->flags[i] = dump_compress_page(t, b->pages[i],
+                                             b->buf_out + i * t->len_buf_out,
+                                             &b->sizes[i]);
+        }
+        qemu_sem_post(&b->done);
+    }
+
+    return NULL;
+}
+
+/* Free the per-thread state and the batches of @p */
+static void dump_pages_free(DumpPages *p)
+{
+    int i;
+
+    for (i = 0; i < p->nr_threads; i++) {
+        DumpCompressThread *t = &p->threads[i];
+
 #ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
+        g_free(t->wrkmem);
 #endif
-    uint8_t *buf_out = NULL;
-    off_t offset_desc, offset_data;
-    PageDescriptor pd, pd_zero;
+#ifdef CONFIG_ZSTD
+        ZSTD_freeCCtx(t->zstd_cctx);
+#endif
+    }
+    for (i = 0; i < p->nr_batches; i++) {
+        DumpPageBatch *b = &p->batches[i];
+
+        qemu_sem_destroy(&b->ready);
+        qemu_sem_destroy(&b->done);
+        g_free(b->buf_out);
+    }
+
+    g_free(p->threads);
+    g_free(p->batches);
+}
+
+static int dump_pages_start_threads(DumpPages *p, Error **errp)
+{
+    int i;
+
+    p->threads = g_new0(DumpCompressThread, p->nr_threads);
+    p->nr_batches = 2 * p->nr_threads;
+    p->batches = g_new0(DumpPageBatch, p->nr_batches);
+
+    for (i = 0; i < p->nr_batches; i++) {
+        DumpPageBatch *b = &p->batches[i];
+
+        qemu_sem_init(&b->ready, 0);
+        qemu_sem_init(&b->done, 0);
+        b->buf_out = g_malloc(DUMP_COMPRESS_BATCH_PAGES * p->len_buf_out);
+    }
+
+    for (i = 0; i < p->nr_threads; i++) {
+        DumpCompressThread *t = &p->threads[i];
+
+        t->s = p->s;
+        t->len_buf_out = p->len_buf_out;
+        t->batches[0] = &p->batches[i];
+        t->batches[1] = &p->batches[i + p->nr_threads];
+#ifdef CONFIG_LZO
+        t->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+#ifdef CONFIG_ZSTD
+        if (p->s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+            t->zstd_cctx = ZSTD_createCCtx();
+            if (!t->zstd_cctx) {
+                error_setg(errp, "dump: failed to create zstd context");
+                dump_pages_free(p);
+                return -1;
+            }
+        }
+#endif
+    }
+
+    for (i = 0; i < p->nr_threads; i++) {
+        DumpCompressThread *t = &p->threads[i];
+
+        qemu_thread_create(&t->thread, "dump_compress", dump_compress_thread,
+                           t, QEMU_THREAD_JOINABLE);
+    }
+
+    return 0;
+}
+
+static void dump_pages_stop_threads(DumpPages *p)
+{
+    int i;
+
+    /* Once nothing is in flight, the next batches are what threads wait on */
+    for (i = 0; i < p->nr_batches; i++) {
+        DumpPageBatch *b = &p->batches[i];
+
+        if (b->busy) {
+            qemu_sem_wait(&b->done);
+            b->busy = false;
+        }
+    }
+    for (i = 0; i < p->nr_threads; i++) {
+        DumpPageBatch *b = &p->batches[(p->next_batch + i) % p->nr_batches];
+
+        b->quit = true;
+        qemu_sem_post(&b->ready);
+    }
+
+    for (i = 0; i < p->nr_threads; i++) {
+        qemu_thread_join(&p->threads[i].thread);
+    }
+
+    dump_pages_free(p);
+}
+
+/* Write the page descriptors and data of a compressed batch to the caches */
+static int dump_pages_write_batch(DumpPages *p, DumpPageBatch *b,
+                                  Error **errp)
+{
+    DumpState *s = p->s;
+    PageDescriptor pd;
+    size_t i;
+
+    qemu_sem_wait(&b->done);
+    b->busy = false;
+
+    for (i = 0; i < b->nr_pages; i++) {
+        uint8_t *data = b->flags[i] ? b->buf_out + i * p->len_buf_out
+                                    : b->pages[i];
+
+        if (!b->sizes[i]) {
+            /* zero pages all use the first page of the page section */
+            if (write_cache(&p->page_desc, &p->pd_zero,
+                            sizeof(PageDescriptor), false) < 0) {
+                error_setg(errp, "dump: failed to write page desc");
+                return -1;
+            }
+        } else {
+            if (write_cache(&p->page_data, data, b->sizes[i], false) < 0) {
+                error_setg(errp, "dump: failed to write page data");
+                return -1;
+            }
+
+            pd.flags = cpu_to_dump32(s, b->flags[i]);
+            pd.size = cpu_to_dump32(s, b->sizes[i]);
+            pd.page_flags = cpu_to_dump64(s, 0);
+            pd.offset = cpu_to_dump64(s, p->offset_data);
+            p->offset_data += b->sizes[i];
+
+            if (write_cache(&p->page_desc, &pd, sizeof(PageDescriptor),
+                            false) < 0) {
+                error_setg(errp, "dump: failed to write page desc");
+                return -1;
+            }
+        }
+        s->written_size += s->dump_info.page_size;
+    }
+
+    return 0;
+}
+
+/*
+ * Hand the batch being filled to its thread, and get the next one ready,
+ * writing out what it held before
+ */
+static int dump_pages_submit_batch(DumpPages *p, Error **errp)
+{
+    DumpPageBatch *b = &p->batches[p->next_batch];
+
+    b->busy = true;
+    qemu_sem_post(&b->ready);
+
+    p->next_batch = (p->next_batch + 1) % p->nr_batches;
+    b = &p->batches[p->next_batch];
+    if (b->busy && dump_pages_write_batch(p, b, errp) < 0) {
+        return -1;
+    }
+    b->nr_pages = 0;
+
+    return 0;
+}
+
+static void write_dump_pages(DumpState *s, Error **errp)
+{
+    int ret = 0;
+    DumpPages p = { .s = s };
+    DumpPageBatch *b;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    off_t offset_desc;
+    int i;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
-    offset_data = offset_desc + sizeof(PageDescriptor) * s->num_dumpable;
+    p.offset_data = offset_desc + sizeof(PageDescriptor) * s->num_dumpable;
 
-    prepare_data_cache(&page_desc, s, offset_desc);
-    prepare_data_cache(&page_data, s, offset_data);
+    prepare_data_cache(&p.page_desc, s, offset_desc);
+    prepare_data_cache(&p.page_data, s, p.offset_data);
 
     /* prepare buffer to store compressed data */
-    len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
-    assert(len_buf_out != 0);
-
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
+    p.len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
+    assert(p.len_buf_out != 0);
 
     /*
      * init zero page's page_desc and page_data, because every zero page
      * uses the same page_data
      */
-    pd_zero.size = cpu_to_dump32(s, s->dump_info.page_size);
-    pd_zero.flags = cpu_to_dump32(s, 0);
-    pd_zero.offset = cpu_to_dump64(s, offset_data);
-    pd_zero.page_flags = cpu_to_dump64(s, 0);
+    p.pd_zero.size = cpu_to_dump32(s, s->dump_info.page_size);
+    p.pd_zero.flags = cpu_to_dump32(s, 0);
+    p.pd_zero.offset = cpu_to_dump64(s, p.offset_data);
+    p.pd_zero.page_flags = cpu_to_dump64(s, 0);
     buf = g_malloc0(s->dump_info.page_size);
-    ret = write_cache(&page_data, buf, s->dump_info.page_size, false);
+    ret = write_cache(&p.page_data, buf, s->dump_info.page_size, false);
     g_free(buf);
     if (ret < 0) {
         error_setg(errp, "dump: failed to write page data (zero page)");
-        goto out;
+        goto out_cache;
     }
 
-    offset_data += s->dump_info.page_size;
+    p.offset_data += s->dump_info.page_size;
+
+    p.nr_threads = s->compress_threads;
+    if (dump_pages_start_threads(&p, errp) < 0) {
+        goto out_cache;
+    }
 
     /*
      * dump memory to vmcore page by page. zero page will all be resided in the
      * first page of page section
      */
+    b = &p.batches[p.next_batch];
     while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
+        b->pages[b->nr_pages++] = buf;
+        if (b->nr_pages == DUMP_COMPRESS_BATCH_PAGES) {
+            if (dump_pages_submit_batch(&p, errp) < 0) {
                 goto out;
             }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-            }
-
-            /* get and write page desc here */
-            pd.page_flags = cpu_to_dump64(s, 0);
-            pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+            b = &p.batches[p.next_batch];
+        }
+    }
+    if (b->nr_pages && dump_pages_submit_batch(&p, errp) < 0) {
+        goto out;
+    }
 
-            ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
-            }
+    /* write out the batches still in flight, oldest first */
+    for (i = 0; i < p.nr_batches; i++) {
+        b = &p.batches[(p.next_batch + i) % p.nr_batches];
+        if (b->busy && dump_pages_write_batch(&p, b, errp) < 0) {
+            goto out;
         }
-        s->written_size += s->dump_info.page_size;
     }
 
-    ret = write_cache(&page_desc, NULL, 0, true);
+    ret = write_cache(&p.page_desc, NULL, 0, true);
     if (ret < 0) {
         error_setg(errp, "dump: failed to sync cache for page_desc");
         goto out;
     }
-    ret = write_cache(&page_data, NULL, 0, true);
+    ret = write_cache(&p.page_data, NULL, 0, true);
     if (ret < 0) {
         error_setg(errp, "dump: failed to sync cache for page_data");
         goto out;
     }
 
 out:
-    free_data_cache(&page_desc);
-    free_data_cache(&page_data);
-
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
+    dump_pages_stop_threads(&p);
+out_cache:
+    free_data_cache(&p.page_desc);
+    free_data_cache(&p.page_data);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -1645,7 +1890,8 @@ static void vmcoreinfo_update_phys_base(DumpState *s)
 
 static void dump_init(DumpState *s, int fd, bool has_format,
                       DumpGuestMemoryFormat format, bool paging, bool has_filter,
-                      int64_t begin, int64_t length, Error **errp)
+                      int64_t begin, int64_t length, int compress_threads,
+                      Error **errp)
 {
     VMCoreInfoState *vmci = vmcoreinfo_find();
     CPUState *cpu;
@@ -1808,9 +2054,14 @@ static void dump_init(DumpState *s, int fd, bool has_format,
             s->flag_compress = DUMP_DH_COMPRESSED_SNAPPY;
             break;
 
+        case DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD:
+            s->flag_compress = DUMP_DH_COMPRESSED_ZSTD;
+            break;
+
         default:
             s->flag_compress = 0;
         }
+        s->compress_threads = compress_threads;
 
         return;
     }
@@ -1923,7 +2174,9 @@ void qmp_dump_guest_memory(bool paging, const char *file,
                            bool has_detach, bool detach,
                            bool has_begin, int64_t begin, bool has_length,
                            int64_t length, bool has_format,
-                           DumpGuestMemoryFormat format, Error **errp)
+                           DumpGuestMemoryFormat format,
+                           bool has_compress_threads, int64_t compress_threads,
+                           Error **errp)
 {
     const char *p;
     int fd = -1;
@@ -1980,6 +2233,26 @@ void qmp_dump_guest_memory(bool paging, const char *file,
     }
 #endif
 
+#ifndef CONFIG_ZSTD
+    if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD) {
+        error_setg(errp, "kdump-zstd is not available now");
+        return;
+    }
+#endif
+
+    if (has_compress_threads) {
+        if (compress_threads < 1 ||
+            compress_threads > DUMP_MAX_COMPRESS_THREADS) {
+            error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                       "a value between 1 and "
+                       stringify(DUMP_MAX_COMPRESS_THREADS));
+            return;
+        }
+    } else {
+        compress_threads = MIN(g_get_num_processors(),
+                               DUMP_DEFAULT_COMPRESS_THREADS);
+    }
+
 #ifndef TARGET_X86_64
     if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_WIN_DMP) {
         error_setg(errp, "Windows dump is only available for x86-64");
@@ -2013,7 +2286,7 @@ void qmp_dump_guest_memory(bool paging, const char *file,
     dump_state_prepare(s);
 
     dump_init(s, fd, has_format, format, paging, has_begin,
-              begin, length, &local_err);
+              begin, length, compress_threads, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         atomic_set(&s->status, DUMP_STATUS_FAILED);
@@ -2061,6 +2334,13 @@ DumpGuestMemoryCapability *qmp_query_dump_guest_memory_capability(Error **errp)
     item->value = DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY;
 #endif
 
+    /* add new item if kdump-zstd is available */
+#ifdef CONFIG_ZSTD
+    item->next = g_malloc0(sizeof(DumpGuestMemoryFormatList));
+    item = item->next;
+    item->value = DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD;
+#endif
+
     /* Windows dump is available only if target is x86_64 */
 #ifdef TARGET_X86_64
     item->next = g_malloc0(sizeof(DumpGuestMemoryFormatList));
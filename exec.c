@@ -3360,53 +3360,48 @@ void cpu_flush_icache_range(hwaddr start, hwaddr len)
                                      NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+typedef struct BounceBuffer {
     MemoryRegion *mr;
     void *buffer;
     hwaddr addr;
     hwaddr len;
-    bool in_use;
+    QLIST_ENTRY(BounceBuffer) link;
 } BounceBuffer;
 
-static BounceBuffer bounce;
-
-typedef struct MapClient {
+typedef struct AddressSpaceMapClient {
     QEMUBH *bh;
-    QLIST_ENTRY(MapClient) link;
-} MapClient;
-
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
+    QLIST_ENTRY(AddressSpaceMapClient) link;
+} AddressSpaceMapClient;
 
-static void cpu_unregister_map_client_do(MapClient *client)
+static void address_space_unregister_map_client_do(
+    AddressSpaceMapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        client = QLIST_FIRST(&as->map_client_list);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client = g_malloc(sizeof(*client));
+    AddressSpaceMapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->bounce_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_client_list, client, link);
+    if (as->bounce_buffer_size < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
 void cpu_exec_init_all(void)
@@ -3422,28 +3417,20 @@ void cpu_exec_init_all(void)
     finalize_target_page_bits();
     io_mem_init();
     memory_map_init();
-    qemu_mutex_init(&map_client_list_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(client, &as->map_client_list, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            address_space_unregister_map_client_do(client);
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
-}
-
-static void cpu_notify_map_clients(void)
-{
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
 static bool flatview_access_valid(FlatView *fv, hwaddr addr, hwaddr len,
@@ -3512,8 +3499,8 @@ flatview_extend_translation(FlatView *fv, hwaddr addr,
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -3537,24 +3524,36 @@ void *address_space_map(AddressSpace *as,
     mr = flatview_translate(fv, addr, &xlat, &l, is_write, attrs);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
+        BounceBuffer *bounce;
+
+        /* Avoid unbounded allocations */
+        qemu_mutex_lock(&as->bounce_lock);
+        l = MIN(l, as->max_bounce_buffer_size - as->bounce_buffer_size);
+        if (l == 0) {
+            qemu_mutex_unlock(&as->bounce_lock);
+            stat64_add(&as->bounce_exhausted, 1);
+            trace_address_space_map_bounce_exhausted(as->name, addr, len);
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        as->bounce_buffer_size += l;
+
+        bounce = g_new(BounceBuffer, 1);
+        bounce->buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
+        bounce->addr = addr;
+        bounce->len = l;
+        QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+        qemu_mutex_unlock(&as->bounce_lock);
+        stat64_add(&as->bounce_maps, 1);
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
         if (!is_write) {
             flatview_read(fv, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                               bounce->buffer, l);
         }
 
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
 
@@ -3566,6 +3565,26 @@ void *address_space_map(AddressSpace *as,
     return ptr;
 }
 
+static BounceBuffer *address_space_find_bounce(AddressSpace *as, void *buffer)
+{
+    BounceBuffer *bounce;
+
+    if (!atomic_read(&as->bounce_buffer_size)) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+        if (bounce->buffer == buffer) {
+            QLIST_REMOVE(bounce, link);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&as->bounce_lock);
+
+    return bounce;
+}
+
 /* Unmaps a memory region previously mapped by address_space_map().
  * Will also mark the memory as dirty if is_write is true.  access_len gives
  * the amount of memory that was actually read or written by the caller.
@@ -3573,7 +3592,9 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          bool is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bounce = address_space_find_bounce(as, buffer);
+
+    if (!bounce) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -3589,14 +3610,17 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
-    }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
+    }
+    qemu_vfree(bounce->buffer);
+    memory_region_unref(bounce->mr);
+
+    qemu_mutex_lock(&as->bounce_lock);
+    as->bounce_buffer_size -= bounce->len;
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->bounce_lock);
+    g_free(bounce);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
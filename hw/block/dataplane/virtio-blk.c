@@ -41,15 +41,17 @@ struct VirtIOBlockDataPlane {
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
-    IOThread *iothread;
-    AioContext *ctx;
+    IOThread **iothreads;           /* referenced IOThreads, may be empty */
+    unsigned num_iothreads;
+    AioContext *ctx;                /* BlockBackend's AioContext */
+    AioContext **vq_aio_context;    /* AioContext handling each virtqueue */
 };
 
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
     if (s->batch_notifications) {
-        set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
+        set_bit_atomic(virtio_get_queue_index(vq), s->batch_notify_vqs);
         qemu_bh_schedule(s->bh);
     } else {
         virtio_notify_irqfd(s->vdev, vq);
@@ -60,14 +62,12 @@ static void notify_guest_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
     unsigned nvqs = s->conf->num_queues;
-    unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
-
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j / BITS_PER_LONG];
+        /* Bits may be set concurrently by other IOThreads */
+        unsigned long *word = &s->batch_notify_vqs[j / BITS_PER_LONG];
+        unsigned long bits = atomic_xchg(word, 0);
 
         while (bits != 0) {
             unsigned i = j + ctzl(bits);
@@ -80,6 +80,58 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+/* The AioContext that processes requests from @vq */
+AioContext *virtio_blk_data_plane_get_vq_aio_context(VirtIOBlockDataPlane *s,
+                                                     VirtQueue *vq)
+{
+    return s->vq_aio_context[virtio_get_queue_index(vq)];
+}
+
+/* Resolve the iothread-vq-mapping property into @iothreads, which must have
+ * room for conf->num_iothread_vq_mapping elements.
+ *
+ * Context: QEMU global mutex held
+ */
+static bool get_iothread_vq_mapping(VirtIOBlkConf *conf, IOThread **iothreads,
+                                    Error **errp)
+{
+    unsigned i, j;
+
+    if (conf->iothread) {
+        error_setg(errp, "iothread and iothread-vq-mapping properties cannot "
+                   "be set at the same time");
+        return false;
+    }
+    if (conf->num_iothread_vq_mapping > conf->num_queues) {
+        error_setg(errp, "iothread-vq-mapping has more IOThreads (%" PRIu32
+                   ") than virtqueues (%" PRIu16 ")",
+                   conf->num_iothread_vq_mapping, conf->num_queues);
+        return false;
+    }
+
+    for (i = 0; i < conf->num_iothread_vq_mapping; i++) {
+        const char *id = conf->iothread_vq_mapping[i];
+
+        if (!id) {
+            error_setg(errp, "iothread-vq-mapping[%u] is not set", i);
+            return false;
+        }
+        iothreads[i] = iothread_by_id(id);
+        if (!iothreads[i]) {
+            error_setg(errp, "IOThread \"%s\" not found", id);
+            return false;
+        }
+        for (j = 0; j < i; j++) {
+            if (iothreads[j] == iothreads[i]) {
+                error_setg(errp, "IOThread \"%s\" is listed more than once in "
+                           "iothread-vq-mapping", id);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 /* Context: QEMU global mutex held */
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -88,10 +140,25 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    g_autofree IOThread **iothreads = NULL;
+    unsigned num_iothreads = 0;
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->num_iothread_vq_mapping) {
+        num_iothreads = conf->num_iothread_vq_mapping;
+        iothreads = g_new(IOThread *, num_iothreads);
+        if (!get_iothread_vq_mapping(conf, iothreads, errp)) {
+            return false;
+        }
+    } else if (conf->iothread) {
+        num_iothreads = 1;
+        iothreads = g_new(IOThread *, 1);
+        iothreads[0] = conf->iothread;
+    }
+
+    if (num_iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -119,14 +186,22 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
+    s->vq_aio_context = g_new(AioContext *, conf->num_queues);
 
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
-        s->ctx = iothread_get_aio_context(s->iothread);
-    } else {
-        s->ctx = qemu_get_aio_context();
+    /* Virtqueues are spread round-robin across the IOThreads.  The
+     * BlockBackend lives in the first IOThread's AioContext; requests
+     * submitted from the others are handed over to it by the block layer. */
+    for (i = 0; i < num_iothreads; i++) {
+        object_ref(OBJECT(iothreads[i]));
+    }
+    for (i = 0; i < conf->num_queues; i++) {
+        s->vq_aio_context[i] = num_iothreads ?
+            iothread_get_aio_context(iothreads[i % num_iothreads]) :
+            qemu_get_aio_context();
     }
+    s->ctx = s->vq_aio_context[0];
+    s->iothreads = g_steal_pointer(&iothreads);
+    s->num_iothreads = num_iothreads;
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
@@ -139,6 +214,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -148,9 +224,11 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     assert(!vblk->dataplane_started);
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
     }
+    g_free(s->iothreads);
+    g_free(s->vq_aio_context);
     g_free(s);
 }
 
@@ -228,14 +306,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = s->vq_aio_context[i];
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -245,19 +324,23 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     return -ENOSYS;
 }
 
-/* Stop notifications for new requests from guest.
+/* Stop notifications for new requests from guest on the virtqueues handled
+ * by the current AioContext.
  *
  * Context: BH in IOThread
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (s->vq_aio_context[i] == ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        }
     }
 }
 
@@ -284,8 +367,16 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    for (i = 0; i < MAX(s->num_iothreads, 1); i++) {
+        AioContext *ctx = s->num_iothreads ?
+            iothread_get_aio_context(s->iothreads[i]) : s->ctx;
+
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh, s);
+        aio_context_release(ctx);
+    }
+
     aio_context_acquire(s->ctx);
-    aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
     /* Drain and try to switch bs back to the QEMU main loop. If other users
      * keep the BlockBackend in the iothread, that's ok */
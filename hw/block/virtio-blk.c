@@ -72,6 +72,17 @@ static void virtio_blk_free_request(VirtIOBlockReq *req)
     g_free(req);
 }
 
+/* The AioContext whose lock protects the requests of @vq.  With an
+ * iothread-vq-mapping this may differ from the BlockBackend's AioContext,
+ * where requests complete. */
+static AioContext *virtio_blk_get_vq_aio_context(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane_started && !s->dataplane_disabled) {
+        return virtio_blk_data_plane_get_vq_aio_context(s->dataplane, vq);
+    }
+    return blk_get_aio_context(s->blk);
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlock *s = req->dev;
@@ -117,8 +128,10 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
     VirtIOBlockReq *next = opaque;
     VirtIOBlock *s = next->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    /* Merged requests all come from the same virtqueue */
+    AioContext *ctx = virtio_blk_get_vq_aio_context(s, next->vq);
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_acquire(ctx);
     while (next) {
         VirtIOBlockReq *req = next;
         next = req->mr_next;
@@ -151,15 +164,16 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
         block_acct_done(blk_get_stats(s->blk), &req->acct);
         virtio_blk_free_request(req);
     }
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
 }
 
 static void virtio_blk_flush_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *req = opaque;
     VirtIOBlock *s = req->dev;
+    AioContext *ctx = virtio_blk_get_vq_aio_context(s, req->vq);
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_acquire(ctx);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, 0, true)) {
             goto out;
@@ -171,7 +185,7 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 
 out:
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
 }
 
 static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
@@ -180,8 +194,9 @@ static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
     VirtIOBlock *s = req->dev;
     bool is_write_zeroes = (virtio_ldl_p(VIRTIO_DEVICE(s), &req->out.type) &
                             ~VIRTIO_BLK_T_BARRIER) == VIRTIO_BLK_T_WRITE_ZEROES;
+    AioContext *ctx = virtio_blk_get_vq_aio_context(s, req->vq);
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_acquire(ctx);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, false, is_write_zeroes)) {
             goto out;
@@ -195,7 +210,7 @@ static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 
 out:
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
 }
 
 #ifdef __linux__
@@ -213,6 +228,7 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
     struct virtio_scsi_inhdr *scsi;
     struct sg_io_hdr *hdr;
+    AioContext *ctx;
 
     scsi = (void *)req->elem.in_sg[req->elem.in_num - 2].iov_base;
 
@@ -242,10 +258,11 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     virtio_stl_p(vdev, &scsi->data_len, hdr->dxfer_len);
 
 out:
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    ctx = virtio_blk_get_vq_aio_context(s, req->vq);
+    aio_context_acquire(ctx);
     virtio_blk_req_complete(req, status);
     virtio_blk_free_request(req);
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
     g_free(ioctl_req);
 }
 
@@ -766,9 +783,14 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     MultiReqBuffer mrb = {};
     bool suppress_notifications = virtio_queue_get_notification(vq);
     bool progress = false;
+    AioContext *ctx = virtio_blk_get_vq_aio_context(s, vq);
+    /* Plugging is only possible from the BlockBackend's AioContext */
+    bool plug = ctx == blk_get_aio_context(s->blk);
 
-    aio_context_acquire(blk_get_aio_context(s->blk));
-    blk_io_plug(s->blk);
+    aio_context_acquire(ctx);
+    if (plug) {
+        blk_io_plug(s->blk);
+    }
 
     do {
         if (suppress_notifications) {
@@ -793,8 +815,10 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
         virtio_blk_submit_multireq(s->blk, &mrb);
     }
 
-    blk_io_unplug(s->blk);
-    aio_context_release(blk_get_aio_context(s->blk));
+    if (plug) {
+        blk_io_unplug(s->blk);
+    }
+    aio_context_release(ctx);
     return progress;
 }
 
@@ -1279,6 +1303,9 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BOOL("seg-max-adjust", VirtIOBlock, conf.seg_max_adjust, true),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_ARRAY("iothread-vq-mapping", VirtIOBlock,
+                      conf.num_iothread_vq_mapping, conf.iothread_vq_mapping,
+                      qdev_prop_string, char *),
     DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_DISCARD, true),
     DEFINE_PROP_BIT64("write-zeroes", VirtIOBlock, host_features,
@@ -42,6 +42,7 @@
 #include "trace.h"
 #include "monitor/qdev.h"
 #include "hw/pci/pci.h"
+#include "net_rx_pkt.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -85,6 +86,16 @@
 
 #endif
 
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)
+
 static inline __virtio16 *virtio_net_rsc_ext_num_packets(
     struct virtio_net_hdr *hdr)
 {
@@ -108,6 +119,8 @@ static VirtIOFeature feature_sizes[] = {
      .end = endof(struct virtio_net_config, mtu)},
     {.flags = 1ULL << VIRTIO_NET_F_SPEED_DUPLEX,
      .end = endof(struct virtio_net_config, duplex)},
+    {.flags = (1ULL << VIRTIO_NET_F_RSS) | (1ULL << VIRTIO_NET_F_HASH_REPORT),
+     .end = endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
@@ -138,6 +151,11 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
     virtio_stl_p(vdev, &netcfg.speed, n->net_conf.speed);
     netcfg.duplex = n->net_conf.duplex;
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
@@ -496,6 +514,14 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+static void virtio_net_disable_rss(VirtIONet *n)
+{
+    if (n->rss_data.enabled) {
+        trace_virtio_net_rss_disable();
+    }
+    n->rss_data.enabled = false;
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -523,6 +549,7 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+    virtio_net_disable_rss(n);
 
     /* Flush any async TX */
     for (i = 0;  i < n->max_queues; i++) {
@@ -561,14 +588,17 @@ static int peer_has_ufo(VirtIONet *n)
 }
 
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
     int i;
     NetClientState *nc;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
+    n->rss_data.populate_hash = !!hash_report;
 
-    if (version_1) {
+    if (hash_report) {
+        n->guest_hdr_len = sizeof(struct virtio_net_hdr_v1_hash);
+    } else if (version_1) {
         n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
@@ -697,10 +727,18 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_UFO);
     }
 
+    /* The header with the hash report only exists in the modern format */
+    if (!virtio_has_feature(features, VIRTIO_F_VERSION_1)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+    }
+
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
 
+    /* Steering and hashing are done by virtio_net_receive_rcu() */
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
     features = vhost_net_get_features(get_vhost_net(nc->peer), features);
     vdev->backend_features = features;
 
@@ -860,13 +898,16 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
     }
 
     virtio_net_set_multiqueue(n,
+                              virtio_has_feature(features, VIRTIO_NET_F_RSS) ||
                               virtio_has_feature(features, VIRTIO_NET_F_MQ));
 
     virtio_net_set_mrg_rx_bufs(n,
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_MRG_RXBUF),
                                virtio_has_feature(features,
-                                                  VIRTIO_F_VERSION_1));
+                                                  VIRTIO_F_VERSION_1),
+                               virtio_has_feature(features,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
     n->rsc4_enabled = virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT) &&
         virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO4);
@@ -1136,6 +1177,133 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/*
+ * Parse a VIRTIO_NET_CTRL_MQ_RSS_CONFIG (@do_rss) or
+ * VIRTIO_NET_CTRL_MQ_HASH_CONFIG command.  The latter has the same layout
+ * with the indirection table, unclassified queue and queue count replaced
+ * by reserved fields.
+ *
+ * Returns: the number of queue pairs to use, 0 on error.
+ */
+static uint16_t virtio_net_handle_rss(VirtIONet *n, struct iovec *iov,
+                                      unsigned int iov_cnt, bool do_rss)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRssData *rss = &n->rss_data;
+    struct virtio_net_rss_config cfg;
+    size_t s, offset = 0, size_get;
+    uint16_t queues, i;
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED temp;
+    const char *err_msg = "";
+    uint32_t err_value = 0;
+
+    if (do_rss && !virtio_vdev_has_feature(vdev, VIRTIO_NET_F_RSS)) {
+        err_msg = "RSS is not negotiated";
+        goto error;
+    }
+    if (!do_rss && !virtio_vdev_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+        err_msg = "Hash report is not negotiated";
+        goto error;
+    }
+
+    size_get = offsetof(struct virtio_net_rss_config, indirection_table);
+    s = iov_to_buf(iov, iov_cnt, offset, &cfg, size_get);
+    if (s != size_get) {
+        err_msg = "Short command buffer";
+        err_value = (uint32_t)s;
+        goto error;
+    }
+    rss->hash_types = virtio_ldl_p(vdev, &cfg.hash_types);
+    rss->indirections_len = do_rss ?
+        virtio_lduw_p(vdev, &cfg.indirection_table_mask) + 1 : 1;
+    if (!is_power_of_2(rss->indirections_len) ||
+        rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN) {
+        err_msg = "Invalid size of indirection table";
+        err_value = rss->indirections_len;
+        goto error;
+    }
+    rss->default_queue = do_rss ?
+        virtio_lduw_p(vdev, &cfg.unclassified_queue) : 0;
+    if (rss->default_queue >= n->max_queues) {
+        err_msg = "Invalid default queue";
+        err_value = rss->default_queue;
+        goto error;
+    }
+    offset += size_get;
+
+    size_get = sizeof(uint16_t) * rss->indirections_len;
+    s = iov_to_buf(iov, iov_cnt, offset, rss->indirections_table, size_get);
+    if (s != size_get) {
+        err_msg = "Short indirection table buffer";
+        err_value = (uint32_t)s;
+        goto error;
+    }
+    offset += size_get;
+
+    size_get = sizeof(temp);
+    s = iov_to_buf(iov, iov_cnt, offset, &temp, size_get);
+    if (s != size_get) {
+        err_msg = "Can't get queues";
+        err_value = (uint32_t)s;
+        goto error;
+    }
+    queues = do_rss ? virtio_lduw_p(vdev, &temp.max_tx_vq) : n->curr_queues;
+    if (queues == 0 || queues > n->max_queues) {
+        err_msg = "Invalid number of queues";
+        err_value = queues;
+        goto error;
+    }
+
+    for (i = 0; i < rss->indirections_len; i++) {
+        uint16_t val = virtio_lduw_p(vdev, &rss->indirections_table[i]);
+
+        if (do_rss && val >= queues) {
+            err_msg = "Invalid queue in indirection table";
+            err_value = val;
+            goto error;
+        }
+        rss->indirections_table[i] = do_rss ? val : 0;
+    }
+
+    if (temp.hash_key_length > VIRTIO_NET_RSS_MAX_KEY_SIZE) {
+        err_msg = "Invalid key size";
+        err_value = temp.hash_key_length;
+        goto error;
+    }
+    if (!temp.hash_key_length && rss->hash_types) {
+        err_msg = "No key provided";
+        goto error;
+    }
+    if (!temp.hash_key_length && !rss->hash_types) {
+        virtio_net_disable_rss(n);
+        return queues;
+    }
+    offset += size_get;
+
+    size_get = temp.hash_key_length;
+    memset(rss->key, 0, sizeof(rss->key));
+    s = iov_to_buf(iov, iov_cnt, offset, rss->key, size_get);
+    if (s != size_get) {
+        err_msg = "Can't get key buffer";
+        err_value = (uint32_t)s;
+        goto error;
+    }
+
+    rss->enabled = true;
+    rss->redirect = do_rss;
+    trace_virtio_net_rss_enable(rss->hash_types, rss->indirections_len,
+                                temp.hash_key_length);
+    return queues;
+
+error:
+    trace_virtio_net_rss_error(err_msg, err_value);
+    virtio_net_disable_rss(n);
+    return 0;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -1144,17 +1312,25 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
-    s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
-    if (s != sizeof(mq)) {
-        return VIRTIO_NET_ERR;
+    if (cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        /* Only configures hash reporting, the queues stay as they are */
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, false);
+        return queues ? VIRTIO_NET_OK : VIRTIO_NET_ERR;
     }
 
-    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, true);
+    } else if (cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
+        if (s != sizeof(mq)) {
+            return VIRTIO_NET_ERR;
+        }
+        queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
+        virtio_net_disable_rss(n);
+    } else {
         return VIRTIO_NET_ERR;
     }
 
-    queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
-
     if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
         queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
         queues > n->max_queues ||
@@ -1230,6 +1406,18 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    int i;
+
+    if (n->rss_data.enabled && n->rss_data.redirect) {
+        /*
+         * Packets steered to this queue may have been held back by the
+         * subqueue they arrived on.
+         */
+        for (i = 0; i < n->curr_queues; i++) {
+            qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+        }
+        return;
+    }
 
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
@@ -1387,21 +1575,115 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
+static int virtio_net_get_hash_type(bool isip4, bool isip6, bool isudp,
+                                    bool istcp, uint32_t types)
+{
+    uint32_t mask;
+
+    if (isip4) {
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+            return NetPktRssIpV4Tcp;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+            return NetPktRssIpV4Udp;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv4) {
+            return NetPktRssIpV4;
+        }
+    } else if (isip6) {
+        mask = VIRTIO_NET_RSS_HASH_TYPE_TCP_EX | VIRTIO_NET_RSS_HASH_TYPE_TCPv6;
+        if (istcp && (types & mask)) {
+            return (types & VIRTIO_NET_RSS_HASH_TYPE_TCP_EX) ?
+                NetPktRssIpV6TcpEx : NetPktRssIpV6Tcp;
+        }
+        mask = VIRTIO_NET_RSS_HASH_TYPE_UDP_EX | VIRTIO_NET_RSS_HASH_TYPE_UDPv6;
+        if (isudp && (types & mask)) {
+            return (types & VIRTIO_NET_RSS_HASH_TYPE_UDP_EX) ?
+                NetPktRssIpV6UdpEx : NetPktRssIpV6Udp;
+        }
+        mask = VIRTIO_NET_RSS_HASH_TYPE_IP_EX | VIRTIO_NET_RSS_HASH_TYPE_IPv6;
+        if (types & mask) {
+            return (types & VIRTIO_NET_RSS_HASH_TYPE_IP_EX) ?
+                NetPktRssIpV6Ex : NetPktRssIpV6;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Calculate the Toeplitz hash of a received packet as configured by the
+ * guest.  Returns the queue the packet should be steered to, or -1 if it
+ * stays on the queue it arrived on.
+ */
+static int virtio_net_process_rss(VirtIONet *n, const uint8_t *buf,
+                                  size_t size, uint32_t *hash_value,
+                                  uint16_t *hash_report)
+{
+    static const uint16_t reports[NetPktRssIpV6UdpEx + 1] = {
+        [NetPktRssIpV4]      = VIRTIO_NET_HASH_REPORT_IPv4,
+        [NetPktRssIpV4Tcp]   = VIRTIO_NET_HASH_REPORT_TCPv4,
+        [NetPktRssIpV6Tcp]   = VIRTIO_NET_HASH_REPORT_TCPv6,
+        [NetPktRssIpV6]      = VIRTIO_NET_HASH_REPORT_IPv6,
+        [NetPktRssIpV6Ex]    = VIRTIO_NET_HASH_REPORT_IPv6_EX,
+        [NetPktRssIpV6TcpEx] = VIRTIO_NET_HASH_REPORT_TCPv6_EX,
+        [NetPktRssIpV4Udp]   = VIRTIO_NET_HASH_REPORT_UDPv4,
+        [NetPktRssIpV6Udp]   = VIRTIO_NET_HASH_REPORT_UDPv6,
+        [NetPktRssIpV6UdpEx] = VIRTIO_NET_HASH_REPORT_UDPv6_EX,
+    };
+    VirtioNetRssData *rss = &n->rss_data;
+    struct NetRxPkt *pkt = n->rx_pkt;
+    bool isip4, isip6, isudp, istcp;
+    int hash_type;
+
+    net_rx_pkt_set_protocols(pkt, buf + n->host_hdr_len,
+                             size - n->host_hdr_len);
+    net_rx_pkt_get_protocols(pkt, &isip4, &isip6, &isudp, &istcp);
+    hash_type = virtio_net_get_hash_type(isip4, isip6, isudp, istcp,
+                                         rss->hash_types);
+    if (hash_type < 0) {
+        return rss->redirect ? rss->default_queue : -1;
+    }
+
+    *hash_value = net_rx_pkt_calc_rss_hash(pkt, hash_type, rss->key);
+    *hash_report = reports[hash_type];
+
+    if (!rss->redirect) {
+        return -1;
+    }
+    return rss->indirections_table[*hash_value &
+                                   (rss->indirections_len - 1)];
+}
+
 static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                                       size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
-    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIONetQueue *q;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
     struct virtio_net_hdr_mrg_rxbuf mhdr;
     unsigned mhdr_cnt = 0;
     size_t offset, i, guest_offset;
+    uint32_t hash_value = 0;
+    uint16_t hash_report = VIRTIO_NET_HASH_REPORT_NONE;
 
     if (!virtio_net_can_receive(nc)) {
         return -1;
     }
 
+    if (n->rss_data.enabled) {
+        int index = virtio_net_process_rss(n, buf, size, &hash_value,
+                                           &hash_report);
+
+        if (index >= 0 && index != nc->queue_index) {
+            nc = qemu_get_subqueue(n->nic, index);
+            if (!virtio_net_can_receive(nc)) {
+                return -1;
+            }
+        }
+    }
+    q = virtio_net_get_subqueue(nc);
+
     /* hdr_len refers to the header we supply to the guest */
     if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
         return 0;
@@ -1452,6 +1734,17 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             }
 
             receive_header(n, sg, elem->in_num, buf, size);
+            if (n->rss_data.populate_hash) {
+                struct virtio_net_hdr_v1_hash hdr;
+
+                virtio_stl_p(vdev, &hdr.hash_value, hash_value);
+                virtio_stw_p(vdev, &hdr.hash_report, hash_report);
+                hdr.padding = 0;
+                iov_from_buf(sg, elem->in_num,
+                             offsetof(typeof(hdr), hash_value),
+                             &hdr.hash_value,
+                             sizeof(hdr) - offsetof(typeof(hdr), hash_value));
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -2444,7 +2737,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
     trace_virtio_net_post_load_device();
     virtio_net_set_mrg_rx_bufs(n, n->mergeable_rx_bufs,
                                virtio_vdev_has_feature(vdev,
-                                                       VIRTIO_F_VERSION_1));
+                                                       VIRTIO_F_VERSION_1),
+                               virtio_vdev_has_feature(vdev,
+                                                VIRTIO_NET_F_HASH_REPORT));
 
     /* MAC_TABLE_ENTRIES may be different from the saved image */
     if (n->mac_table.in_use > MAC_TABLE_ENTRIES) {
@@ -2670,6 +2965,50 @@ static const VMStateDescription vmstate_virtio_net_has_vnet = {
     },
 };
 
+static bool virtio_net_rss_needed(void *opaque)
+{
+    return VIRTIO_NET(opaque)->rss_data.enabled;
+}
+
+static int virtio_net_rss_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+    VirtioNetRssData *rss = &n->rss_data;
+    int i;
+
+    if (!is_power_of_2(rss->indirections_len) ||
+        rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        rss->default_queue >= n->max_queues) {
+        return -EINVAL;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        if (rss->indirections_table[i] >= n->max_queues) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net_rss = {
+    .name = "virtio-net-device/rss",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_net_rss_needed,
+    .post_load = virtio_net_rss_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rss_data.enabled, VirtIONet),
+        VMSTATE_BOOL(rss_data.redirect, VirtIONet),
+        VMSTATE_UINT32(rss_data.hash_types, VirtIONet),
+        VMSTATE_UINT8_ARRAY(rss_data.key, VirtIONet,
+                            VIRTIO_NET_RSS_MAX_KEY_SIZE),
+        VMSTATE_UINT16(rss_data.indirections_len, VirtIONet),
+        VMSTATE_UINT16_ARRAY(rss_data.indirections_table, VirtIONet,
+                             VIRTIO_NET_RSS_MAX_TABLE_LEN),
+        VMSTATE_UINT16(rss_data.default_queue, VirtIONet),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_virtio_net_device = {
     .name = "virtio-net-device",
     .version_id = VIRTIO_NET_VM_VERSION,
@@ -2720,6 +3059,10 @@ static const VMStateDescription vmstate_virtio_net_device = {
                             has_ctrl_guest_offloads),
         VMSTATE_END_OF_LIST()
    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_virtio_net_rss,
+        NULL
+    }
 };
 
 static NetClientInfo net_virtio_info = {
@@ -3063,7 +3406,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
@@ -3075,6 +3418,8 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     QTAILQ_INIT(&n->rsc_chains);
     n->qdev = dev;
+
+    net_rx_pkt_init(&n->rx_pkt, false);
 }
 
 static void virtio_net_device_unrealize(DeviceState *dev)
@@ -3111,6 +3456,7 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     g_free(n->vqs);
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
+    net_rx_pkt_uninit(n->rx_pkt);
     virtio_cleanup(vdev);
 }
 
@@ -3212,6 +3558,10 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
     DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                    VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                    VIRTIO_NET_F_HASH_REPORT, false),
     DEFINE_PROP_BIT64("guest_rsc_ext", VirtIONet, host_features,
                     VIRTIO_NET_F_RSC_EXT, false),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
@@ -17,6 +17,7 @@
 #include "qapi/error.h"
 #include "hw/virtio/vhost.h"
 #include "qemu/atomic.h"
+#include "qemu/cutils.h"
 #include "qemu/range.h"
 #include "qemu/error-report.h"
 #include "qemu/memfd.h"
@@ -60,6 +61,13 @@ bool vhost_has_free_slot(void)
     return slots_limit > used_memslots;
 }
 
+/*
+ * Number of log chunks checked at once for dirty bits: clean stretches of
+ * this size (16MB of guest memory with 64-bit chunks) are skipped with a
+ * single buffer_is_zero() call, which uses vector instructions.
+ */
+#define VHOST_LOG_SCAN_CHUNKS 64
+
 static void vhost_dev_sync_region(struct vhost_dev *dev,
                                   MemoryRegionSection *section,
                                   uint64_t mfirst, uint64_t mlast,
@@ -79,29 +87,45 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     assert(end / VHOST_LOG_CHUNK < dev->log_size);
     assert(start / VHOST_LOG_CHUNK < dev->log_size);
 
-    for (;from < to; ++from) {
-        vhost_log_chunk_t log;
+    while (from < to) {
+        vhost_log_chunk_t *next = from + MIN(to - from, VHOST_LOG_SCAN_CHUNKS);
+
         /* We first check with non-atomic: much cheaper,
          * and we expect non-dirty to be the common case. */
-        if (!*from) {
-            addr += VHOST_LOG_CHUNK;
+        if (buffer_is_zero(from, (next - from) * sizeof(*from))) {
+            addr += (next - from) * VHOST_LOG_CHUNK;
+            from = next;
             continue;
         }
-        /* Data must be read atomically. We don't really need barrier semantics
-         * but it's easier to use atomic_* than roll our own. */
-        log = atomic_xchg(from, 0);
-        while (log) {
-            int bit = ctzl(log);
-            hwaddr page_addr;
-            hwaddr section_offset;
-            hwaddr mr_offset;
-            page_addr = addr + bit * VHOST_LOG_PAGE;
-            section_offset = page_addr - section->offset_within_address_space;
-            mr_offset = section_offset + section->offset_within_region;
-            memory_region_set_dirty(section->mr, mr_offset, VHOST_LOG_PAGE);
-            log &= ~(0x1ull << bit);
+
+        for (; from < next; ++from, addr += VHOST_LOG_CHUNK) {
+            vhost_log_chunk_t log;
+
+            if (!*from) {
+                continue;
+            }
+            /* Data must be read atomically. We don't really need barrier
+             * semantics but it's easier to use atomic_* than roll our own. */
+            log = atomic_xchg(from, 0);
+            /* Mark runs of dirty pages at once */
+            while (log) {
+                int bit = ctzl(log);
+                int pages = ctzl(~(log >> bit));
+                hwaddr page_addr;
+                hwaddr section_offset;
+                hwaddr mr_offset;
+                page_addr = addr + bit * VHOST_LOG_PAGE;
+                section_offset = page_addr -
+                                 section->offset_within_address_space;
+                mr_offset = section_offset + section->offset_within_region;
+                memory_region_set_dirty(section->mr, mr_offset,
+                                        pages * VHOST_LOG_PAGE);
+                if (bit + pages == VHOST_LOG_BITS) {
+                    break;
+                }
+                log &= ~0UL << (bit + pages);
+            }
         }
-        addr += VHOST_LOG_CHUNK;
     }
 }
 
@@ -110,6 +134,7 @@ static int vhost_sync_dirty_bitmap(struct vhost_dev *dev,
                                    hwaddr first,
                                    hwaddr last)
 {
+    struct vhost_dev *logdev;
     int i;
     hwaddr start_addr;
     hwaddr end_addr;
@@ -129,15 +154,20 @@ static int vhost_sync_dirty_bitmap(struct vhost_dev *dev,
                               range_get_last(reg->guest_phys_addr,
                                              reg->memory_size));
     }
-    for (i = 0; i < dev->nvqs; ++i) {
-        struct vhost_virtqueue *vq = dev->vqs + i;
+    /* Also cover the rings of the devices this one harvests the log for */
+    QLIST_FOREACH(logdev, &dev->log->devs, log_entry) {
+        for (i = 0; i < logdev->nvqs; ++i) {
+            struct vhost_virtqueue *vq = logdev->vqs + i;
 
-        if (!vq->used_phys && !vq->used_size) {
-            continue;
-        }
+            if (!vq->used_phys && !vq->used_size) {
+                continue;
+            }
 
-        vhost_dev_sync_region(dev, section, start_addr, end_addr, vq->used_phys,
-                              range_get_last(vq->used_phys, vq->used_size));
+            vhost_dev_sync_region(dev, section, start_addr, end_addr,
+                                  vq->used_phys,
+                                  range_get_last(vq->used_phys,
+                                                 vq->used_size));
+        }
     }
     return 0;
 }
@@ -147,6 +177,24 @@ static void vhost_log_sync(MemoryListener *listener,
 {
     struct vhost_dev *dev = container_of(listener, struct vhost_dev,
                                          memory_listener);
+    struct vhost_dev *logdev;
+
+    /*
+     * All devices sharing a log write to it, and syncing clears what it
+     * reads, so the first logging device syncs for the others instead of
+     * each of them scanning the same log again.  They all map the same
+     * sections.
+     */
+    if (dev->log) {
+        QLIST_FOREACH(logdev, &dev->log->devs, log_entry) {
+            if (logdev->log_enabled && logdev->started) {
+                break;
+            }
+        }
+        if (logdev != dev) {
+            return;
+        }
+    }
     vhost_sync_dirty_bitmap(dev, section, 0x0, ~0x0ULL);
 }
 
@@ -209,6 +257,7 @@ static struct vhost_log *vhost_log_alloc(uint64_t size, bool share)
     log->size = size;
     log->refcnt = 1;
     log->fd = fd;
+    QLIST_INIT(&log->devs);
 
     return log;
 }
@@ -256,6 +305,8 @@ static void vhost_log_put(struct vhost_dev *dev, bool sync)
         }
 
         g_free(log);
+    } else {
+        QLIST_REMOVE(dev, log_entry);
     }
 
     dev->log = NULL;
@@ -284,6 +335,7 @@ static inline void vhost_dev_log_resize(struct vhost_dev *dev, uint64_t size)
     vhost_log_put(dev, true);
     dev->log = log;
     dev->log_size = size;
+    QLIST_INSERT_HEAD(&log->devs, dev, log_entry);
 }
 
 static int vhost_dev_has_iommu(struct vhost_dev *dev)
@@ -1650,6 +1702,7 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
         hdev->log_size = vhost_get_log_size(hdev);
         hdev->log = vhost_log_get(hdev->log_size,
                                   vhost_dev_log_is_shared(hdev));
+        QLIST_INSERT_HEAD(&hdev->log->devs, hdev, log_entry);
         log_base = (uintptr_t)hdev->log->log;
         r = hdev->vhost_ops->vhost_set_log_base(hdev,
                                                 hdev->log_size ? log_base : 0,
@@ -103,8 +103,39 @@ typedef struct {
      * Returns: true if ->wait() should be called, false otherwise.
      */
     bool (*need_wait)(AioContext *ctx);
+
+    /*
+     * dispatch:
+     * @ctx: the AioContext
+     *
+     * Run completion callbacks for events collected by ->wait() that are
+     * not tied to an AioHandler.  Optional.
+     *
+     * Called with ctx->list_lock incremented but not locked.
+     *
+     * Returns: true if progress was made, false otherwise.
+     */
+    bool (*dispatch)(AioContext *ctx);
 } FDMonOps;
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * A request submitted with aio_add_sqe() on the io_uring that the AioContext
+ * uses for file descriptor monitoring.
+ */
+typedef struct CqeHandler CqeHandler;
+struct CqeHandler {
+    /* Called in the AioContext home thread once the request has completed */
+    void (*cb)(CqeHandler *handler);
+
+    /* The completion queue entry, filled in before @cb is called */
+    struct io_uring_cqe cqe;
+
+    QSIMPLEQ_ENTRY(CqeHandler) next;
+};
+typedef QSIMPLEQ_HEAD(, CqeHandler) CqeHandlerSimpleQ;
+#endif
+
 /*
  * Each aio_bh_poll() call carves off a slice of the BH list, so that newly
  * scheduled BHs are not processed until the next aio_bh_poll() call.  All
@@ -213,6 +244,25 @@ struct AioContext {
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
+
+    /*
+     * Handlers for external file descriptors that became ready while
+     * external clients were disabled.  They are dispatched and re-armed
+     * when external clients are enabled again.  Only used by the
+     * AioContext home thread.
+     */
+    AioHandlerList io_uring_parked_handlers;
+
+    /* Completed aio_add_sqe() requests waiting for their callback */
+    CqeHandlerSimpleQ cqe_handler_ready_list;
+
+    /*
+     * Files registered with fdmon_io_uring, indexed by their slot in the
+     * registered file table.  Unused slots contain -1.  NULL if the kernel
+     * does not support registered files.
+     */
+    QemuMutex io_uring_fixed_files_lock;
+    int *io_uring_fixed_files;
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -491,6 +541,49 @@ struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+#ifdef CONFIG_LINUX_IO_URING
+/**
+ * aio_has_io_uring:
+ * @ctx: the AioContext
+ *
+ * Returns: true if @ctx monitors file descriptors with io_uring, so that
+ * aio_add_sqe() can be used.
+ */
+bool aio_has_io_uring(AioContext *ctx);
+
+/**
+ * aio_add_sqe:
+ * @ctx: the AioContext, which must be the current thread's home AioContext
+ * @prep_sqe: function that fills in the sqe
+ * @opaque: argument for @prep_sqe
+ * @cqe_handler: called when the request completes
+ *
+ * Queue a request on the io_uring that @ctx uses for file descriptor
+ * monitoring.  The sqe is submitted together with the next wait for
+ * events, so no extra system call is needed.  @prep_sqe must not set the
+ * sqe's user_data field.
+ */
+void aio_add_sqe(AioContext *ctx,
+                 void (*prep_sqe)(struct io_uring_sqe *sqe, void *opaque),
+                 void *opaque, CqeHandler *cqe_handler);
+
+/**
+ * aio_register_fixed_file:
+ * @ctx: the AioContext
+ * @fd: file descriptor to register
+ *
+ * Register @fd in the registered file table of @ctx's io_uring.  @fd must
+ * be unregistered with aio_unregister_fixed_file() before it is closed.
+ *
+ * Returns: the index of @fd in the table, or a negative errno value if it
+ * could not be registered.
+ */
+int aio_register_fixed_file(AioContext *ctx, int fd);
+
+/* Remove @fd from the registered file table of @ctx's io_uring */
+void aio_unregister_fixed_file(AioContext *ctx, int fd);
+#endif
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -58,9 +58,14 @@
 #define BLOCK_OPT_DATA_FILE         "data_file"
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
 #define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
+/* Number of written ranges that are batched before the dirty bitmaps are
+ * updated */
+#define BDRV_DIRTY_PENDING_MAX      32
+
 enum BdrvTrackedRequestType {
     BDRV_TRACKED_READ,
     BDRV_TRACKED_WRITE,
@@ -904,9 +909,20 @@ struct BlockDriverState {
      * Reading from the list can be done with either the BQL or the
      * dirty_bitmap_mutex.  Modifying a bitmap only requires
      * dirty_bitmap_mutex.  */
-    QemuMutex dirty_bitmap_mutex;
+    QemuRecMutex dirty_bitmap_mutex;
     QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
 
+    /* Ranges written since the dirty bitmaps were last updated.  They are
+     * applied to the enabled bitmaps whenever dirty_bitmap_mutex is taken,
+     * so that a write costs the same no matter how many bitmaps there are.
+     * Protected by dirty_pending_lock.  */
+    QemuSpin dirty_pending_lock;
+    int dirty_pending_count;
+    struct {
+        int64_t offset;
+        int64_t bytes;
+    } dirty_pending[BDRV_DIRTY_PENDING_MAX];
+
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
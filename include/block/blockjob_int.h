@@ -52,6 +52,12 @@ struct BlockJobDriver {
      * besides job->blk to the new AioContext.
      */
     void (*attached_aio_context)(BlockJob *job, AioContext *new_context);
+
+    /*
+     * If the callback is not NULL, it is invoked by block_job_query() to
+     * fill in the fields of @info that are specific to the job type.
+     */
+    void (*query)(BlockJob *job, BlockJobInfo *info);
 };
 
 /**
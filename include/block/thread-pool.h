@@ -20,6 +20,9 @@
 
 #include "block/block.h"
 
+/* Maximum number of worker threads for each host NUMA node */
+#define THREAD_POOL_MAX_WORKERS 64
+
 typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
@@ -34,4 +37,21 @@ int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg);
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 
+typedef struct ThreadPoolNodeStats {
+    int node;
+    int workers;
+    int max_workers;
+    uint64_t queue_depth;
+    uint64_t requests;
+    uint64_t steals;
+    uint64_t wait_ns;
+} ThreadPoolNodeStats;
+
+/* Fill in a newly allocated array with the statistics of each host NUMA
+ * node's workers, and return the number of nodes.  The caller must free
+ * the array with g_free().  */
+int thread_pool_get_stats(ThreadPoolNodeStats **stats);
+void thread_pool_set_max_workers(int max_workers);
+void thread_pool_set_pin_workers(bool pin_workers);
+
 #endif
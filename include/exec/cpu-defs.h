@@ -186,6 +186,35 @@ typedef struct CPUTLBDescFast {
     CPUTLBEntry *table;
 } CPUTLBDescFast QEMU_ALIGNED(2 * sizeof(void *));
 
+/*
+ * A range flush requested by another vCPU: all pages in [addr, addr + len)
+ * of the MMU indexes in idxmap, where only the low @bits of the virtual
+ * address are significant when matching entries.
+ */
+typedef struct CPUTLBFlushRange {
+    target_ulong addr;
+    target_ulong len;
+    uint16_t idxmap;
+    uint16_t bits;
+} CPUTLBFlushRange;
+
+/* Number of disjoint ranges that can be batched before a full flush */
+#define CPU_TLB_PENDING_RANGES 16
+
+/*
+ * Flushes requested by other vCPUs that have not been processed yet.
+ * Requests are merged here so that a burst of remote flushes only
+ * queues a single work item on the target vCPU.
+ */
+typedef struct CPUTLBPendingFlush {
+    /* A work item that will process this batch has been queued. */
+    bool queued;
+    /* MMU indexes that must be flushed completely. */
+    uint16_t full;
+    unsigned n_ranges;
+    CPUTLBFlushRange range[CPU_TLB_PENDING_RANGES];
+} CPUTLBPendingFlush;
+
 /*
  * Data elements that are shared between all MMU modes.
  */
@@ -198,6 +227,8 @@ typedef struct CPUTLBCommon {
      * Protected by tlb_c.lock.
      */
     uint16_t dirty;
+    /* Flushes queued by other vCPUs.  Protected by tlb_c.lock. */
+    CPUTLBPendingFlush pending;
     /*
      * Statistics.  These are not lock protected, but are read and
      * written atomically.  This allows the monitor to print a snapshot
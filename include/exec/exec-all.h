@@ -246,6 +246,63 @@ void tlb_flush_by_mmuidx_all_cpus(CPUState *cpu, uint16_t idxmap);
  * depend on when the guests translation ends the TB.
  */
 void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *cpu, uint16_t idxmap);
+/**
+ * tlb_flush_range_by_mmuidx:
+ * @cpu: CPU whose TLB should be flushed
+ * @addr: virtual address of the start of the range to be flushed
+ * @len: length of range to be flushed
+ * @idxmap: bitmap of MMU indexes to flush
+ * @bits: number of significant bits in address
+ *
+ * Similar to tlb_flush_page_by_mmuidx, but flush all pages within the
+ * range [@addr, @addr + @len), and only compare the low @bits of the
+ * virtual address when looking for matching entries.  Flushes requested
+ * for other vCPUs are batched, so that a large shootdown only queues
+ * one work item on each of them.
+ */
+void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                               target_ulong len, uint16_t idxmap,
+                               unsigned bits);
+/**
+ * tlb_flush_range_by_mmuidx_all_cpus:
+ * @cpu: Originating CPU of the flush
+ * @addr: virtual address of the start of the range to be flushed
+ * @len: length of range to be flushed
+ * @idxmap: bitmap of MMU indexes to flush
+ * @bits: number of significant bits in address
+ *
+ * Like tlb_flush_range_by_mmuidx, but for the TLBs of all CPUs.
+ */
+void tlb_flush_range_by_mmuidx_all_cpus(CPUState *cpu, target_ulong addr,
+                                        target_ulong len, uint16_t idxmap,
+                                        unsigned bits);
+/**
+ * tlb_flush_range_by_mmuidx_all_cpus_synced:
+ * @cpu: Originating CPU of the flush
+ * @addr: virtual address of the start of the range to be flushed
+ * @len: length of range to be flushed
+ * @idxmap: bitmap of MMU indexes to flush
+ * @bits: number of significant bits in address
+ *
+ * Like tlb_flush_range_by_mmuidx_all_cpus except the source vCPUs work
+ * is scheduled as safe work meaning all flushes will be complete once
+ * the source vCPUs safe work is complete.
+ */
+void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *cpu,
+                                               target_ulong addr,
+                                               target_ulong len,
+                                               uint16_t idxmap,
+                                               unsigned bits);
+/**
+ * tlb_flush_range:
+ * @cpu: CPU whose TLB should be flushed
+ * @addr: virtual address of the start of the range to be flushed
+ * @len: length of range to be flushed
+ *
+ * Flush the pages within [@addr, @addr + @len) from the TLB of the
+ * specified CPU, for all MMU indexes.
+ */
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len);
 /**
  * tlb_set_page_with_attrs:
  * @cpu: CPU to add this TLB entry for
@@ -329,6 +386,29 @@ static inline void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *cpu,
                                                        uint16_t idxmap)
 {
 }
+static inline void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                                             target_ulong len, uint16_t idxmap,
+                                             unsigned bits)
+{
+}
+static inline void tlb_flush_range_by_mmuidx_all_cpus(CPUState *cpu,
+                                                      target_ulong addr,
+                                                      target_ulong len,
+                                                      uint16_t idxmap,
+                                                      unsigned bits)
+{
+}
+static inline void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *cpu,
+                                                             target_ulong addr,
+                                                             target_ulong len,
+                                                             uint16_t idxmap,
+                                                             unsigned bits)
+{
+}
+static inline void tlb_flush_range(CPUState *cpu, target_ulong addr,
+                                   target_ulong len)
+{
+}
 #endif
 /**
  * probe_access:
@@ -27,6 +27,7 @@
 #include "qemu/notify.h"
 #include "qom/object.h"
 #include "qemu/rcu.h"
+#include "qemu/stats64.h"
 
 #define RAM_ADDR_INVALID (~(ram_addr_t)0)
 
@@ -404,6 +405,11 @@ struct MemoryRegion {
     const char *name;
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
+
+    /* Used by memory_region_transaction_commit() to skip unchanged views */
+    unsigned render_dirty_gen;
+    unsigned render_check_gen;
+    bool render_check_dirty;
 };
 
 struct IOMMUMemoryRegion {
@@ -533,6 +539,18 @@ struct MemoryListener {
      */
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
 
+    /**
+     * @log_sync_global:
+     *
+     * This is the global version of @log_sync when the listener does
+     * not have a way to synchronize the log with finer granularity.
+     * When the listener registers with @log_sync_global defined, then
+     * its @log_sync must be NULL.  Vice versa.
+     *
+     * @listener: The #MemoryListener.
+     */
+    void (*log_sync_global)(MemoryListener *listener);
+
     /**
      * @log_clear:
      *
@@ -657,6 +675,9 @@ struct MemoryListener {
 /**
  * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
+/* Default budget for the bounce buffers of an #AddressSpace, in bytes */
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE 4096
+
 struct AddressSpace {
     /* private: */
     struct rcu_head rcu;
@@ -670,6 +691,20 @@ struct AddressSpace {
     struct MemoryRegionIoeventfd *ioeventfds;
     QTAILQ_HEAD(, MemoryListener) listeners;
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
+
+    /*
+     * Bounce buffers handed out by address_space_map() for memory that
+     * cannot be accessed directly, and clients waiting for them.  Protected
+     * by bounce_lock.  bounce_buffer_size never exceeds
+     * max_bounce_buffer_size.
+     */
+    QemuMutex bounce_lock;
+    size_t bounce_buffer_size;
+    size_t max_bounce_buffer_size;
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    QLIST_HEAD(, AddressSpaceMapClient) map_client_list;
+    Stat64 bounce_maps;         /* successful bounce buffer mappings */
+    Stat64 bounce_exhausted;    /* mappings that failed for lack of budget */
 };
 
 typedef struct AddressSpaceDispatch AddressSpaceDispatch;
@@ -2305,8 +2340,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, hwaddr len,
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -2331,6 +2366,23 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          bool is_write, hwaddr access_len);
 
+/* address_space_register_map_client: Wait for bounce buffers to be released
+ *
+ * Schedules @bh once, as soon as a bounce buffer of @as is released or
+ * immediately if some of its bounce buffer budget is available.
+ *
+ * @as: #AddressSpace for which address_space_map() failed
+ * @bh: bottom half to schedule
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: Cancel a pending map client
+ *
+ * @as: #AddressSpace passed to address_space_register_map_client()
+ * @bh: bottom half passed to address_space_register_map_client()
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_full(AddressSpace *as, hwaddr addr,
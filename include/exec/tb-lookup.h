@@ -16,35 +16,75 @@
 #include "exec/exec-all.h"
 #include "exec/tb-hash.h"
 
+#ifdef CONFIG_PROFILER
+#define tb_jmp_cache_stat_inc(cpu, field) \
+    atomic_set(&(cpu)->tb_jmp_cache_stats.field, \
+               (cpu)->tb_jmp_cache_stats.field + 1)
+#else
+#define tb_jmp_cache_stat_inc(cpu, field) do { } while (0)
+#endif
+
+/*
+ * Insert @tb in way 0 of its set, shifting the other ways down by one.
+ * Only called by the vCPU thread; other threads may concurrently clear
+ * entries, which at worst resurrects a TB that tb_lookup__cpu_state()
+ * then rejects because of CF_INVALID.
+ */
+static inline void tb_jmp_cache_insert(CPUState *cpu, target_ulong pc,
+                                       TranslationBlock *tb)
+{
+    TranslationBlock **set =
+        &cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc) * TB_JMP_CACHE_WAYS];
+    int i;
+
+    if (atomic_read(&set[TB_JMP_CACHE_WAYS - 1])) {
+        tb_jmp_cache_stat_inc(cpu, evictions);
+    }
+    for (i = TB_JMP_CACHE_WAYS - 1; i > 0; i--) {
+        atomic_set(&set[i], atomic_read(&set[i - 1]));
+    }
+    atomic_set(&set[0], tb);
+}
+
 /* Might cause an exception, so have a longjmp destination ready */
 static inline TranslationBlock *
 tb_lookup__cpu_state(CPUState *cpu, target_ulong *pc, target_ulong *cs_base,
                      uint32_t *flags, uint32_t cf_mask)
 {
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
-    TranslationBlock *tb;
-    uint32_t hash;
+    TranslationBlock *tb, **set;
+    int i;
 
     cpu_get_tb_cpu_state(env, pc, cs_base, flags);
-    hash = tb_jmp_cache_hash_func(*pc);
-    tb = atomic_rcu_read(&cpu->tb_jmp_cache[hash]);
+    set = &cpu->tb_jmp_cache[tb_jmp_cache_hash_func(*pc) * TB_JMP_CACHE_WAYS];
 
     cf_mask &= ~CF_CLUSTER_MASK;
     cf_mask |= cpu->cluster_index << CF_CLUSTER_SHIFT;
 
-    if (likely(tb &&
-               tb->pc == *pc &&
-               tb->cs_base == *cs_base &&
-               tb->flags == *flags &&
-               tb->trace_vcpu_dstate == *cpu->trace_dstate &&
-               (tb_cflags(tb) & (CF_HASH_MASK | CF_INVALID)) == cf_mask)) {
-        return tb;
+    for (i = 0; i < TB_JMP_CACHE_WAYS; i++) {
+        tb = atomic_rcu_read(&set[i]);
+        if (likely(tb &&
+                   tb->pc == *pc &&
+                   tb->cs_base == *cs_base &&
+                   tb->flags == *flags &&
+                   tb->trace_vcpu_dstate == *cpu->trace_dstate &&
+                   (tb_cflags(tb) & (CF_HASH_MASK | CF_INVALID)) == cf_mask)) {
+            tb_jmp_cache_stat_inc(cpu, hits);
+            if (i) {
+                /* Promote: swap with the next hotter way */
+                atomic_set(&set[i], atomic_read(&set[i - 1]));
+                atomic_set(&set[i - 1], tb);
+                tb_jmp_cache_stat_inc(cpu, promotions);
+            }
+            return tb;
+        }
     }
+    tb_jmp_cache_stat_inc(cpu, misses);
     tb = tb_htable_lookup(cpu, *pc, *cs_base, *flags, cf_mask);
     if (tb == NULL) {
         return NULL;
     }
-    atomic_set(&cpu->tb_jmp_cache[hash], tb);
+    tb_jmp_cache_insert(cpu, *pc, tb);
     return tb;
 }
 
@@ -261,11 +261,30 @@ struct CPUWatchpoint {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 struct hax_vcpu_state;
 
-#define TB_JMP_CACHE_BITS 12
+/*
+ * The TB jump cache is set-associative: TB_JMP_CACHE_SIZE sets of
+ * TB_JMP_CACHE_WAYS entries each.  Way 0 holds the most recently
+ * inserted TB; a hit in any other way promotes the TB by one way, so
+ * that hot TBs end up being found on the first probe.
+ */
+#define TB_JMP_CACHE_BITS 11
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
+#define TB_JMP_CACHE_WAYS 4
+#define TB_JMP_CACHE_ENTRIES (TB_JMP_CACHE_SIZE * TB_JMP_CACHE_WAYS)
+
+#ifdef CONFIG_PROFILER
+/* Only written by the vCPU thread; read with atomic_read() for "info jit" */
+typedef struct TBJmpCacheStats {
+    size_t hits;        /* found in the jump cache */
+    size_t promotions;  /* hits outside way 0 */
+    size_t misses;      /* had to go to tb_ctx.htable */
+    size_t evictions;   /* insertions that pushed a TB out of its set */
+} TBJmpCacheStats;
+#endif
 
 /* work queue */
 
@@ -331,6 +350,8 @@ struct qemu_work_item;
  * @opaque: User data.
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: Dirty ring shared with KVM, if dirty ring is enabled.
+ * @kvm_fetch_index: Index of the next dirty ring entry to harvest.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
  * @trace_dstate_delayed: Delayed changes to trace_dstate (includes all changes
@@ -387,7 +408,10 @@ struct CPUState {
     IcountDecr *icount_decr_ptr;
 
     /* Accessed in parallel; all accesses must be atomic */
-    struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_ENTRIES];
+#ifdef CONFIG_PROFILER
+    TBJmpCacheStats tb_jmp_cache_stats;
+#endif
 
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
@@ -410,6 +434,8 @@ struct CPUState {
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -459,7 +485,7 @@ static inline void cpu_tb_jmp_cache_clear(CPUState *cpu)
 {
     unsigned int i;
 
-    for (i = 0; i < TB_JMP_CACHE_SIZE; i++) {
+    for (i = 0; i < TB_JMP_CACHE_ENTRIES; i++) {
         atomic_set(&cpu->tb_jmp_cache[i], NULL);
     }
 }
@@ -357,6 +357,9 @@ struct PCIDevice {
 
     /* ID of standby device in net_failover pair */
     char *failover_pair_id;
+
+    /* Budget for address_space_map() bounce buffers in bus_master_as */
+    uint64_t max_bounce_buffer_size;
 };
 
 void pci_register_bar(PCIDevice *pci_dev, int region_num,
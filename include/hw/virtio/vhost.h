@@ -43,6 +43,8 @@ struct vhost_log {
     int refcnt;
     int fd;
     vhost_log_chunk_t *log;
+    /* Devices logging here; the first one harvests the log for all */
+    QLIST_HEAD(, vhost_dev) devs;
 };
 
 struct vhost_dev;
@@ -86,6 +88,7 @@ struct vhost_dev {
     const VhostOps *vhost_ops;
     void *opaque;
     struct vhost_log *log;
+    QLIST_ENTRY(vhost_dev) log_entry;
     QLIST_ENTRY(vhost_dev) entry;
     QLIST_HEAD(, vhost_iommu) iommu_list;
     IOMMUNotifier n;
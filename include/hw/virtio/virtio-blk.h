@@ -34,6 +34,9 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    /* IOThread ids that the virtqueues are spread across, round-robin */
+    uint32_t num_iothread_vq_mapping;
+    char **iothread_vq_mapping;
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
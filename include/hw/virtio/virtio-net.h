@@ -123,6 +123,21 @@ typedef struct VirtioNetRscChain {
     VirtioNetRscStat stat;
 } VirtioNetRscChain;
 
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+
+/* Receive-side scaling and hash report state, set by the guest */
+typedef struct VirtioNetRssData {
+    bool enabled;
+    bool redirect;          /* steer packets to queues (not only report) */
+    bool populate_hash;     /* VIRTIO_NET_F_HASH_REPORT negotiated */
+    uint32_t hash_types;    /* VIRTIO_NET_RSS_HASH_TYPE_* */
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint16_t indirections_len;
+    uint16_t indirections_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint16_t default_queue; /* for packets without a hash */
+} VirtioNetRssData;
+
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 * KiB))
 
@@ -199,6 +214,8 @@ struct VirtIONet {
     bool failover;
     DeviceListener primary_listener;
     Notifier migration_state;
+    VirtioNetRssData rss_data;
+    struct NetRxPkt *rx_pkt;
 };
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -220,6 +220,29 @@ int kvm_init_vcpu(CPUState *cpu);
 int kvm_cpu_exec(CPUState *cpu);
 int kvm_destroy_vcpu(CPUState *cpu);
 
+/**
+ * kvm_dirty_ring_enabled - return whether guest dirty pages are tracked
+ *                          with the per-vCPU KVM dirty rings
+ */
+bool kvm_dirty_ring_enabled(void);
+
+/**
+ * kvm_dirty_ring_query_stats - return the KVM dirty ring statistics
+ *
+ * Must only be called if kvm_dirty_ring_enabled() returns true.
+ *
+ * Returns: a newly allocated DirtyRingStats
+ */
+struct DirtyRingStats *kvm_dirty_ring_query_stats(void);
+
+/**
+ * kvm_dirty_ring_reaper_stop - stop and join the dirty ring reaper thread
+ *
+ * Must be called with the BQL held, after the vCPUs have been stopped.
+ * Does nothing if the dirty ring is not in use.
+ */
+void kvm_dirty_ring_reaper_stop(void);
+
 /**
  * kvm_arm_supports_user_irq
  *
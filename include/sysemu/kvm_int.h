@@ -10,6 +10,7 @@
 #define QEMU_KVM_INT_H
 
 #include "exec/memory.h"
+#include "qemu/thread.h"
 #include "sysemu/accel.h"
 #include "sysemu/kvm.h"
 
@@ -23,16 +24,50 @@ typedef struct KVMSlot
     int old_flags;
     /* Dirty bitmap cache for the slot */
     unsigned long *dirty_bmap;
+    hwaddr dirty_bmap_size;
+    /* Offset of the slot in the ram_addr_t space */
+    ram_addr_t ram_start_offset;
 } KVMSlot;
 
 typedef struct KVMMemoryListener {
     MemoryListener listener;
-    /* Protects the slots and all inside them */
-    QemuMutex slots_lock;
     KVMSlot *slots;
     int as_id;
 } KVMMemoryListener;
 
+enum KVMDirtyRingReaperState {
+    KVM_DIRTY_RING_REAPER_NONE = 0,
+    /* The reaper is sleeping */
+    KVM_DIRTY_RING_REAPER_WAIT,
+    /* The reaper is reaping for dirty pages */
+    KVM_DIRTY_RING_REAPER_REAPING,
+};
+
+/*
+ * KVM reaper instance, responsible for collecting the KVM dirty bits
+ * via the dirty ring.
+ */
+typedef struct KVMDirtyRingReaper {
+    /* The reaper thread */
+    QemuThread reaper_thr;
+    /* Posted to wake the reaper early, e.g. when it is asked to quit */
+    QemuSemaphore reaper_sem;
+    /* Set when the reaper thread should exit */
+    bool reaper_quit;
+    /* Current sleep interval between two harvests, in milliseconds */
+    unsigned int reaper_interval_ms;
+    /* Iteration number of the reaper thread */
+    volatile uint64_t reaper_iteration;
+    /* Reaper thread state */
+    volatile enum KVMDirtyRingReaperState reaper_state;
+    /* Number of harvests of all vCPU rings, protected by kml_slots_lock */
+    uint64_t reap_count;
+    /* Number of dirty pages collected, protected by kml_slots_lock */
+    uint64_t reaped_pages;
+    /* Number of KVM_EXIT_DIRTY_RING_FULL exits, protected by the BQL */
+    uint64_t full_exits;
+} KVMDirtyRingReaper;
+
 #define TYPE_KVM_ACCEL ACCEL_CLASS_NAME("kvm")
 
 #define KVM_STATE(obj) \
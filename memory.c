@@ -23,6 +23,7 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/qemu-print.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 #include "trace-root.h"
 
@@ -42,6 +43,15 @@ static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
 bool global_dirty_log;
 
+/*
+ * A region whose render_dirty_gen equals memory_region_render_gen was
+ * changed in the current transaction; flat views whose tree contains no such
+ * region are reused as is on commit.  memory_region_render_all forces all
+ * views to be regenerated, for changes that are not tied to a region.
+ */
+static unsigned memory_region_render_gen = 1;
+static bool memory_region_render_all;
+
 static QTAILQ_HEAD(, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
 
@@ -50,6 +60,14 @@ static QTAILQ_HEAD(, AddressSpace) address_spaces
 
 static GHashTable *flat_views;
 
+static void memory_region_update_pending_set(MemoryRegion *mr, bool pending)
+{
+    if (pending) {
+        mr->render_dirty_gen = memory_region_render_gen;
+        memory_region_update_pending = true;
+    }
+}
+
 typedef struct AddrRange AddrRange;
 
 /*
@@ -976,26 +994,82 @@ static void flatviews_init(void)
     }
 }
 
-static void flatviews_reset(void)
+/*
+ * Return whether @mr or any region reachable from it through subregions and
+ * aliases changed in the current transaction.  Results are cached in each
+ * region for the duration of the transaction, so that trees shared through
+ * aliases are only walked once.
+ */
+static bool memory_region_render_dirty(MemoryRegion *mr)
 {
-    AddressSpace *as;
+    MemoryRegion *subregion;
+    bool dirty;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
+    if (mr->render_check_gen == memory_region_render_gen) {
+        return mr->render_check_dirty;
+    }
+
+    dirty = mr->render_dirty_gen == memory_region_render_gen;
+    if (!dirty && mr->enabled) {
+        if (mr->alias) {
+            dirty = memory_region_render_dirty(mr->alias);
+        }
+        QTAILQ_FOREACH(subregion, &mr->subregions, subregions_link) {
+            if (dirty) {
+                break;
+            }
+            dirty = memory_region_render_dirty(subregion);
+        }
     }
+
+    mr->render_check_gen = memory_region_render_gen;
+    mr->render_check_dirty = dirty;
+    return dirty;
+}
+
+/*
+ * Render the unique flat views of all address spaces.  A view is only
+ * regenerated if its tree changed since the previous commit; otherwise
+ * the previous view is reused, and listeners see no change for it.
+ */
+static void flatviews_reset(unsigned *rendered, unsigned *reused)
+{
+    GHashTable *old_views = flat_views;
+    AddressSpace *as;
+
+    flat_views = NULL;
     flatviews_init();
 
     /* Render unique FVs */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *view = NULL;
 
         if (g_hash_table_lookup(flat_views, physmr)) {
             continue;
         }
 
-        generate_memory_topology(physmr);
+        if (old_views && !memory_region_render_all &&
+            !memory_region_render_dirty(physmr)) {
+            view = g_hash_table_lookup(old_views, physmr);
+        }
+        if (view) {
+            flatview_ref(view);
+            g_hash_table_replace(flat_views, physmr, view);
+            (*reused)++;
+        } else {
+            generate_memory_topology(physmr);
+            (*rendered)++;
+        }
+    }
+
+    if (old_views) {
+        g_hash_table_unref(old_views);
     }
+
+    /* Start a new generation of dirty regions */
+    memory_region_render_gen++;
+    memory_region_render_all = false;
 }
 
 static void address_space_set_flatview(AddressSpace *as)
@@ -1007,6 +1081,14 @@ static void address_space_set_flatview(AddressSpace *as)
     assert(new_view);
 
     if (old_view == new_view) {
+        /*
+         * Listeners build their view of the address space from region_add
+         * and region_nop between begin and commit, so report every range
+         * as unchanged.
+         */
+        if (!QTAILQ_EMPTY(&as->listeners)) {
+            address_space_update_topology_pass(as, new_view, new_view, true);
+        }
         return;
     }
 
@@ -1070,17 +1152,27 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
-            flatviews_reset();
+            int64_t start_ns = get_clock();
+            unsigned rendered = 0, reused = 0;
+
+            flatviews_reset(&rendered, &reused);
 
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                FlatView *old_view = address_space_to_flatview(as);
+
                 address_space_set_flatview(as);
-                address_space_update_ioeventfds(as);
+                if (ioeventfd_update_pending ||
+                    address_space_to_flatview(as) != old_view) {
+                    address_space_update_ioeventfds(as);
+                }
             }
             memory_region_update_pending = false;
             ioeventfd_update_pending = false;
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            trace_memory_region_transaction_commit(rendered, reused,
+                                                   get_clock() - start_ns);
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1993,7 +2085,7 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    memory_region_update_pending_set(mr, mr->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2019,18 +2111,24 @@ static void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
      * address space once.
      */
     QTAILQ_FOREACH(listener, &memory_listeners, link) {
-        if (!listener->log_sync) {
-            continue;
-        }
-        as = listener->address_space;
-        view = address_space_get_flatview(as);
-        FOR_EACH_FLAT_RANGE(fr, view) {
-            if (fr->dirty_log_mask && (!mr || fr->mr == mr)) {
-                MemoryRegionSection mrs = section_from_flat_range(fr, view);
-                listener->log_sync(listener, &mrs);
+        if (listener->log_sync) {
+            as = listener->address_space;
+            view = address_space_get_flatview(as);
+            FOR_EACH_FLAT_RANGE(fr, view) {
+                if (fr->dirty_log_mask && (!mr || fr->mr == mr)) {
+                    MemoryRegionSection mrs = section_from_flat_range(fr, view);
+                    listener->log_sync(listener, &mrs);
+                }
             }
+            flatview_unref(view);
+        } else if (listener->log_sync_global) {
+            /*
+             * No matter whether MR is specified, what we can do here
+             * is to do a global sync, because we are not capable to
+             * sync in a finer granularity.
+             */
+            listener->log_sync_global(listener);
         }
-        flatview_unref(view);
     }
 }
 
@@ -2111,7 +2209,7 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        memory_region_update_pending_set(mr, mr->enabled);
         memory_region_transaction_commit();
     }
 }
@@ -2121,7 +2219,7 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
-        memory_region_update_pending |= mr->enabled;
+        memory_region_update_pending_set(mr, mr->enabled);
         memory_region_transaction_commit();
     }
 }
@@ -2131,7 +2229,7 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        memory_region_update_pending_set(mr, mr->enabled);
         memory_region_transaction_commit();
     }
 }
@@ -2382,7 +2480,7 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    memory_region_update_pending_set(mr, mr->enabled && subregion->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2421,7 +2519,7 @@ void memory_region_del_subregion(MemoryRegion *mr,
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    memory_region_update_pending_set(mr, mr->enabled && subregion->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2432,7 +2530,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_update_pending_set(mr, true);
     memory_region_transaction_commit();
 }
 
@@ -2448,7 +2546,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
-    memory_region_update_pending = true;
+    memory_region_update_pending_set(mr, true);
     memory_region_transaction_commit();
 }
 
@@ -2485,7 +2583,7 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    memory_region_update_pending_set(mr, mr->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2613,6 +2711,7 @@ void memory_global_dirty_log_start(void)
     /* Refresh DIRTY_MEMORY_MIGRATION bit.  */
     memory_region_transaction_begin();
     memory_region_update_pending = true;
+    memory_region_render_all = true;
     memory_region_transaction_commit();
 }
 
@@ -2623,6 +2722,7 @@ static void memory_global_dirty_log_do_stop(void)
     /* Refresh DIRTY_MEMORY_MIGRATION bit.  */
     memory_region_transaction_begin();
     memory_region_update_pending = true;
+    memory_region_render_all = true;
     memory_region_transaction_commit();
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
@@ -2774,6 +2874,13 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     QTAILQ_INIT(&as->listeners);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
+    qemu_mutex_init(&as->bounce_lock);
+    as->bounce_buffer_size = 0;
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    QLIST_INIT(&as->bounce_buffers);
+    QLIST_INIT(&as->map_client_list);
+    stat64_init(&as->bounce_maps, 0);
+    stat64_init(&as->bounce_exhausted, 0);
     address_space_update_topology(as);
     address_space_update_ioeventfds(as);
 }
@@ -2781,6 +2888,9 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 static void do_address_space_destroy(AddressSpace *as)
 {
     assert(QTAILQ_EMPTY(&as->listeners));
+    assert(QLIST_EMPTY(&as->bounce_buffers));
+    assert(QLIST_EMPTY(&as->map_client_list));
+    qemu_mutex_destroy(&as->bounce_lock);
 
     flatview_unref(as->current_map);
     g_free(as->name);
@@ -3129,7 +3239,17 @@ void mtree_info(bool flatview, bool dispatch_tree, bool owner)
     QTAILQ_INIT(&ml_head);
 
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        uint64_t bounce_maps = stat64_get(&as->bounce_maps);
+        uint64_t bounce_exhausted = stat64_get(&as->bounce_exhausted);
+
         qemu_printf("address-space: %s\n", as->name);
+        if (bounce_maps || bounce_exhausted) {
+            qemu_printf("  (bounce buffers: %zu/%zu bytes in use, %" PRIu64
+                        " mapped, %" PRIu64 " exhausted)\n",
+                        atomic_read(&as->bounce_buffer_size),
+                        as->max_bounce_buffer_size,
+                        bounce_maps, bounce_exhausted);
+        }
         mtree_print_mr(as->root, 1, 0, &ml_head, owner);
         qemu_printf("\n");
     }
@@ -15,13 +15,16 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
 #include "socket.h"
+#include "sysemu/kvm.h"
 #include "sysemu/runstate.h"
+#include "sysemu/cpus.h"
 #include "sysemu/sysemu.h"
 #include "rdma.h"
 #include "ram.h"
@@ -163,6 +166,7 @@ void migration_object_init(void)
     qemu_event_init(&current_incoming->main_thread_load_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
+    qemu_sem_init(&current_incoming->postcopy_qemufile_dst_done, 0);
 
     init_dirty_bitmap_incoming_migration();
 
@@ -220,6 +224,10 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -629,6 +637,10 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
          * right now.  Multifd needs more than one channel, we wait.
          */
         start_migration = !migrate_use_multifd();
+    } else if (migrate_postcopy_preempt()) {
+        /* The postcopy preempt channel, the migration is already going */
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        return;
     } else {
         /* Multiple connections */
         assert(migrate_use_multifd());
@@ -656,6 +668,9 @@ bool migration_has_all_channels(void)
     bool all_channels;
 
     all_channels = multifd_recv_all_channels_created();
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
 
     return all_channels && mis->from_src_file != NULL;
 }
@@ -923,6 +938,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->page_size = qemu_target_page_size();
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
     info->ram->pages_per_second = s->pages_per_second;
+    info->ram->dirty_sync_time = ram_counters.dirty_sync_time;
 
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
@@ -948,6 +964,11 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
                                     compression_counters.compression_rate;
     }
 
+    if (kvm_dirty_ring_enabled()) {
+        info->has_dirty_ring = true;
+        info->dirty_ring = kvm_dirty_ring_query_stats();
+    }
+
     if (cpu_throttle_active()) {
         info->has_cpu_throttle_percentage = true;
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
@@ -1082,6 +1103,82 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE] &&
+        !cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Multifd zero page detection requires multifd");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_XBZRLE] &&
+        (!cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+         !cap_list[MIGRATION_CAPABILITY_XBZRLE])) {
+        error_setg(errp, "Multifd XBZRLE requires multifd and xbzrle");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Postcopy preempt is not compatible with multifd");
+            return false;
+        }
+
+        /* The compression threads write to the main channel directly */
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Postcopy preempt is not compatible with compress");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
+        /*
+         * These either need a destination that runs along, send RAM in
+         * a way that cannot be tracked page by page, or read guest
+         * memory after the background snapshot has released it.
+         */
+        static const MigrationCapability incompatible[] = {
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT,
+            MIGRATION_CAPABILITY_DIRTY_BITMAPS,
+            MIGRATION_CAPABILITY_BLOCK,
+            MIGRATION_CAPABILITY_RETURN_PATH,
+            MIGRATION_CAPABILITY_MULTIFD,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_RELEASE_RAM,
+            MIGRATION_CAPABILITY_X_COLO,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible); i++) {
+            if (cap_list[incompatible[i]]) {
+                error_setg(errp, "Background snapshot is not compatible "
+                           "with %s",
+                           MigrationCapability_str(incompatible[i]));
+                return false;
+            }
+        }
+
+        if (!ram_write_tracking_available()) {
+            error_setg(errp, "Background snapshot requires userfaultfd "
+                       "write protection support in the host kernel");
+            return false;
+        }
+
+        if (!ram_write_tracking_compatible()) {
+            error_setg(errp, "Background snapshot cannot write-protect "
+                       "all of guest RAM");
+            error_append_hint(errp, "Only anonymous private memory is "
+                              "supported, not shared or file backed "
+                              "memory.\n");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -1605,14 +1702,14 @@ static void block_cleanup_parameters(MigrationState *s)
 
 static void migrate_fd_cleanup(MigrationState *s)
 {
+    QEMUFile *tmp;
+
     qemu_bh_delete(s->cleanup_bh);
     s->cleanup_bh = NULL;
 
     qemu_savevm_state_cleanup();
 
     if (s->to_dst_file) {
-        QEMUFile *tmp;
-
         trace_migrate_fd_cleanup();
         qemu_mutex_unlock_iothread();
         if (s->migration_thread_running) {
@@ -1633,6 +1730,14 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_fclose(tmp);
     }
 
+    qemu_mutex_lock(&s->qemu_file_lock);
+    tmp = s->postcopy_qemufile_src;
+    s->postcopy_qemufile_src = NULL;
+    qemu_mutex_unlock(&s->qemu_file_lock);
+    if (tmp) {
+        qemu_fclose(tmp);
+    }
+
     assert(!migration_is_active(s));
 
     if (s->state == MIGRATION_STATUS_CANCELLING) {
@@ -1715,6 +1820,13 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING) {
+        WITH_QEMU_LOCK_GUARD(&s->qemu_file_lock) {
+            if (s->postcopy_qemufile_src) {
+                qemu_file_shutdown(s->postcopy_qemufile_src);
+            }
+        }
+    }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
 
@@ -2278,6 +2390,42 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_use_multifd_zero_page(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE];
+}
+
+bool migrate_use_multifd_xbzrle(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_XBZRLE];
+}
+
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -2698,6 +2846,18 @@ static int postcopy_start(MigrationState *ms)
     int64_t bandwidth = migrate_max_postcopy_bandwidth();
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+
+    if (migrate_postcopy_preempt()) {
+        /* The preempt channel has to be there before the destination runs */
+        qemu_sem_wait(&ms->postcopy_qemufile_src_sem);
+        if (!ms->postcopy_qemufile_src) {
+            error_report("postcopy_start: Postcopy preempt channel failed");
+            migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
+                              MIGRATION_STATUS_FAILED);
+            return -1;
+        }
+    }
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -3071,21 +3231,32 @@ static MigThrError postcopy_pause(MigrationState *s)
     assert(s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE);
 
     while (true) {
-        QEMUFile *file;
+        QEMUFile *file, *preempt_file;
 
         migrate_set_state(&s->state, s->state,
                           MIGRATION_STATUS_POSTCOPY_PAUSED);
 
-        /* Current channel is possibly broken. Release it. */
+        /*
+         * Current channel is possibly broken. Release it.  The preempt
+         * channel isn't re-established on recovery, so drop it as well:
+         * urgent pages go on the main channel from now on.
+         */
         assert(s->to_dst_file);
         qemu_mutex_lock(&s->qemu_file_lock);
         file = s->to_dst_file;
         s->to_dst_file = NULL;
+        preempt_file = s->postcopy_qemufile_src;
+        s->postcopy_qemufile_src = NULL;
         qemu_mutex_unlock(&s->qemu_file_lock);
 
         qemu_file_shutdown(file);
         qemu_fclose(file);
 
+        if (preempt_file) {
+            qemu_file_shutdown(preempt_file);
+            qemu_fclose(preempt_file);
+        }
+
         error_report("Detected IO failure for postcopy. "
                      "Migration paused.");
 
@@ -3485,6 +3656,205 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+static void bg_migration_vm_start_bh(void *opaque)
+{
+    MigrationState *s = opaque;
+
+    qemu_bh_delete(s->vm_start_bh);
+    s->vm_start_bh = NULL;
+
+    vm_start();
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                  s->downtime_start;
+}
+
+/**
+ * bg_migration_completion: Used by bg_migration_thread once all of RAM
+ *   has been saved.
+ *
+ * @s: Current migration state
+ * @bioc: Device state saved when the guest was paused
+ */
+static void bg_migration_completion(MigrationState *s,
+                                    QIOChannelBuffer *bioc)
+{
+    int current_active_state = s->state;
+    int ret;
+
+    /*
+     * Every page has been saved and released, so the guest cannot wait
+     * on write protection while we hold the iothread lock below.
+     */
+    ram_write_tracking_stop();
+
+    if (s->state == MIGRATION_STATUS_ACTIVE) {
+        qemu_mutex_lock_iothread();
+        qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+        ret = qemu_savevm_state_complete_precopy_iterable(s->to_dst_file,
+                                                          false);
+        qemu_mutex_unlock_iothread();
+
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The device state goes last, as with a normal migration */
+    qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+    qemu_fflush(s->to_dst_file);
+
+    if (qemu_file_get_error(s->to_dst_file)) {
+        trace_migration_completion_file_err();
+        goto fail;
+    }
+
+    migrate_set_state(&s->state, current_active_state,
+                      MIGRATION_STATUS_COMPLETED);
+    return;
+
+fail:
+    migrate_set_state(&s->state, current_active_state,
+                      MIGRATION_STATUS_FAILED);
+}
+
+static void bg_migration_iteration_finish(MigrationState *s)
+{
+    qemu_mutex_lock_iothread();
+    switch (s->state) {
+    case MIGRATION_STATUS_COMPLETED:
+        migration_calculate_complete(s);
+        break;
+
+    case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_FAILED:
+    case MIGRATION_STATUS_CANCELLED:
+    case MIGRATION_STATUS_CANCELLING:
+        break;
+
+    default:
+        /* Should not reach here, but if so, forgive the VM. */
+        error_report("%s: Unknown ending state %d", __func__, s->state);
+        break;
+    }
+    migrate_fd_cleanup_schedule(s);
+    qemu_mutex_unlock_iothread();
+}
+
+/*
+ * Migration thread for background snapshots.
+ *
+ * The guest is only paused while its device state is saved, into a
+ * buffer, and RAM is write-protected.  RAM is then saved while the guest
+ * runs, each page either in turn or as soon as the guest tries to write
+ * to it, and the device state is appended once all of it is saved.
+ */
+static void *bg_migration_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    bool urgent = false;
+
+    rcu_register_thread();
+
+    object_ref(OBJECT(s));
+    update_iteration_initial_status(s);
+
+    bioc = qio_channel_buffer_new(512 * KiB);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "bg-snapshot-device-state");
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    qemu_savevm_state_header(s->to_dst_file);
+    qemu_savevm_state_setup(s->to_dst_file);
+
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+
+    trace_migration_thread_setup_complete();
+
+    /* Only write-protecting the RAM needs the guest to be stopped */
+    ram_write_tracking_prepare();
+
+    qemu_mutex_lock_iothread();
+    s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER, NULL);
+    s->vm_was_running = runstate_is_running();
+
+    if (global_state_store() ||
+        vm_stop_force_state(RUN_STATE_PAUSED) < 0) {
+        goto fail;
+    }
+
+    cpu_synchronize_all_states();
+    if (qemu_savevm_state_complete_precopy_non_iterable(fb, false, false)) {
+        goto fail;
+    }
+    qemu_fflush(fb);
+    if (qemu_file_get_error(fb)) {
+        goto fail;
+    }
+    trace_bg_migration_device_state_saved(bioc->usage,
+        qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - s->downtime_start);
+
+    if (ram_write_tracking_start()) {
+        goto fail;
+    }
+
+    /*
+     * The VM state change handlers may write to guest RAM, which is now
+     * write-protected until this thread saves it: restart the guest from
+     * the main loop rather than from here.
+     */
+    if (s->vm_was_running) {
+        s->vm_start_bh = qemu_bh_new(bg_migration_vm_start_bh, s);
+        qemu_bh_schedule(s->vm_start_bh);
+    } else {
+        s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                      s->downtime_start;
+    }
+    qemu_mutex_unlock_iothread();
+
+    while (migration_is_active(s)) {
+        if (urgent || !qemu_file_rate_limit(s->to_dst_file)) {
+            int ret = qemu_savevm_state_iterate(s->to_dst_file, false);
+
+            if (ret > 0) {
+                bg_migration_completion(s, bioc);
+                break;
+            }
+        }
+
+        if (migration_detect_error(s) == MIG_THR_ERR_FATAL) {
+            break;
+        }
+
+        urgent = migration_rate_limit();
+    }
+
+    trace_migration_thread_after_loop();
+    goto out;
+
+fail:
+    migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_FAILED);
+    if (s->vm_was_running) {
+        vm_start();
+    }
+    qemu_mutex_unlock_iothread();
+
+out:
+    /* Wakes up the guest if the snapshot failed or was cancelled */
+    ram_write_tracking_stop();
+    bg_migration_iteration_finish(s);
+    qemu_fclose(fb);
+    object_unref(OBJECT(s));
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s, Error *error_in)
 {
     Error *local_err = NULL;
@@ -3548,8 +3918,21 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         migrate_fd_cleanup(s);
         return;
     }
-    qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
-                       QEMU_THREAD_JOINABLE);
+
+    if (postcopy_preempt_setup(s, &local_err)) {
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+    if (migrate_background_snapshot()) {
+        qemu_thread_create(&s->thread, "bg_snapshot", bg_migration_thread,
+                           s, QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(&s->thread, "live_migration", migration_thread,
+                           s, QEMU_THREAD_JOINABLE);
+    }
     s->migration_thread_running = true;
 }
 
@@ -3665,6 +4048,14 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-multifd-zero-page",
+                        MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE),
+    DEFINE_PROP_MIG_CAP("x-multifd-xbzrle",
+                        MIGRATION_CAPABILITY_MULTIFD_XBZRLE),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+                        MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
+    DEFINE_PROP_MIG_CAP("x-background-snapshot",
+                        MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -3691,6 +4082,7 @@ static void migration_instance_finalize(Object *obj)
     qemu_sem_destroy(&ms->pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     qemu_sem_destroy(&ms->rp_state.rp_sem);
     error_free(ms->error);
 }
@@ -3735,6 +4127,7 @@ static void migration_instance_init(Object *obj)
 
     qemu_sem_init(&ms->postcopy_pause_sem, 0);
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
     qemu_sem_init(&ms->wait_unplug_sem, 0);
@@ -43,6 +43,29 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/* Channels a postcopy destination receives pages on */
+typedef enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    /* Urgent pages, only used with postcopy-preempt */
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+} RamChannel;
+
+/*
+ * Host page being assembled from target pages during postcopy.  Each
+ * channel has its own, since with postcopy-preempt the source can switch
+ * to the urgent channel in the middle of a host page.
+ */
+typedef struct PostcopyTmpPage {
+    void *tmp_huge_page;
+    /* Host address of the host page being assembled, NULL if none */
+    void *host_addr;
+    /* Number of target pages of the host page received so far */
+    int target_pages;
+    /* Whether all the target pages received so far are zero */
+    bool all_zero;
+} PostcopyTmpPage;
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -75,7 +98,9 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    PostcopyTmpPage postcopy_tmp_pages[RAM_CHANNEL_MAX];
+    /* Last RAMBlock a page was received for, per channel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
@@ -101,6 +126,15 @@ struct MigrationIncomingState {
     QemuSemaphore postcopy_pause_sem_dst;
     QemuSemaphore postcopy_pause_sem_fault;
 
+    /* Channel for urgent pages, only with postcopy-preempt */
+    QEMUFile *postcopy_qemufile_dst;
+    /* Posted once postcopy_qemufile_dst has been established */
+    QemuSemaphore postcopy_qemufile_dst_done;
+    bool have_preempt_thread;
+    QemuThread postcopy_prio_thread;
+    /* Set this when we want the preempt thread to quit */
+    bool postcopy_preempt_quit;
+
     /* List of listening socket addresses  */
     SocketAddressList *socket_address_list;
 };
@@ -134,6 +168,8 @@ struct MigrationState
     /*< public >*/
     QemuThread thread;
     QEMUBH *cleanup_bh;
+    /* Restarts the guest once a background snapshot has saved its devices */
+    QEMUBH *vm_start_bh;
     QEMUFile *to_dst_file;
     /*
      * Protects to_dst_file pointer.  We need to make sure we won't
@@ -244,6 +280,12 @@ struct MigrationState
     /* Needed by postcopy-pause state */
     QemuSemaphore postcopy_pause_sem;
     QemuSemaphore postcopy_pause_rp_sem;
+
+    /* Channel for urgent pages, only with postcopy-preempt */
+    QEMUFile *postcopy_qemufile_src;
+    /* Posted once the creation of postcopy_qemufile_src has finished */
+    QemuSemaphore postcopy_qemufile_src_sem;
+
     /*
      * Whether we abort the migration if decompression errors are
      * detected at the destination. It is left at false for qemu
@@ -298,6 +340,10 @@ bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+bool migrate_use_multifd_zero_page(void);
+bool migrate_use_multifd_xbzrle(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_background_snapshot(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
 MultiFDCompression migrate_multifd_compression(void);
@@ -11,6 +11,8 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "qemu/rcu.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
@@ -23,6 +25,8 @@
 #include "qemu-file.h"
 #include "trace.h"
 #include "multifd.h"
+#include "page_cache.h"
+#include "xbzrle.h"
 
 /* Multiple fd's */
 
@@ -251,6 +255,7 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     pages->allocated = 0;
     pages->packet_num = 0;
     pages->block = NULL;
+    pages->xbzrle = false;
     g_free(pages->iov);
     pages->iov = NULL;
     g_free(pages->offset);
@@ -258,16 +263,19 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     g_free(pages);
 }
 
-static void multifd_send_fill_packet(MultiFDSendParams *p)
+static void multifd_send_fill_packet(MultiFDSendParams *p, uint32_t flags,
+                                     uint64_t packet_num)
 {
     MultiFDPacket_t *packet = p->packet;
     int i;
 
-    packet->flags = cpu_to_be32(p->flags);
+    packet->flags = cpu_to_be32(flags);
     packet->pages_alloc = cpu_to_be32(p->pages->allocated);
     packet->pages_used = cpu_to_be32(p->pages->used);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
-    packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->packet_num = cpu_to_be64(packet_num);
+    packet->zero_pages = cpu_to_be32(p->zero_num);
+    packet->xbzrle_pages = cpu_to_be32(p->xbzrle_num);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
@@ -279,6 +287,12 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
         packet->offset[i] = cpu_to_be64(temp);
     }
+
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t temp = p->zero[i];
+
+        packet->offset[p->pages->used + i] = cpu_to_be64(temp);
+    }
 }
 
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
@@ -324,20 +338,51 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     if (packet->pages_alloc > p->pages->allocated) {
         multifd_pages_clear(p->pages);
         p->pages = multifd_pages_init(packet->pages_alloc);
+        g_free(p->zero);
+        p->zero = g_new0(ram_addr_t, packet->pages_alloc);
+        /* allocated again on the next XBZRLE packet */
+        g_free(p->xbzrle_len);
+        p->xbzrle_len = NULL;
+        g_free(p->xbzrle_buf);
+        p->xbzrle_buf = NULL;
     }
 
     p->pages->used = be32_to_cpu(packet->pages_used);
-    if (p->pages->used > packet->pages_alloc) {
+    p->zero_num = be32_to_cpu(packet->zero_pages);
+    if (p->pages->used > packet->pages_alloc ||
+        p->zero_num > packet->pages_alloc - p->pages->used) {
+        error_setg(errp, "multifd: received packet "
+                   "with %d pages and %d zero pages and expected maximum "
+                   "pages are %d",
+                   p->pages->used, p->zero_num, packet->pages_alloc) ;
+        return -1;
+    }
+
+    p->xbzrle_num = be32_to_cpu(packet->xbzrle_pages);
+    if (p->xbzrle_num > p->pages->used) {
         error_setg(errp, "multifd: received packet "
-                   "with %d pages and expected maximum pages are %d",
-                   p->pages->used, packet->pages_alloc) ;
+                   "with %d XBZRLE pages and %d pages",
+                   p->xbzrle_num, p->pages->used);
+        return -1;
+    }
+
+    if (p->zero_num && !migrate_use_multifd_zero_page()) {
+        error_setg(errp, "multifd: received zero pages but "
+                   "multifd-zero-page is not enabled");
+        return -1;
+    }
+
+    if (p->xbzrle_num && !migrate_use_multifd_xbzrle()) {
+        error_setg(errp, "multifd: received XBZRLE pages but "
+                   "multifd-xbzrle is not enabled");
         return -1;
     }
 
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->pages->used == 0) {
+    p->pages->block = NULL;
+    if (p->pages->used == 0 && p->zero_num == 0) {
         return 0;
     }
 
@@ -363,6 +408,101 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->pages->iov[i].iov_len = qemu_target_page_size();
     }
 
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->pages->used + i]);
+
+        if (offset > (block->used_length - qemu_target_page_size())) {
+            error_setg(errp, "multifd: zero page offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, block->max_length);
+            return -1;
+        }
+        p->zero[i] = offset;
+    }
+    p->pages->block = block;
+
+    return 0;
+}
+
+/**
+ * multifd_recv_zero_pages: fill the zero pages of the last packet
+ *
+ * Pages that already read as zero are left alone so that we don't
+ * allocate memory for them on the destination.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_recv_zero_pages(MultiFDRecvParams *p)
+{
+    size_t page_size = qemu_target_page_size();
+    uint32_t i;
+
+    for (i = 0; i < p->zero_num; i++) {
+        void *host = p->pages->block->host + p->zero[i];
+
+        if (!buffer_is_zero(host, page_size)) {
+            memset(host, 0, page_size);
+        }
+    }
+}
+
+/**
+ * multifd_recv_xbzrle_pages: read and decode the XBZRLE pages
+ *
+ * The encoded pages are the last ones of the packet.  Their data
+ * comes after the data of the other pages and is decoded on top of
+ * the current contents of guest memory.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_recv_xbzrle_pages(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint32_t first = pages->used - p->xbzrle_num;
+    size_t size = 0;
+    uint8_t *data;
+    uint32_t i;
+
+    if (!p->xbzrle_len) {
+        p->xbzrle_len = g_new(uint32_t, pages->allocated);
+        p->xbzrle_buf = g_malloc(pages->allocated * page_size);
+    }
+
+    if (qio_channel_read_all(p->c, (char *)p->xbzrle_len,
+                             p->xbzrle_num * sizeof(uint32_t), errp)) {
+        return -1;
+    }
+
+    for (i = 0; i < p->xbzrle_num; i++) {
+        p->xbzrle_len[i] = be32_to_cpu(p->xbzrle_len[i]);
+        if (p->xbzrle_len[i] > page_size) {
+            error_setg(errp, "multifd %d: XBZRLE page of %u bytes",
+                       p->id, p->xbzrle_len[i]);
+            return -1;
+        }
+        size += p->xbzrle_len[i];
+    }
+
+    if (qio_channel_read_all(p->c, (char *)p->xbzrle_buf, size, errp)) {
+        return -1;
+    }
+
+    data = p->xbzrle_buf;
+    for (i = 0; i < p->xbzrle_num; i++) {
+        if (xbzrle_decode_buffer(data, p->xbzrle_len[i],
+                                 pages->iov[first + i].iov_base,
+                                 page_size) == -1) {
+            error_setg(errp, "multifd %d: failed to decode XBZRLE page "
+                       "of ram block %s", p->id, pages->block->idstr);
+            return -1;
+        }
+        data += p->xbzrle_len[i];
+    }
+
     return 0;
 }
 
@@ -382,6 +522,12 @@ struct {
     int exiting;
     /* multifd ops */
     MultiFDMethods *ops;
+    /* channels look for zero pages themselves */
+    bool zero_page;
+    /* channels XBZRLE encode pages, each one owns a shard of the cache */
+    bool xbzrle;
+    /* a page full of zeros, for the XBZRLE cache */
+    uint8_t *xbzrle_zero_page;
 } *multifd_send_state;
 
 /*
@@ -402,6 +548,280 @@ struct {
  * false.
  */
 
+/**
+ * multifd_send_zero_page_detect: separate the zero pages of a packet
+ *
+ * Moves the offsets of the zero pages of @p->pages to @p->zero and
+ * compacts the remaining pages at the start of @p->pages, so that the
+ * send methods only see pages with data.
+ *
+ * Returns the number of pages with data.
+ *
+ * @p: Params for the channel that we are using
+ */
+static uint32_t multifd_send_zero_page_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i, normal = 0;
+
+    for (i = 0; i < pages->used; i++) {
+        if (buffer_is_zero(pages->iov[i].iov_base, page_size)) {
+            p->zero[p->zero_num++] = pages->offset[i];
+        } else {
+            pages->offset[normal] = pages->offset[i];
+            pages->iov[normal] = pages->iov[i];
+            normal++;
+        }
+    }
+    pages->used = normal;
+    p->num_zero_pages += p->zero_num;
+
+    return normal;
+}
+
+/*
+ * The XBZRLE cache is split between the channels by page number, so
+ * that channels encoding neighbouring pages don't contend for the same
+ * lock.  Inside a shard pages are looked up by their page number
+ * divided by the number of channels, so that every slot is used.
+ */
+static MultiFDSendParams *multifd_xbzrle_shard(ram_addr_t addr, uint64_t *key)
+{
+    size_t page_size = qemu_target_page_size();
+    uint64_t page = addr / page_size;
+    int channels = migrate_multifd_channels();
+
+    *key = page / channels * page_size;
+    return &multifd_send_state->params[page % channels];
+}
+
+static int64_t multifd_xbzrle_shard_size(int64_t cache_size)
+{
+    return MAX(pow2floor(cache_size / migrate_multifd_channels()),
+               qemu_target_page_size());
+}
+
+static void multifd_xbzrle_cache_insert(ram_addr_t addr, const uint8_t *data,
+                                        uint64_t age)
+{
+    MultiFDSendParams *owner;
+    uint64_t key;
+
+    owner = multifd_xbzrle_shard(addr, &key);
+    qemu_mutex_lock(&owner->xbzrle_lock);
+    /* We don't care if this fails to allocate a new cache page */
+    cache_insert(owner->xbzrle_cache, key, data, age);
+    qemu_mutex_unlock(&owner->xbzrle_lock);
+}
+
+/**
+ * multifd_xbzrle_cache_zero_page: insert a zero page in the XBZRLE cache
+ *
+ * Used by the migration thread for the zero pages that it sends
+ * itself, so that a stale copy of the page is not used for encoding.
+ *
+ * @addr: address of the page
+ */
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr)
+{
+    if (!multifd_send_state || !multifd_send_state->xbzrle) {
+        return;
+    }
+    multifd_xbzrle_cache_insert(addr, multifd_send_state->xbzrle_zero_page,
+                                ram_counters.dirty_sync_count);
+}
+
+/**
+ * multifd_xbzrle_cache_resize: resize the shards of the XBZRLE cache
+ *
+ * Called from the main thread, like xbzrle_cache_resize().  The
+ * contents of the cache are dropped.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @new_size: new size of the whole cache
+ * @errp: pointer to an error
+ */
+int multifd_xbzrle_cache_resize(int64_t new_size, Error **errp)
+{
+    int channels = migrate_multifd_channels();
+    PageCache **caches;
+    int i;
+
+    if (!multifd_send_state || !multifd_send_state->xbzrle) {
+        return 0;
+    }
+
+    caches = g_new0(PageCache *, channels);
+    for (i = 0; i < channels; i++) {
+        caches[i] = cache_init(multifd_xbzrle_shard_size(new_size),
+                               qemu_target_page_size(), errp);
+        if (!caches[i]) {
+            while (i--) {
+                cache_fini(caches[i]);
+            }
+            g_free(caches);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < channels; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->xbzrle_lock);
+        cache_fini(p->xbzrle_cache);
+        p->xbzrle_cache = caches[i];
+        qemu_mutex_unlock(&p->xbzrle_lock);
+    }
+    g_free(caches);
+
+    return 0;
+}
+
+/**
+ * multifd_send_xbzrle_encode: XBZRLE encode the pages of a packet
+ *
+ * Each page with data is looked up in the shard of the cache that owns
+ * it.  Pages that didn't change since they were cached are dropped from
+ * the packet, and the ones that encode well are moved after the pages
+ * that are sent whole.  Pages are copied before being looked up, and
+ * whole pages are sent from that copy, so that the cache always holds
+ * what the destination has even if the guest keeps writing to them.
+ *
+ * The zero pages of the packet are inserted in the cache too.
+ *
+ * Returns the number of pages that are sent whole.
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages with data
+ * @stats: where to count the cache hits, misses, overflows and bytes
+ */
+static uint32_t multifd_send_xbzrle_encode(MultiFDSendParams *p, uint32_t used,
+                                           XBZRLECacheStats *stats)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    ram_addr_t block_offset = pages->block->offset;
+    uint32_t i, normal = 0;
+
+    p->xbzrle_num = 0;
+    p->xbzrle_size = 0;
+
+    for (i = 0; i < p->zero_num; i++) {
+        multifd_xbzrle_cache_insert(block_offset + p->zero[i],
+                                    multifd_send_state->xbzrle_zero_page,
+                                    p->xbzrle_age);
+    }
+
+    for (i = 0; i < used; i++) {
+        uint8_t *copy = p->xbzrle_copy + i * page_size;
+        MultiFDSendParams *owner;
+        uint64_t key;
+        int len = -1;
+
+        owner = multifd_xbzrle_shard(block_offset + pages->offset[i], &key);
+        memcpy(copy, pages->iov[i].iov_base, page_size);
+
+        qemu_mutex_lock(&owner->xbzrle_lock);
+        if (!cache_is_cached(owner->xbzrle_cache, key, p->xbzrle_age)) {
+            stats->cache_miss++;
+            cache_insert(owner->xbzrle_cache, key, copy, p->xbzrle_age);
+        } else {
+            uint8_t *cached = get_cached_data(owner->xbzrle_cache, key);
+
+            len = xbzrle_encode_buffer(cached, copy, page_size,
+                                       p->xbzrle_encoded + p->xbzrle_size,
+                                       page_size);
+            if (len != 0) {
+                memcpy(cached, copy, page_size);
+            }
+            /* every hit counts as encoded, see save_xbzrle_page() */
+            stats->pages++;
+            if (len == -1) {
+                stats->overflow++;
+                stats->bytes += page_size;
+            }
+        }
+        qemu_mutex_unlock(&owner->xbzrle_lock);
+
+        if (len == 0) {
+            /* the destination already has it */
+            continue;
+        }
+
+        if (len == -1) {
+            pages->offset[normal] = pages->offset[i];
+            pages->iov[normal].iov_base = copy;
+            pages->iov[normal].iov_len = page_size;
+            normal++;
+            continue;
+        }
+
+        p->xbzrle_offset[p->xbzrle_num] = pages->offset[i];
+        p->xbzrle_len[p->xbzrle_num] = cpu_to_be32(len);
+        p->xbzrle_num++;
+        p->xbzrle_size += len;
+        stats->bytes += len + sizeof(uint32_t);
+    }
+
+    for (i = 0; i < p->xbzrle_num; i++) {
+        pages->offset[normal + i] = p->xbzrle_offset[i];
+    }
+    pages->used = normal + p->xbzrle_num;
+    p->num_xbzrle_pages += p->xbzrle_num;
+
+    return normal;
+}
+
+static int multifd_send_xbzrle_write(MultiFDSendParams *p, uint32_t num,
+                                     Error **errp)
+{
+    struct iovec iov[] = {
+        {
+            .iov_base = p->xbzrle_len,
+            .iov_len = num * sizeof(uint32_t),
+        }, {
+            .iov_base = p->xbzrle_encoded,
+            .iov_len = p->xbzrle_size,
+        },
+    };
+
+    return qio_channel_writev_all(p->c, iov, ARRAY_SIZE(iov), errp);
+}
+
+/*
+ * The migration thread accounts every queued page as a normal page.
+ * Correct the counters for the pages the channel found to be zero,
+ * which only cost an offset in the packet header, and for the ones
+ * that hit the XBZRLE cache.  Those were encoded, dropped because they
+ * didn't change, or sent whole on overflow; the encoded bytes already
+ * include a whole page for the latter.
+ *
+ * Called with p->mutex held.
+ */
+static void multifd_send_account_pages(QEMUFile *f, MultiFDSendParams *p)
+{
+    XBZRLECacheStats *xbzrle = &p->xbzrle_pending;
+    size_t page_size = qemu_target_page_size();
+    int64_t bytes = p->zero_pages_pending * page_size
+                    + xbzrle->pages * page_size - xbzrle->bytes;
+
+    qemu_file_update_transfer(f, -bytes);
+    ram_counters.duplicate += p->zero_pages_pending;
+    ram_counters.normal -= p->zero_pages_pending
+                           + xbzrle->pages - xbzrle->overflow;
+    ram_counters.multifd_bytes -= bytes;
+    ram_counters.transferred -= bytes;
+    p->zero_pages_pending = 0;
+
+    xbzrle_counters.pages += xbzrle->pages;
+    xbzrle_counters.cache_miss += xbzrle->cache_miss;
+    xbzrle_counters.overflow += xbzrle->overflow;
+    xbzrle_counters.bytes += xbzrle->bytes;
+    memset(xbzrle, 0, sizeof(*xbzrle));
+}
+
 static int multifd_send_pages(QEMUFile *f)
 {
     int i;
@@ -434,7 +854,9 @@ static int multifd_send_pages(QEMUFile *f)
     assert(!p->pages->used);
     assert(!p->pages->block);
 
+    multifd_send_account_pages(f, p);
     p->packet_num = multifd_send_state->packet_num++;
+    p->xbzrle_age = ram_counters.dirty_sync_count;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
     transferred = ((uint64_t) pages->used) * qemu_target_page_size()
@@ -448,7 +870,8 @@ static int multifd_send_pages(QEMUFile *f)
     return 1;
 }
 
-int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                       bool xbzrle)
 {
     MultiFDPages_t *pages = multifd_send_state->pages;
 
@@ -461,6 +884,7 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
         pages->iov[pages->used].iov_base = block->host + offset;
         pages->iov[pages->used].iov_len = qemu_target_page_size();
         pages->used++;
+        pages->xbzrle |= xbzrle && multifd_send_state->xbzrle;
 
         if (pages->used < pages->allocated) {
             return 1;
@@ -472,7 +896,7 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
     }
 
     if (pages->block != block) {
-        return  multifd_queue_page(f, block, offset);
+        return  multifd_queue_page(f, block, offset, xbzrle);
     }
 
     return 1;
@@ -547,6 +971,21 @@ void multifd_save_cleanup(void)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
+        qemu_mutex_destroy(&p->xbzrle_lock);
+        if (p->xbzrle_cache) {
+            cache_fini(p->xbzrle_cache);
+            p->xbzrle_cache = NULL;
+        }
+        g_free(p->xbzrle_offset);
+        p->xbzrle_offset = NULL;
+        g_free(p->xbzrle_len);
+        p->xbzrle_len = NULL;
+        g_free(p->xbzrle_encoded);
+        p->xbzrle_encoded = NULL;
+        g_free(p->xbzrle_copy);
+        p->xbzrle_copy = NULL;
         multifd_send_state->ops->send_cleanup(p, &local_err);
         if (local_err) {
             migrate_set_error(migrate_get_current(), local_err);
@@ -558,6 +997,8 @@ void multifd_save_cleanup(void)
     multifd_send_state->params = NULL;
     multifd_pages_clear(multifd_send_state->pages);
     multifd_send_state->pages = NULL;
+    g_free(multifd_send_state->xbzrle_zero_page);
+    multifd_send_state->xbzrle_zero_page = NULL;
     g_free(multifd_send_state);
     multifd_send_state = NULL;
 }
@@ -602,6 +1043,10 @@ void multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_account_pages(f, p);
+        qemu_mutex_unlock(&p->mutex);
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
@@ -634,7 +1079,32 @@ static void *multifd_send_thread(void *opaque)
         if (p->pending_job) {
             uint32_t used = p->pages->used;
             uint64_t packet_num = p->packet_num;
+            XBZRLECacheStats xbzrle = { 0 };
+            uint32_t xbzrle_num;
             flags = p->flags;
+            p->flags = 0;
+
+            /*
+             * The pages belong to the channel until pending_job drops, so
+             * look for zero pages and encode them without the mutex, which
+             * multifd_send_pages() needs to pick a channel.
+             */
+            qemu_mutex_unlock(&p->mutex);
+            if (used && multifd_send_state->zero_page) {
+                used = multifd_send_zero_page_detect(p);
+            }
+
+            if (p->pages->xbzrle) {
+                used = multifd_send_xbzrle_encode(p, used, &xbzrle);
+            }
+            xbzrle_num = p->xbzrle_num;
+            qemu_mutex_lock(&p->mutex);
+
+            p->zero_pages_pending += p->zero_num;
+            p->xbzrle_pending.pages += xbzrle.pages;
+            p->xbzrle_pending.cache_miss += xbzrle.cache_miss;
+            p->xbzrle_pending.overflow += xbzrle.overflow;
+            p->xbzrle_pending.bytes += xbzrle.bytes;
 
             if (used) {
                 ret = multifd_send_state->ops->send_prepare(p, used,
@@ -644,16 +1114,18 @@ static void *multifd_send_thread(void *opaque)
                     break;
                 }
             }
-            multifd_send_fill_packet(p);
-            p->flags = 0;
+            multifd_send_fill_packet(p, flags, packet_num);
+            trace_multifd_send(p->id, packet_num, used, p->zero_num,
+                               xbzrle_num, flags, p->next_packet_size);
             p->num_packets++;
             p->num_pages += used;
             p->pages->used = 0;
             p->pages->block = NULL;
+            p->pages->xbzrle = false;
+            p->zero_num = 0;
+            p->xbzrle_num = 0;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags,
-                               p->next_packet_size);
 
             ret = qio_channel_write_all(p->c, (void *)p->packet,
                                         p->packet_len, &local_err);
@@ -668,6 +1140,13 @@ static void *multifd_send_thread(void *opaque)
                 }
             }
 
+            if (xbzrle_num) {
+                ret = multifd_send_xbzrle_write(p, xbzrle_num, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            }
+
             qemu_mutex_lock(&p->mutex);
             p->pending_job--;
             qemu_mutex_unlock(&p->mutex);
@@ -706,7 +1185,8 @@ out:
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages, p->num_xbzrle_pages);
 
     return NULL;
 }
@@ -756,6 +1236,12 @@ int multifd_save_setup(Error **errp)
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
     atomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    multifd_send_state->zero_page = migrate_use_multifd_zero_page();
+    multifd_send_state->xbzrle = migrate_use_multifd_xbzrle();
+    if (multifd_send_state->xbzrle) {
+        multifd_send_state->xbzrle_zero_page =
+            g_malloc0(qemu_target_page_size());
+    }
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -767,6 +1253,14 @@ int multifd_save_setup(Error **errp)
         p->pending_job = 0;
         p->id = i;
         p->pages = multifd_pages_init(page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
+        qemu_mutex_init(&p->xbzrle_lock);
+        if (multifd_send_state->xbzrle) {
+            p->xbzrle_offset = g_new0(ram_addr_t, page_count);
+            p->xbzrle_len = g_new0(uint32_t, page_count);
+            p->xbzrle_encoded = g_malloc(page_count * qemu_target_page_size());
+            p->xbzrle_copy = g_malloc(page_count * qemu_target_page_size());
+        }
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(uint64_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
@@ -786,6 +1280,16 @@ int multifd_save_setup(Error **errp)
             error_propagate(errp, local_err);
             return ret;
         }
+
+        if (multifd_send_state->xbzrle) {
+            int64_t size;
+
+            size = multifd_xbzrle_shard_size(migrate_xbzrle_cache_size());
+            p->xbzrle_cache = cache_init(size, qemu_target_page_size(), errp);
+            if (!p->xbzrle_cache) {
+                return -1;
+            }
+        }
     }
     return 0;
 }
@@ -871,6 +1375,12 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
+        g_free(p->xbzrle_len);
+        p->xbzrle_len = NULL;
+        g_free(p->xbzrle_buf);
+        p->xbzrle_buf = NULL;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
@@ -942,14 +1452,17 @@ static void *multifd_recv_thread(void *opaque)
             break;
         }
 
-        used = p->pages->used;
+        /* the recv methods only see the pages that are sent whole */
+        used = p->pages->used - p->xbzrle_num;
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
-                           p->next_packet_size);
+        trace_multifd_recv(p->id, p->packet_num, used, p->zero_num,
+                           p->xbzrle_num, flags, p->next_packet_size);
         p->num_packets++;
         p->num_pages += used;
+        p->num_zero_pages += p->zero_num;
+        p->num_xbzrle_pages += p->xbzrle_num;
         qemu_mutex_unlock(&p->mutex);
 
         if (used) {
@@ -959,6 +1472,17 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        if (p->xbzrle_num) {
+            ret = multifd_recv_xbzrle_pages(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        }
+
+        if (p->zero_num) {
+            multifd_recv_zero_pages(p);
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -974,7 +1498,8 @@ static void *multifd_recv_thread(void *opaque)
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages, p->num_xbzrle_pages);
 
     return NULL;
 }
@@ -1003,6 +1528,7 @@ int multifd_load_setup(Error **errp)
         p->quit = false;
         p->id = i;
         p->pages = multifd_pages_init(page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(uint64_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
@@ -21,7 +21,10 @@ bool multifd_recv_all_channels_created(void);
 bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
 void multifd_send_sync_main(QEMUFile *f);
-int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
+int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                       bool xbzrle);
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr);
+int multifd_xbzrle_cache_resize(int64_t new_size, Error **errp);
 
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
@@ -42,12 +45,23 @@ typedef struct {
     uint32_t flags;
     /* maximum number of allocated pages */
     uint32_t pages_alloc;
+    /* number of pages with data (non zero pages) */
     uint32_t pages_used;
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
+    /* number of zero pages, only with multifd-zero-page */
+    uint32_t zero_pages;
+    /* number of XBZRLE encoded pages, the last ones of pages_used */
+    uint32_t xbzrle_pages;
+    uint64_t unused64[3];    /* Reserved for future use */
     char ramblock[256];
+    /*
+     * Offsets of the pages_used pages with data, followed by the
+     * offsets of the zero_pages zero pages.  The data of the encoded
+     * pages is sent after the data of the other pages, as an array of
+     * big endian 16 bit lengths followed by the encoded buffers.
+     */
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
 
@@ -63,6 +77,8 @@ typedef struct {
     /* pointer to each page */
     struct iovec *iov;
     RAMBlock *block;
+    /* XBZRLE encode the pages, only on the sending side */
+    bool xbzrle;
 } MultiFDPages_t;
 
 typedef struct {
@@ -102,6 +118,36 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages found by this channel */
+    uint64_t num_zero_pages;
+    /* zero pages not yet accounted by the migration thread */
+    uint64_t zero_pages_pending;
+    /* XBZRLE pages sent through this channel */
+    uint64_t num_xbzrle_pages;
+    /* offsets of the zero pages of the packet being sent */
+    ram_addr_t *zero;
+    /* number of zero pages of the packet being sent */
+    uint32_t zero_num;
+    /* XBZRLE statistics not yet accounted by the migration thread */
+    XBZRLECacheStats xbzrle_pending;
+    /* bitmap generation of the packet being sent */
+    uint64_t xbzrle_age;
+    /* XBZRLE encoded pages of the packet being sent */
+    uint32_t xbzrle_num;
+    /* size of their encoded data */
+    uint32_t xbzrle_size;
+    /* offsets of the encoded pages */
+    ram_addr_t *xbzrle_offset;
+    /* big endian length of each encoded page */
+    uint32_t *xbzrle_len;
+    /* encoded data */
+    uint8_t *xbzrle_encoded;
+    /* copies of the pages that are sent as they were cached */
+    uint8_t *xbzrle_copy;
+    /* shard of the XBZRLE cache owned by this channel */
+    struct PageCache *xbzrle_cache;
+    /* protects xbzrle_cache, other channels encode its pages too */
+    QemuMutex xbzrle_lock;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for compression methods */
@@ -141,6 +187,20 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages received through this channel */
+    uint64_t num_zero_pages;
+    /* offsets of the zero pages of the last packet */
+    ram_addr_t *zero;
+    /* number of zero pages of the last packet */
+    uint32_t zero_num;
+    /* XBZRLE pages received through this channel */
+    uint64_t num_xbzrle_pages;
+    /* number of XBZRLE encoded pages of the last packet */
+    uint32_t xbzrle_num;
+    /* lengths of the encoded pages of the last packet */
+    uint32_t *xbzrle_len;
+    /* encoded data of the last packet */
+    uint8_t *xbzrle_buf;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for de-compression methods */
@@ -23,6 +23,8 @@
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
+#include "socket.h"
+#include "qemu-file-channel.h"
 #include "qapi/error.h"
 #include "qemu/notify.h"
 #include "qemu/rcu.h"
@@ -539,8 +541,27 @@ static void postcopy_balloon_inhibit(bool state)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_preempt_thread) {
+        /*
+         * On success the source ends the urgent channel with an EOS, so
+         * the thread quits by itself; on failure kick it out.
+         */
+        if (mis->state == MIGRATION_STATUS_FAILED) {
+            atomic_set(&mis->postcopy_preempt_quit, true);
+            qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+            if (mis->postcopy_qemufile_dst) {
+                qemu_file_shutdown(mis->postcopy_qemufile_dst);
+            }
+        }
+        trace_postcopy_ram_incoming_cleanup_preempt_join();
+        qemu_thread_join(&mis->postcopy_prio_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -577,9 +598,13 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         }
     }
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[i];
+
+        if (tmp_page->tmp_huge_page) {
+            munmap(tmp_page->tmp_huge_page, mis->largest_page_size);
+            tmp_page->tmp_huge_page = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -1094,8 +1119,52 @@ retry:
     return NULL;
 }
 
+/*
+ * Loads the urgent pages that the source sends on the postcopy preempt
+ * channel, while the listen thread keeps loading the background stream.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret;
+
+    rcu_register_thread();
+
+    /* The source connects the channel asynchronously */
+    qemu_sem_wait(&mis->postcopy_qemufile_dst_done);
+    if (atomic_read(&mis->postcopy_preempt_quit)) {
+        rcu_unregister_thread();
+        return NULL;
+    }
+
+    trace_postcopy_preempt_thread_entry();
+    qemu_file_set_blocking(mis->postcopy_qemufile_dst, true);
+
+    /* Runs until the source sends RAM_SAVE_FLAG_EOS on the channel */
+    WITH_RCU_READ_LOCK_GUARD() {
+        ret = ram_load_postcopy(mis->postcopy_qemufile_dst,
+                                RAM_CHANNEL_POSTCOPY);
+    }
+    if (ret) {
+        /*
+         * Make sure the source notices; it pauses the migration and sends
+         * the urgent pages on the main channel once recovered.
+         */
+        error_report("%s: failed to load urgent pages: %d", __func__, ret);
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+    }
+
+    trace_postcopy_preempt_thread_exit(ret);
+    rcu_unregister_thread();
+    return NULL;
+}
+
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
+    int channels = migrate_postcopy_preempt() ? RAM_CHANNEL_MAX :
+                                                RAM_CHANNEL_POSTCOPY;
+    int i;
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -1134,14 +1203,20 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                                  PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                                  MAP_ANONYMOUS, -1, 0);
-    if (mis->postcopy_tmp_page == MAP_FAILED) {
-        mis->postcopy_tmp_page = NULL;
-        error_report("%s: Failed to map postcopy_tmp_page %s",
-                     __func__, strerror(errno));
-        return -1;
+    /* One temporary page per channel pages are received on */
+    for (i = 0; i < channels; i++) {
+        PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[i];
+
+        tmp_page->tmp_huge_page = mmap(NULL, mis->largest_page_size,
+                                       PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                                       MAP_ANONYMOUS, -1, 0);
+        if (tmp_page->tmp_huge_page == MAP_FAILED) {
+            tmp_page->tmp_huge_page = NULL;
+            error_report("%s: Failed to map postcopy_tmp_pages[%d] %s",
+                         __func__, i, strerror(errno));
+            return -1;
+        }
+        postcopy_temp_page_reset(tmp_page);
     }
 
     /*
@@ -1166,6 +1241,14 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
      */
     postcopy_balloon_inhibit(true);
 
+    if (migrate_postcopy_preempt()) {
+        mis->postcopy_preempt_quit = false;
+        qemu_thread_create(&mis->postcopy_prio_thread, "postcopy/preempt",
+                           postcopy_preempt_thread, mis,
+                           QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
@@ -1338,6 +1421,88 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * Called on the destination when the source opens the postcopy preempt
+ * channel; the preempt thread starts loading from it.
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    trace_postcopy_preempt_new_channel();
+    mis->postcopy_qemufile_dst = file;
+    qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+}
+
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        migrate_set_error(s, local_err);
+        error_free(local_err);
+    } else {
+        QEMUFile *file;
+
+        qio_channel_set_name(ioc, "migration-postcopy-preempt");
+        /* Urgent pages are flushed one by one, don't let them linger */
+        qio_channel_set_delay(ioc, false);
+        file = qemu_fopen_channel_output(ioc);
+
+        /*
+         * migrate_fd_cleanup() releases the channel under the same lock,
+         * so don't install it once the migration has been torn down.
+         */
+        qemu_mutex_lock(&s->qemu_file_lock);
+        if (migration_is_setup_or_active(s->state)) {
+            s->postcopy_qemufile_src = file;
+            file = NULL;
+        }
+        qemu_mutex_unlock(&s->qemu_file_lock);
+
+        if (file) {
+            trace_postcopy_preempt_send_channel_drop();
+            qemu_fclose(file);
+        } else {
+            trace_postcopy_preempt_send_channel_new();
+        }
+    }
+    object_unref(OBJECT(ioc));
+    /* postcopy_start() waits for this, whatever the outcome */
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+}
+
+/*
+ * Start opening the channel the source sends urgent postcopy pages on.
+ * The connection completes asynchronously; postcopy_start() waits for it.
+ *
+ * Returns 0 on success, -1 with @errp set if the migration can't use it.
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    if (!socket_send_channel_supported()) {
+        error_setg(errp, "Postcopy preempt requires a socket migration");
+        return -1;
+    }
+
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "Postcopy preempt does not support TLS");
+        return -1;
+    }
+
+    /* Drop the post of an earlier migration that never reached postcopy */
+    while (!qemu_sem_timedwait(&s->postcopy_qemufile_src_sem, 0)) {
+        /* nothing */
+    }
+
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+    return 0;
+}
+
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
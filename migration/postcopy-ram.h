@@ -34,6 +34,13 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis);
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
 
+/*
+ * Postcopy preempt: a second channel the source sends the pages the
+ * destination faulted on over, ahead of the background page stream.
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+
 /*
  * Userfault requires us to mark RAM as NOHUGEPAGE prior to discard
  * however leaving it until after precopy means that most of the precopy
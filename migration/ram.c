@@ -55,6 +55,19 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "sysemu/balloon.h"
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd)
+#include <linux/userfaultfd.h>
+#ifdef UFFDIO_WRITEPROTECT
+#define RAM_WRITE_TRACKING
+#endif
+#endif
 
 /***********************************************************/
 /* ram save/restore */
@@ -152,6 +165,8 @@ int xbzrle_cache_resize(int64_t new_size, Error **errp)
         cache_fini(XBZRLE.cache);
         XBZRLE.cache = new_cache;
     }
+
+    ret = multifd_xbzrle_cache_resize(new_size, errp);
 out:
     XBZRLE_cache_unlock();
     return ret;
@@ -353,6 +368,17 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /* Last block sent on the postcopy preempt channel */
+    RAMBlock *postcopy_last_sent_block;
+    /*
+     * Whether sending the host page at last_seen_block/last_page was
+     * interrupted to send urgent pages on the postcopy preempt channel
+     */
+    bool postcopy_preempted;
+    /* userfaultfd write-protecting RAM for a background snapshot, or -1 */
+    int uffdio_fd;
+    /* RAM was populated for write tracking and the balloon is inhibited */
+    bool write_tracking_prepared;
 };
 typedef struct RAMState RAMState;
 
@@ -409,6 +435,8 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* Page requested by the destination, sent on the preempt channel */
+    bool         urgent;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -669,6 +697,11 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
         return;
     }
 
+    if (migrate_use_multifd_xbzrle()) {
+        multifd_xbzrle_cache_zero_page(current_addr);
+        return;
+    }
+
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
     cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
@@ -978,6 +1011,7 @@ static void migration_bitmap_sync(RAMState *rs)
 {
     RAMBlock *block;
     int64_t end_time;
+    int64_t sync_start;
 
     ram_counters.dirty_sync_count++;
 
@@ -986,7 +1020,10 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 
     trace_migration_bitmap_sync_start();
+    sync_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     memory_global_dirty_log_sync();
+    ram_counters.dirty_sync_time += qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                    sync_start;
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
@@ -1178,7 +1215,11 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 {
     int pages = -1;
     uint8_t *p;
-    bool send_async = true;
+    /*
+     * With a background snapshot the page is writable again as soon as
+     * it has been saved, so it must be copied right away.
+     */
+    bool send_async = !migrate_background_snapshot();
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
     ram_addr_t current_addr = block->offset + offset;
@@ -1212,7 +1253,10 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
                                  ram_addr_t offset)
 {
-    if (multifd_queue_page(rs->f, block, offset) < 0) {
+    /* The multifd channels do the XBZRLE encoding, like in ram_save_page() */
+    bool xbzrle = !rs->ram_bulk_stage && migrate_use_multifd_xbzrle();
+
+    if (multifd_queue_page(rs->f, block, offset, xbzrle) < 0) {
         return -1;
     }
     ram_counters.normal++;
@@ -1401,6 +1445,384 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
     }
 }
 
+/*
+ * Background snapshots: guest RAM is write-protected with userfaultfd
+ * while the guest is paused, and a page the guest then tries to write
+ * is saved ahead of the linear scan before its protection is dropped,
+ * so that the stream holds RAM as it was when the guest was paused.
+ */
+#ifdef RAM_WRITE_TRACKING
+
+/* Whether @block is write-protected during a background snapshot */
+static bool ramblock_is_write_tracked(RAMBlock *block)
+{
+    /* The guest cannot change read-only memory */
+    return !block->mr->readonly && !block->mr->rom_device;
+}
+
+static int uffd_open_wp(Error **errp)
+{
+    struct uffdio_api api_struct = {
+        .api = UFFD_API,
+        .features = UFFD_FEATURE_PAGEFAULT_FLAG_WP,
+    };
+    int fd;
+
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Failed to open userfault descriptor");
+        return -1;
+    }
+
+    if (ioctl(fd, UFFDIO_API, &api_struct)) {
+        error_setg_errno(errp, errno,
+                         "userfaultfd write protection is not supported");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int uffd_register_wp(int fd, void *addr, uint64_t length,
+                            Error **errp)
+{
+    struct uffdio_register reg_struct = {
+        .range.start = (uintptr_t)addr,
+        .range.len = length,
+        .mode = UFFDIO_REGISTER_MODE_WP,
+    };
+
+    if (ioctl(fd, UFFDIO_REGISTER, &reg_struct)) {
+        error_setg_errno(errp, errno, "Failed to register %p+%" PRIx64
+                         " for write tracking", addr, length);
+        return -1;
+    }
+
+    /* Only anonymous private memory can be write-protected so far */
+    if (!(reg_struct.ioctls & (1ULL << _UFFDIO_WRITEPROTECT))) {
+        ioctl(fd, UFFDIO_UNREGISTER, &reg_struct.range);
+        error_setg(errp, "Memory at %p+%" PRIx64 " cannot be write-protected",
+                   addr, length);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void uffd_unregister(int fd, void *addr, uint64_t length)
+{
+    struct uffdio_range range = {
+        .start = (uintptr_t)addr,
+        .len = length,
+    };
+
+    ioctl(fd, UFFDIO_UNREGISTER, &range);
+}
+
+static int uffd_protect(int fd, void *addr, uint64_t length, bool wp)
+{
+    struct uffdio_writeprotect wp_struct = {
+        .range.start = (uintptr_t)addr,
+        .range.len = length,
+        .mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0,
+    };
+
+    if (ioctl(fd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        int ret = -errno;
+
+        error_report("%s: %s %p+%" PRIx64 " failed: %s", __func__,
+                     wp ? "protecting" : "unprotecting", addr, length,
+                     strerror(errno));
+        return ret;
+    }
+
+    return 0;
+}
+
+bool ram_write_tracking_available(void)
+{
+    int fd = uffd_open_wp(NULL);
+
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+bool ram_write_tracking_compatible(void)
+{
+    RAMBlock *block;
+    bool ret = true;
+    int fd;
+
+    fd = uffd_open_wp(NULL);
+    if (fd < 0) {
+        return false;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!ramblock_is_write_tracked(block)) {
+            continue;
+        }
+        if (uffd_register_wp(fd, block->host, block->max_length, NULL)) {
+            ret = false;
+            break;
+        }
+        uffd_unregister(fd, block->host, block->max_length);
+    }
+
+    close(fd);
+    return ret;
+}
+
+/*
+ * Write protection only applies to pages that are mapped, so touch every
+ * host page of @block first; reading maps the shared zero page for memory
+ * the guest never used, without allocating it.
+ */
+static void ram_block_populate_pages(RAMBlock *block)
+{
+    char *ptr = (char *)block->host;
+    ram_addr_t offset;
+
+    for (offset = 0; offset < block->used_length;
+         offset += block->page_size) {
+        char tmp = *(volatile char *)(ptr + offset);
+
+        /* Don't let the compiler drop the read */
+        asm volatile("" : "+r" (tmp));
+    }
+}
+
+/**
+ * ram_write_tracking_prepare: populate guest RAM for write tracking
+ *
+ * Touching all of guest RAM takes a while for large guests, so this is
+ * done before the guest is stopped and without the iothread lock.  Pages
+ * stay mapped once populated, as long as the balloon can't discard them.
+ */
+void ram_write_tracking_prepare(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    /* A page the balloon discards would lose its protection */
+    qemu_balloon_inhibit(true);
+    rs->write_tracking_prepared = true;
+
+    RCU_READ_LOCK_GUARD();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (ramblock_is_write_tracked(block)) {
+            ram_block_populate_pages(block);
+        }
+    }
+}
+
+/**
+ * ram_write_tracking_start: write-protect guest RAM
+ *
+ * Returns zero on success or negative on error
+ *
+ * Called after ram_write_tracking_prepare(), with the iothread lock held
+ * and the guest stopped; the guest must not be restarted from this thread
+ * after this, since the device code run on restart may write to the
+ * protected RAM.
+ */
+int ram_write_tracking_start(void)
+{
+    RAMState *rs = ram_state;
+    Error *local_err = NULL;
+    RAMBlock *block;
+    int fd;
+
+    assert(rs->write_tracking_prepared);
+
+    fd = uffd_open_wp(&local_err);
+    if (fd < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!ramblock_is_write_tracked(block)) {
+            continue;
+        }
+        if (uffd_register_wp(fd, block->host, block->max_length,
+                             &local_err)) {
+            error_prepend(&local_err, "RAM block '%s': ", block->idstr);
+            error_report_err(local_err);
+            goto fail;
+        }
+        if (uffd_protect(fd, block->host, block->used_length, true)) {
+            goto fail;
+        }
+        trace_ram_write_tracking_ramblock_start(block->idstr,
+                                                block->page_size,
+                                                block->host,
+                                                block->used_length);
+    }
+
+    rs->uffdio_fd = fd;
+    return 0;
+
+fail:
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!ramblock_is_write_tracked(block)) {
+            continue;
+        }
+        /* Unregistering drops any protection set up so far */
+        uffd_unregister(fd, block->host, block->max_length);
+    }
+    close(fd);
+    return -1;
+}
+
+/**
+ * ram_write_tracking_stop: drop write protection of guest RAM
+ *
+ * Wakes up everything still waiting on a protected page, and undoes
+ * ram_write_tracking_prepare().  Does nothing if write tracking was not
+ * prepared.
+ */
+void ram_write_tracking_stop(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs || !rs->write_tracking_prepared) {
+        return;
+    }
+    rs->write_tracking_prepared = false;
+    qemu_balloon_inhibit(false);
+
+    if (rs->uffdio_fd < 0) {
+        return;
+    }
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            if (!ramblock_is_write_tracked(block)) {
+                continue;
+            }
+            uffd_protect(rs->uffdio_fd, block->host, block->used_length,
+                         false);
+            uffd_unregister(rs->uffdio_fd, block->host, block->max_length);
+            trace_ram_write_tracking_ramblock_stop(block->idstr,
+                                                   block->page_size,
+                                                   block->host,
+                                                   block->used_length);
+        }
+    }
+
+    close(rs->uffdio_fd);
+    rs->uffdio_fd = -1;
+}
+
+/**
+ * poll_fault_page: get a page the guest is waiting to write to
+ *
+ * Returns the block of the page (or NULL if there is none), without
+ * blocking
+ *
+ * @rs: current RAM state
+ * @offset: used to return the offset of the host page within the RAMBlock
+ */
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    struct uffd_msg msg;
+    RAMBlock *block;
+    void *addr;
+
+    if (rs->uffdio_fd < 0) {
+        return NULL;
+    }
+
+    do {
+        if (read(rs->uffdio_fd, &msg, sizeof(msg)) != sizeof(msg)) {
+            /* Usually EAGAIN: nobody is waiting */
+            return NULL;
+        }
+    } while (msg.event != UFFD_EVENT_PAGEFAULT ||
+             !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP));
+
+    addr = (void *)(uintptr_t)msg.arg.pagefault.address;
+    block = qemu_ram_block_from_host(addr, false, offset);
+    if (!block) {
+        error_report("%s: write fault at %p outside of guest RAM",
+                     __func__, addr);
+        return NULL;
+    }
+
+    *offset = QEMU_ALIGN_DOWN(*offset, block->page_size);
+    trace_ram_write_tracking_fault(block->idstr, *offset);
+    return block;
+}
+
+/*
+ * Drop write protection of the host pages holding target pages @start to
+ * @end (exclusive) of @block, once they have been saved.
+ */
+static void ram_write_tracking_release(RAMState *rs, RAMBlock *block,
+                                       unsigned long start, unsigned long end)
+{
+    ram_addr_t offset, length;
+
+    if (rs->uffdio_fd < 0 || !ramblock_is_write_tracked(block)) {
+        return;
+    }
+
+    offset = QEMU_ALIGN_DOWN((ram_addr_t)start << TARGET_PAGE_BITS,
+                             block->page_size);
+    length = ROUND_UP((ram_addr_t)end << TARGET_PAGE_BITS,
+                      block->page_size) - offset;
+    length = MIN(length, block->used_length - offset);
+
+    uffd_protect(rs->uffdio_fd, block->host + offset, length, false);
+}
+
+#else /* !RAM_WRITE_TRACKING */
+
+bool ram_write_tracking_available(void)
+{
+    return false;
+}
+
+bool ram_write_tracking_compatible(void)
+{
+    return false;
+}
+
+void ram_write_tracking_prepare(void)
+{
+}
+
+int ram_write_tracking_start(void)
+{
+    error_report("%s: userfaultfd write protection is not supported",
+                 __func__);
+    return -1;
+}
+
+void ram_write_tracking_stop(void)
+{
+}
+
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    return NULL;
+}
+
+static void ram_write_tracking_release(RAMState *rs, RAMBlock *block,
+                                       unsigned long start, unsigned long end)
+{
+}
+
+#endif /* RAM_WRITE_TRACKING */
+
 /**
  * unqueue_page: gets a page of the queue
  *
@@ -1458,6 +1880,10 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     do {
         block = unqueue_page(rs, &offset);
+        if (!block) {
+            /* Next, pages the guest is waiting to write to, if any */
+            block = poll_fault_page(rs, &offset);
+        }
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -1659,6 +2085,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
 {
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    bool use_multifd;
     int res;
 
     if (control_save_page(rs, block, offset, &res)) {
@@ -1669,34 +2096,86 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
-    res = save_zero_page(rs, block, offset);
-    if (res > 0) {
-        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
-         * page would be stale
-         */
-        if (!save_page_use_compression(rs)) {
-            XBZRLE_cache_lock();
-            xbzrle_cache_zero_page(rs, block->offset + offset);
-            XBZRLE_cache_unlock();
-        }
-        ram_release_pages(block->idstr, offset, res);
-        return res;
-    }
-
     /*
      * Do not use multifd for:
      * 1. Compression as the first page in the new block should be posted out
      *    before sending the compressed page
      * 2. In postcopy as one whole host page should be placed
      */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+    use_multifd = !save_page_use_compression(rs) && migrate_use_multifd()
+                  && !migration_in_postcopy();
+
+    /*
+     * With multifd-zero-page the multifd channels look for zero pages
+     * in parallel, don't scan the page on the migration thread.
+     */
+    if (!use_multifd || !migrate_use_multifd_zero_page()) {
+        res = save_zero_page(rs, block, offset);
+        if (res > 0) {
+            /* Must let xbzrle know, otherwise a previous (now 0'd) cached
+             * page would be stale
+             */
+            if (!save_page_use_compression(rs)) {
+                XBZRLE_cache_lock();
+                xbzrle_cache_zero_page(rs, block->offset + offset);
+                XBZRLE_cache_unlock();
+            }
+            ram_release_pages(block->idstr, offset, res);
+            return res;
+        }
+    }
+
+    if (use_multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
     return ram_save_page(rs, pss, last_stage);
 }
 
+/*
+ * Whether pages the destination faults on go over the postcopy preempt
+ * channel.  That is only the case once postcopy has started, and until
+ * the first postcopy recovery, after which they share the main channel.
+ */
+static bool postcopy_preempt_active(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return migrate_postcopy_preempt() && migration_in_postcopy() &&
+           s->postcopy_qemufile_src;
+}
+
+/*
+ * Called between the target pages of a background host page: returns true
+ * to stop sending it if the destination is waiting for some page.
+ */
+static bool postcopy_preempt_triggered(RAMState *rs, PageSearchStatus *pss)
+{
+    if (pss->urgent || !postcopy_preempt_active() ||
+        QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests)) {
+        return false;
+    }
+
+    trace_postcopy_preempt_triggered(pss->block->idstr, pss->page);
+    rs->postcopy_preempted = true;
+    return true;
+}
+
+/* Whether @pss is in the host page whose sending was interrupted */
+static bool postcopy_preempt_in_interrupted_page(RAMState *rs,
+                                                 PageSearchStatus *pss)
+{
+    size_t pagesize_bits;
+
+    if (!rs->postcopy_preempted || pss->block != rs->last_seen_block) {
+        return false;
+    }
+
+    pagesize_bits = qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    return QEMU_ALIGN_DOWN(pss->page, pagesize_bits) ==
+           QEMU_ALIGN_DOWN(rs->last_page, pagesize_bits);
+}
+
 /**
  * ram_save_host_page: save a whole host page
  *
@@ -1721,12 +2200,17 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     int tmppages, pages = 0;
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long start_page = pss->page;
 
     if (ramblock_is_ignored(pss->block)) {
         error_report("block %s should not be migrated !", pss->block->idstr);
         return 0;
     }
 
+    if (!pss->urgent) {
+        rs->postcopy_preempted = false;
+    }
+
     do {
         /* Check the pages is dirty and if it is send it */
         if (!migration_bitmap_clear_dirty(rs, pss->block, pss->page)) {
@@ -1741,17 +2225,69 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
 
         pages += tmppages;
         pss->page++;
-        /* Allow rate limiting to happen in the middle of huge pages */
-        migration_rate_limit();
+        /*
+         * Allow rate limiting to happen in the middle of huge pages, but
+         * never hold back a page the destination is waiting for.
+         */
+        if (!pss->urgent) {
+            migration_rate_limit();
+        }
     } while ((pss->page & (pagesize_bits - 1)) &&
              offset_in_ramblock(pss->block,
-                                ((ram_addr_t)pss->page) << TARGET_PAGE_BITS));
+                                ((ram_addr_t)pss->page) << TARGET_PAGE_BITS) &&
+             !postcopy_preempt_triggered(rs, pss));
+
+    /* The pages have been copied to the stream, the guest may change them */
+    ram_write_tracking_release(rs, pss->block, start_page, pss->page);
 
     /* The offset we leave with is the last one we looked at */
     pss->page--;
     return pages;
 }
 
+/**
+ * postcopy_preempt_send_urgent: send a requested host page on the
+ *   postcopy preempt channel
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int postcopy_preempt_send_urgent(RAMState *rs, PageSearchStatus *pss,
+                                        bool last_stage)
+{
+    MigrationState *s = migrate_get_current();
+    QEMUFile *main_file = rs->f;
+    RAMBlock *main_last_sent_block = rs->last_sent_block;
+    int pages, ret;
+
+    trace_postcopy_preempt_send_urgent(pss->block->idstr, pss->page);
+
+    /* Each channel has its own RAM_SAVE_FLAG_CONTINUE state */
+    rs->f = s->postcopy_qemufile_src;
+    rs->last_sent_block = rs->postcopy_last_sent_block;
+    pss->urgent = true;
+
+    pages = ram_save_host_page(rs, pss, last_stage);
+    /* The destination is waiting for it, don't leave it in the buffer */
+    qemu_fflush(rs->f);
+    ret = qemu_file_get_error(rs->f);
+
+    rs->postcopy_last_sent_block = rs->last_sent_block;
+    rs->f = main_file;
+    rs->last_sent_block = main_last_sent_block;
+
+    if (ret) {
+        /* Fail the main channel too, so that the migration pauses */
+        qemu_file_set_error(rs->f, ret);
+        return ret;
+    }
+
+    return pages;
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -1781,6 +2317,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     pss.block = rs->last_seen_block;
     pss.page = rs->last_page;
     pss.complete_round = false;
+    pss.urgent = false;
 
     if (!pss.block) {
         pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
@@ -1790,6 +2327,26 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
         again = true;
         found = get_queued_page(rs, &pss);
 
+        if (found && postcopy_preempt_active()) {
+            if (!postcopy_preempt_in_interrupted_page(rs, &pss)) {
+                /*
+                 * The background search carries on from where it was
+                 * rather than from the urgent page, so that it can
+                 * finish any host page it was interrupted in.
+                 */
+                return postcopy_preempt_send_urgent(rs, &pss, last_stage);
+            }
+            /*
+             * The destination wants the rest of the host page we were
+             * sending; it can only be assembled from a single channel,
+             * so finish it on the main one.
+             */
+            trace_postcopy_preempt_restore(rs->last_seen_block->idstr,
+                                           rs->last_page);
+            pss.block = rs->last_seen_block;
+            pss.page = rs->last_page;
+        }
+
         if (!found) {
             /* priority queue empty, so just search for something dirty */
             found = find_dirty_block(rs, &pss, &again);
@@ -1889,7 +2446,9 @@ static void ram_save_cleanup(void *opaque)
     /* caller have hold iothread lock or is in a bh, so there is
      * no writing race against the migration bitmap
      */
-    memory_global_dirty_log_stop();
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_stop();
+    }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->clear_bmap);
@@ -1908,6 +2467,8 @@ static void ram_state_reset(RAMState *rs)
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
     rs->last_page = 0;
+    rs->postcopy_last_sent_block = NULL;
+    rs->postcopy_preempted = false;
     rs->last_version = ram_list.version;
     rs->ram_bulk_stage = true;
     rs->fpo_enabled = false;
@@ -2169,6 +2730,7 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms)
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
     rs->last_page = 0;
+    rs->postcopy_preempted = false;
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         /* Deal with TPS != HPS and huge pages */
@@ -2229,7 +2791,8 @@ static int xbzrle_init(void)
 {
     Error *local_err = NULL;
 
-    if (!migrate_use_xbzrle()) {
+    /* With multifd-xbzrle the cache is split between the multifd channels */
+    if (!migrate_use_xbzrle() || migrate_use_multifd_xbzrle()) {
         return 0;
     }
 
@@ -2290,6 +2853,7 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    (*rsp)->uffdio_fd = -1;
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -2349,8 +2913,14 @@ static void ram_init_bitmaps(RAMState *rs)
 
     WITH_RCU_READ_LOCK_GUARD() {
         ram_list_init_bitmaps();
-        memory_global_dirty_log_start();
-        migration_bitmap_sync_precopy(rs);
+        /*
+         * A background snapshot saves every page once, and tracks guest
+         * writes with write protection rather than dirty logging.
+         */
+        if (!migrate_background_snapshot()) {
+            memory_global_dirty_log_start();
+            migration_bitmap_sync_precopy(rs);
+        }
     }
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
@@ -2394,6 +2964,9 @@ static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
     rs->last_page = 0;
+    /* Urgent pages share the main channel after a recovery */
+    rs->postcopy_last_sent_block = NULL;
+    rs->postcopy_preempted = false;
     rs->last_version = ram_list.version;
     /*
      * Disable the bulk stage, otherwise we'll resend the whole RAM no
@@ -2638,7 +3211,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     int ret = 0;
 
     WITH_RCU_READ_LOCK_GUARD() {
-        if (!migration_in_postcopy()) {
+        if (!migration_in_postcopy() && !migrate_background_snapshot()) {
             migration_bitmap_sync_precopy(rs);
         }
 
@@ -2667,6 +3240,13 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     if (ret >= 0) {
         multifd_send_sync_main(rs->f);
+        if (postcopy_preempt_active()) {
+            /* Let the destination's preempt thread quit */
+            QEMUFile *file = migrate_get_current()->postcopy_qemufile_src;
+
+            qemu_put_be64(file, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(file);
+        }
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
     }
@@ -2685,7 +3265,7 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
 
-    if (!migration_in_postcopy() &&
+    if (!migration_in_postcopy() && !migrate_background_snapshot() &&
         remaining_size < max_size) {
         qemu_mutex_lock_iothread();
         WITH_RCU_READ_LOCK_GUARD() {
@@ -2744,12 +3324,16 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * Returns a pointer from within the RCU-protected ram_list.
  *
+ * @mis: the incoming migration state
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel @f belongs to; each one tracks its own last block
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
+                                              QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -2776,6 +3360,8 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
         return NULL;
     }
 
+    mis->last_recv_block[channel] = block;
+
     return block;
 }
 
@@ -3163,27 +3749,43 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
     return postcopy_ram_incoming_init(mis);
 }
 
+/**
+ * postcopy_temp_page_reset: forget the host page being assembled
+ *
+ * @tmp_page: the temporary page of a channel
+ */
+void postcopy_temp_page_reset(PostcopyTmpPage *tmp_page)
+{
+    tmp_page->host_addr = NULL;
+    tmp_page->target_pages = 0;
+    /* Assume we have a zero page until we detect something different */
+    tmp_page->all_zero = true;
+}
+
 /**
  * ram_load_postcopy: load a page in postcopy case
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt
+ * thread for the urgent page channel.
  * rcu_read_lock is taken prior to this being called.
  *
+ * The host page being assembled is kept in the temporary page of
+ * @channel, so a host page may span several calls: with postcopy-preempt
+ * the source can end a section in the middle of a host page.
+ *
  * @f: QEMUFile where to send the data
+ * @channel: the channel @f belongs to
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
-    void *this_host = NULL;
-    bool all_zero = true;
-    int target_pages = 0;
+    PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[channel];
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr;
@@ -3211,7 +3813,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(mis, f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -3219,7 +3821,7 @@ static int ram_load_postcopy(QEMUFile *f)
                 ret = -EINVAL;
                 break;
             }
-            target_pages++;
+            tmp_page->target_pages++;
             matches_target_page_size = block->page_size == TARGET_PAGE_SIZE;
             /*
              * Postcopy requires that we place whole host pages atomically;
@@ -3229,19 +3831,20 @@ static int ram_load_postcopy(QEMUFile *f)
              * that's moved into place later.
              * The migration protocol uses,  possibly smaller, target-pages
              * however the source ensures it always sends all the components
-             * of a host page in one chunk.
+             * of a host page in one chunk on one channel (with
+             * postcopy-preempt, possibly split over several sections).
              */
-            page_buffer = postcopy_host_page +
+            page_buffer = tmp_page->tmp_huge_page +
                           ((uintptr_t)host & (block->page_size - 1));
-            if (target_pages == 1) {
-                this_host = (void *)QEMU_ALIGN_DOWN((uintptr_t)host,
-                                                    block->page_size);
+            if (tmp_page->target_pages == 1) {
+                tmp_page->host_addr =
+                    (void *)QEMU_ALIGN_DOWN((uintptr_t)host, block->page_size);
             } else {
                 /* not the 1st TP within the HP */
                 if (QEMU_ALIGN_DOWN((uintptr_t)host, block->page_size) !=
-                    (uintptr_t)this_host) {
+                    (uintptr_t)tmp_page->host_addr) {
                     error_report("Non-same host page %p/%p",
-                                  host, this_host);
+                                  host, tmp_page->host_addr);
                     ret = -EINVAL;
                     break;
                 }
@@ -3251,10 +3854,11 @@ static int ram_load_postcopy(QEMUFile *f)
              * If it's the last part of a host page then we place the host
              * page
              */
-            if (target_pages == (block->page_size / TARGET_PAGE_SIZE)) {
+            if (tmp_page->target_pages ==
+                (block->page_size / TARGET_PAGE_SIZE)) {
                 place_needed = true;
             }
-            place_source = postcopy_host_page;
+            place_source = tmp_page->tmp_huge_page;
         }
 
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
@@ -3268,12 +3872,12 @@ static int ram_load_postcopy(QEMUFile *f)
                 memset(page_buffer, ch, TARGET_PAGE_SIZE);
             }
             if (ch) {
-                all_zero = false;
+                tmp_page->all_zero = false;
             }
             break;
 
         case RAM_SAVE_FLAG_PAGE:
-            all_zero = false;
+            tmp_page->all_zero = false;
             if (!matches_target_page_size) {
                 /* For huge pages, we always use temporary buffer */
                 qemu_get_buffer(f, page_buffer, TARGET_PAGE_SIZE);
@@ -3291,7 +3895,7 @@ static int ram_load_postcopy(QEMUFile *f)
             }
             break;
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
-            all_zero = false;
+            tmp_page->all_zero = false;
             len = qemu_get_be32(f);
             if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
@@ -3324,20 +3928,15 @@ static int ram_load_postcopy(QEMUFile *f)
 
         if (!ret && place_needed) {
             /* This gets called at the last target page in the host page */
-            void *place_dest = (void *)QEMU_ALIGN_DOWN((uintptr_t)host,
-                                                       block->page_size);
-
-            if (all_zero) {
-                ret = postcopy_place_page_zero(mis, place_dest,
+            if (tmp_page->all_zero) {
+                ret = postcopy_place_page_zero(mis, tmp_page->host_addr,
                                                block);
             } else {
-                ret = postcopy_place_page(mis, place_dest,
+                ret = postcopy_place_page(mis, tmp_page->host_addr,
                                           place_source, block);
             }
             place_needed = false;
-            target_pages = 0;
-            /* Assume we have a zero page until we detect something different */
-            all_zero = true;
+            postcopy_temp_page_reset(tmp_page);
         }
     }
 
@@ -3411,6 +4010,7 @@ static void colo_flush_ram_cache(void)
 static int ram_load_precopy(QEMUFile *f)
 {
     int flags = 0, ret = 0, invalid_flags = 0, len = 0, i = 0;
+    MigrationIncomingState *mis = migration_incoming_get_current();
     /* ADVISE is earlier, it shows the source has the postcopy capability on */
     bool postcopy_advised = postcopy_is_advised();
     if (!migrate_use_compression()) {
@@ -3448,7 +4048,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(mis, f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -3625,7 +4226,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -52,6 +52,8 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 /* For incoming postcopy discard */
 int ram_discard_range(const char *block_name, uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+void postcopy_temp_page_reset(struct PostcopyTmpPage *tmp_page);
+int ram_load_postcopy(QEMUFile *f, int channel);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
@@ -63,6 +65,13 @@ int64_t ramblock_recv_bitmap_send(QEMUFile *file,
                                   const char *block_name);
 int ram_dirty_bitmap_reload(MigrationState *s, RAMBlock *rb);
 
+/* Background snapshot */
+bool ram_write_tracking_available(void);
+bool ram_write_tracking_compatible(void);
+void ram_write_tracking_prepare(void);
+int ram_write_tracking_start(void);
+void ram_write_tracking_stop(void);
+
 /* ram cache */
 int colo_init_ram_cache(void);
 void colo_release_ram_cache(void);
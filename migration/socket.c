@@ -32,6 +32,15 @@ struct SocketOutgoingArgs {
     SocketAddress *saddr;
 } outgoing_args;
 
+/*
+ * Whether the outgoing migration goes over a socket, i.e. whether
+ * socket_send_channel_create() can open more channels to the destination.
+ */
+bool socket_send_channel_supported(void)
+{
+    return outgoing_args.saddr != NULL;
+}
+
 void socket_send_channel_create(QIOTaskFunc f, void *data)
 {
     QIOChannelSocket *sioc = qio_channel_socket_new();
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,16 +25,24 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+
+/*
+ * The encoder spends nearly all of its time finding where runs of equal
+ * (zrun) and of differing (nzrun) bytes end.  The scanning is done by
+ * these helpers, which return the length of such a run starting at
+ * @old_buf/@new_buf and not longer than @len, so that the encoding loop
+ * can be shared between the scalar and the vectorized implementations.
+ */
+typedef size_t (*xbzrle_run_fn)(const uint8_t *old_buf,
+                                const uint8_t *new_buf, size_t len);
+
+static inline QEMU_ALWAYS_INLINE int
+xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                   uint8_t *dst, int dlen,
+                   xbzrle_run_fn zrun, xbzrle_run_fn nzrun)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
+    uint32_t zrun_len, nzrun_len;
     int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
-
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
 
     while (i < slen) {
         /* overflow */
@@ -41,28 +50,8 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        zrun_len = zrun(old_buf + i, new_buf + i, slen - i);
+        i += zrun_len;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,56 +65,396 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        nzrun_len = nzrun(old_buf + i, new_buf + i, slen - i);
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i += nzrun_len;
     }
 
     return d;
 }
 
+/*
+ * Both buffers are aligned to sizeof(long) at the end of the page, so once
+ * the remaining length is a multiple of sizeof(long) they can be compared
+ * a word at a time.
+ */
+static size_t xbzrle_zrun_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                              size_t len)
+{
+    size_t i = 0;
+    size_t res = len % sizeof(long);
+
+    /* not aligned to sizeof(long) */
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed */
+    if (!res) {
+        while (i < len &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+
+        /* go over the rest */
+        while (i < len && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+    }
+
+    return i;
+}
+
+static size_t xbzrle_nzrun_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                               size_t len)
+{
+    size_t i = 0;
+    size_t res = len % sizeof(long);
+
+    /* not aligned to sizeof(long) */
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < len) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
+                i += sizeof(long);
+            }
+        }
+    }
+
+    return i;
+}
+
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_int, xbzrle_nzrun_int);
+}
+
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/*
+ * The vectorized helpers compare a whole vector at a time and locate the
+ * first byte that ends the run from the comparison mask.  They use
+ * unaligned loads, so they need no alignment prologue.
+ */
+static size_t xbzrle_zrun_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    while (i < len && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static size_t xbzrle_nzrun_sse2(const uint8_t *old_buf,
+                                const uint8_t *new_buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < len && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_sse2, xbzrle_nzrun_sse2);
+}
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static size_t xbzrle_zrun_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq != UINT32_MAX) {
+            return i + ctz32(~eq);
+        }
+    }
+    while (i < len && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static size_t xbzrle_nzrun_avx2(const uint8_t *old_buf,
+                                const uint8_t *new_buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < len && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_avx2, xbzrle_nzrun_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+/*
+ * AVX512F has no byte compares, so look for the 32-bit lane that ends the
+ * run and finish with a byte loop inside that lane.
+ */
+static size_t xbzrle_zrun_avx512(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        uint32_t ne = _mm512_cmpneq_epi32_mask(a, b);
+
+        if (ne) {
+            i += ctz32(ne) * 4;
+            break;
+        }
+    }
+    while (i < len && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static size_t xbzrle_nzrun_avx512(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, size_t len)
+{
+    const __m512i ones = _mm512_set1_epi32(0x01010101);
+    const __m512i highs = _mm512_set1_epi32(0x80808080);
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        __m512i x = _mm512_xor_si512(a, b);
+        /* Lanes of x that contain a zero byte, i.e. an equal byte */
+        __m512i t = _mm512_andnot_si512(x, _mm512_sub_epi32(x, ones));
+        uint32_t eq = _mm512_test_epi32_mask(t, highs);
+
+        if (eq) {
+            i += ctz32(eq) * 4;
+            break;
+        }
+    }
+    while (i < len && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_avx512, xbzrle_nzrun_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512F_OPT */
+
+/* Note that for test_xbzrle_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512F 1
+#define CACHE_AVX2    2
+#define CACHE_SSE2    4
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support CONFIG_AVX2_OPT.
+ */
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+# define INIT_CACHE 0
+# define INIT_ACCEL xbzrle_encode_buffer_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL xbzrle_encode_buffer_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static int (*encode_accel)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+
+    if (cache & CACHE_SSE2) {
+        fn = xbzrle_encode_buffer_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512F_OPT
+    if (cache & CACHE_AVX512F) {
+        fn = xbzrle_encode_buffer_avx512;
+    }
+#endif
+    encode_accel = fn;
+}
+
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* See util/bufferiszero.c for the XCR0 bits */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F)) {
+                cache |= CACHE_AVX512F;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT || CONFIG_AVX512F_OPT */
+
+bool test_xbzrle_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_buffer_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#else
+#define encode_accel xbzrle_encode_buffer_int
+bool test_xbzrle_next_accel(void)
+{
+    return false;
+}
+#endif
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
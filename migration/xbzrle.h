@@ -18,4 +18,10 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/*
+ * For use by tests and benchmarks: switch xbzrle_encode_buffer() to the
+ * next slower implementation.  Returns false if there is none left.
+ */
+bool test_xbzrle_next_accel(void);
 #endif
@@ -266,6 +266,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us\n",
+                       info->ram->dirty_sync_time);
         monitor_printf(mon, "page size: %" PRIu64 " kbytes\n",
                        info->ram->page_size >> 10);
         monitor_printf(mon, "multifd bytes: %" PRIu64 " kbytes\n",
@@ -322,6 +324,17 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->compression->compression_rate);
     }
 
+    if (info->has_dirty_ring) {
+        monitor_printf(mon, "dirty ring size: %" PRIu32 " entries\n",
+                       info->dirty_ring->ring_size);
+        monitor_printf(mon, "dirty ring reaps: %" PRIu64 "\n",
+                       info->dirty_ring->reap_count);
+        monitor_printf(mon, "dirty ring reaped pages: %" PRIu64 " pages\n",
+                       info->dirty_ring->reaped_pages);
+        monitor_printf(mon, "dirty ring full exits: %" PRIu64 "\n",
+                       info->dirty_ring->full_exits);
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -1483,7 +1483,7 @@ static void nbd_eject_notifier(Notifier *n, void *data)
 
 NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
                           uint64_t size, const char *name, const char *desc,
-                          const char *bitmap, bool readonly, bool shared,
+                          const char *bitmap, bool readonly, bool multi_conn,
                           void (*close)(NBDExport *), bool writethrough,
                           BlockBackend *on_eject_blk, Error **errp)
 {
@@ -1531,13 +1531,17 @@ NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
                      NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_CACHE);
     if (readonly) {
         exp->nbdflags |= NBD_FLAG_READ_ONLY;
-        if (shared) {
-            exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
-        }
     } else {
         exp->nbdflags |= (NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES |
                           NBD_FLAG_SEND_FAST_ZERO);
     }
+    /*
+     * All connections go through the same BlockBackend, so a flush on any
+     * of them covers writes completed on the others.
+     */
+    if (multi_conn) {
+        exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
     assert(size <= INT64_MAX - dev_offset);
     exp->size = QEMU_ALIGN_DOWN(size, BDRV_SECTOR_SIZE);
 
@@ -1841,7 +1845,20 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1 + !!iov[1].iov_len, errp);
 }
 
+/*
+ * Maximum number of chunks of a sparse read that are gathered into a single
+ * write to the socket.
+ */
+#define NBD_SPARSE_READ_MAX_CHUNKS 128
+
+typedef union NBDStructuredReadChunk {
+    NBDStructuredReadData data;
+    NBDStructuredReadHole hole;
+} NBDStructuredReadChunk;
+
 /* Do a sparse read and send the structured reply to the client.
+ * Data and hole chunks are sent straight from @data with scatter/gather
+ * I/O, batching up to NBD_SPARSE_READ_MAX_CHUNKS chunks per write.
  * Returns -errno if sending fails. bdrv_block_status_above() failure is
  * reported to the client, at which point this function succeeds.
  */
@@ -1855,6 +1872,11 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
     int ret = 0;
     NBDExport *exp = client->exp;
     size_t progress = 0;
+    g_autofree NBDStructuredReadChunk *chunks =
+        g_new(NBDStructuredReadChunk, NBD_SPARSE_READ_MAX_CHUNKS);
+    g_autofree struct iovec *iov =
+        g_new(struct iovec, 2 * NBD_SPARSE_READ_MAX_CHUNKS);
+    unsigned int nb_chunks = 0, niov = 0;
 
     while (progress < size) {
         int64_t pnum;
@@ -1862,33 +1884,38 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                                              offset + progress,
                                              size - progress, &pnum, NULL,
                                              NULL);
+        NBDStructuredReadChunk *chunk;
         bool final;
 
         if (status < 0) {
             char *msg = g_strdup_printf("unable to check for holes: %s",
                                         strerror(-status));
 
-            ret = nbd_co_send_structured_error(client, handle, -status, msg,
-                                               errp);
+            if (niov) {
+                ret = nbd_co_send_iov(client, iov, niov, errp);
+            }
+            if (ret == 0) {
+                ret = nbd_co_send_structured_error(client, handle, -status,
+                                                   msg, errp);
+            }
             g_free(msg);
             return ret;
         }
         assert(pnum && pnum <= size - progress);
         final = progress + pnum == size;
+        chunk = &chunks[nb_chunks++];
         if (status & BDRV_BLOCK_ZERO) {
-            NBDStructuredReadHole chunk;
-            struct iovec iov[] = {
-                {.iov_base = &chunk, .iov_len = sizeof(chunk)},
-            };
-
             trace_nbd_co_send_structured_read_hole(handle, offset + progress,
                                                    pnum);
-            set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+            set_be_chunk(&chunk->hole.h, final ? NBD_REPLY_FLAG_DONE : 0,
                          NBD_REPLY_TYPE_OFFSET_HOLE,
-                         handle, sizeof(chunk) - sizeof(chunk.h));
-            stq_be_p(&chunk.offset, offset + progress);
-            stl_be_p(&chunk.length, pnum);
-            ret = nbd_co_send_iov(client, iov, 1, errp);
+                         handle, sizeof(chunk->hole) - sizeof(chunk->hole.h));
+            stq_be_p(&chunk->hole.offset, offset + progress);
+            stl_be_p(&chunk->hole.length, pnum);
+            iov[niov++] = (struct iovec) {
+                .iov_base = &chunk->hole,
+                .iov_len = sizeof(chunk->hole),
+            };
         } else {
             ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
                             data + progress, pnum);
@@ -1896,15 +1923,30 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                 error_setg_errno(errp, -ret, "reading from file failed");
                 break;
             }
-            ret = nbd_co_send_structured_read(client, handle, offset + progress,
-                                              data + progress, pnum, final,
-                                              errp);
+            trace_nbd_co_send_structured_read(handle, offset + progress,
+                                              data + progress, pnum);
+            set_be_chunk(&chunk->data.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                         NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                         sizeof(chunk->data) - sizeof(chunk->data.h) + pnum);
+            stq_be_p(&chunk->data.offset, offset + progress);
+            iov[niov++] = (struct iovec) {
+                .iov_base = &chunk->data,
+                .iov_len = sizeof(chunk->data),
+            };
+            iov[niov++] = (struct iovec) {
+                .iov_base = data + progress,
+                .iov_len = pnum,
+            };
         }
+        progress += pnum;
 
-        if (ret < 0) {
-            break;
+        if (final || nb_chunks == NBD_SPARSE_READ_MAX_CHUNKS) {
+            ret = nbd_co_send_iov(client, iov, niov, errp);
+            if (ret < 0) {
+                break;
+            }
+            nb_chunks = niov = 0;
         }
-        progress += pnum;
     }
     return ret;
 }
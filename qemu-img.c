@@ -79,6 +79,7 @@ enum {
     OPTION_DISABLE = 273,
     OPTION_MERGE = 274,
     OPTION_BITMAPS = 275,
+    OPTION_STATS = 276,
 };
 
 typedef enum OutputFormat {
@@ -196,6 +197,7 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--stats' prints the amount of copied data and the throughput\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1664,7 +1666,7 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
+#define MAX_COROUTINES 64
 
 typedef struct ImgConvertState {
     BlockBackend **src;
@@ -1688,6 +1690,7 @@ typedef struct ImgConvertState {
     bool copy_range;
     bool salvage;
     bool quiet;
+    bool stats;
     int min_sparse;
     int alignment;
     size_t cluster_sectors;
@@ -1954,6 +1957,35 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/*
+ * Let the request that starts at @wr_offs go ahead with its write.  If
+ * @schedule is true, it only runs once the caller yields; otherwise it is
+ * entered immediately.
+ */
+static void convert_co_wake_writer(ImgConvertState *s, int64_t wr_offs,
+                                   bool schedule)
+{
+    int i;
+
+    s->wr_offs = wr_offs;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == wr_offs) {
+            if (schedule) {
+                s->wait_sector_num[i] = -1;
+                aio_co_schedule(qemu_get_current_aio_context(), s->co[i]);
+            } else {
+                /*
+                 * A -> B -> A cannot occur because A has
+                 * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                 * B will never enter A during this time window.
+                 */
+                qemu_coroutine_enter(s->co[i]);
+            }
+            break;
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -2027,6 +2059,16 @@ retry:
                 qemu_coroutine_yield();
             }
             s->wait_sector_num[index] = -1;
+
+            /*
+             * Compressed writes only need to be submitted in order, the
+             * driver allocates their host space in that same order.  Let
+             * the next request start compressing while this one is still
+             * in flight instead of serialising all of the compression.
+             */
+            if (s->compressed) {
+                convert_co_wake_writer(s, sector_num + n, true);
+            }
         }
 
         if (s->ret == -EINPROGRESS) {
@@ -2046,21 +2088,10 @@ retry:
             }
         }
 
-        if (s->wr_in_order) {
+        if (s->wr_in_order && !s->compressed) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_co_wake_writer(s, sector_num + n, false);
         }
     }
 
@@ -2141,6 +2172,19 @@ static int convert_do_copy(ImgConvertState *s)
     return s->ret;
 }
 
+static void convert_print_stats(ImgConvertState *s, int64_t elapsed_ns)
+{
+    uint64_t bytes = s->allocated_done * BDRV_SECTOR_SIZE;
+    double seconds = MAX(elapsed_ns, 1) / (double)NANOSECONDS_PER_SECOND;
+    char *bytes_str = size_to_str(bytes);
+    char *rate_str = size_to_str(bytes / seconds);
+
+    printf("Copied %s in %3.3f seconds (%s/s).\n",
+           bytes_str, seconds, rate_str);
+    g_free(bytes_str);
+    g_free(rate_str);
+}
+
 static int convert_copy_bitmaps(BlockDriverState *src, BlockDriverState *dst)
 {
     BdrvDirtyBitmap *bm;
@@ -2196,6 +2240,7 @@ static int img_convert(int argc, char **argv)
     bool force_share = false;
     bool explict_min_sparse = false;
     bool bitmaps = false;
+    int64_t start_time;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -2216,6 +2261,7 @@ static int img_convert(int argc, char **argv)
             {"salvage", no_argument, 0, OPTION_SALVAGE},
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
+            {"stats", no_argument, 0, OPTION_STATS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:Cco:l:S:pt:T:qnm:WU",
@@ -2344,6 +2390,9 @@ static int img_convert(int argc, char **argv)
         case OPTION_BITMAPS:
             bitmaps = true;
             break;
+        case OPTION_STATS:
+            s.stats = true;
+            break;
         }
     }
 
@@ -2689,7 +2738,11 @@ static int img_convert(int argc, char **argv)
         s.unallocated_blocks_are_zero = bdi.unallocated_blocks_are_zero;
     }
 
+    start_time = get_clock();
     ret = convert_do_copy(&s);
+    if (s.stats && ret == 0) {
+        convert_print_stats(&s, get_clock() - start_time);
+    }
 
     /* Now copy the bitmaps */
     if (bitmaps && ret == 0) {
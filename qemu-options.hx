@@ -123,6 +123,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                igd-passthru=on|off (enable Xen integrated Intel graphics passthrough, default=off)\n"
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
+    "                dirty-ring-size=n (KVM dirty ring entries per vCPU, default=0)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
 SRST
@@ -148,6 +149,17 @@ SRST
     ``kvm-shadow-mem=size``
         Defines the size of the KVM shadow MMU.
 
+    ``dirty-ring-size=n``
+        When KVM accelerator is used, it controls the size of the per-vCPU
+        dirty page ring buffer (number of entries for each vCPU). It should
+        be a value that is power of two, and it should be 1024 or bigger (but
+        still less than the maximum value that the kernel supports).  4096
+        could be a good initial value if you have no idea which is the best.
+        Set this value to 0 to disable the feature.  By default, this feature
+        is disabled (dirty-ring-size=0) and KVM records dirty pages in a
+        bitmap per memory slot, whose synchronization cost grows with the
+        guest size rather than with the number of dirtied pages.
+
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
@@ -4998,6 +5010,19 @@ SRST
         Multiple devices can be assigned to an IOThread. Note that not
         all devices support an ``iothread`` parameter.
 
+        A virtio-blk device can instead spread its virtqueues across
+        several IOThreads with the ``iothread-vq-mapping`` array
+        property, which cannot be combined with ``iothread``. Virtqueue
+        n is handled by the IOThread at index n modulo the number of
+        IOThreads listed, so there must be no more IOThreads than
+        virtqueues. Requests are still submitted to the disk from the
+        AioContext of the first IOThread:
+
+        ::
+
+            -object iothread,id=io0 -object iothread,id=io1
+            -device virtio-blk-pci,drive=drive0,num-queues=4,len-iothread-vq-mapping=2,iothread-vq-mapping[0]=io0,iothread-vq-mapping[1]=io1
+
         The ``query-iothreads`` QMP command lists IOThreads and reports
         their thread IDs so that the user can configure host CPU
         pinning/affinity.
@@ -4502,6 +4502,10 @@ void qemu_cleanup(void)
     vm_shutdown();
     replay_finish();
 
+    if (kvm_enabled()) {
+        kvm_dirty_ring_reaper_stop();
+    }
+
     job_cancel_sync_all();
     bdrv_close_all();
 
@@ -0,0 +1,78 @@
+/*
+ * Xor Based Zero Run Length Encoding speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/cutils.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define PAGES 256
+
+/*
+ * Pages in which every dirty_stride-th 64-byte block has changed, which is
+ * roughly what a guest that updates a few fields per record produces.  A
+ * stride of 0 means unchanged pages.
+ */
+static const int dirty_strides[] = { 0, 8, 1 };
+
+static double encode_speed(uint8_t *old, uint8_t *new, uint8_t *compressed)
+{
+    const size_t total = 1 * GiB;
+    size_t remain;
+    int i;
+
+    g_test_timer_start();
+    for (remain = total; remain; remain -= PAGES * PAGE_SIZE) {
+        for (i = 0; i < PAGES; i++) {
+            xbzrle_encode_buffer(old + i * PAGE_SIZE, new + i * PAGE_SIZE,
+                                 PAGE_SIZE, compressed, PAGE_SIZE);
+        }
+    }
+    g_test_timer_elapsed();
+
+    return (double)total / MiB / g_test_timer_last();
+}
+
+/* Runs every available encoder, from the fastest to the scalar one */
+static void test_encode_speed(void)
+{
+    uint8_t *old = g_malloc(PAGES * PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, j, accel = 0;
+
+    for (i = 0; i < PAGES * PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+
+    do {
+        g_print("\naccel %d:", accel++);
+        for (j = 0; j < ARRAY_SIZE(dirty_strides); j++) {
+            memcpy(new, old, PAGES * PAGE_SIZE);
+            if (dirty_strides[j]) {
+                for (i = 0; i < PAGES * PAGE_SIZE; i += dirty_strides[j] * 64) {
+                    new[i] ^= 0xff;
+                }
+            }
+            g_print(" stride %d %.2f MB/sec", dirty_strides[j],
+                    encode_speed(old, new, compressed));
+        }
+    } while (test_xbzrle_next_accel());
+    g_print("\n");
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/benchmark/encode", test_encode_speed);
+
+    return g_test_run();
+}
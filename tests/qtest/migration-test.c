@@ -465,6 +465,8 @@ typedef struct {
     bool use_shmem;
     /* only launch the target process */
     bool only_target;
+    /* send the pages faulted on during postcopy over a separate channel */
+    bool postcopy_preempt;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -703,6 +705,7 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     MigrateStart *args)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    bool postcopy_preempt = args->postcopy_preempt;
     QTestState *from, *to;
 
     if (test_migrate_start(&from, &to, uri, args)) {
@@ -713,6 +716,11 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -760,10 +768,23 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
-static void test_postcopy_recovery(void)
+static void test_postcopy_preempt(void)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
+
+    args->postcopy_preempt = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_recovery_common(MigrateStart *args)
+{
+    QTestState *from, *to;
     char *uri;
 
     args->hide_stderr = true;
@@ -823,6 +844,20 @@ static void test_postcopy_recovery(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_recovery(void)
+{
+    test_postcopy_recovery_common(migrate_start_new());
+}
+
+static void test_postcopy_preempt_recovery(void)
+{
+    MigrateStart *args = migrate_start_new();
+
+    /* The preempt channel is dropped on pause; recovery must not need it */
+    args->postcopy_preempt = true;
+    test_postcopy_recovery_common(args);
+}
+
 static void test_baddest(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -1099,6 +1134,61 @@ static void test_migrate_fd_proto(void)
     test_migrate_end(from, to, true);
 }
 
+static void test_background_snapshot(void)
+{
+    g_autofree char *path = g_strdup_printf("%s/snapshot", tmpfs);
+    g_autofree char *save_uri = g_strdup_printf("exec:cat > %s", path);
+    g_autofree char *load_uri = g_strdup_printf("exec:cat %s", path);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    /* Only accepted if the host can write-protect all of guest RAM */
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-capabilities',"
+                    "'arguments': { 'capabilities': [ {"
+                    "'capability': 'background-snapshot', 'state': true"
+                    "} ] } }");
+    if (qdict_haskey(rsp, "error")) {
+        qobject_unref(rsp);
+        g_test_skip("userfaultfd write protection not available");
+        qtest_quit(from);
+        qtest_quit(to);
+        cleanup("bootsect");
+        cleanup("src_serial");
+        cleanup("dest_serial");
+        return;
+    }
+    qobject_unref(rsp);
+
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, save_uri, "{}");
+    wait_for_migration_complete(from);
+
+    /* The guest kept running once its device state was saved */
+    rsp = wait_command(from, "{ 'execute': 'query-status' }");
+    g_assert(qdict_get_bool(rsp, "running"));
+    qobject_unref(rsp);
+
+    /* The snapshot is a normal migration stream */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", load_uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+    cleanup("snapshot");
+}
+
 static void do_test_validate_uuid(MigrateStart *args, bool should_fail)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -1260,7 +1350,8 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
-static void test_multifd_tcp(const char *method)
+static void test_multifd_tcp(const char *method, bool zero_page,
+                             bool xbzrle)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
@@ -1290,6 +1381,19 @@ static void test_multifd_tcp(const char *method)
     migrate_set_capability(from, "multifd", "true");
     migrate_set_capability(to, "multifd", "true");
 
+    if (zero_page) {
+        migrate_set_capability(from, "multifd-zero-page", "true");
+        migrate_set_capability(to, "multifd-zero-page", "true");
+    }
+
+    if (xbzrle) {
+        migrate_set_parameter_int(from, "xbzrle-cache-size", 33554432);
+        migrate_set_capability(from, "xbzrle", "true");
+        migrate_set_capability(to, "xbzrle", "true");
+        migrate_set_capability(from, "multifd-xbzrle", "true");
+        migrate_set_capability(to, "multifd-xbzrle", "true");
+    }
+
     /* Start incoming migration from the 1st socket */
     rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
                            "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
@@ -1320,18 +1424,28 @@ static void test_multifd_tcp(const char *method)
 
 static void test_multifd_tcp_none(void)
 {
-    test_multifd_tcp("none");
+    test_multifd_tcp("none", false, false);
+}
+
+static void test_multifd_tcp_zero_page(void)
+{
+    test_multifd_tcp("none", true, false);
+}
+
+static void test_multifd_tcp_xbzrle(void)
+{
+    test_multifd_tcp("none", true, true);
 }
 
 static void test_multifd_tcp_zlib(void)
 {
-    test_multifd_tcp("zlib");
+    test_multifd_tcp("zlib", false, false);
 }
 
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
-    test_multifd_tcp("zstd");
+    test_multifd_tcp("zstd", false, false);
 }
 #endif
 
@@ -1481,6 +1595,9 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/preempt/recovery",
+                   test_postcopy_preempt_recovery);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
@@ -1488,6 +1605,7 @@ int main(int argc, char **argv)
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/background_snapshot", test_background_snapshot);
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
     qtest_add_func("/migration/validate_uuid_error", test_validate_uuid_error);
     qtest_add_func("/migration/validate_uuid_src_not_set",
@@ -1497,6 +1615,9 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
     qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/zero-page",
+                   test_multifd_tcp_zero_page);
+    qtest_add_func("/migration/multifd/tcp/xbzrle", test_multifd_tcp_xbzrle);
     qtest_add_func("/migration/multifd/tcp/cancel", test_multifd_tcp_cancel);
     qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
 #ifdef CONFIG_ZSTD
@@ -10,9 +10,11 @@
 #include "qemu/osdep.h"
 #include "qemu/module.h"
 #include "qemu/units.h"
+#include "qemu/bswap.h"
 #include "libqtest.h"
 #include "libqos/qgraph.h"
 #include "libqos/pci.h"
+#include "block/nvme.h"
 
 typedef struct QNvme QNvme;
 
@@ -66,6 +68,71 @@ static void nvmetest_oob_cmb_test(void *obj, void *data, QGuestAllocator *alloc)
     g_assert_cmpint(qpci_io_readl(pdev, bar, cmb_bar_size - 1), !=, 0x44332211);
 }
 
+/*
+ * The NVMe block driver sizes its pool of I/O queue pairs from dword 0 of the
+ * Set Features (Number of Queues) completion, which reports how many queues
+ * the controller really allocated when fewer than requested are available.
+ */
+static void nvmetest_num_queues_test(void *obj, void *data,
+                                     QGuestAllocator *alloc)
+{
+    QNvme *nvme = obj;
+    QPCIDevice *pdev = &nvme->dev;
+    QTestState *qts = pdev->bus->qts;
+    QPCIBar bar;
+    uint64_t asq, acq;
+    NvmeCmd cmd;
+    NvmeCqe cqe;
+    uint32_t result;
+    int i;
+
+    qpci_device_enable(pdev);
+    bar = qpci_iomap(pdev, 0, NULL);
+
+    /* Two-entry admin queues, 4k pages, 64 byte SQEs and 16 byte CQEs */
+    asq = guest_alloc(alloc, 4096);
+    acq = guest_alloc(alloc, 4096);
+    qtest_memset(qts, acq, 0, 4096);
+    qpci_io_writel(pdev, bar, offsetof(NvmeBar, aqa), (1 << 16) | 1);
+    qpci_io_writel(pdev, bar, offsetof(NvmeBar, asq), asq);
+    qpci_io_writel(pdev, bar, offsetof(NvmeBar, asq) + 4, asq >> 32);
+    qpci_io_writel(pdev, bar, offsetof(NvmeBar, acq), acq);
+    qpci_io_writel(pdev, bar, offsetof(NvmeBar, acq) + 4, acq >> 32);
+    qpci_io_writel(pdev, bar, offsetof(NvmeBar, cc),
+                   (4 << 20) | (6 << 16) | 1);
+    g_assert_cmpint(qpci_io_readl(pdev, bar, offsetof(NvmeBar, csts)) & 1,
+                    ==, 1);
+
+    /* Ask for 63 I/O queues like block/nvme.c does */
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cid = cpu_to_le16(1),
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32((62 << 16) | 62),
+    };
+    qtest_memwrite(qts, asq, &cmd, sizeof(cmd));
+    qpci_io_writel(pdev, bar, 0x1000, 1);
+
+    /* The controller processes submissions from a timer */
+    for (i = 0; i < 100; i++) {
+        qtest_clock_step(qts, 1000);
+        qtest_memread(qts, acq, &cqe, sizeof(cqe));
+        if (le16_to_cpu(cqe.status) & 1) {
+            break;
+        }
+    }
+    g_assert_cmpint(le16_to_cpu(cqe.status), ==, 1);
+    g_assert_cmpint(le16_to_cpu(cqe.cid), ==, 1);
+
+    /* num_queues=5 includes the admin queue; both counts are zero-based */
+    result = le32_to_cpu(cqe.result);
+    g_assert_cmpint(result & 0xffff, ==, 3);
+    g_assert_cmpint(result >> 16, ==, 3);
+
+    guest_free(alloc, asq);
+    guest_free(alloc, acq);
+}
+
 static void nvme_register_nodes(void)
 {
     QOSGraphEdgeOptions opts = {
@@ -83,6 +150,10 @@ static void nvme_register_nodes(void)
     qos_add_test("oob-cmb-access", "nvme", nvmetest_oob_cmb_test, &(QOSGraphTestOptions) {
         .edge.extra_device_opts = "cmb_size_mb=2"
     });
+    qos_add_test("num-queues", "nvme", nvmetest_num_queues_test,
+                 &(QOSGraphTestOptions) {
+        .edge.extra_device_opts = "num_queues=5"
+    });
 }
 
 libqos_init(nvme_register_nodes);
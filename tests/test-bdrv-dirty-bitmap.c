@@ -0,0 +1,178 @@
+/*
+ * Block dirty bitmap tests
+ *
+ * Copyright Red Hat, Inc. 2020
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block.h"
+#include "block/block_int.h"
+#include "block/dirty-bitmap.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+
+#define GRANULARITY 4096
+
+typedef struct TestData {
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *enabled;
+    BdrvDirtyBitmap *disabled;
+} TestData;
+
+static void test_data_init(TestData *data)
+{
+    data->bs = bdrv_open("null-co://", NULL, NULL, BDRV_O_RDWR,
+                         &error_abort);
+    data->enabled = bdrv_create_dirty_bitmap(data->bs, GRANULARITY,
+                                             "enabled", &error_abort);
+    data->disabled = bdrv_create_dirty_bitmap(data->bs, GRANULARITY,
+                                              "disabled", &error_abort);
+    bdrv_disable_dirty_bitmap(data->disabled);
+}
+
+static void test_data_destroy(TestData *data)
+{
+    bdrv_release_dirty_bitmap(data->enabled);
+    bdrv_release_dirty_bitmap(data->disabled);
+    bdrv_unref(data->bs);
+}
+
+/* Pending ranges only reach the bitmaps that are enabled */
+static void test_pending_enabled_only(void)
+{
+    TestData data;
+
+    test_data_init(&data);
+
+    bdrv_set_dirty(data.bs, 0, GRANULARITY);
+    bdrv_set_dirty(data.bs, 4 * GRANULARITY, GRANULARITY);
+    g_assert_cmpint(data.bs->dirty_pending_count, ==, 2);
+
+    g_assert_cmpint(bdrv_get_dirty_count(data.enabled), ==, 2 * GRANULARITY);
+    g_assert_cmpint(data.bs->dirty_pending_count, ==, 0);
+    g_assert(bdrv_dirty_bitmap_get(data.enabled, 0));
+    g_assert(!bdrv_dirty_bitmap_get(data.enabled, GRANULARITY));
+    g_assert(bdrv_dirty_bitmap_get(data.enabled, 4 * GRANULARITY));
+    g_assert_cmpint(bdrv_get_dirty_count(data.disabled), ==, 0);
+
+    test_data_destroy(&data);
+}
+
+/* Touching ranges are merged into a single batch entry */
+static void test_pending_merge(void)
+{
+    TestData data;
+
+    test_data_init(&data);
+
+    bdrv_set_dirty(data.bs, GRANULARITY, GRANULARITY);
+    bdrv_set_dirty(data.bs, 2 * GRANULARITY, GRANULARITY);
+    bdrv_set_dirty(data.bs, 0, GRANULARITY);
+    g_assert_cmpint(data.bs->dirty_pending_count, ==, 1);
+
+    g_assert_cmpint(bdrv_get_dirty_count(data.enabled), ==, 3 * GRANULARITY);
+
+    test_data_destroy(&data);
+}
+
+/*
+ * A reset must not be undone by a range that was written before it but is
+ * only applied afterwards.
+ */
+static void test_pending_flush_reset(void)
+{
+    TestData data;
+
+    test_data_init(&data);
+
+    bdrv_set_dirty(data.bs, 0, 2 * GRANULARITY);
+    bdrv_reset_dirty_bitmap(data.enabled, 0, GRANULARITY);
+    g_assert_cmpint(bdrv_get_dirty_count(data.enabled), ==, GRANULARITY);
+
+    bdrv_set_dirty(data.bs, 8 * GRANULARITY, GRANULARITY);
+    bdrv_clear_dirty_bitmap(data.enabled, NULL);
+    g_assert_cmpint(bdrv_get_dirty_count(data.enabled), ==, 0);
+
+    test_data_destroy(&data);
+}
+
+/*
+ * Writes issued while a bitmap is enabled are recorded even if it is
+ * disabled before the batch is flushed, and writes issued while it is
+ * disabled are not recorded once it is enabled again.
+ */
+static void test_pending_flush_enable_disable(void)
+{
+    TestData data;
+
+    test_data_init(&data);
+
+    bdrv_set_dirty(data.bs, 0, GRANULARITY);
+    bdrv_disable_dirty_bitmap(data.enabled);
+    g_assert_cmpint(data.bs->dirty_pending_count, ==, 0);
+
+    bdrv_set_dirty(data.bs, 4 * GRANULARITY, GRANULARITY);
+    bdrv_enable_dirty_bitmap(data.disabled);
+    g_assert_cmpint(data.bs->dirty_pending_count, ==, 0);
+
+    g_assert_cmpint(bdrv_get_dirty_count(data.enabled), ==, GRANULARITY);
+    g_assert(bdrv_dirty_bitmap_get(data.enabled, 0));
+    g_assert_cmpint(bdrv_get_dirty_count(data.disabled), ==, 0);
+
+    test_data_destroy(&data);
+}
+
+/* A full batch is flushed together with the write that does not fit */
+static void test_pending_full(void)
+{
+    TestData data;
+    int i;
+
+    test_data_init(&data);
+
+    for (i = 0; i < BDRV_DIRTY_PENDING_MAX; i++) {
+        bdrv_set_dirty(data.bs, 2 * i * GRANULARITY, GRANULARITY);
+    }
+    g_assert_cmpint(data.bs->dirty_pending_count, ==, BDRV_DIRTY_PENDING_MAX);
+
+    /* Merging into the last entry still works on a full batch */
+    bdrv_set_dirty(data.bs, (2 * i - 1) * GRANULARITY, GRANULARITY);
+    g_assert_cmpint(data.bs->dirty_pending_count, ==, BDRV_DIRTY_PENDING_MAX);
+
+    bdrv_set_dirty(data.bs, (2 * i + 1) * GRANULARITY, GRANULARITY);
+    g_assert_cmpint(data.bs->dirty_pending_count, ==, 0);
+
+    g_assert_cmpint(bdrv_get_dirty_count(data.enabled), ==,
+                    (BDRV_DIRTY_PENDING_MAX + 2) * GRANULARITY);
+    for (i = 0; i < BDRV_DIRTY_PENDING_MAX; i++) {
+        g_assert(bdrv_dirty_bitmap_get(data.enabled, 2 * i * GRANULARITY));
+    }
+    g_assert(bdrv_dirty_bitmap_get(data.enabled, (2 * i - 1) * GRANULARITY));
+    g_assert(!bdrv_dirty_bitmap_get(data.enabled, 2 * i * GRANULARITY));
+    g_assert(bdrv_dirty_bitmap_get(data.enabled, (2 * i + 1) * GRANULARITY));
+    g_assert_cmpint(bdrv_get_dirty_count(data.disabled), ==, 0);
+
+    test_data_destroy(&data);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/bdrv-dirty-bitmap/pending/enabled-only",
+                    test_pending_enabled_only);
+    g_test_add_func("/bdrv-dirty-bitmap/pending/merge", test_pending_merge);
+    g_test_add_func("/bdrv-dirty-bitmap/pending/flush-reset",
+                    test_pending_flush_reset);
+    g_test_add_func("/bdrv-dirty-bitmap/pending/flush-enable-disable",
+                    test_pending_flush_enable_disable);
+    g_test_add_func("/bdrv-dirty-bitmap/pending/full", test_pending_full);
+
+    return g_test_run();
+}
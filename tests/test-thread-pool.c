@@ -4,6 +4,7 @@
 #include "block/thread-pool.h"
 #include "block/block.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-block-core.h"
 #include "qemu/timer.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
@@ -136,6 +137,36 @@ static void test_submit_many(void)
     }
 }
 
+static int64_t count_requests(void)
+{
+    ThreadPoolNodeInfoList *list, *l;
+    int64_t requests = 0;
+
+    list = qmp_query_thread_pool(&error_abort);
+    g_assert(list);
+    for (l = list; l; l = l->next) {
+        g_assert_cmpint(l->value->workers, <=, 64);
+        requests += l->value->requests;
+    }
+    qapi_free_ThreadPoolNodeInfoList(list);
+    return requests;
+}
+
+static void test_stats(void)
+{
+    int64_t before = count_requests();
+    Error *local_err = NULL;
+
+    test_submit_many();
+    g_assert_cmpint(count_requests() - before, ==, 100);
+
+    qmp_set_thread_pool_parameters(true, 0, false, false, &local_err);
+    error_free_or_abort(&local_err);
+    qmp_set_thread_pool_parameters(true, 8, false, false, &error_abort);
+    test_submit_many();
+    qmp_set_thread_pool_parameters(true, 64, false, false, &error_abort);
+}
+
 static void do_test_cancel(bool sync)
 {
     WorkerTestData data[100];
@@ -243,6 +274,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/stats", test_stats);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
 
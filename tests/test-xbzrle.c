@@ -174,6 +174,76 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_PAGES 64
+
+/*
+ * Every encoder implementation must produce exactly the same output,
+ * including the overflow result when the destination is too small.
+ */
+static void test_encode_decode_accel(void)
+{
+    uint8_t *old = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *new = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *ref = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc(PAGE_SIZE);
+    int ref_len[ACCEL_PAGES];
+    int dlen[ACCEL_PAGES];
+    bool first = true;
+    int i, j, rc;
+
+    for (i = 0; i < ACCEL_PAGES * PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, ACCEL_PAGES * PAGE_SIZE);
+
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        uint8_t *page = new + i * PAGE_SIZE;
+        int runs = g_test_rand_int_range(0, 4 << (i % 8));
+
+        for (j = 0; j < runs; j++) {
+            int start = g_test_rand_int_range(0, PAGE_SIZE);
+            int len = g_test_rand_int_range(1, MIN(200, PAGE_SIZE - start + 1));
+
+            while (len--) {
+                page[start++] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+        dlen[i] = i % 3 ? PAGE_SIZE : g_test_rand_int_range(0, PAGE_SIZE);
+    }
+
+    do {
+        for (i = 0; i < ACCEL_PAGES; i++) {
+            rc = xbzrle_encode_buffer(old + i * PAGE_SIZE, new + i * PAGE_SIZE,
+                                      PAGE_SIZE, compressed, dlen[i]);
+            if (first) {
+                ref_len[i] = rc;
+                if (rc > 0) {
+                    memcpy(ref + i * PAGE_SIZE, compressed, rc);
+                }
+            } else {
+                g_assert_cmpint(rc, ==, ref_len[i]);
+                g_assert(rc <= 0 ||
+                         memcmp(ref + i * PAGE_SIZE, compressed, rc) == 0);
+            }
+
+            if (rc >= 0) {
+                memcpy(test, old + i * PAGE_SIZE, PAGE_SIZE);
+                g_assert(xbzrle_decode_buffer(compressed, rc, test,
+                                              PAGE_SIZE) >= 0);
+                g_assert(memcmp(test, new + i * PAGE_SIZE, PAGE_SIZE) == 0);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(compressed);
+    g_free(test);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +256,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* Must come last, it disables the accelerated encoders */
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
 
     return g_test_run();
 }
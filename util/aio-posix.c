@@ -653,6 +653,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
         progress |= aio_dispatch_ready_handlers(ctx, &ready_list);
     }
 
+    if (ctx->fdmon_ops->dispatch) {
+        progress |= ctx->fdmon_ops->dispatch(ctx);
+    }
+
     aio_free_deleted_handlers(ctx);
 
     qemu_lockcnt_dec(&ctx->list_lock);
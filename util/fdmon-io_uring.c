@@ -19,9 +19,13 @@
  * 4. Nanosecond timeouts are supported so it requires fewer syscalls than
  *    epoll(7).
  *
- * This code only monitors file descriptors and does not do asynchronous disk
- * I/O.  Implementing disk I/O efficiently has other requirements and should
- * use a separate io_uring so it does not make sense to unify the code.
+ * Other users can queue their own requests on the same io_uring with
+ * aio_add_sqe(), for example block/io_uring.c does so for disk I/O.  Their
+ * sqes are submitted together with the poll requests in the next call to
+ * fdmon_io_uring_wait(), and their cqes are handed to a CqeHandler
+ * callback in fdmon_io_uring_dispatch().  This saves the system calls and
+ * the wakeups of a separate ring.  A registered file table is available to
+ * such users via aio_register_fixed_file().
  *
  * File descriptor monitoring is implemented using the following operations:
  *
@@ -37,19 +41,27 @@
  * io_uring calls the submission queue the "sq ring" and the completion queue
  * the "cq ring".  Ring entries are called "sqe" and "cqe", respectively.
  *
- * The code is structured so that sq/cq rings are only modified within
- * fdmon_io_uring_wait().  Changes to AioHandlers are made by enqueuing them on
- * ctx->submit_list so that fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD
- * and/or IORING_OP_POLL_REMOVE sqes for them.
+ * The code is structured so that sq/cq rings are only modified by the
+ * AioContext home thread, within fdmon_io_uring_wait() or aio_add_sqe().
+ * Changes to AioHandlers are made by enqueuing them on ctx->submit_list so
+ * that fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD and/or
+ * IORING_OP_POLL_REMOVE sqes for them.
+ *
+ * While external clients are disabled, the io_uring is still used so that
+ * aio_add_sqe() requests keep completing.  External handlers that become
+ * ready in the meantime are "parked" on ctx->io_uring_parked_handlers and
+ * dispatched once external clients are enabled again.
  */
 
 #include "qemu/osdep.h"
 #include <poll.h>
+#include "block/aio-wait.h"
 #include "qemu/rcu_queue.h"
 #include "aio-posix.h"
 
 enum {
     FDMON_IO_URING_ENTRIES  = 128, /* sq/cq ring size */
+    FDMON_IO_URING_FIXED_FILES = 64, /* registered file table size */
 
     /* AioHandler::flags */
     FDMON_IO_URING_PENDING  = (1 << 0),
@@ -57,6 +69,12 @@ enum {
     FDMON_IO_URING_REMOVE   = (1 << 2),
 };
 
+/*
+ * user_data of sqes added with aio_add_sqe() is a CqeHandler pointer tagged
+ * with this bit; untagged user_data is an AioHandler pointer or zero.
+ */
+#define FDMON_IO_URING_CQE_HANDLER 1
+
 static inline int poll_events_from_pfd(int pfd_events)
 {
     return (pfd_events & G_IO_IN ? POLLIN : 0) |
@@ -75,7 +93,7 @@ static inline int pfd_events_from_poll(int poll_events)
 
 /*
  * Returns an sqe for submitting a request.  Only be called within
- * fdmon_io_uring_wait().
+ * fdmon_io_uring_wait() or aio_add_sqe().
  */
 static struct io_uring_sqe *get_sqe(AioContext *ctx)
 {
@@ -210,24 +228,65 @@ static void fill_sq_ring(AioContext *ctx)
             add_poll_add_sqe(ctx, node);
         }
         if (flags & FDMON_IO_URING_REMOVE) {
-            add_poll_remove_sqe(ctx, node);
+            if (QLIST_IS_INSERTED(node, node_parked)) {
+                /*
+                 * The IORING_OP_POLL_ADD has already completed, so there is
+                 * nothing to cancel and the handler can go away right now.
+                 */
+                QLIST_REMOVE(node, node_parked);
+                atomic_and(&node->flags, ~FDMON_IO_URING_REMOVE);
+                QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node,
+                                      node_deleted);
+            } else {
+                add_poll_remove_sqe(ctx, node);
+            }
         }
     }
 }
 
+/*
+ * Dispatch and re-arm handlers that became ready while external clients
+ * were disabled.  Returns the number of handlers added to ready_list.
+ */
+static int unpark_handlers(AioContext *ctx, AioHandlerList *ready_list)
+{
+    AioHandler *node;
+    int n = 0;
+
+    while ((node = QLIST_FIRST(&ctx->io_uring_parked_handlers))) {
+        QLIST_REMOVE(node, node_parked);
+        aio_add_ready_handler(ready_list, node, node->pfd.revents);
+        add_poll_add_sqe(ctx, node);
+        n++;
+    }
+    return n;
+}
+
 /* Returns true if a handler became ready */
 static bool process_cqe(AioContext *ctx,
                         AioHandlerList *ready_list,
                         struct io_uring_cqe *cqe)
 {
-    AioHandler *node = io_uring_cqe_get_data(cqe);
+    uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+    AioHandler *node;
     unsigned flags;
 
     /* poll_timeout and poll_remove have a zero user_data field */
-    if (!node) {
+    if (!data) {
         return false;
     }
 
+    if (data & FDMON_IO_URING_CQE_HANDLER) {
+        CqeHandler *cqe_handler = (CqeHandler *)(data &
+                                                 ~FDMON_IO_URING_CQE_HANDLER);
+
+        cqe_handler->cqe = *cqe;
+        QSIMPLEQ_INSERT_TAIL(&ctx->cqe_handler_ready_list, cqe_handler, next);
+        return true;
+    }
+
+    node = (AioHandler *)data;
+
     /*
      * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we race
      * with enqueue() here then we can safely clear the FDMON_IO_URING_REMOVE
@@ -239,6 +298,13 @@ static bool process_cqe(AioContext *ctx,
         return false;
     }
 
+    if (!aio_node_check(ctx, node->is_external)) {
+        /* Re-armed by unpark_handlers() once external clients are enabled */
+        node->pfd.revents = pfd_events_from_poll(cqe->res);
+        QLIST_INSERT_HEAD(&ctx->io_uring_parked_handlers, node, node_parked);
+        return false;
+    }
+
     aio_add_ready_handler(ready_list, node, pfd_events_from_poll(cqe->res));
 
     /* IORING_OP_POLL_ADD is one-shot so we must re-arm it */
@@ -270,28 +336,49 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
                                int64_t timeout)
 {
     unsigned wait_nr = 1; /* block until at least one cqe is ready */
+    int num_ready = 0;
     int ret;
 
-    /* Fall back while external clients are disabled */
-    if (atomic_read(&ctx->external_disable_cnt)) {
-        return fdmon_poll_ops.wait(ctx, ready_list, timeout);
+    fill_sq_ring(ctx);
+
+    if (!atomic_read(&ctx->external_disable_cnt)) {
+        num_ready = unpark_handlers(ctx, ready_list);
     }
 
-    if (timeout == 0) {
+    if (timeout == 0 || num_ready ||
+        io_uring_cq_ready(&ctx->fdmon_io_uring)) {
         wait_nr = 0; /* non-blocking */
     } else if (timeout > 0) {
         add_timeout_sqe(ctx, timeout);
     }
 
-    fill_sq_ring(ctx);
+    /* Skip the system call if there is nothing to submit or wait for */
+    if (wait_nr || io_uring_sq_ready(&ctx->fdmon_io_uring)) {
+        do {
+            ret = io_uring_submit_and_wait(&ctx->fdmon_io_uring, wait_nr);
+        } while (ret == -EINTR);
 
-    do {
-        ret = io_uring_submit_and_wait(&ctx->fdmon_io_uring, wait_nr);
-    } while (ret == -EINTR);
+        assert(ret >= 0);
+    }
 
-    assert(ret >= 0);
+    return num_ready + process_cq_ring(ctx, ready_list);
+}
+
+static bool fdmon_io_uring_dispatch(AioContext *ctx)
+{
+    CqeHandler *cqe_handler;
+    bool progress = false;
 
-    return process_cq_ring(ctx, ready_list);
+    /*
+     * Callbacks may run a nested event loop, which continues where we left
+     * off, so always take the first element instead of iterating.
+     */
+    while ((cqe_handler = QSIMPLEQ_FIRST(&ctx->cqe_handler_ready_list))) {
+        QSIMPLEQ_REMOVE_HEAD(&ctx->cqe_handler_ready_list, next);
+        cqe_handler->cb(cqe_handler);
+        progress = true;
+    }
+    return progress;
 }
 
 static bool fdmon_io_uring_need_wait(AioContext *ctx)
@@ -311,16 +398,127 @@ static bool fdmon_io_uring_need_wait(AioContext *ctx)
         return true;
     }
 
-    /* Are we falling back to fdmon-poll? */
-    return atomic_read(&ctx->external_disable_cnt);
+    /* Are there parked handlers that can be dispatched now? */
+    return !QLIST_EMPTY(&ctx->io_uring_parked_handlers) &&
+           !atomic_read(&ctx->external_disable_cnt);
 }
 
 static const FDMonOps fdmon_io_uring_ops = {
     .update = fdmon_io_uring_update,
     .wait = fdmon_io_uring_wait,
     .need_wait = fdmon_io_uring_need_wait,
+    .dispatch = fdmon_io_uring_dispatch,
 };
 
+bool aio_has_io_uring(AioContext *ctx)
+{
+    return ctx->fdmon_ops == &fdmon_io_uring_ops;
+}
+
+void aio_add_sqe(AioContext *ctx,
+                 void (*prep_sqe)(struct io_uring_sqe *sqe, void *opaque),
+                 void *opaque, CqeHandler *cqe_handler)
+{
+    struct io_uring_sqe *sqe;
+
+    assert(aio_has_io_uring(ctx));
+    assert(in_aio_context_home_thread(ctx));
+    assert(!((uintptr_t)cqe_handler & FDMON_IO_URING_CQE_HANDLER));
+
+    sqe = get_sqe(ctx);
+    prep_sqe(sqe, opaque);
+    io_uring_sqe_set_data(sqe, (void *)((uintptr_t)cqe_handler |
+                                        FDMON_IO_URING_CQE_HANDLER));
+}
+
+/*
+ * Registered files save the kernel from looking up and referencing the file
+ * on every request.  The table is registered once with empty slots when the
+ * ring is created, because registering it later would have to wait for all
+ * in-flight requests, including the poll requests that may never complete.
+ * Slots are then filled and cleared with IORING_REGISTER_FILES_UPDATE.
+ */
+static void fixed_files_setup(AioContext *ctx)
+{
+    int *files = g_new(int, FDMON_IO_URING_FIXED_FILES);
+    int i;
+
+    for (i = 0; i < FDMON_IO_URING_FIXED_FILES; i++) {
+        files[i] = -1;
+    }
+
+    if (io_uring_register_files(&ctx->fdmon_io_uring, files,
+                                FDMON_IO_URING_FIXED_FILES) < 0) {
+        g_free(files);
+        return;
+    }
+
+    qemu_mutex_init(&ctx->io_uring_fixed_files_lock);
+    ctx->io_uring_fixed_files = files;
+}
+
+static int fixed_file_lookup_locked(AioContext *ctx, int fd)
+{
+    int i;
+
+    for (i = 0; i < FDMON_IO_URING_FIXED_FILES; i++) {
+        if (ctx->io_uring_fixed_files[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int aio_register_fixed_file(AioContext *ctx, int fd)
+{
+    int idx, ret;
+
+    if (!aio_has_io_uring(ctx) || !ctx->io_uring_fixed_files) {
+        return -ENOTSUP;
+    }
+
+    qemu_mutex_lock(&ctx->io_uring_fixed_files_lock);
+    idx = fixed_file_lookup_locked(ctx, fd);
+    if (idx >= 0) {
+        goto out;
+    }
+
+    idx = fixed_file_lookup_locked(ctx, -1);
+    if (idx < 0) {
+        idx = -ENOSPC;
+        goto out;
+    }
+
+    ret = io_uring_register_files_update(&ctx->fdmon_io_uring, idx, &fd, 1);
+    if (ret < 0) {
+        idx = ret;
+        goto out;
+    }
+    ctx->io_uring_fixed_files[idx] = fd;
+
+out:
+    qemu_mutex_unlock(&ctx->io_uring_fixed_files_lock);
+    return idx;
+}
+
+void aio_unregister_fixed_file(AioContext *ctx, int fd)
+{
+    int idx;
+    int unused = -1;
+
+    if (!aio_has_io_uring(ctx) || !ctx->io_uring_fixed_files) {
+        return;
+    }
+
+    qemu_mutex_lock(&ctx->io_uring_fixed_files_lock);
+    idx = fixed_file_lookup_locked(ctx, fd);
+    if (idx >= 0) {
+        io_uring_register_files_update(&ctx->fdmon_io_uring, idx, &unused, 1);
+        ctx->io_uring_fixed_files[idx] = -1;
+    }
+    qemu_mutex_unlock(&ctx->io_uring_fixed_files_lock);
+}
+
 bool fdmon_io_uring_setup(AioContext *ctx)
 {
     int ret;
@@ -331,6 +529,9 @@ bool fdmon_io_uring_setup(AioContext *ctx)
     }
 
     QSLIST_INIT(&ctx->submit_list);
+    QLIST_INIT(&ctx->io_uring_parked_handlers);
+    QSIMPLEQ_INIT(&ctx->cqe_handler_ready_list);
+    fixed_files_setup(ctx);
     ctx->fdmon_ops = &fdmon_io_uring_ops;
     return true;
 }
@@ -342,6 +543,17 @@ void fdmon_io_uring_destroy(AioContext *ctx)
 
         io_uring_queue_exit(&ctx->fdmon_io_uring);
 
+        if (ctx->io_uring_fixed_files) {
+            qemu_mutex_destroy(&ctx->io_uring_fixed_files_lock);
+            g_free(ctx->io_uring_fixed_files);
+            ctx->io_uring_fixed_files = NULL;
+        }
+
+        /* Parked handlers are monitored by fdmon-poll from now on */
+        while ((node = QLIST_FIRST(&ctx->io_uring_parked_handlers))) {
+            QLIST_REMOVE(node, node_parked);
+        }
+
         /* Move handlers due to be removed onto the deleted list */
         while ((node = QSLIST_FIRST_RCU(&ctx->submit_list))) {
             unsigned flags = atomic_fetch_and(&node->flags,
@@ -15,16 +15,31 @@
  * GNU GPL, version 2 or (at your option) any later version.
  */
 #include "qemu/osdep.h"
+#ifdef CONFIG_LINUX
+#include <sched.h>
+#endif
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 
-static void do_spawn_thread(ThreadPool *pool);
+/*
+ * The worker threads are shared by all AioContexts.  There is one group of
+ * workers per host NUMA node, and requests go to the group of the node the
+ * submitting thread runs on.  Each worker has its own queue; workers that
+ * run out of requests take them from the queues of other workers in the
+ * same group.
+ */
+#define THREAD_POOL_MAX_CPUS 1024
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolWorker ThreadPoolWorker;
+typedef struct ThreadPoolNode ThreadPoolNode;
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -37,15 +52,17 @@ struct ThreadPoolElement {
     ThreadPool *pool;
     ThreadPoolFunc *func;
     void *arg;
+    ThreadPoolWorker *worker;
+    int64_t submit_ns;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Moving state out of THREAD_QUEUED is protected by the lock of
+     * worker.  After that, only the worker thread can write to it.  Reads
+     * and writes of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Access to this list is protected by the lock of worker.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
     /* Access to this list is protected by the global mutex.  */
@@ -55,108 +72,274 @@ struct ThreadPoolElement {
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
+    /* Taken by workers while they complete a request */
     QemuMutex lock;
-    QemuCond worker_stopped;
-    QemuSemaphore sem;
-    int max_threads;
-    QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+};
 
-    /* The following variables are protected by lock.  */
+struct ThreadPoolWorker {
+    ThreadPoolNode *node;
+    int index;
+    QemuSemaphore sem;
+    bool idle;
+
+    QemuMutex lock;
+    /* The following variables are protected by lock.  running is also
+     * protected by the lock of node, so both are needed to change it. */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
-    int cur_threads;
-    int idle_threads;
-    int new_threads;     /* backlog of threads we need to create */
-    int pending_threads; /* threads created but not running yet */
-    bool stopping;
+    bool running;
+    int queued;
+    uint64_t requests;
+    uint64_t steals;
+    uint64_t wait_ns;
+};
+
+struct ThreadPoolNode {
+    int id;
+#ifdef CONFIG_LINUX
+    cpu_set_t cpus;
+#endif
+    unsigned next_worker;
+
+    QemuMutex lock;
+    /* Protected by lock.  */
+    int nr_workers;
+
+    ThreadPoolWorker workers[THREAD_POOL_MAX_WORKERS];
 };
 
+static ThreadPoolNode *thread_pool_nodes;
+static int thread_pool_nr_nodes;
+static int thread_pool_cpu_node[THREAD_POOL_MAX_CPUS];
+
+static int thread_pool_max_workers = THREAD_POOL_MAX_WORKERS;
+static bool thread_pool_pin_workers;
+
+#ifdef CONFIG_LINUX
+/* Scheduling parameters of the main thread, which workers start with */
+static cpu_set_t thread_pool_default_cpus;
+static int thread_pool_default_policy = -1;
+static struct sched_param thread_pool_default_param;
+#endif
+
+static void thread_pool_init(void);
+
+static ThreadPoolElement *worker_take(ThreadPoolWorker *w,
+                                      ThreadPoolWorker *thief)
+{
+    ThreadPoolElement *req;
+
+    QEMU_LOCK_GUARD(&w->lock);
+    req = QTAILQ_FIRST(&w->request_list);
+    if (!req) {
+        return NULL;
+    }
+
+    QTAILQ_REMOVE(&w->request_list, req, reqs);
+    atomic_set(&w->queued, w->queued - 1);
+    req->state = THREAD_ACTIVE;
+    w->requests++;
+    w->wait_ns += get_clock() - req->submit_ns;
+    if (w != thief) {
+        w->steals++;
+    }
+    return req;
+}
+
+static ThreadPoolElement *worker_steal(ThreadPoolWorker *thief)
+{
+    ThreadPoolNode *node = thief->node;
+    ThreadPoolElement *req;
+    int i;
+
+    for (i = 1; i < THREAD_POOL_MAX_WORKERS; i++) {
+        ThreadPoolWorker *w =
+            &node->workers[(thief->index + i) % THREAD_POOL_MAX_WORKERS];
+
+        if (atomic_read(&w->queued)) {
+            req = worker_take(w, thief);
+            if (req) {
+                return req;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Called when the worker has been idle for a while.  Returns true if it
+ * has nothing left to do and must exit. */
+static bool worker_stop(ThreadPoolWorker *w)
+{
+    ThreadPoolNode *node = w->node;
+    bool stop;
+
+    qemu_mutex_lock(&node->lock);
+    qemu_mutex_lock(&w->lock);
+    stop = QTAILQ_EMPTY(&w->request_list);
+    if (stop) {
+        w->running = false;
+        node->nr_workers--;
+    }
+    qemu_mutex_unlock(&w->lock);
+    qemu_mutex_unlock(&node->lock);
+    return stop;
+}
+
+/* Workers are started by whatever thread submits a request, and would
+ * otherwise inherit its CPU affinity and scheduling policy.  A vCPU or
+ * iothread may well be pinned or run with a real-time policy, so drop
+ * both in favour of those of the main thread, or of the node's CPUs if
+ * workers are pinned.
+ */
+static void worker_setup_sched(ThreadPoolWorker *w)
+{
+#ifdef CONFIG_LINUX
+    cpu_set_t *cpus = &thread_pool_default_cpus;
+
+    if (thread_pool_default_policy >= 0 &&
+        sched_setscheduler(0, thread_pool_default_policy,
+                           &thread_pool_default_param) < 0) {
+        trace_thread_pool_sched_failed(w->node->id, w->index, errno);
+    }
+
+    if (atomic_read(&thread_pool_pin_workers) && CPU_COUNT(&w->node->cpus)) {
+        cpus = &w->node->cpus;
+    }
+    if (CPU_COUNT(cpus) &&
+        sched_setaffinity(0, sizeof(*cpus), cpus) < 0) {
+        trace_thread_pool_pin_failed(w->node->id, w->index, errno);
+    }
+#endif
+}
+
 static void *worker_thread(void *opaque)
 {
-    ThreadPool *pool = opaque;
+    ThreadPoolWorker *w = opaque;
 
-    qemu_mutex_lock(&pool->lock);
-    pool->pending_threads--;
-    do_spawn_thread(pool);
+    worker_setup_sched(w);
 
-    while (!pool->stopping) {
+    for (;;) {
         ThreadPoolElement *req;
+        ThreadPool *pool;
         int ret;
 
-        do {
-            pool->idle_threads++;
-            qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
-            qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
+        req = worker_take(w, w);
+        if (!req) {
+            req = worker_steal(w);
+        }
+        if (!req) {
+            /* Workers above the limit exit as soon as their queue is empty */
+            if (w->index >= atomic_read(&thread_pool_max_workers) &&
+                worker_stop(w)) {
+                break;
+            }
+
+            atomic_set(&w->idle, true);
+            ret = qemu_sem_timedwait(&w->sem, 10000);
+            atomic_set(&w->idle, false);
+            if (ret == -1 && worker_stop(w)) {
+                break;
+            }
+            continue;
         }
-
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
 
         ret = req->func(req->arg);
 
+        /* Once the request is done, thread_pool_free() may free the pool
+         * as soon as the lock is released.  */
+        pool = req->pool;
+        qemu_mutex_lock(&pool->lock);
         req->ret = ret;
         /* Write ret before state.  */
         smp_wmb();
         req->state = THREAD_DONE;
-
-        qemu_mutex_lock(&pool->lock);
-
         qemu_bh_schedule(pool->completion_bh);
+        qemu_mutex_unlock(&pool->lock);
     }
 
-    pool->cur_threads--;
-    qemu_cond_signal(&pool->worker_stopped);
-    qemu_mutex_unlock(&pool->lock);
+    trace_thread_pool_worker_exit(w->node->id, w->index);
     return NULL;
 }
 
-static void do_spawn_thread(ThreadPool *pool)
+static ThreadPoolNode *thread_pool_current_node(void)
 {
-    QemuThread t;
+#ifdef CONFIG_LINUX
+    int cpu = sched_getcpu();
 
-    /* Runs with lock taken.  */
-    if (!pool->new_threads) {
-        return;
+    if (cpu >= 0 && cpu < THREAD_POOL_MAX_CPUS) {
+        return &thread_pool_nodes[thread_pool_cpu_node[cpu]];
     }
-
-    pool->new_threads--;
-    pool->pending_threads++;
-
-    qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
+#endif
+    return &thread_pool_nodes[0];
 }
 
-static void spawn_thread_bh_fn(void *opaque)
+/* Returns a running worker of @node with its lock taken.  An idle worker
+ * is preferred, then a new one if the limit allows, and only then the
+ * busy worker with the shortest queue.
+ */
+static ThreadPoolWorker *thread_pool_get_worker(ThreadPoolNode *node)
 {
-    ThreadPool *pool = opaque;
-
-    qemu_mutex_lock(&pool->lock);
-    do_spawn_thread(pool);
-    qemu_mutex_unlock(&pool->lock);
-}
+    ThreadPoolWorker *w, *best;
+    int max_workers, start, i;
+
+retry:
+    max_workers = atomic_read(&thread_pool_max_workers);
+    start = atomic_fetch_inc(&node->next_worker) % max_workers;
+    for (i = 0; i < max_workers; i++) {
+        w = &node->workers[(start + i) % max_workers];
+        if (atomic_read(&w->running) && atomic_read(&w->idle)) {
+            qemu_mutex_lock(&w->lock);
+            if (w->running) {
+                return w;
+            }
+            qemu_mutex_unlock(&w->lock);
+        }
+    }
 
-static void spawn_thread(ThreadPool *pool)
-{
-    pool->cur_threads++;
-    pool->new_threads++;
-    /* If there are threads being created, they will spawn new workers, so
-     * we don't spend time creating many threads in a loop holding a mutex or
-     * starving the current vcpu.
-     *
-     * If there are no idle threads, ask the main thread to create one, so we
-     * inherit the correct affinity instead of the vcpu affinity.
-     */
-    if (!pool->pending_threads) {
-        qemu_bh_schedule(pool->new_thread_bh);
+    qemu_mutex_lock(&node->lock);
+    if (node->nr_workers < max_workers) {
+        for (i = 0; i < max_workers; i++) {
+            QemuThread t;
+
+            w = &node->workers[i];
+            if (w->running) {
+                continue;
+            }
+
+            qemu_mutex_lock(&w->lock);
+            w->running = true;
+            node->nr_workers++;
+            qemu_mutex_unlock(&node->lock);
+
+            trace_thread_pool_worker_start(node->id, w->index);
+            qemu_thread_create(&t, "worker", worker_thread, w,
+                               QEMU_THREAD_DETACHED);
+            return w;
+        }
+    }
+    qemu_mutex_unlock(&node->lock);
+
+    /* Workers above a lowered limit can still take requests until they
+     * exit */
+    best = NULL;
+    for (i = 0; i < THREAD_POOL_MAX_WORKERS; i++) {
+        w = &node->workers[i];
+        if (atomic_read(&w->running) &&
+            (!best || atomic_read(&w->queued) < atomic_read(&best->queued))) {
+            best = w;
+        }
+    }
+    if (!best) {
+        goto retry;
+    }
+    qemu_mutex_lock(&best->lock);
+    if (!best->running) {
+        qemu_mutex_unlock(&best->lock);
+        goto retry;
     }
+    return best;
 }
 
 static void thread_pool_completion_bh(void *opaque)
@@ -206,25 +389,21 @@ restart:
 static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
-    ThreadPool *pool = elem->pool;
+    ThreadPoolWorker *w = elem->worker;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    QEMU_LOCK_GUARD(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
-         */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
+    /* No thread has yet started working on elem if it is still queued, and
+     * it stays queued while the lock is held.  */
+    QEMU_LOCK_GUARD(&w->lock);
+    if (elem->state == THREAD_QUEUED) {
+        QTAILQ_REMOVE(&w->request_list, elem, reqs);
+        atomic_set(&w->queued, w->queued - 1);
+        qemu_bh_schedule(elem->pool->completion_bh);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
     }
-
 }
 
 static AioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -245,24 +424,26 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    ThreadPoolWorker *w;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->submit_ns = get_clock();
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
-    }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
+    thread_pool_init();
+    w = thread_pool_get_worker(thread_pool_current_node());
+    req->worker = w;
+    QTAILQ_INSERT_TAIL(&w->request_list, req, reqs);
+    atomic_set(&w->queued, w->queued + 1);
+    qemu_mutex_unlock(&w->lock);
+    qemu_sem_post(&w->sem);
     return &req->common;
 }
 
@@ -304,13 +485,8 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->ctx = ctx;
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
     qemu_mutex_init(&pool->lock);
-    qemu_cond_init(&pool->worker_stopped);
-    qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
-    pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -328,25 +504,183 @@ void thread_pool_free(ThreadPool *pool)
 
     assert(QLIST_EMPTY(&pool->head));
 
+    /* Wait for workers that are still scheduling completion_bh */
     qemu_mutex_lock(&pool->lock);
-
-    /* Stop new threads from spawning */
-    qemu_bh_delete(pool->new_thread_bh);
-    pool->cur_threads -= pool->new_threads;
-    pool->new_threads = 0;
-
-    /* Wait for worker threads to terminate */
-    pool->stopping = true;
-    while (pool->cur_threads > 0) {
-        qemu_sem_post(&pool->sem);
-        qemu_cond_wait(&pool->worker_stopped, &pool->lock);
-    }
-
     qemu_mutex_unlock(&pool->lock);
 
     qemu_bh_delete(pool->completion_bh);
-    qemu_sem_destroy(&pool->sem);
-    qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
     g_free(pool);
 }
+
+#ifdef CONFIG_LINUX
+/* Parse a list such as "0-3,8,10-11" as found in sysfs */
+static void thread_pool_parse_list(const char *str, unsigned long *bitmap)
+{
+    while (*str) {
+        unsigned long first, last;
+        const char *end;
+
+        if (qemu_strtoul(str, &end, 10, &first) < 0) {
+            return;
+        }
+        last = first;
+        if (*end == '-' && qemu_strtoul(end + 1, &end, 10, &last) < 0) {
+            return;
+        }
+        for (; first <= last && first < THREAD_POOL_MAX_CPUS; first++) {
+            set_bit(first, bitmap);
+        }
+        if (*end != ',') {
+            return;
+        }
+        str = end + 1;
+    }
+}
+
+static unsigned long *thread_pool_read_list(const char *path)
+{
+    unsigned long *bitmap;
+    gchar *contents;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return NULL;
+    }
+    bitmap = bitmap_new(THREAD_POOL_MAX_CPUS);
+    thread_pool_parse_list(contents, bitmap);
+    g_free(contents);
+    return bitmap;
+}
+
+/* Map host CPUs to NUMA nodes; without that information, all CPUs are
+ * treated as one node.  */
+static int thread_pool_init_nodes(void)
+{
+    unsigned long *online, *cpus;
+    long id;
+    int nr_nodes, i = 0;
+
+    online = thread_pool_read_list("/sys/devices/system/node/online");
+    if (!online) {
+        return 1;
+    }
+
+    nr_nodes = MAX(bitmap_count_one(online, THREAD_POOL_MAX_CPUS), 1);
+    thread_pool_nodes = g_new0(ThreadPoolNode, nr_nodes);
+    for (id = find_first_bit(online, THREAD_POOL_MAX_CPUS);
+         id < THREAD_POOL_MAX_CPUS;
+         id = find_next_bit(online, THREAD_POOL_MAX_CPUS, id + 1), i++) {
+        g_autofree char *path =
+            g_strdup_printf("/sys/devices/system/node/node%ld/cpulist", id);
+        long cpu;
+
+        thread_pool_nodes[i].id = id;
+        cpus = thread_pool_read_list(path);
+        if (!cpus) {
+            continue;
+        }
+        for (cpu = find_first_bit(cpus, THREAD_POOL_MAX_CPUS);
+             cpu < THREAD_POOL_MAX_CPUS;
+             cpu = find_next_bit(cpus, THREAD_POOL_MAX_CPUS, cpu + 1)) {
+            thread_pool_cpu_node[cpu] = i;
+            if (cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &thread_pool_nodes[i].cpus);
+            }
+        }
+        g_free(cpus);
+    }
+    g_free(online);
+    return nr_nodes;
+}
+#else
+static int thread_pool_init_nodes(void)
+{
+    return 1;
+}
+#endif
+
+/* Set up the worker groups on first use */
+static void thread_pool_init(void)
+{
+    static gsize initialized;
+    int i, j;
+
+    if (!g_once_init_enter(&initialized)) {
+        return;
+    }
+
+#ifdef CONFIG_LINUX
+    if (sched_getaffinity(getpid(), sizeof(thread_pool_default_cpus),
+                          &thread_pool_default_cpus) < 0) {
+        CPU_ZERO(&thread_pool_default_cpus);
+    }
+    if (sched_getparam(getpid(), &thread_pool_default_param) == 0) {
+        thread_pool_default_policy = sched_getscheduler(getpid());
+    }
+#endif
+
+    thread_pool_nr_nodes = thread_pool_init_nodes();
+    if (!thread_pool_nodes) {
+        thread_pool_nodes = g_new0(ThreadPoolNode, 1);
+    }
+
+    for (i = 0; i < thread_pool_nr_nodes; i++) {
+        ThreadPoolNode *node = &thread_pool_nodes[i];
+
+        qemu_mutex_init(&node->lock);
+        for (j = 0; j < THREAD_POOL_MAX_WORKERS; j++) {
+            ThreadPoolWorker *w = &node->workers[j];
+
+            w->node = node;
+            w->index = j;
+            qemu_sem_init(&w->sem, 0);
+            qemu_mutex_init(&w->lock);
+            QTAILQ_INIT(&w->request_list);
+        }
+    }
+
+    g_once_init_leave(&initialized, 1);
+}
+
+int thread_pool_get_stats(ThreadPoolNodeStats **stats)
+{
+    int i, j;
+
+    thread_pool_init();
+
+    *stats = g_new0(ThreadPoolNodeStats, thread_pool_nr_nodes);
+    for (i = 0; i < thread_pool_nr_nodes; i++) {
+        ThreadPoolNode *node = &thread_pool_nodes[i];
+        ThreadPoolNodeStats *st = &(*stats)[i];
+
+        st->node = node->id;
+        st->max_workers = atomic_read(&thread_pool_max_workers);
+        qemu_mutex_lock(&node->lock);
+        st->workers = node->nr_workers;
+        qemu_mutex_unlock(&node->lock);
+
+        for (j = 0; j < THREAD_POOL_MAX_WORKERS; j++) {
+            ThreadPoolWorker *w = &node->workers[j];
+
+            qemu_mutex_lock(&w->lock);
+            st->queue_depth += w->queued;
+            st->requests += w->requests;
+            st->steals += w->steals;
+            st->wait_ns += w->wait_ns;
+            qemu_mutex_unlock(&w->lock);
+        }
+    }
+
+    return thread_pool_nr_nodes;
+}
+
+void thread_pool_set_max_workers(int max_workers)
+{
+    assert(max_workers >= 1 && max_workers <= THREAD_POOL_MAX_WORKERS);
+    atomic_set(&thread_pool_max_workers, max_workers);
+}
+
+void thread_pool_set_pin_workers(bool pin_workers)
+{
+    atomic_set(&thread_pool_pin_workers, pin_workers);
+}